@@ -41,6 +41,11 @@
 #include <libdeflate.h>
 #endif
 
+#ifdef HAVE_LIBISAL
+#include <isa-l/igzip_lib.h>
+#include <isa-l/crc.h>
+#endif
+
 #include "htslib/hts.h"
 #include "htslib/bgzf.h"
 #include "htslib/hfile.h"
@@ -48,6 +53,7 @@
 #include "htslib/hts_endian.h"
 #include "cram/pooled_alloc.h"
 #include "hts_internal.h"
+#include "hfile_internal.h"
 
 #define BGZF_CACHE
 #define BGZF_MT
@@ -295,6 +301,7 @@ static int bgzf_idx_flush(BGZF *fp) {
 void bgzf_index_destroy(BGZF *fp);
 int bgzf_index_add_block(BGZF *fp);
 static int mt_destroy(mtaux_t *mt);
+static const struct bgzf_codec *bgzf_default_codec(void);
 
 static inline void packInt16(uint8_t *buffer, uint16_t value)
 {
@@ -363,6 +370,7 @@ static BGZF *bgzf_read_init(hFILE *hfpr)
     if (fp == NULL) return NULL;
 
     fp->is_write = 0;
+    fp->codec = bgzf_default_codec();
     fp->uncompressed_block = malloc(2 * BGZF_MAX_BLOCK_SIZE);
     if (fp->uncompressed_block == NULL) { free(fp); return NULL; }
     fp->compressed_block = (char *)fp->uncompressed_block + BGZF_MAX_BLOCK_SIZE;
@@ -399,6 +407,7 @@ static BGZF *bgzf_write_init(const char *mode)
     fp = (BGZF*)calloc(1, sizeof(BGZF));
     if (fp == NULL) goto mem_fail;
     fp->is_write = 1;
+    fp->codec = bgzf_default_codec();
     int compress_level = mode2level(mode);
     if ( compress_level==-2 )
     {
@@ -507,68 +516,263 @@ BGZF *bgzf_hopen(hFILE *hfp, const char *mode)
     return fp;
 }
 
-#ifdef HAVE_LIBDEFLATE
-int bgzf_compress(void *_dst, size_t *dlen, const void *src, size_t slen, int level)
+/*
+ * Deflate implementations ("codecs") that can be chosen at run time.  These
+ * only deal with the raw deflate data; the BGZF header and footer, the EOF
+ * block and uncompressed level 0 blocks are the same whichever is used.
+ */
+struct bgzf_codec {
+    const char *name;
+    // Compress slen bytes into dst, which has room for *dlen bytes, and
+    // set *dlen to the compressed size.  Returns 0 on success.
+    int (*deflate)(uint8_t *dst, size_t *dlen,
+                   const uint8_t *src, size_t slen, int level);
+    // Uncompress into dst, which has room for *dlen bytes, and set *dlen
+    // to the uncompressed size and *crc to its CRC32.  Codecs that can
+    // checksum the data as they produce it do so.  Returns 0 on success.
+    int (*inflate)(uint8_t *dst, size_t *dlen,
+                   const uint8_t *src, size_t slen, uint32_t *crc);
+    uint32_t (*crc32)(uint32_t crc, const uint8_t *buf, size_t len);
+};
+
+static int zlib_deflate(uint8_t *dst, size_t *dlen,
+                        const uint8_t *src, size_t slen, int level)
 {
-    if (slen == 0) {
-        // EOF block
-        if (*dlen < 28) return -1;
-        memcpy(_dst, "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28);
-        *dlen = 28;
-        return 0;
+    z_stream zs;
+    zs.zalloc = NULL; zs.zfree = NULL;
+    zs.msg = NULL;
+    zs.next_in  = (Bytef*)src;
+    zs.avail_in = slen;
+    zs.next_out = dst;
+    zs.avail_out = *dlen;
+    if (level > 9) level = 9; // Levels above 9 are only for libdeflate
+    int ret = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // -15 to disable zlib header/footer
+    if (ret!=Z_OK) {
+        hts_log_error("Call to deflateInit2 failed: %s", bgzf_zerr(ret, &zs));
+        return -1;
     }
+    if ((ret = deflate(&zs, Z_FINISH)) != Z_STREAM_END) {
+        hts_log_error("Deflate operation failed: %s", bgzf_zerr(ret, ret == Z_DATA_ERROR ? &zs : NULL));
+        deflateEnd(&zs);
+        return -1;
+    }
+    if ((ret = deflateEnd(&zs)) != Z_OK) {
+        hts_log_error("Call to deflateEnd failed: %s", bgzf_zerr(ret, NULL));
+        return -1;
+    }
+    *dlen = zs.total_out;
+    return 0;
+}
 
-    uint8_t *dst = (uint8_t*)_dst;
-
-    if (level == 0) {
-        // Uncompressed data
-        if (*dlen < slen+5 + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH) return -1;
-        dst[BLOCK_HEADER_LENGTH] = 1; // BFINAL=1, BTYPE=00; see RFC1951
-        u16_to_le(slen,  &dst[BLOCK_HEADER_LENGTH+1]); // length
-        u16_to_le(~slen, &dst[BLOCK_HEADER_LENGTH+3]); // ones-complement length
-        memcpy(dst + BLOCK_HEADER_LENGTH+5, src, slen);
-        *dlen = slen+5 + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+static int zlib_inflate(uint8_t *dst, size_t *dlen,
+                        const uint8_t *src, size_t slen, uint32_t *crc)
+{
+    z_stream zs = {
+        .zalloc = NULL,
+        .zfree = NULL,
+        .msg = NULL,
+        .next_in = (Bytef*)src,
+        .avail_in = slen,
+        .next_out = (Bytef*)dst,
+        .avail_out = *dlen
+    };
 
-    } else {
-        level = level > 0 ? level : 6; // libdeflate doesn't honour -1 as default
-        // NB levels go up to 12 here.
-        struct libdeflate_compressor *z = libdeflate_alloc_compressor(level);
-        if (!z) return -1;
-
-        // Raw deflate
-        size_t clen =
-            libdeflate_deflate_compress(z, src, slen,
-                                        dst + BLOCK_HEADER_LENGTH,
-                                        *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH);
-
-        if (clen <= 0) {
-            hts_log_error("Call to libdeflate_deflate_compress failed");
-            libdeflate_free_compressor(z);
-            return -1;
+    int ret = inflateInit2(&zs, -15);
+    if (ret != Z_OK) {
+        hts_log_error("Call to inflateInit2 failed: %s", bgzf_zerr(ret, &zs));
+        return -1;
+    }
+    if ((ret = inflate(&zs, Z_FINISH)) != Z_STREAM_END) {
+        hts_log_error("Inflate operation failed: %s", bgzf_zerr(ret, ret == Z_DATA_ERROR ? &zs : NULL));
+        if ((ret = inflateEnd(&zs)) != Z_OK) {
+            hts_log_warning("Call to inflateEnd failed: %s", bgzf_zerr(ret, NULL));
         }
+        return -1;
+    }
+    if ((ret = inflateEnd(&zs)) != Z_OK) {
+        hts_log_error("Call to inflateEnd failed: %s", bgzf_zerr(ret, NULL));
+        return -1;
+    }
+    *dlen = *dlen - zs.avail_out;
+    *crc = hts_crc32(0, dst, *dlen);
+    return 0;
+}
 
-        *dlen = clen + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+static uint32_t zlib_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    return hts_crc32(crc, buf, len);
+}
 
-        libdeflate_free_compressor(z);
+static const struct bgzf_codec zlib_codec = {
+    "zlib", zlib_deflate, zlib_inflate, zlib_crc32
+};
+
+#ifdef HAVE_LIBDEFLATE
+static int libdeflate_deflate(uint8_t *dst, size_t *dlen,
+                              const uint8_t *src, size_t slen, int level)
+{
+    level = level > 0 ? level : 6; // libdeflate doesn't honour -1 as default
+    // NB levels go up to 12 here.
+    struct libdeflate_compressor *z = libdeflate_alloc_compressor(level);
+    if (!z) return -1;
+
+    size_t clen = libdeflate_deflate_compress(z, src, slen, dst, *dlen);
+    libdeflate_free_compressor(z);
+
+    if (clen <= 0) {
+        hts_log_error("Call to libdeflate_deflate_compress failed");
+        return -1;
     }
+    *dlen = clen;
+    return 0;
+}
 
-    // write the header
-    memcpy(dst, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
-    packInt16(&dst[16], *dlen - 1); // write the compressed length; -1 to fit 2 bytes
+static int libdeflate_inflate(uint8_t *dst, size_t *dlen,
+                              const uint8_t *src, size_t slen, uint32_t *crc)
+{
+    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+    if (!z) {
+        hts_log_error("Call to libdeflate_alloc_decompressor failed");
+        return -1;
+    }
 
-    // write the footer
-    uint32_t crc = libdeflate_crc32(0, src, slen);
-    packInt32((uint8_t*)&dst[*dlen - 8], crc);
-    packInt32((uint8_t*)&dst[*dlen - 4], slen);
+    int ret = libdeflate_deflate_decompress(z, src, slen, dst, *dlen, dlen);
+    libdeflate_free_decompressor(z);
+
+    if (ret != LIBDEFLATE_SUCCESS) {
+        hts_log_error("Inflate operation failed: %d", ret);
+        return -1;
+    }
+    *crc = libdeflate_crc32(0, dst, *dlen);
+    return 0;
+}
+
+static uint32_t libdeflate_crc32_buf(uint32_t crc, const uint8_t *buf,
+                                     size_t len)
+{
+    return libdeflate_crc32(crc, buf, len);
+}
+
+static const struct bgzf_codec libdeflate_codec = {
+    "libdeflate", libdeflate_deflate, libdeflate_inflate, libdeflate_crc32_buf
+};
+#endif // HAVE_LIBDEFLATE
+
+#ifdef HAVE_LIBISAL
+// ISA-L's compressor only has a few fast levels, so this codec uses it
+// for decompression and checksums and leaves compression to the best of
+// the others.  Its inflate also computes the CRC32 as it goes.
+static int isal_inflate(uint8_t *dst, size_t *dlen,
+                        const uint8_t *src, size_t slen, uint32_t *crc)
+{
+    struct inflate_state zs;
+    isal_inflate_init(&zs);
+    zs.next_in = (uint8_t *) src;
+    zs.avail_in = slen;
+    zs.next_out = dst;
+    zs.avail_out = *dlen;
+    zs.crc_flag = ISAL_GZIP_NO_HDR; // Raw deflate data, with gzip's CRC32
+
+    int ret = isal_inflate_stateless(&zs);
+    if (ret != ISAL_DECOMP_OK) {
+        hts_log_error("Inflate operation failed: %d", ret);
+        return -1;
+    }
+    *dlen = zs.total_out;
+    *crc = zs.crc;
     return 0;
 }
 
+static uint32_t isal_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    return crc32_gzip_refl(crc, buf, len);
+}
+
+static const struct bgzf_codec isal_codec = {
+#ifdef HAVE_LIBDEFLATE
+    "isal", libdeflate_deflate, isal_inflate, isal_crc32
 #else
+    "isal", zlib_deflate, isal_inflate, isal_crc32
+#endif
+};
+#endif // HAVE_LIBISAL
 
-int bgzf_compress(void *_dst, size_t *dlen, const void *src, size_t slen, int level)
+// All the codecs built in, in order of preference for the default
+static const struct bgzf_codec *const bgzf_codecs[] = {
+#ifdef HAVE_LIBDEFLATE
+    &libdeflate_codec,
+#endif
+#ifdef HAVE_LIBISAL
+    &isal_codec,
+#endif
+    &zlib_codec,
+    NULL
+};
+
+static const struct bgzf_codec *default_codec = NULL;
+static pthread_once_t default_codec_once = PTHREAD_ONCE_INIT;
+
+static const struct bgzf_codec *find_codec(const char *name)
 {
-    uint32_t crc;
-    z_stream zs;
+    int i;
+    for (i = 0; bgzf_codecs[i]; i++)
+        if (strcmp(bgzf_codecs[i]->name, name) == 0) return bgzf_codecs[i];
+    return NULL;
+}
+
+static void init_default_codec(void)
+{
+    const char *name = getenv("HTS_BGZF_CODEC");
+    default_codec = bgzf_codecs[0];
+    if (name && *name) {
+        const struct bgzf_codec *codec = find_codec(name);
+        if (codec) default_codec = codec;
+        else hts_log_warning("BGZF codec \"%s\" is not available; using %s",
+                             name, default_codec->name);
+    }
+}
+
+static const struct bgzf_codec *bgzf_default_codec(void)
+{
+    pthread_once(&default_codec_once, init_default_codec);
+    return default_codec;
+}
+
+int bgzf_set_codec(BGZF *fp, const char *name)
+{
+    const struct bgzf_codec *codec = name ? find_codec(name)
+                                          : bgzf_default_codec();
+    if (!codec) {
+        hts_log_error("BGZF codec \"%s\" is not available", name);
+        return -1;
+    }
+    fp->codec = codec;
+    return 0;
+}
+
+const char *bgzf_get_codec(BGZF *fp)
+{
+    return fp->codec ? fp->codec->name : NULL;
+}
+
+const char *bgzf_codec_name(int i)
+{
+    int n = sizeof(bgzf_codecs) / sizeof(bgzf_codecs[0]) - 1;
+    return (i >= 0 && i < n)? bgzf_codecs[i]->name : NULL;
+}
+
+static int bgzf_compress_with(const struct bgzf_codec *codec, void *_dst,
+                              size_t *dlen, const void *src, size_t slen,
+                              int level)
+{
+    if (slen == 0) {
+        // EOF block
+        if (*dlen < 28) return -1;
+        memcpy(_dst, "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28);
+        *dlen = 28;
+        return 0;
+    }
+
     uint8_t *dst = (uint8_t*)_dst;
 
     if (level == 0) {
@@ -581,38 +785,26 @@ int bgzf_compress(void *_dst, size_t *dlen, const void *src, size_t slen, int le
         *dlen = slen+5 + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
     } else {
         // compress the body
-        zs.zalloc = NULL; zs.zfree = NULL;
-        zs.msg = NULL;
-        zs.next_in  = (Bytef*)src;
-        zs.avail_in = slen;
-        zs.next_out = dst + BLOCK_HEADER_LENGTH;
-        zs.avail_out = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-        int ret = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // -15 to disable zlib header/footer
-        if (ret!=Z_OK) {
-            hts_log_error("Call to deflateInit2 failed: %s", bgzf_zerr(ret, &zs));
-            return -1;
-        }
-        if ((ret = deflate(&zs, Z_FINISH)) != Z_STREAM_END) {
-            hts_log_error("Deflate operation failed: %s", bgzf_zerr(ret, ret == Z_DATA_ERROR ? &zs : NULL));
-            return -1;
-        }
-        if ((ret = deflateEnd(&zs)) != Z_OK) {
-            hts_log_error("Call to deflateEnd failed: %s", bgzf_zerr(ret, NULL));
+        size_t clen = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+        if (codec->deflate(dst + BLOCK_HEADER_LENGTH, &clen, src, slen, level) < 0)
             return -1;
-        }
-        *dlen = zs.total_out + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+        *dlen = clen + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
     }
 
     // write the header
     memcpy(dst, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
     packInt16(&dst[16], *dlen - 1); // write the compressed length; -1 to fit 2 bytes
     // write the footer
-    crc = crc32(crc32(0L, NULL, 0L), (Bytef*)src, slen);
+    uint32_t crc = codec->crc32(0, src, slen);
     packInt32((uint8_t*)&dst[*dlen - 8], crc);
     packInt32((uint8_t*)&dst[*dlen - 4], slen);
     return 0;
 }
-#endif // HAVE_LIBDEFLATE
+
+int bgzf_compress(void *dst, size_t *dlen, const void *src, size_t slen, int level)
+{
+    return bgzf_compress_with(bgzf_default_codec(), dst, dlen, src, slen, level);
+}
 
 static int bgzf_gzip_compress(BGZF *fp, void *_dst, size_t *dlen, const void *src, size_t slen, int level)
 {
@@ -642,7 +834,7 @@ static int deflate_block(BGZF *fp, int block_length)
     size_t comp_size = BGZF_MAX_BLOCK_SIZE;
     int ret;
     if ( !fp->is_gzip )
-        ret = bgzf_compress(fp->compressed_block, &comp_size, fp->uncompressed_block, block_length, fp->compress_level);
+        ret = bgzf_compress_with(fp->codec, fp->compressed_block, &comp_size, fp->uncompressed_block, block_length, fp->compress_level);
     else
         ret = bgzf_gzip_compress(fp, fp->compressed_block, &comp_size, fp->uncompressed_block, block_length, fp->compress_level);
 
@@ -656,68 +848,14 @@ static int deflate_block(BGZF *fp, int block_length)
     return comp_size;
 }
 
-#ifdef HAVE_LIBDEFLATE
-
-static int bgzf_uncompress(uint8_t *dst, size_t *dlen,
-                           const uint8_t *src, size_t slen,
-                           uint32_t expected_crc) {
-    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
-    if (!z) {
-        hts_log_error("Call to libdeflate_alloc_decompressor failed");
-        return -1;
-    }
-
-    int ret = libdeflate_deflate_decompress(z, src, slen, dst, *dlen, dlen);
-    libdeflate_free_decompressor(z);
-
-    if (ret != LIBDEFLATE_SUCCESS) {
-        hts_log_error("Inflate operation failed: %d", ret);
-        return -1;
-    }
-
-    uint32_t crc = libdeflate_crc32(0, (unsigned char *)dst, *dlen);
-    if (crc != expected_crc) {
-        hts_log_error("CRC32 checksum mismatch");
-        return -2;
-    }
-
-    return 0;
-}
-
-#else
-
-static int bgzf_uncompress(uint8_t *dst, size_t *dlen,
+static int bgzf_uncompress(const struct bgzf_codec *codec,
+                           uint8_t *dst, size_t *dlen,
                            const uint8_t *src, size_t slen,
                            uint32_t expected_crc) {
-    z_stream zs = {
-        .zalloc = NULL,
-        .zfree = NULL,
-        .msg = NULL,
-        .next_in = (Bytef*)src,
-        .avail_in = slen,
-        .next_out = (Bytef*)dst,
-        .avail_out = *dlen
-    };
-
-    int ret = inflateInit2(&zs, -15);
-    if (ret != Z_OK) {
-        hts_log_error("Call to inflateInit2 failed: %s", bgzf_zerr(ret, &zs));
-        return -1;
-    }
-    if ((ret = inflate(&zs, Z_FINISH)) != Z_STREAM_END) {
-        hts_log_error("Inflate operation failed: %s", bgzf_zerr(ret, ret == Z_DATA_ERROR ? &zs : NULL));
-        if ((ret = inflateEnd(&zs)) != Z_OK) {
-            hts_log_warning("Call to inflateEnd failed: %s", bgzf_zerr(ret, NULL));
-        }
-        return -1;
-    }
-    if ((ret = inflateEnd(&zs)) != Z_OK) {
-        hts_log_error("Call to inflateEnd failed: %s", bgzf_zerr(ret, NULL));
+    uint32_t crc;
+    if (codec->inflate(dst, dlen, src, slen, &crc) < 0)
         return -1;
-    }
-    *dlen = *dlen - zs.avail_out;
 
-    uint32_t crc = crc32(crc32(0L, NULL, 0L), (unsigned char *)dst, *dlen);
     if (crc != expected_crc) {
         hts_log_error("CRC32 checksum mismatch");
         return -2;
@@ -725,16 +863,15 @@ static int bgzf_uncompress(uint8_t *dst, size_t *dlen,
 
     return 0;
 }
-#endif // HAVE_LIBDEFLATE
 
-// Inflate the block in fp->compressed_block into fp->uncompressed_block
-static int inflate_block(BGZF* fp, int block_length)
+// Inflate the block whose data (following its header) is at cdata
+// into fp->uncompressed_block
+static int inflate_block(BGZF* fp, const uint8_t *cdata, int block_length)
 {
     size_t dlen = BGZF_MAX_BLOCK_SIZE;
-    uint32_t crc = le_to_u32((uint8_t *)fp->compressed_block + block_length-8);
-    int ret = bgzf_uncompress(fp->uncompressed_block, &dlen,
-                              (Bytef*)fp->compressed_block + 18,
-                              block_length - 18, crc);
+    uint32_t crc = le_to_u32(cdata + block_length - 18 - 8);
+    int ret = bgzf_uncompress(fp->codec, fp->uncompressed_block, &dlen,
+                              cdata, block_length - 18, crc);
     if (ret < 0) {
         if (ret == -2)
             fp->errcode |= BGZF_ERR_CRC;
@@ -1013,7 +1150,8 @@ int bgzf_read_block(BGZF *fp)
         return 0;
     }
 
-    uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
+    uint8_t header[BLOCK_HEADER_LENGTH];
+    const uint8_t *cdata;
     int count, size, block_length, remaining;
 
  single_threaded:
@@ -1124,10 +1262,18 @@ int bgzf_read_block(BGZF *fp)
             fp->errcode |= BGZF_ERR_HEADER;
             return -1;
         }
-        compressed_block = (uint8_t*)fp->compressed_block;
-        memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
         remaining = block_length - BLOCK_HEADER_LENGTH;
-        count = hread(fp->fp, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
+        // Inflate straight from the hFILE's buffer if the whole block is
+        // already there, as it always is for memory-mapped files
+        cdata = (const uint8_t *) hfile_read_inplace(fp->fp, remaining);
+        if (cdata) {
+            count = remaining;
+        } else {
+            uint8_t *compressed_block = (uint8_t*)fp->compressed_block;
+            memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
+            count = hread(fp->fp, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
+            cdata = &compressed_block[BLOCK_HEADER_LENGTH];
+        }
         if (count != remaining) {
             hts_log_error("Failed to read BGZF block data at offset %"PRId64
                           " expected %d bytes; hread returned %d",
@@ -1136,7 +1282,7 @@ int bgzf_read_block(BGZF *fp)
             return -1;
         }
         size += count;
-        if ((count = inflate_block(fp, block_length)) < 0) {
+        if ((count = inflate_block(fp, cdata, block_length)) < 0) {
             hts_log_debug("Inflate block operation failed for "
                           "block at offset %"PRId64": %s",
                           block_address, bgzf_zerr(count, NULL));
@@ -1252,9 +1398,9 @@ static void *bgzf_encode_func(void *arg) {
     bgzf_job *j = (bgzf_job *)arg;
 
     j->comp_len = BGZF_MAX_BLOCK_SIZE;
-    int ret = bgzf_compress(j->comp_data, &j->comp_len,
-                            j->uncomp_data, j->uncomp_len,
-                            j->fp->compress_level);
+    int ret = bgzf_compress_with(j->fp->codec, j->comp_data, &j->comp_len,
+                                 j->uncomp_data, j->uncomp_len,
+                                 j->fp->compress_level);
     if (ret != 0)
         j->errcode |= BGZF_ERR_ZLIB;
 
@@ -1281,13 +1427,8 @@ static void *bgzf_encode_level0_func(void *arg) {
     u16_to_le(~j->uncomp_len, j->comp_data + BLOCK_HEADER_LENGTH + 3);
 
     // Trailer (CRC, uncompressed length)
-#ifdef HAVE_LIBDEFLATE
-    crc = libdeflate_crc32(0, j->comp_data + BLOCK_HEADER_LENGTH + 5,
-                           j->uncomp_len);
-#else
-    crc = crc32(crc32(0L, NULL, 0L),
-                (Bytef*)j->comp_data + BLOCK_HEADER_LENGTH + 5, j->uncomp_len);
-#endif
+    crc = j->fp->codec->crc32(0, j->comp_data + BLOCK_HEADER_LENGTH + 5,
+                              j->uncomp_len);
     u32_to_le(crc, j->comp_data +  j->comp_len - 8);
     u32_to_le(j->uncomp_len, j->comp_data + j->comp_len - 4);
 
@@ -1302,7 +1443,7 @@ static void *bgzf_decode_func(void *arg) {
 
     j->uncomp_len = BGZF_MAX_BLOCK_SIZE;
     uint32_t crc = le_to_u32((uint8_t *)j->comp_data + j->comp_len-8);
-    int ret = bgzf_uncompress(j->uncomp_data, &j->uncomp_len,
+    int ret = bgzf_uncompress(j->fp->codec, j->uncomp_data, &j->uncomp_len,
                               j->comp_data+18, j->comp_len-18, crc);
     if (ret != 0)
         j->errcode |= BGZF_ERR_ZLIB;
@@ -1690,6 +1831,12 @@ int bgzf_thread_pool(BGZF *fp, hts_tpool *pool, int qsize) {
     mt->jobs_pending = 0;
     mt->free_block = fp->uncompressed_block; // currently in-use block
     mt->block_address = fp->block_address;
+
+    // Let storage reads overlap with decompression; this quietly does
+    // nothing for pipes, sockets and remote files.
+    if (!fp->is_write)
+        hfile_set_readahead(fp->fp, 0, 0);
+
     pthread_create(&mt->io_task, NULL,
                    fp->is_write ? bgzf_mt_writer : bgzf_mt_reader, fp);
 
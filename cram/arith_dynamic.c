@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The CRAM 3.1 adaptive arithmetic coder; see arith_dynamic.h.
+ *
+ * Like rANS_static4x16pr.c this is an independent implementation of the
+ * specification, built on c_range_coder.h and c_simple_model.h, and is
+ * only used in builds with CRAM_EXPERIMENTAL_V31_CODECS.
+ *
+ * Stream layout:
+ *
+ *   flags byte (the order value with unused transforms cleared)
+ *   uncompressed size as uint7, unless ARITH_NOSZ
+ *
+ *   ARITH_STRIPE:
+ *       byte N, N compressed sizes as uint7 and then N sub-streams, each a
+ *       complete stream in its own right.  Sub-stream i holds bytes i,
+ *       i+N, i+2N, ... of the input.
+ *
+ *   ARITH_PACK:
+ *       symbol map (see pack.h) and packed length as uint7.
+ *
+ *   The remaining data is stored verbatim (ARITH_CAT), as a bzip2 stream
+ *   (ARITH_EXT), or as a byte holding the alphabet size (0 meaning 256)
+ *   followed by the range coder output.
+ *
+ * With ARITH_RLE, each literal is followed by its run length (the number
+ * of additional copies) encoded as a series of 2-bit values, stopping at
+ * the first value below 3.  The first uses a model selected by the
+ * literal and subsequent ones two shared models.  Order-1 uses the
+ * previous literal (initially 0) as the context for literals.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef HAVE_LIBBZ2
+#include <bzlib.h>
+#endif
+
+#include "arith_dynamic.h"
+#include "c_range_coder.h"
+#include "c_simple_model.h"
+#include "varint.h"
+#include "pack.h"
+
+#define NSTRIPE 4
+
+// Run length models: one per literal plus two for continuations.
+#define RUN_MODELS 258
+
+/*-----------------------------------------------------------------------------
+ * Entropy coding, with and without run-length modelling.
+ */
+
+static int max_symbol(unsigned char *in, unsigned int in_size) {
+    unsigned int i;
+    int m = 0;
+
+    for (i = 0; i < in_size; i++)
+        if (m < in[i])
+            m = in[i];
+
+    return m + 1;
+}
+
+static unsigned char *arith_compress_core(unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned char *out,
+                                          unsigned int *out_size,
+                                          int order) {
+    int max_sym = max_symbol(in, in_size), nctx, i;
+    SIMPLE_MODEL *lit = NULL, *run = NULL;
+    RangeCoder rc;
+    unsigned int k;
+    uint8_t last = 0;
+
+    if (*out_size < 1)
+        return NULL;
+
+    nctx = (order & ARITH_ORDER) ? max_sym : 1;
+    if (!(lit = malloc(nctx * sizeof(*lit))))
+        return NULL;
+    for (i = 0; i < nctx; i++)
+        SIMPLE_MODEL_init(&lit[i], max_sym);
+
+    if (order & ARITH_RLE) {
+        if (!(run = malloc(RUN_MODELS * sizeof(*run)))) {
+            free(lit);
+            return NULL;
+        }
+        for (i = 0; i < RUN_MODELS; i++)
+            SIMPLE_MODEL_init(&run[i], 4);
+    }
+
+    out[0] = max_sym & 0xff;
+    RC_SetOutput(&rc, out+1, out + *out_size);
+    RC_StartEncode(&rc);
+
+    for (k = 0; k < in_size && !rc.err; k++) {
+        uint8_t c = in[k];
+        SIMPLE_MODEL_encodeSymbol(&lit[last], &rc, c);
+        if (order & ARITH_ORDER)
+            last = c;
+
+        if (run) {
+            unsigned int r = 0;
+            int rctx = c, part;
+            while (k+1 < in_size && in[k+1] == c)
+                r++, k++;
+
+            do {
+                part = r > 3 ? 3 : r;
+                SIMPLE_MODEL_encodeSymbol(&run[rctx], &rc, part);
+                r -= part;
+                rctx = rctx < 256 ? 256 : 257;
+            } while (part == 3);
+        }
+    }
+
+    RC_FinishEncode(&rc);
+    free(lit);
+    free(run);
+
+    if (rc.err)
+        return NULL;
+
+    *out_size = RC_OutSize(&rc) + 1;
+    return out;
+}
+
+static unsigned char *arith_uncompress_core(unsigned char *in,
+                                            unsigned int in_size,
+                                            unsigned char *out,
+                                            unsigned int out_sz,
+                                            int order) {
+    SIMPLE_MODEL *lit = NULL, *run = NULL;
+    int max_sym, nctx, i;
+    unsigned char *ret = NULL;
+    RangeCoder rc;
+    unsigned int k;
+    uint8_t last = 0;
+
+    if (in_size < 1)
+        return NULL;
+    max_sym = in[0] ? in[0] : 256;
+
+    nctx = (order & ARITH_ORDER) ? max_sym : 1;
+    if (!(lit = malloc(nctx * sizeof(*lit))))
+        return NULL;
+    for (i = 0; i < nctx; i++)
+        SIMPLE_MODEL_init(&lit[i], max_sym);
+
+    if (order & ARITH_RLE) {
+        if (!(run = malloc(RUN_MODELS * sizeof(*run))))
+            goto err;
+        for (i = 0; i < RUN_MODELS; i++)
+            SIMPLE_MODEL_init(&run[i], 4);
+    }
+
+    RC_SetInput(&rc, in+1, in + in_size);
+    RC_StartDecode(&rc);
+
+    for (k = 0; k < out_sz; ) {
+        uint8_t c = SIMPLE_MODEL_decodeSymbol(&lit[last], &rc);
+        out[k++] = c;
+        if (order & ARITH_ORDER)
+            last = c;
+
+        if (run) {
+            unsigned int r = 0;
+            int rctx = c, part;
+            do {
+                part = SIMPLE_MODEL_decodeSymbol(&run[rctx], &rc);
+                r += part;
+                rctx = rctx < 256 ? 256 : 257;
+                if (r > out_sz - k)
+                    goto err;
+            } while (part == 3);
+            memset(out + k, c, r);
+            k += r;
+        }
+
+        if (rc.err)
+            goto err;
+    }
+
+    ret = out;
+
+ err:
+    free(lit);
+    free(run);
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * Top level encoder and decoder, handling the data transforms.
+ */
+
+unsigned int arith_compress_bound(unsigned int in_size, int order) {
+    uint64_t sz;
+
+    if (order & ARITH_STRIPE) {
+        int o2 = (order & ~ARITH_STRIPE) | ARITH_NOSZ;
+        sz = 1 + 5 + 1 + NSTRIPE * (5 + (uint64_t)
+             arith_compress_bound(in_size / NSTRIPE + 1, o2));
+    } else {
+        // bzip2 may expand by 1% + 600 bytes; the range coder stops and
+        // falls back to storing uncompressed data if it expands at all.
+        sz = 1.05 * in_size + 600 + 64;
+    }
+
+    return sz > UINT_MAX ? UINT_MAX : sz;
+}
+
+static unsigned char *arith_compress_stripe(unsigned char *in,
+                                            unsigned int in_size,
+                                            unsigned char *out,
+                                            unsigned int *out_size,
+                                            int order) {
+    unsigned char *sub[NSTRIPE] = {NULL}, *part = NULL, *cp = out, *ret = NULL;
+    unsigned int sub_len[NSTRIPE];
+    int o2 = (order & ~ARITH_STRIPE) | ARITH_NOSZ, z;
+    uint64_t need;
+
+    if (!(part = malloc(in_size / NSTRIPE + 1)))
+        return NULL;
+
+    for (z = 0; z < NSTRIPE; z++) {
+        unsigned int ulen = in_size / NSTRIPE + (z < in_size % NSTRIPE), i;
+        for (i = 0; i < ulen; i++)
+            part[i] = in[i*NSTRIPE + z];
+        if (!(sub[z] = arith_compress(part, ulen, &sub_len[z], o2)))
+            goto err;
+    }
+
+    need = 1 + 5 + 1 + NSTRIPE*5;
+    for (z = 0; z < NSTRIPE; z++)
+        need += sub_len[z];
+    if (need > *out_size)
+        goto err;
+
+    *cp++ = ARITH_STRIPE | (order & ARITH_NOSZ);
+    if (!(order & ARITH_NOSZ))
+        cp += var_put_u32(cp, in_size);
+    *cp++ = NSTRIPE;
+    for (z = 0; z < NSTRIPE; z++)
+        cp += var_put_u32(cp, sub_len[z]);
+    for (z = 0; z < NSTRIPE; z++) {
+        memcpy(cp, sub[z], sub_len[z]);
+        cp += sub_len[z];
+    }
+
+    *out_size = cp - out;
+    ret = out;
+
+ err:
+    for (z = 0; z < NSTRIPE; z++)
+        free(sub[z]);
+    free(part);
+    return ret;
+}
+
+unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
+                                 unsigned char *out, unsigned int *out_size,
+                                 int order) {
+    unsigned char *packed = NULL, *out_free = NULL, *cp, *out_end;
+    unsigned char *data = in;
+    unsigned int data_len = in_size, c_size;
+    int flags = order & (ARITH_ORDER | ARITH_RLE | ARITH_NOSZ);
+    int hdr;
+
+    if (!out) {
+        *out_size = arith_compress_bound(in_size, order);
+        if (!(out = out_free = malloc(*out_size)))
+            return NULL;
+    }
+    out_end = out + *out_size;
+
+    if ((order & ARITH_STRIPE) && in_size >= NSTRIPE) {
+        unsigned int osz = *out_size;
+        if (arith_compress_stripe(in, in_size, out, &osz, order) &&
+            osz <= in_size + 6) {
+            *out_size = osz;
+            return out;
+        }
+        goto cat;
+    }
+
+    if (*out_size < 6 + 17 + 5 + 10)
+        goto fail;
+
+    cp = out + 1;
+    if (!(order & ARITH_NOSZ))
+        cp += var_put_u32(cp, in_size);
+    hdr = cp - out;
+
+    if (in_size == 0)
+        goto cat;
+
+    if (order & ARITH_PACK) {
+        uint8_t pmeta[17];
+        int pmeta_len;
+        uint32_t plen;
+        if ((packed = hts_pack(in, in_size, pmeta, &pmeta_len, &plen))) {
+            memcpy(cp, pmeta, pmeta_len);
+            cp += pmeta_len;
+            cp += var_put_u32(cp, plen);
+            data = packed;
+            data_len = plen;
+            flags |= ARITH_PACK;
+        }
+    }
+
+    c_size = out_end - cp;
+    if (order & ARITH_CAT || !data_len) {
+        if (c_size < data_len)
+            goto cat;
+        memcpy(cp, data, data_len);
+        c_size = data_len;
+        flags = (flags & ~(ARITH_ORDER | ARITH_RLE)) | ARITH_CAT;
+#ifdef HAVE_LIBBZ2
+    } else if (order & ARITH_EXT) {
+        if (BZ_OK != BZ2_bzBuffToBuffCompress((char *)cp, &c_size,
+                                              (char *)data, data_len,
+                                              9, 0, 30))
+            goto cat;
+        flags = (flags & ~(ARITH_ORDER | ARITH_RLE)) | ARITH_EXT;
+#endif
+    } else if (!arith_compress_core(data, data_len, cp, &c_size, order)) {
+        // Expanded beyond the output buffer; keep the transforms only
+        if (out_end - cp < data_len)
+            goto cat;
+        memcpy(cp, data, data_len);
+        c_size = data_len;
+        flags = (flags & ~(ARITH_ORDER | ARITH_RLE)) | ARITH_CAT;
+    }
+    cp += c_size;
+
+    // Store uncompressed if the entropy encoding didn't help
+    if (cp - out > in_size + hdr)
+        goto cat;
+
+    out[0] = flags;
+    *out_size = cp - out;
+    free(packed);
+    return out;
+
+ cat:
+    if (*out_size < in_size + 6)
+        goto fail;
+    cp = out;
+    *cp++ = ARITH_CAT | (order & ARITH_NOSZ);
+    if (!(order & ARITH_NOSZ))
+        cp += var_put_u32(cp, in_size);
+    memcpy(cp, in, in_size);
+    *out_size = cp - out + in_size;
+    free(packed);
+    return out;
+
+ fail:
+    free(packed);
+    free(out_free);
+    return NULL;
+}
+
+unsigned char *arith_compress(unsigned char *in, unsigned int in_size,
+                              unsigned int *out_size, int order) {
+    return arith_compress_to(in, in_size, NULL, out_size, order);
+}
+
+static unsigned char *arith_uncompress_stripe(unsigned char *cp,
+                                              unsigned char *cp_end,
+                                              unsigned char *out,
+                                              unsigned int out_sz) {
+    uint32_t clen[256];
+    unsigned char *part = NULL;
+    int N, z, n;
+
+    if (cp >= cp_end || (N = *cp++) == 0)
+        return NULL;
+    for (z = 0; z < N; z++) {
+        if (!(n = var_get_u32(cp, cp_end, &clen[z])))
+            return NULL;
+        cp += n;
+    }
+
+    if (!(part = malloc(out_sz / N + 1)))
+        return NULL;
+
+    for (z = 0; z < N; z++) {
+        unsigned int ulen = out_sz / N + (z < out_sz % N), i;
+        if (clen[z] > cp_end - cp ||
+            !arith_uncompress_to(cp, clen[z], part, &ulen) ||
+            ulen != out_sz / N + (z < out_sz % N))
+            goto err;
+        for (i = 0; i < ulen; i++)
+            out[i*N + z] = part[i];
+        cp += clen[z];
+    }
+
+    free(part);
+    return out;
+
+ err:
+    free(part);
+    return NULL;
+}
+
+unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
+                                   unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp = in, *cp_end = in + in_size, *out_free = NULL;
+    unsigned char *packed = NULL, *data;
+    uint32_t usize, data_len, plen = 0;
+    uint8_t map[16];
+    int order, nsym = 0, n;
+
+    if (in_size < 1)
+        return NULL;
+    order = *cp++;
+
+    if (order & ARITH_NOSZ) {
+        usize = *out_size;
+    } else {
+        if (!(n = var_get_u32(cp, cp_end, &usize)))
+            return NULL;
+        cp += n;
+    }
+
+    if (out) {
+        if (usize > *out_size)
+            return NULL;
+    } else {
+        if (!(out = out_free = malloc(usize ? usize : 1)))
+            return NULL;
+    }
+
+    if (order & ARITH_STRIPE) {
+        if (!arith_uncompress_stripe(cp, cp_end, out, usize))
+            goto err;
+        *out_size = usize;
+        return out;
+    }
+
+    data = out;
+    data_len = usize;
+    if (order & ARITH_PACK) {
+        if (!(n = hts_unpack_meta(cp, cp_end - cp, map, &nsym)))
+            goto err;
+        cp += n;
+        if (!(n = var_get_u32(cp, cp_end, &plen)))
+            goto err;
+        cp += n;
+        if (plen != hts_packed_len(usize, nsym))
+            goto err;
+        if (!(packed = malloc(plen ? plen : 1)))
+            goto err;
+        data = packed;
+        data_len = plen;
+    }
+
+    if (order & ARITH_CAT) {
+        if (data_len > cp_end - cp)
+            goto err;
+        memcpy(data, cp, data_len);
+    } else if (order & ARITH_EXT) {
+#ifdef HAVE_LIBBZ2
+        unsigned int dlen = data_len;
+        if (BZ_OK != BZ2_bzBuffToBuffDecompress((char *)data, &dlen,
+                                                (char *)cp, cp_end - cp,
+                                                0, 0) ||
+            dlen != data_len)
+            goto err;
+#else
+        goto err;
+#endif
+    } else if (data_len) {
+        if (!arith_uncompress_core(cp, cp_end - cp, data, data_len, order))
+            goto err;
+    }
+
+    if (order & ARITH_PACK) {
+        if (hts_unpack(packed, plen, out, usize, nsym, map) < 0)
+            goto err;
+        free(packed);
+    }
+
+    *out_size = usize;
+    return out;
+
+ err:
+    free(packed);
+    free(out_free);
+    return NULL;
+}
+
+unsigned char *arith_uncompress(unsigned char *in, unsigned int in_size,
+                                unsigned int *out_size) {
+    return arith_uncompress_to(in, in_size, NULL, out_size);
+}
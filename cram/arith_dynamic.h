@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ARITH_DYNAMIC_H
+#define ARITH_DYNAMIC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The CRAM 3.1 adaptive arithmetic coder.
+ *
+ * Rather than storing static frequency tables like the rANS codecs,
+ * this adapts its order-0 or order-1 model while coding.  This is slower
+ * but typically compresses small or non-stationary blocks better.  The
+ * bottom bit of order selects order-0 or order-1 modelling; the other
+ * flags match the equivalent rANS-Nx16 transforms.
+ */
+#define ARITH_ORDER  0x01
+#define ARITH_EXT    0x04 // Use bzip2 instead (if available)
+#define ARITH_STRIPE 0x08 // Split into 4 byte-interleaved streams
+#define ARITH_NOSZ   0x10 // Don't store the uncompressed size
+#define ARITH_CAT    0x20 // No entropy encoding; data copied verbatim
+#define ARITH_RLE    0x40 // Model symbol runs
+#define ARITH_PACK   0x80 // Bit-pack small alphabets (<= 16 symbols)
+
+/* Returns the maximum compressed size for in_size bytes with 'order' */
+unsigned int arith_compress_bound(unsigned int in_size, int order);
+
+/*
+ * Compresses in_size bytes of 'in'.  If 'out' is NULL a buffer is
+ * allocated, otherwise *out_size must hold its capacity.  On success
+ * *out_size holds the compressed size.
+ *
+ * Returns the output buffer on success, NULL on failure.
+ */
+unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
+                                 unsigned char *out, unsigned int *out_size,
+                                 int order);
+unsigned char *arith_compress(unsigned char *in, unsigned int in_size,
+                              unsigned int *out_size, int order);
+
+/*
+ * Uncompresses in_size bytes of 'in'.  If 'out' is non-NULL, *out_size
+ * holds its capacity.  Streams encoded with ARITH_NOSZ require *out_size
+ * to be the exact uncompressed size.  On success *out_size holds the
+ * uncompressed size.
+ *
+ * Returns the output buffer on success, NULL on failure.
+ */
+unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
+                                   unsigned char *out, unsigned int *out_size);
+unsigned char *arith_uncompress(unsigned char *in, unsigned int in_size,
+                                unsigned int *out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ARITH_DYNAMIC_H */
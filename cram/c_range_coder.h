@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A byte-oriented range coder with carry propagation, in the style of
+ * the LZMA encoder.  Used by the CRAM 3.1 adaptive arithmetic coder.
+ *
+ * The encoder keeps a 33-bit 'low' so that carries can be propagated
+ * into bytes already produced; a run of 0xFF bytes is held back in
+ * 'cache'/'ff_num' until the carry is known.  The first byte output is
+ * always zero and the decoder reads 5 bytes to prime its state.
+ */
+
+#ifndef C_RANGE_CODER_H
+#define C_RANGE_CODER_H
+
+#include <stdint.h>
+
+#define RC_TOP (1u << 24)
+
+typedef struct {
+    uint64_t low;
+    uint32_t range, code;
+    uint32_t ff_num;
+    uint8_t  cache;
+    uint8_t *in_buf, *in_end;
+    uint8_t *out_buf, *out_start, *out_end;
+    int err;    // set when reading or writing past the buffer ends
+} RangeCoder;
+
+static inline void RC_SetInput(RangeCoder *rc, uint8_t *in, uint8_t *in_end) {
+    rc->in_buf = in;
+    rc->in_end = in_end;
+    rc->err = 0;
+}
+
+static inline void RC_SetOutput(RangeCoder *rc, uint8_t *out,
+                                uint8_t *out_end) {
+    rc->out_buf = rc->out_start = out;
+    rc->out_end = out_end;
+    rc->err = 0;
+}
+
+static inline size_t RC_OutSize(RangeCoder *rc) {
+    return rc->out_buf - rc->out_start;
+}
+
+static inline void RC_StartEncode(RangeCoder *rc) {
+    rc->low = 0;
+    rc->range = 0xFFFFFFFF;
+    rc->ff_num = 1;
+    rc->cache = 0;
+}
+
+static inline void RC_OutByte(RangeCoder *rc, uint8_t c) {
+    if (rc->out_buf < rc->out_end)
+        *rc->out_buf++ = c;
+    else
+        rc->err = 1;
+}
+
+static inline void RC_ShiftLow(RangeCoder *rc) {
+    if ((uint32_t)rc->low < 0xFF000000u || (rc->low >> 32) != 0) {
+        uint8_t carry = rc->low >> 32;
+        uint8_t temp = rc->cache;
+        do {
+            RC_OutByte(rc, temp + carry);
+            temp = 0xFF;
+        } while (--rc->ff_num != 0);
+        rc->cache = (uint8_t)((uint32_t)rc->low >> 24);
+    }
+    rc->ff_num++;
+    rc->low = (uint32_t)rc->low << 8;
+}
+
+static inline void RC_FinishEncode(RangeCoder *rc) {
+    int i;
+    for (i = 0; i < 5; i++)
+        RC_ShiftLow(rc);
+}
+
+static inline uint8_t RC_InByte(RangeCoder *rc) {
+    if (rc->in_buf < rc->in_end)
+        return *rc->in_buf++;
+    rc->err = 1;
+    return 0;
+}
+
+static inline void RC_StartDecode(RangeCoder *rc) {
+    int i;
+    rc->range = 0xFFFFFFFF;
+    rc->code = 0;
+    for (i = 0; i < 5; i++)
+        rc->code = (rc->code << 8) | RC_InByte(rc);
+}
+
+static inline void RC_Encode(RangeCoder *rc, uint32_t cumFreq, uint32_t freq,
+                             uint32_t totFreq) {
+    rc->range /= totFreq;
+    rc->low += (uint64_t)cumFreq * rc->range;
+    rc->range *= freq;
+    while (rc->range < RC_TOP) {
+        rc->range <<= 8;
+        RC_ShiftLow(rc);
+    }
+}
+
+/*
+ * Returns the cumulative frequency of the next symbol.  Must be followed
+ * by RC_Decode with the same totFreq.
+ */
+static inline uint32_t RC_GetFreq(RangeCoder *rc, uint32_t totFreq) {
+    uint32_t f;
+    rc->range /= totFreq;
+    f = rc->code / rc->range;
+    return f < totFreq ? f : totFreq - 1; // only exceeded on corrupt input
+}
+
+static inline void RC_Decode(RangeCoder *rc, uint32_t cumFreq,
+                             uint32_t freq) {
+    rc->code -= cumFreq * rc->range;
+    rc->range *= freq;
+    while (rc->range < RC_TOP) {
+        rc->code = (rc->code << 8) | RC_InByte(rc);
+        rc->range <<= 8;
+    }
+}
+
+#endif /* C_RANGE_CODER_H */
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * An adaptive order-0 frequency model for use with c_range_coder.h.
+ *
+ * Symbols are kept approximately sorted by frequency, so the linear
+ * search for the common symbols is short.  Frequencies grow by STEP per
+ * occurrence and are halved once the total exceeds MAX_FREQ, which keeps
+ * the model adaptive to changing statistics.
+ */
+
+#ifndef C_SIMPLE_MODEL_H
+#define C_SIMPLE_MODEL_H
+
+#include <stdint.h>
+
+#include "c_range_coder.h"
+
+#define SM_MAX_FREQ ((1<<16)-17)
+#define SM_STEP 16
+#define SM_MAX_SYM 256
+
+typedef struct {
+    uint16_t Freq;
+    uint16_t Symbol;
+} SymFreqs;
+
+typedef struct {
+    uint32_t TotFreq;
+    uint32_t nsym;
+    // F[0] is a sentinel with maximal frequency, so the bubble-up in the
+    // update step never needs a bounds check.
+    SymFreqs F[SM_MAX_SYM+1];
+} SIMPLE_MODEL;
+
+static inline void SIMPLE_MODEL_init(SIMPLE_MODEL *m, int nsym) {
+    int i;
+
+    m->F[0].Freq = 0xFFFF;
+    m->F[0].Symbol = 0;
+    for (i = 0; i < nsym; i++) {
+        m->F[i+1].Symbol = i;
+        m->F[i+1].Freq = 1;
+    }
+    m->TotFreq = nsym;
+    m->nsym = nsym;
+}
+
+static inline void SIMPLE_MODEL_normalize(SIMPLE_MODEL *m) {
+    uint32_t i;
+
+    m->TotFreq = 0;
+    for (i = 1; i <= m->nsym; i++) {
+        m->F[i].Freq -= m->F[i].Freq >> 1;
+        m->TotFreq += m->F[i].Freq;
+    }
+}
+
+static inline void SIMPLE_MODEL_update(SIMPLE_MODEL *m, SymFreqs *s) {
+    s->Freq += SM_STEP;
+    m->TotFreq += SM_STEP;
+    if (m->TotFreq > SM_MAX_FREQ)
+        SIMPLE_MODEL_normalize(m);
+
+    if (s[0].Freq > s[-1].Freq) {
+        SymFreqs t = s[0];
+        s[0] = s[-1];
+        s[-1] = t;
+    }
+}
+
+/* Encodes 'sym', which must be less than the model's nsym */
+static inline void SIMPLE_MODEL_encodeSymbol(SIMPLE_MODEL *m, RangeCoder *rc,
+                                             uint16_t sym) {
+    SymFreqs *s = &m->F[1];
+    uint32_t acc = 0;
+
+    while (s->Symbol != sym)
+        acc += s++->Freq;
+
+    RC_Encode(rc, acc, s->Freq, m->TotFreq);
+    SIMPLE_MODEL_update(m, s);
+}
+
+static inline uint16_t SIMPLE_MODEL_decodeSymbol(SIMPLE_MODEL *m,
+                                                 RangeCoder *rc) {
+    SymFreqs *s = &m->F[1];
+    uint32_t freq = RC_GetFreq(rc, m->TotFreq);
+    uint32_t acc = 0;
+    uint16_t sym;
+
+    while ((acc += s->Freq) <= freq)
+        s++;
+    acc -= s->Freq;
+
+    RC_Decode(rc, acc, s->Freq);
+    sym = s->Symbol;
+    SIMPLE_MODEL_update(m, s);
+
+    return sym;
+}
+
+#endif /* C_SIMPLE_MODEL_H */
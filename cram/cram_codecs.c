@@ -322,6 +322,8 @@ int cram_external_decode_int(cram_slice *slice, cram_codec *c,
     b = cram_get_block_by_id(slice, c->u.external.content_id);
     if (!b)
         return *out_size?-1:0;
+    if (cram_uncompress_block_lazy(b) < 0)
+        return -1;
 
     cp = (char *)b->data + b->idx;
     // E_INT and E_LONG are guaranteed single item queries
@@ -342,6 +344,8 @@ int cram_external_decode_long(cram_slice *slice, cram_codec *c,
     b = cram_get_block_by_id(slice, c->u.external.content_id);
     if (!b)
         return *out_size?-1:0;
+    if (cram_uncompress_block_lazy(b) < 0)
+        return -1;
 
     cp = (char *)b->data + b->idx;
     // E_INT and E_LONG are guaranteed single item queries
@@ -362,6 +366,8 @@ int cram_external_decode_char(cram_slice *slice, cram_codec *c,
     b = cram_get_block_by_id(slice, c->u.external.content_id);
     if (!b)
         return *out_size?-1:0;
+    if (cram_uncompress_block_lazy(b) < 0)
+        return -1;
 
     cp = cram_extract_block(b, *out_size);
     if (!cp)
@@ -383,6 +389,8 @@ static int cram_external_decode_block(cram_slice *slice, cram_codec *c,
     b = cram_get_block_by_id(slice, c->u.external.content_id);
     if (!b)
         return *out_size?-1:0;
+    if (cram_uncompress_block_lazy(b) < 0)
+        return -1;
 
     cp = cram_extract_block(b, *out_size);
     if (!cp)
@@ -1823,6 +1831,8 @@ static int cram_byte_array_stop_decode_char(cram_slice *slice, cram_codec *c,
     b = cram_get_block_by_id(slice, c->u.byte_array_stop.content_id);
     if (!b)
         return *out_size?-1:0;
+    if (cram_uncompress_block_lazy(b) < 0)
+        return -1;
 
     if (b->idx >= b->uncomp_size)
         return -1;
@@ -1861,6 +1871,8 @@ int cram_byte_array_stop_decode_block(cram_slice *slice, cram_codec *c,
     b = cram_get_block_by_id(slice, c->u.byte_array_stop.content_id);
     if (!b)
         return *out_size?-1:0;
+    if (cram_uncompress_block_lazy(b) < 0)
+        return -1;
 
     if (b->idx >= b->uncomp_size)
         return -1;
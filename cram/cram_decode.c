@@ -51,6 +51,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "cram.h"
 #include "os.h"
 #include "../htslib/hts.h"
+#include "../sam_internal.h"
 
 //Whether CIGAR has just M or uses = and X to indicate match and mismatch
 //#define USE_X
@@ -547,6 +548,54 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
     return hdr;
 }
 
+/*
+ * Compressed size of external blocks in a slice below which they are left
+ * for the codecs to decompress on first use rather than handed out to
+ * other threads.
+ */
+#define PARALLEL_UNCOMP_MIN 65536
+
+static int cram_uncompress_block_i(void *arg, int i) {
+    return cram_uncompress_block(((cram_block **)arg)[i]);
+}
+
+/*
+ * With a thread pool, decompresses the external blocks of a slice flagged
+ * in 'used' (or all of them if 'used' is NULL) concurrently, so a single
+ * large slice does not inflate its blocks one after another.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_uncompress_slice_blocks(cram_fd *fd, cram_slice *s,
+                                        int *used) {
+    cram_block **blks;
+    int i, n = 0, r;
+    int64_t comp_size = 0;
+
+    if (!fd->pool)
+        return 0;
+
+    if (!(blks = malloc(s->hdr->num_blocks * sizeof(*blks))))
+        return -1;
+
+    for (i = 0; i < s->hdr->num_blocks; i++) {
+        cram_block *b = s->block[i];
+        if (b->content_type != EXTERNAL || b->method == RAW ||
+            (used && !used[i]))
+            continue;
+        blks[n++] = b;
+        comp_size += b->comp_size;
+    }
+
+    r = n >= 2 && comp_size >= PARALLEL_UNCOMP_MIN
+        ? cram_parallel_for(fd, n, cram_uncompress_block_i, blks)
+        : 0;
+
+    free(blks);
+    return r;
+}
+
 /*
  * Note we also need to scan through the record encoding map to
  * see which data series share the same block, either external or
@@ -562,7 +611,7 @@ int cram_dependent_data_series(cram_fd *fd,
                                cram_slice *s) {
     int *block_used;
     int core_used = 0;
-    int i;
+    int i, r;
     static int i_to_id[] = {
         DS_BF, DS_AP, DS_FP, DS_RL, DS_DL, DS_NF, DS_BA, DS_QS,
         DS_FC, DS_FN, DS_BS, DS_IN, DS_RG, DS_MQ, DS_TL, DS_RN,
@@ -621,20 +670,18 @@ int cram_dependent_data_series(cram_fd *fd,
 
         if (fd->required_fields & SAM_RGAUX)
             s->data_series |= CRAM_RG | CRAM_BF;
-
-        // Always uncompress CORE block
-        if (cram_uncompress_block(s->block[0]))
-            return -1;
     } else {
         s->data_series = CRAM_ALL;
+    }
 
-        for (i = 0; i < s->hdr->num_blocks; i++) {
-            if (cram_uncompress_block(s->block[i]))
-                return -1;
-        }
+    // Always uncompress CORE block.  External blocks are uncompressed by
+    // the codecs on first use, so unwanted data series are never inflated,
+    // or up front in parallel for the wanted ones if we have a thread pool.
+    if (cram_uncompress_block(s->block[0]))
+        return -1;
 
-        return 0;
-    }
+    if (s->data_series == CRAM_ALL)
+        return cram_uncompress_slice_blocks(fd, s, NULL);
 
     block_used = calloc(s->hdr->num_blocks+1, sizeof(int));
     if (!block_used)
@@ -706,10 +753,6 @@ int cram_dependent_data_series(cram_fd *fd,
                         if (s->block[j]->content_type == EXTERNAL &&
                             s->block[j]->content_id == bnum1) {
                             block_used[j] = 1;
-                            if (cram_uncompress_block(s->block[j])) {
-                                free(block_used);
-                                return -1;
-                            }
                         }
                     }
                     break;
@@ -752,10 +795,6 @@ int cram_dependent_data_series(cram_fd *fd,
                                 if (s->block[j]->content_type == EXTERNAL &&
                                     s->block[j]->content_id == bnum1) {
                                     block_used[j] = 1;
-                                    if (cram_uncompress_block(s->block[j])) {
-                                        free(block_used);
-                                        return -1;
-                                    }
                                 }
                             }
                             break;
@@ -864,8 +903,9 @@ int cram_dependent_data_series(cram_fd *fd,
         }
     } while (orig_ds != s->data_series);
 
+    r = cram_uncompress_slice_blocks(fd, s, block_used);
     free(block_used);
-    return 0;
+    return r;
 }
 
 /*
@@ -946,6 +986,58 @@ void cram_decode_estimate_sizes(cram_block_compression_hdr *hdr, cram_slice *s,
  * CRAM slices
  */
 
+/*
+ * Reads the optional tags, in BAM auxiliary field format, at the end of a
+ * CRAM 3 slice header.  CRAM_TAG_GENREF is the only one used; others are
+ * skipped, and parsing stops quietly at anything malformed.
+ */
+static void cram_decode_slice_tags(cram_block_slice_hdr *hdr,
+                                   const unsigned char *cp,
+                                   const unsigned char *cp_end) {
+    while (cp_end - cp >= 3) {
+        const unsigned char *tag = cp;
+        const unsigned char *nul;
+        int64_t len;
+        int sz;
+
+        cp += 3;
+        switch (tag[2]) {
+        case 'A': case 'c': case 'C':
+            len = 1; break;
+        case 's': case 'S':
+            len = 2; break;
+        case 'i': case 'I': case 'f':
+            len = 4; break;
+        case 'Z': case 'H':
+            if (!(nul = memchr(cp, 0, cp_end - cp)))
+                return;
+            len = nul - cp + 1;
+            break;
+        case 'B':
+            if (cp_end - cp < 5)
+                return;
+            switch (cp[0]) {
+            case 'c': case 'C': sz = 1; break;
+            case 's': case 'S': sz = 2; break;
+            case 'i': case 'I': case 'f': sz = 4; break;
+            default: return;
+            }
+            len = 5 + (int64_t) sz * (cp[1] | (cp[2] << 8) | (cp[3] << 16)
+                                      | ((uint32_t) cp[4] << 24));
+            break;
+        default:
+            return;
+        }
+        if (cp_end - cp < len)
+            return;
+
+        if (tag[0] == CRAM_TAG_GENREF[0] && tag[1] == CRAM_TAG_GENREF[1]
+            && (tag[2] == 'c' || tag[2] == 'C'))
+            hdr->ref_generated = cp[0] != 0;
+        cp += len;
+    }
+}
+
 /*
  * Decodes a CRAM (un)mapped slice header block.
  * Returns slice header ptr on success
@@ -1042,6 +1134,9 @@ cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b) {
             return NULL;
         }
         memcpy(hdr->md5, cp, 16);
+        cp += 16;
+        if (CRAM_MAJOR_VERS(fd->version) >= 3)
+            cram_decode_slice_tags(hdr, cp, cp_end);
     } else {
         memset(hdr->md5, 0, 16);
     }
@@ -2216,6 +2311,11 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
                               ref_id, s->ref_start, s->ref_end);
                 return -1;
             }
+            // A consensus generated by the encoder is not a copy of the
+            // reference, so MD and NM cannot be computed from it.  Those
+            // tags were stored verbatim instead.
+            if (s->hdr->ref_generated)
+                s->decode_md = 0;
         } else if (!c->comp_hdr->no_ref) {
             //// Avoid Java cramtools bug by loading entire reference seq
             //s->ref = cram_get_ref(fd, s->hdr->ref_seq_id, 1, 0);
@@ -2295,6 +2395,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
         } else if (!s->ref && s->hdr->ref_base_id >= 0) {
             cram_block *b = cram_get_block_by_id(s, s->hdr->ref_base_id);
             if (b) {
+                if (cram_uncompress_block(b) != 0)
+                    return -1;
                 if (!(md5 = hts_md5_init()))
                     return -1;
                 hts_md5_update(md5, b->data, b->uncomp_size);
@@ -2766,11 +2868,17 @@ typedef struct {
     int exit_code;
 } cram_decode_job;
 
+static int cram_slice_to_bams(cram_fd *fd, cram_slice *s, sam_hdr_t *sh);
+
 void *cram_decode_slice_thread(void *arg) {
     cram_decode_job *j = (cram_decode_job *)arg;
 
     j->exit_code = cram_decode_slice(j->fd, j->c, j->s, j->h);
 
+    // Failure here isn't fatal; cram_get_bam_seq converts records itself
+    if (j->exit_code == 0)
+        cram_slice_to_bams(j->fd, j->s, j->h);
+
     return j;
 }
 
@@ -2921,6 +3029,87 @@ static int cram_to_bam(sam_hdr_t *sh, cram_fd *fd, cram_slice *s,
     return bam_idx + (aux - aux_orig);
 }
 
+/*
+ * Converts every record in a decoded slice to BAM in one pass, writing
+ * them into a single buffer sized up front, so that cram_get_bam_seq()
+ * only needs to copy each one out.  This is called by the decoding
+ * threads, moving the work of cram_to_bam() off the main thread.
+ *
+ * Returns 0 on success
+ *        -1 on failure, leaving s->bams NULL
+ */
+static int cram_slice_to_bams(cram_fd *fd, cram_slice *s, sam_hdr_t *sh) {
+    sam_hrecs_t *bfd = sh->hrecs;
+    int rec, nrec = s->hdr->num_records;
+    size_t sz = 0, prefix_len = strlen(fd->prefix);
+    bam1_t b;
+
+    if (!(s->bams = malloc(nrec * sizeof(*s->bams))))
+        return -1;
+
+    // Upper bound on the size of each record, as per bam_construct_seq()
+    for (rec = 0; rec < nrec; rec++) {
+        cram_record *cr = &s->crecs[rec];
+        s->bams[rec].data = sz;
+        sz += (cr->name_len ? cr->name_len : prefix_len + 22) + 4
+            + cr->ncigar*4 + (cr->len+1)/2 + cr->len + cr->aux_size;
+        if (cr->rg >= 0 && cr->rg < bfd->nrg)
+            sz += bfd->rg[cr->rg].name_len + 4;
+    }
+
+    if (!(s->bam_data = malloc(sz ? sz : 1)))
+        goto err;
+
+    memset(&b, 0, sizeof(b));
+    for (rec = 0; rec < nrec; rec++) {
+        cram_bam_rec *br = &s->bams[rec];
+        bam_seq_t *bp = &b;
+
+        b.data = s->bam_data + br->data;
+        b.m_data = (rec+1 < nrec ? s->bams[rec+1].data : sz) - br->data;
+        b.l_data = 0;
+        bam_set_mempolicy(&b, BAM_USER_OWNS_DATA);
+
+        if (cram_to_bam(sh, fd, s, &s->crecs[rec], rec, &bp) < 0)
+            goto err;
+        if (b.data != s->bam_data + br->data) {
+            // Overran our estimate; shouldn't happen
+            free(b.data);
+            goto err;
+        }
+        br->core = b.core;
+        br->l_data = b.l_data;
+    }
+
+    return 0;
+
+ err:
+    free(s->bams);
+    free(s->bam_data);
+    s->bams = NULL;
+    s->bam_data = NULL;
+    return -1;
+}
+
+/*
+ * Copies record 'rec' from the slice's converted BAM records into *bam.
+ *
+ * Returns the size of the bam record on success
+ *         -1 on failure.
+ */
+static int cram_copy_bam(cram_slice *s, int rec, bam_seq_t **bam) {
+    cram_bam_rec *br = &s->bams[rec];
+    bam1_t *b = *bam;
+
+    if (realloc_bam_data(b, br->l_data) < 0)
+        return -1;
+    b->core = br->core;
+    b->l_data = br->l_data;
+    memcpy(b->data, s->bam_data + br->data, br->l_data);
+
+    return br->l_data;
+}
+
 /*
  * Here be dragons! The multi-threading code in this is crufty beyond belief.
  */
@@ -3334,6 +3523,9 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
     c = fd->ctr;
     s = c->slice;
 
+    if (s->bams)
+        return cram_copy_bam(s, s->curr_rec-1, bam);
+
     return cram_to_bam(fd->header, fd, s, cr, s->curr_rec-1, bam);
 }
 
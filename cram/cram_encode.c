@@ -548,7 +548,7 @@ cram_block *cram_encode_slice_header(cram_fd *fd, cram_slice *s) {
     if (!b)
         return NULL;
 
-    cp = buf = malloc(16+5*(8+s->hdr->num_blocks));
+    cp = buf = malloc(20+5*(8+s->hdr->num_blocks));
     if (NULL == buf) {
         cram_free_block(b);
         return NULL;
@@ -579,7 +579,14 @@ cram_block *cram_encode_slice_header(cram_fd *fd, cram_slice *s) {
         memcpy(cp, s->hdr->md5, 16); cp += 16;
     }
 
-    assert(cp-buf <= 16+5*(8+s->hdr->num_blocks));
+    if (CRAM_MAJOR_VERS(fd->version) >= 3 && s->hdr->ref_generated) {
+        *cp++ = CRAM_TAG_GENREF[0];
+        *cp++ = CRAM_TAG_GENREF[1];
+        *cp++ = 'c';
+        *cp++ = 1;
+    }
+
+    assert(cp-buf <= 20+5*(8+s->hdr->num_blocks));
 
     b->data = (unsigned char *)buf;
     b->comp_size = b->uncomp_size = cp-buf;
@@ -812,26 +819,150 @@ static int cram_encode_slice_read(cram_fd *fd,
 }
 
 
+/*
+ * A list of block compression jobs covering every slice in a container.
+ * The blocks are independent of each other, so once all slices have been
+ * encoded they can be compressed in parallel via cram_parallel_for().
+ * Jobs are kept in the order the serial code would have run them in.
+ */
+typedef struct {
+    cram_slice *s;     // for FQZ, else NULL
+    cram_block *b;
+    cram_metrics *m;
+    int method, level;
+} cram_comp_job;
+
+typedef struct {
+    cram_fd *fd;
+    cram_comp_job *job;
+    int njob, ajob;
+} cram_comp_jobs;
+
+/*
+ * Queues block 'b' for compression.  As with cram_compress_block, only
+ * the first request for any one block takes effect.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_add_comp_job(cram_comp_jobs *j, cram_slice *s, cram_block *b,
+                             cram_metrics *m, int method, int level) {
+    int i;
+
+    if (!b)
+        return 0;
+
+    for (i = j->njob-1; i >= 0; i--)
+        if (j->job[i].b == b)
+            return 0;
+
+    if (j->njob >= j->ajob) {
+        int a = j->ajob ? j->ajob*2 : 64;
+        cram_comp_job *job = realloc(j->job, a * sizeof(*job));
+        if (!job)
+            return -1;
+        j->job = job;
+        j->ajob = a;
+    }
+
+    j->job[j->njob].s = s;
+    j->job[j->njob].b = b;
+    j->job[j->njob].m = m;
+    j->job[j->njob].method = method;
+    j->job[j->njob].level = level;
+    j->njob++;
+
+    return 0;
+}
+
+static int cram_comp_job_run(void *arg, int i) {
+    cram_comp_jobs *j = (cram_comp_jobs *)arg;
+    cram_comp_job *job = &j->job[i];
+
+    return cram_compress_block2(j->fd, job->s, job->b, job->m,
+                                job->method, job->level);
+}
+
+// Largest first, so a big quality block doesn't start last.
+static int cram_comp_job_cmp(const void *a, const void *b) {
+    const cram_comp_job *ja = (const cram_comp_job *)a;
+    const cram_comp_job *jb = (const cram_comp_job *)b;
+
+    return (ja->b->uncomp_size < jb->b->uncomp_size)
+        - (ja->b->uncomp_size > jb->b->uncomp_size);
+}
+
+/*
+ * Compresses all queued blocks.  Without a thread pool this is the same
+ * sequence of calls as compressing each slice in turn.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_run_comp_jobs(cram_comp_jobs *j) {
+    if (j->fd->pool && j->njob > 1)
+        qsort(j->job, j->njob, sizeof(*j->job), cram_comp_job_cmp);
+
+    return cram_parallel_for(j->fd, j->njob, cram_comp_job_run, j);
+}
+
+/*
+ * The rANS-Nx16, arithmetic, fqzcomp and name tokeniser codecs (CRAM
+ * method ids 5 to 8) here have only been checked against themselves, not
+ * against streams written by other CRAM 3.1 implementations, and the
+ * fqzcomp and tokeniser stream layouts are known to differ from the
+ * specification.  Until that is fixed and checked they are neither written
+ * nor read (see cram_uncompress_block) unless built with
+ * -DCRAM_EXPERIMENTAL_V31_CODECS, so CRAM 3.1 output uses the 3.0 codecs,
+ * which 3.1 readers also accept.
+ */
+#ifdef CRAM_EXPERIMENTAL_V31_CODECS
+#define CRAM_V31_CODECS(fd) (CRAM_MAJOR_VERS((fd)->version) == 3 && \
+                             CRAM_MINOR_VERS((fd)->version) >= 1)
+#else
+#define CRAM_V31_CODECS(fd) 0
+#endif
+
 /*
  * Applies various compression methods to specific blocks, depending on
- * known observations of how data series compress.
+ * known observations of how data series compress.  The blocks are
+ * queued on 'j' rather than compressed here; see cram_run_comp_jobs().
  *
  * Returns 0 on success
  *        -1 on failure
  */
-static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
+static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s,
+                               cram_comp_jobs *j) {
     int level = fd->level, i;
     int method = 1<<GZIP | 1<<GZIP_RLE, methodF = method;
+    int qmethod, nmethod;
 
     /* Compress the CORE Block too, with minimal zlib level */
     if (level > 5 && s->block[0]->uncomp_size > 500)
-        cram_compress_block(fd, s->block[0], NULL, 1<<GZIP, 1);
+        if (cram_add_comp_job(j, NULL, s->block[0], NULL, 1<<GZIP, 1))
+            return -1;
 
     if (fd->use_bz2)
         method |= 1<<BZIP2;
 
-    if (fd->use_rans)
-        method |= (1<<RANS0) | (1<<RANS1);
+    if (fd->use_rans) {
+        if (CRAM_V31_CODECS(fd)) {
+            // CRAM 3.1 supersedes rANS 4x8 with rANS Nx16
+            method |= (1<<RANS_PR0) | (1<<RANS_PR1) | (1<<RANS_PR64)
+                | (1<<RANS_PR128) | (1<<RANS_PR193);
+            if (level >= 7)
+                method |= (1<<RANS_PR9) | (1<<RANS_PR129) | (1<<RANS_PR192);
+        } else {
+            method |= (1<<RANS0) | (1<<RANS1);
+        }
+    }
+
+    if (fd->use_arith && CRAM_V31_CODECS(fd)) {
+        method |= (1<<ARITH_PR0) | (1<<ARITH_PR1) | (1<<ARITH_PR64);
+        if (level >= 7)
+            method |= (1<<ARITH_PR9) | (1<<ARITH_PR128) | (1<<ARITH_PR129)
+                | (1<<ARITH_PR192) | (1<<ARITH_PR193);
+    }
 
     if (fd->use_lzma)
         method |= (1<<LZMA);
@@ -841,70 +972,81 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
     if (level >= 6)
         methodF = method;
 
+    /* Specialised codecs for qualities and names */
+    qmethod = method;
+    nmethod = method & ~(1<<RANS0 | 1<<GZIP_RLE | 1<<RANS_PR0 | 1<<ARITH_PR0);
+    if (CRAM_V31_CODECS(fd)) {
+        qmethod |= 1<<FQZ;
+        if (level >= 7)
+            qmethod |= 1<<FQZ_b | 1<<FQZ_c | 1<<FQZ_d;
+        nmethod |= 1<<TOK3;
+        if (fd->use_arith)
+            nmethod |= 1<<TOKA;
+    }
+
 
     /* Specific compression methods for certain block types */
-    if (cram_compress_block(fd, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
-                            method, level))
+    if (cram_add_comp_job(j, NULL, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
+                          method, level))
         return -1;
 
     if (fd->level == 0) {
         /* Do nothing */
     } else if (fd->level == 1) {
-        if (cram_compress_block(fd, s->block[DS_QS], fd->m[DS_QS],
-                                methodF, 1))
+        if (cram_add_comp_job(j, NULL, s->block[DS_QS], fd->m[DS_QS],
+                              methodF, 1))
             return -1;
         for (i = DS_aux; i <= DS_aux_oz; i++) {
             if (s->block[i])
-                if (cram_compress_block(fd, s->block[i], fd->m[i],
-                                        method, 1))
+                if (cram_add_comp_job(j, NULL, s->block[i], fd->m[i],
+                                      method, 1))
                     return -1;
         }
     } else if (fd->level < 3) {
-        if (cram_compress_block(fd, s->block[DS_QS], fd->m[DS_QS],
-                                method, 1))
+        if (cram_add_comp_job(j, s, s->block[DS_QS], fd->m[DS_QS],
+                              qmethod, 1))
             return -1;
-        if (cram_compress_block(fd, s->block[DS_BA], fd->m[DS_BA],
-                                method, 1))
+        if (cram_add_comp_job(j, NULL, s->block[DS_BA], fd->m[DS_BA],
+                              method, 1))
             return -1;
         if (s->block[DS_BB])
-            if (cram_compress_block(fd, s->block[DS_BB], fd->m[DS_BB],
-                                    method, 1))
+            if (cram_add_comp_job(j, NULL, s->block[DS_BB], fd->m[DS_BB],
+                                  method, 1))
                 return -1;
         for (i = DS_aux; i <= DS_aux_oz; i++) {
             if (s->block[i])
-                if (cram_compress_block(fd, s->block[i], fd->m[i],
-                                        method, level))
+                if (cram_add_comp_job(j, NULL, s->block[i], fd->m[i],
+                                      method, level))
                     return -1;
         }
     } else {
-        if (cram_compress_block(fd, s->block[DS_QS], fd->m[DS_QS],
-                                method, level))
+        if (cram_add_comp_job(j, s, s->block[DS_QS], fd->m[DS_QS],
+                              qmethod, level))
             return -1;
-        if (cram_compress_block(fd, s->block[DS_BA], fd->m[DS_BA],
-                                method, level))
+        if (cram_add_comp_job(j, NULL, s->block[DS_BA], fd->m[DS_BA],
+                              method, level))
             return -1;
         if (s->block[DS_BB])
-            if (cram_compress_block(fd, s->block[DS_BB], fd->m[DS_BB],
-                                    method, level))
+            if (cram_add_comp_job(j, NULL, s->block[DS_BB], fd->m[DS_BB],
+                                  method, level))
                 return -1;
         for (i = DS_aux; i <= DS_aux_oz; i++) {
             if (s->block[i])
-                if (cram_compress_block(fd, s->block[i], fd->m[i],
-                                        method, level))
+                if (cram_add_comp_job(j, NULL, s->block[i], fd->m[i],
+                                      method, level))
                     return -1;
         }
     }
 
-    // NAME: best is generally xz, bzip2, zlib then rans1
-    if (cram_compress_block(fd, s->block[DS_RN], fd->m[DS_RN],
-                            method & ~(1<<RANS0 | 1<<GZIP_RLE),
-                            level))
+    // NAME: best is generally tok3, xz, bzip2, zlib then rans1
+    if (cram_add_comp_job(j, NULL, s->block[DS_RN], fd->m[DS_RN],
+                          nmethod, level))
         return -1;
 
     // NS shows strong local correlation as rearrangements are localised
     if (s->block[DS_NS] != s->block[0])
-        if (cram_compress_block(fd, s->block[DS_NS], fd->m[DS_NS],
-                                method, level))
+        if (cram_add_comp_job(j, NULL, s->block[DS_NS], fd->m[DS_NS],
+                              method, level))
             return -1;
 
 
@@ -920,14 +1062,14 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
             if (s->aux_block[i]->method != RAW)
                 continue;
 
-            if (cram_compress_block(fd, s->aux_block[i], s->aux_block[i]->m,
-                                    method, level))
+            if (cram_add_comp_job(j, NULL, s->aux_block[i], s->aux_block[i]->m,
+                                  method, level))
                 return -1;
         }
     }
 
     /*
-     * Minimal compression of any block still uncompressed, bar CORE
+     * Minimal compression of any block not yet queued, bar CORE
      */
     {
         int i;
@@ -938,8 +1080,8 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
             if (s->block[i]->method != RAW)
                 continue;
 
-            if (cram_compress_block(fd, s->block[i], fd->m[i],
-                                    methodF, level))
+            if (cram_add_comp_job(j, NULL, s->block[i], fd->m[i],
+                                  methodF, level))
                 return -1;
         }
     }
@@ -948,13 +1090,15 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 }
 
 /*
- * Encodes a single slice from a container
+ * Encodes a single slice from a container.  The resulting blocks are
+ * added to 'j' for compression, after which cram_finish_slice() is called.
  *
  * Returns 0 on success
  *        -1 on failure
  */
 static int cram_encode_slice(cram_fd *fd, cram_container *c,
-                             cram_block_compression_hdr *h, cram_slice *s) {
+                             cram_block_compression_hdr *h, cram_slice *s,
+                             cram_comp_jobs *j) {
     int rec, r = 0;
     int64_t last_pos;
     int embed_ref;
@@ -1004,9 +1148,15 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
         if (!(s->block[DS_ref] = cram_new_block(EXTERNAL, DS_ref)))
             return -1;
         s->ref_id = DS_ref; // needed?
-        BLOCK_APPEND(s->block[DS_ref],
-                     c->ref + s->hdr->ref_seq_start - c->ref_start,
-                     s->hdr->ref_seq_span);
+        if (s->cons_ref) {
+            BLOCK_APPEND(s->block[DS_ref],
+                         s->cons_ref + s->hdr->ref_seq_start - s->ref_start,
+                         s->hdr->ref_seq_span);
+        } else {
+            BLOCK_APPEND(s->block[DS_ref],
+                         c->ref + s->hdr->ref_seq_start - c->ref_start,
+                         s->hdr->ref_seq_span);
+        }
     }
 
     /*
@@ -1099,10 +1249,24 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
             BLOCK_UPLEN(s->block[id]);
     }
 
-    // Compress it all
-    if (cram_compress_slice(fd, c, s) == -1)
+    // Queue it all for compression
+    if (cram_compress_slice(fd, c, s, j) == -1)
         return -1;
 
+    return r ? -1 : 0;
+
+ block_err:
+    return -1;
+}
+
+/*
+ * Completes a slice once its blocks have been compressed, removing empty
+ * blocks and creating the slice header block.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_finish_slice(cram_fd *fd, cram_slice *s) {
     // Collapse empty blocks and create hdr_block
     {
         int i, j;
@@ -1131,10 +1295,7 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
             return -1;
     }
 
-    return r ? -1 : 0;
-
- block_err:
-    return -1;
+    return 0;
 }
 
 /*
@@ -1301,6 +1462,150 @@ static int add_read_names(cram_fd *fd, cram_container *c, cram_slice *s,
     return -1;
 }
 
+/*
+ * Builds a consensus sequence for a slice from its aligned reads, for
+ * embedding in place of a reference (embed_ref=2).  Each position gets
+ * its most common base, or N if no read has an A, C, G or T there.
+ *
+ * Reads are visited in position order, so base counts are only needed
+ * for a window as wide as the longest alignment rather than for the
+ * whole slice.
+ *
+ * On success s->cons_ref holds the consensus for s->ref_start to
+ * s->ref_end inclusive (1-based).  As decoders will not use a reference
+ * beyond its @SQ length, neither do we; those bases are stored verbatim.
+ * The consensus always has at least one base so it can be embedded.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_generate_reference(cram_fd *fd, cram_container *c,
+                                   cram_slice *s, int bam_start) {
+    // BAM nibble to A, C, G, T count index; others are not counted
+    static const int8_t base_idx[16] = {
+        -1, 0, 1,-1, 2,-1,-1,-1, 3,-1,-1,-1,-1,-1,-1,-1
+    };
+    int64_t start = INT64_MAX, end = INT64_MIN, last_pos = INT64_MIN;
+    int64_t max_span = 1, done, p, cend, rlen;
+    uint32_t (*hist)[4] = NULL;
+    size_t hsize = 1;
+    int *order = NULL, nrec, r, sorted = 1;
+
+    nrec = MIN(c->curr_c_rec - bam_start, s->hdr->num_records);
+    if (nrec <= 0)
+        return 0;
+    if (!(order = malloc(nrec * sizeof(*order))))
+        return -1;
+
+    for (r = 0; r < nrec; r++) {
+        bam_seq_t *b = c->bams[bam_start + r];
+        int64_t pos = bam_pos(b)+1, last = pos;
+
+        if (!(bam_flag(b) & BAM_FUNMAP))
+            last = pos + bam_cigar2rlen(bam_cigar_len(b), bam_cigar(b)) - 1;
+        if (last < pos)
+            last = pos;
+
+        start = MIN(start, pos);
+        end   = MAX(end, last);
+        max_span = MAX(max_span, last - pos + 1);
+        sorted &= pos >= last_pos;
+        last_pos = pos;
+        order[r] = bam_start + r;
+    }
+
+    if (!sorted) {
+        // Insertion sort; slices are rarely far out of order
+        for (r = 1; r < nrec; r++) {
+            int x = order[r], q;
+            int64_t pos = bam_pos(c->bams[x]);
+            for (q = r; q > 0 && bam_pos(c->bams[order[q-1]]) > pos; q--)
+                order[q] = order[q-1];
+            order[q] = x;
+        }
+    }
+
+    rlen = sam_hdr_tid2len(fd->header, c->ref_id);
+    cend = rlen > 0 ? MIN(end, rlen) : end;
+
+    while (hsize < max_span)
+        hsize *= 2;
+    hist = calloc(hsize, sizeof(*hist));
+    s->cons_ref = malloc(MAX(cend, start) - start + 1);
+    if (!hist || !s->cons_ref)
+        goto err;
+    s->cons_ref[0] = 'N';
+    s->ref_start = start;
+    s->ref_end   = cend;
+
+    for (done = start, r = 0; r <= nrec; r++) {
+        bam_seq_t *b = r < nrec ? c->bams[order[r]] : NULL;
+        int64_t pos = b ? bam_pos(b)+1 : end+1;
+
+        // No later read can reach positions before this one
+        for (; done < pos; done++) {
+            uint32_t *h = hist[done & (hsize-1)];
+            int i, best = -1;
+            uint32_t best_n = 0;
+            for (i = 0; i < 4; i++)
+                if (best_n < h[i])
+                    best_n = h[i], best = i;
+            if (done <= cend)
+                s->cons_ref[done - start] = best < 0 ? 'N' : "ACGT"[best];
+            memset(h, 0, sizeof(*h) * 4);
+        }
+
+        if (!b || (bam_flag(b) & BAM_FUNMAP))
+            continue;
+
+        uint32_t *cig = bam_cigar(b);
+        uint8_t *seq = bam_seq(b);
+        int ncig = bam_cigar_len(b), slen = bam_seq_len(b), i;
+        int64_t spos = 0;
+
+        for (i = 0, p = pos; i < ncig; i++) {
+            int64_t len = cig[i] >> BAM_CIGAR_SHIFT, k;
+            switch (cig[i] & BAM_CIGAR_MASK) {
+            case BAM_CMATCH:
+            case BAM_CBASE_MATCH:
+            case BAM_CBASE_MISMATCH:
+                for (k = 0; k < len && spos + k < slen; k++) {
+                    int x = base_idx[bam_seqi(seq, spos + k)];
+                    if (x >= 0)
+                        hist[(p + k) & (hsize-1)][x]++;
+                }
+                p += len;
+                spos += len;
+                break;
+
+            case BAM_CINS:
+            case BAM_CSOFT_CLIP:
+                spos += len;
+                break;
+
+            case BAM_CDEL:
+            case BAM_CREF_SKIP:
+                p += len;
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    free(hist);
+    free(order);
+    return 0;
+
+ err:
+    free(hist);
+    free(order);
+    free(s->cons_ref);
+    s->cons_ref = NULL;
+    return -1;
+}
+
 /*
  * Encodes all slices in a container into blocks.
  * Returns 0 on success
@@ -1329,9 +1634,15 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
         }
     }
 
+    if (fd->embed_ref == 2 && c->multi_seq) {
+        hts_log_error("Generated references cannot be used with "
+                      "multi-reference slices");
+        return -1;
+    }
+
     /* To create M5 strings */
     /* Fetch reference sequence */
-    if (!fd->no_ref) {
+    if (!fd->no_ref && fd->embed_ref != 2) {
         if (!c->bams || !c->bams[0])
             goto_err;
         bam_seq_t *b = c->bams[0];
@@ -1375,6 +1686,15 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
         // is done within process_one_read().
         kstring_t MD = {0};
 
+        // Without a reference, diff against a consensus of this slice
+        if (fd->embed_ref == 2 && c->ref_id >= 0) {
+            if (cram_generate_reference(fd, c, s, r1_start) != 0)
+                return -1;
+            c->ref       = s->cons_ref;
+            c->ref_start = s->ref_start;
+            c->ref_end   = s->ref_end;
+        }
+
         // Iterate through records creating the cram blocks for some
         // fields and just gathering stats for others.
         for (r2 = 0; r1 < c->curr_c_rec && r2 < s->hdr->num_records; r1++, r2++) {
@@ -1431,6 +1751,12 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
             s->hdr->ref_seq_id    = c->ref_id;
             s->hdr->ref_seq_start = first_base;
             s->hdr->ref_seq_span  = MAX(0, last_base - first_base + 1);
+
+            // Embedded reference blocks must not be empty, even if no
+            // read in the slice covers a reference base.
+            if (fd->embed_ref && c->ref_id >= 0 && !s->hdr->ref_seq_span &&
+                (s->cons_ref || first_base <= c->ref_end))
+                s->hdr->ref_seq_span = 1;
         }
         s->hdr->num_records = r2;
 
@@ -1495,7 +1821,13 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
         cram_slice *s = c->slices[i];
 
         if (CRAM_MAJOR_VERS(fd->version) != 1) {
-            if (s->hdr->ref_seq_id >= 0 && c->multi_seq == 0 && !fd->no_ref) {
+            // Generated references get a zero MD5, as there is no real
+            // reference to check against, and are marked with the
+            // CRAM_TAG_GENREF slice header tag
+            s->hdr->ref_generated = fd->embed_ref == 2
+                && s->hdr->ref_seq_id >= 0;
+            if (s->hdr->ref_seq_id >= 0 && c->multi_seq == 0 &&
+                !fd->no_ref && fd->embed_ref != 2) {
                 hts_md5_context *md5 = hts_md5_init();
                 if (!md5)
                     return -1;
@@ -1762,12 +2094,32 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
     }
 
 
-    /* Encode slices */
-    for (i = 0; i < c->curr_slice; i++) {
-        hts_log_info("Encode slice %d", i);
+    /*
+     * Encode slices.  Encoding shares the container's codecs so is done
+     * in turn, but compression of the resulting blocks is spread over the
+     * thread pool, across all slices at once.
+     */
+    {
+        cram_comp_jobs jobs = {fd, NULL, 0, 0};
 
-        if (cram_encode_slice(fd, c, h, c->slices[i]) != 0)
+        for (i = 0; i < c->curr_slice; i++) {
+            hts_log_info("Encode slice %d", i);
+
+            if (cram_encode_slice(fd, c, h, c->slices[i], &jobs) != 0) {
+                free(jobs.job);
+                return -1;
+            }
+        }
+
+        if (cram_run_comp_jobs(&jobs) != 0) {
+            free(jobs.job);
             return -1;
+        }
+        free(jobs.job);
+
+        for (i = 0; i < c->curr_slice; i++)
+            if (cram_finish_slice(fd, c->slices[i]) != 0)
+                return -1;
     }
 
     /* Create compression header */
@@ -2701,12 +3053,14 @@ static int process_one_read(cram_fd *fd, cram_container *c,
     // to ensure valid data round-trips the same regardless of who
     // defines it as valid.
     // Similarly when alignments go beyond end of the reference.
-    int verbatim_NM = fd->store_nm;
-    int verbatim_MD = fd->store_md;
+    // MD and NM against a generated consensus would be meaningless
+    int verbatim_NM = fd->store_nm || fd->embed_ref == 2;
+    int verbatim_MD = fd->store_md || fd->embed_ref == 2;
 
     // FIXME: multi-ref containers
 
-    ref = c->ref;
+    // Indexed by 0-based reference position, as c->ref may not start at 1
+    ref = c->ref ? c->ref - (c->ref_start-1) : NULL;
     cr->flags       = bam_flag(b);
     cr->len         = bam_seq_len(b);
     if (!bam_aux_get(b, "MD"))
@@ -204,13 +204,20 @@ enum cram_content_type cram_block_get_content_type(cram_block *b) {
 }
 
 void cram_block_set_content_id(cram_block *b, int32_t id) { b->content_id = id; }
-void cram_block_set_comp_size(cram_block *b, int32_t size) { b->comp_size = size; }
+void cram_block_set_comp_size(cram_block *b, int32_t size) {
+    b->comp_size = size;
+    b->comp_crc_data = NULL;
+}
 void cram_block_set_uncomp_size(cram_block *b, int32_t size) { b->uncomp_size = size; }
 void cram_block_set_crc32(cram_block *b, int32_t crc) { b->crc32 = crc; }
-void cram_block_set_data(cram_block *b, void *data) { BLOCK_DATA(b) = data; }
+void cram_block_set_data(cram_block *b, void *data) {
+    BLOCK_DATA(b) = data;
+    b->comp_crc_data = NULL;
+}
 void cram_block_set_size(cram_block *b, int32_t size) { BLOCK_SIZE(b) = size; }
 
 int cram_block_append(cram_block *b, const void *data, int size) {
+    b->comp_crc_data = NULL;
     BLOCK_APPEND(b, data, size);
     return 0;
 
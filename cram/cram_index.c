@@ -46,6 +46,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * earlier as it is sorted) range will be held within it. This ensures that
  * the outer list will never have containments and we can safely do a
  * binary search to find the first range which overlaps any given coordinate.
+ *
+ * As no list contains any containments, the end coordinates within a list
+ * are sorted as well as the starts.  So both the first entry ending at or
+ * after a position and the last entry starting at or before a position
+ * can be found by binary search, making queries O(log n) per list.
  */
 
 #define HTS_BUILDING_LIBRARY // Enables HTSLIB_EXPORT, see htslib/hts_defs.h
@@ -402,44 +407,19 @@ cram_index *cram_index_query(cram_fd *fd, int refid, hts_pos_t pos,
     if (!from->e)
         return NULL;
 
-    // This sequence is covered by the index, so binary search to find
-    // the optimal starting block.
-    i = 0, j = fd->index[refid+1].nslice-1;
-    for (k = j/2; k != i; k = (j-i)/2 + i) {
-        if (from->e[k].refid > refid) {
-            j = k;
-            continue;
-        }
-
-        if (from->e[k].refid < refid) {
-            i = k;
-            continue;
-        }
-
-        if (from->e[k].start >= pos) {
+    // Binary search for the first entry ending at or after pos, which is
+    // also the first to overlap it.  If none do, use the last entry.
+    i = 0, j = from->nslice;
+    while (i < j) {
+        k = i + (j-i)/2;
+        if (from->e[k].end < pos)
+            i = k+1;
+        else
             j = k;
-            continue;
-        }
-
-        if (from->e[k].start < pos) {
-            i = k;
-            continue;
-        }
     }
-    // i==j or i==j-1. Check if j is better.
-    if (j >= 0 && from->e[j].start < pos && from->e[j].refid == refid)
-        i = j;
-
-    /* The above found *a* bin overlapping, but not necessarily the first */
-    while (i > 0 && from->e[i-1].end >= pos)
+    if (i == from->nslice)
         i--;
 
-    /* We may be one bin before the optimum, so check */
-    while (i+1 < from->nslice &&
-           (from->e[i].refid < refid ||
-            from->e[i].end < pos))
-        i++;
-
     e = &from->e[i];
 
     return e;
@@ -464,22 +444,36 @@ cram_index *cram_index_last(cram_fd *fd, int refid, cram_index *from) {
     return &from->e[slice];
 }
 
+/*
+ * Returns the last of the n entries in e[] starting at or before 'end',
+ * or e[0] if there are none.
+ */
+static cram_index *cram_index_last_before(cram_index *e, int n,
+                                          hts_pos_t end) {
+    int i = 1, j = n, k;
+
+    // Binary search for the first entry after e[0] starting beyond end
+    while (i < j) {
+        k = i + (j-i)/2;
+        if (e[k].start <= end)
+            i = k+1;
+        else
+            j = k;
+    }
+
+    return &e[i-1];
+}
+
 cram_index *cram_index_query_last(cram_fd *fd, int refid, hts_pos_t end) {
     cram_index *first = cram_index_query(fd, refid, end, NULL);
     cram_index *last =  cram_index_last(fd, refid, NULL);
     if (!first || !last)
         return NULL;
 
-    while (first < last && (first+1)->start <= end)
-        first++;
+    first = cram_index_last_before(first, last - first + 1, end);
 
-    while (first->e) {
-        int count = 0;
-        int nslices = first->nslice;
-        first = first->e;
-        while (++count < nslices && (first+1)->start <= end)
-            first++;
-    }
+    while (first->e)
+        first = cram_index_last_before(first->e, first->nslice, end);
 
     return first;
 }
@@ -565,13 +559,12 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 static int cram_index_build_multiref(cram_fd *fd,
                                      cram_container *c,
                                      cram_slice *s,
-                                     BGZF *fp,
+                                     kstring_t *str,
                                      off_t cpos,
                                      int32_t landmark,
                                      int sz) {
     int i, ref = -2;
     int64_t ref_start = 0, ref_end;
-    char buf[1024];
 
     if (fd->mode != 'w') {
         if (0 != cram_decode_slice(fd, c, s, fd->header))
@@ -597,10 +590,9 @@ static int cram_index_build_multiref(cram_fd *fd,
         }
 
         if (ref != -2) {
-            sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-                    ref, ref_start, ref_end - ref_start + 1,
-                    (int64_t)cpos, landmark, sz);
-            if (bgzf_write(fp, buf, strlen(buf)) < 0)
+            if (ksprintf(str, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
+                         ref, ref_start, ref_end - ref_start + 1,
+                         (int64_t)cpos, landmark, sz) < 0)
                 return -4;
         }
 
@@ -610,16 +602,48 @@ static int cram_index_build_multiref(cram_fd *fd,
     }
 
     if (ref != -2) {
-        sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-                ref, ref_start, ref_end - ref_start + 1,
-                (int64_t)cpos, landmark, sz);
-        if (bgzf_write(fp, buf, strlen(buf)) < 0)
+        if (ksprintf(str, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
+                     ref, ref_start, ref_end - ref_start + 1,
+                     (int64_t)cpos, landmark, sz) < 0)
             return -4;
     }
 
     return 0;
 }
 
+/*
+ * Formats the index line(s) for a single slice, appending to str.
+ *
+ * Returns 0 on success,
+ *        -1 on read failure
+ *        -2 on wrong sort order
+ *        -4 on write failure
+ */
+static int cram_index_slice_str(cram_fd *fd,
+                                cram_container *c,
+                                cram_slice *s,
+                                kstring_t *str,
+                                off_t cpos,
+                                off_t spos, // relative to cpos
+                                off_t sz) {
+    if (sz > INT_MAX) {
+        hts_log_error("CRAM slice is too big (%"PRId64" bytes)",
+                      (int64_t) sz);
+        return -1;
+    }
+
+    if (s->hdr->ref_seq_id == -2)
+        return cram_index_build_multiref(fd, c, s, str, cpos, spos, sz);
+
+    if (ksprintf(str, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
+                 s->hdr->ref_seq_id, s->hdr->ref_seq_start,
+                 s->hdr->ref_seq_span, (int64_t)cpos, (int)spos,
+                 (int)sz) < 0)
+        return -4;
+
+    return 0;
+}
+
 /*
  * Adds a single slice to the index.
  */
@@ -630,67 +654,219 @@ int cram_index_slice(cram_fd *fd,
                      off_t cpos,
                      off_t spos, // relative to cpos
                      off_t sz) {
+    kstring_t str = {0};
     int ret;
-    char buf[1024];
 
-    if (sz > INT_MAX) {
-        hts_log_error("CRAM slice is too big (%"PRId64" bytes)",
-                      (int64_t) sz);
-        return -1;
-    }
+    ret = cram_index_slice_str(fd, c, s, &str, cpos, spos, sz);
+    if (ret == 0 && str.l && bgzf_write(fp, str.s, str.l) < 0)
+        ret = -4;
+    free(str.s);
 
-    if (s->hdr->ref_seq_id == -2) {
-        ret = cram_index_build_multiref(fd, c, s, fp, cpos, spos, sz);
-    } else {
-        sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-                s->hdr->ref_seq_id, s->hdr->ref_seq_start,
-                s->hdr->ref_seq_span, (int64_t)cpos, (int)spos, (int)sz);
-        ret = (bgzf_write(fp, buf, strlen(buf)) >= 0)? 0 : -4;
+    return ret;
+}
+
+/*
+ * One slice to index.  With a thread pool these are run as jobs, with the
+ * results written out in file order.
+ */
+typedef struct {
+    cram_fd *fd;
+    cram_container *c;
+    cram_slice *s;
+    off_t cpos;
+    int32_t landmark;
+    off_t sz;
+    int last;          // the final slice of c, which we then free
+    int ret;
+    kstring_t str;
+} cram_index_job;
+
+static void *cram_index_job_run(void *arg) {
+    cram_index_job *j = (cram_index_job *)arg;
+
+    j->ret = cram_index_slice_str(j->fd, j->c, j->s, &j->str,
+                                  j->cpos, j->landmark, j->sz);
+    cram_free_slice(j->s);
+    j->s = NULL;
+
+    return j;
+}
+
+/*
+ * Writes out the index lines of a completed job, and frees it.
+ *
+ * Returns 0 on success, or a cram_index_build error code.
+ */
+static int cram_index_job_finish(cram_index_job *j, BGZF *fp) {
+    int ret = j->ret;
+
+    if (ret == 0 && j->str.l && bgzf_write(fp, j->str.s, j->str.l) < 0)
+        ret = -4;
+
+    cram_free_slice(j->s);
+    if (j->last)
+        cram_free_container(j->c);
+    free(j->str.s);
+    free(j);
+
+    return ret;
+}
+
+/*
+ * Writes out any finished jobs.  With 'wait' set, this blocks until
+ * all jobs have finished.
+ *
+ * Returns 0 on success, or a cram_index_build error code.
+ */
+static int cram_index_flush_jobs(hts_tpool_process *q, BGZF *fp, int wait) {
+    hts_tpool_result *r;
+    int ret = 0, ret2;
+
+    while ((r = wait && !hts_tpool_process_empty(q)
+            ? hts_tpool_next_result_wait(q)
+            : hts_tpool_next_result(q))) {
+        ret2 = cram_index_job_finish(hts_tpool_result_data(r), fp);
+        hts_tpool_delete_result(r, 0);
+        if (ret == 0)
+            ret = ret2;
     }
 
     return ret;
 }
 
+/*
+ * Moves forward in the file to 'pos', seeking if we can and reading
+ * otherwise.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_skip_to(cram_fd *fd, off_t pos) {
+    off_t cur = htell(fd->fp);
+    char buf[65536];
+
+    if (cur > pos)
+        return -1;
+    if (cur == pos || hseek(fd->fp, pos, SEEK_SET) >= 0)
+        return 0;
+
+    while (cur < pos) {
+        ssize_t len = hread(fd->fp, buf, MIN(sizeof(buf), pos - cur));
+        if (len <= 0)
+            return -1;
+        cur += len;
+    }
+
+    return 0;
+}
+
 /*
  * Adds a single container to the index.
+ *
+ * A slice covering just one reference is indexed from its header alone,
+ * so we skip over its data blocks.  Multi-reference slices have to be
+ * read in full and decoded.  With a thread pool the slices are indexed
+ * by worker threads and q is the queue to dispatch them to.
+ *
+ * Takes ownership of the container, which is freed along with the job
+ * for its last slice.
  */
 static
 int cram_index_container(cram_fd *fd,
                          cram_container *c,
                          BGZF *fp,
+                         hts_tpool_process *q,
                          off_t cpos) {
-    int j;
-    off_t spos;
+    int j, ret = 0, owned = 1;
+    off_t spos, send, cend = cpos + c->offset + c->length;
+    cram_index_job *job = NULL;
 
     // 2.0 format
     for (j = 0; j < c->num_landmarks; j++) {
         cram_slice *s;
-        off_t sz;
-        int ret;
 
         spos = htell(fd->fp);
         if (spos - cpos - c->offset != c->landmark[j]) {
             hts_log_error("CRAM slice offset %"PRId64" does not match"
                           " landmark %d in container header (%d)",
                           spos - cpos - c->offset, j, c->landmark[j]);
-            return -1;
+            ret = -1;
+            goto err;
         }
+        send = j+1 < c->num_landmarks
+            ? cpos + c->offset + c->landmark[j+1]
+            : cend;
 
-        if (!(s = cram_read_slice(fd))) {
-            return -1;
+        if (!(s = cram_read_slice_hdr(fd))) {
+            ret = -1;
+            goto err;
         }
 
-        sz = htell(fd->fp) - spos;
-        ret = cram_index_slice(fd, c, s, fp, cpos, c->landmark[j], sz);
+        if (s->hdr->ref_seq_id == -2
+            ? cram_read_slice_blocks(fd, s) != 0 || htell(fd->fp) != send
+            : cram_index_skip_to(fd, send) != 0) {
+            cram_free_slice(s);
+            ret = -1;
+            goto err;
+        }
 
-        cram_free_slice(s);
+        if (!(job = calloc(1, sizeof(*job)))) {
+            cram_free_slice(s);
+            ret = -1;
+            goto err;
+        }
+        job->fd = fd;
+        job->c = c;
+        job->s = s;
+        job->cpos = cpos;
+        job->landmark = c->landmark[j];
+        job->sz = send - spos;
+        if ((job->last = (j == c->num_landmarks-1)))
+            owned = 0;
+
+        if (!q) {
+            cram_index_job_run(job);
+            ret = cram_index_job_finish(job, fp);
+            job = NULL;
+            if (ret < 0)
+                goto err;
+            continue;
+        }
 
-        if (ret < 0) {
-            return ret;
+        // Queue full, so write out results until there's space
+        while (hts_tpool_dispatch2(fd->pool, q, cram_index_job_run, job, 1)
+               < 0) {
+            hts_tpool_result *r;
+            if (errno != EAGAIN || !(r = hts_tpool_next_result_wait(q))) {
+                ret = -1;
+                goto err;
+            }
+            ret = cram_index_job_finish(hts_tpool_result_data(r), fp);
+            hts_tpool_delete_result(r, 0);
+            if (ret < 0)
+                goto err;
         }
+        job = NULL;
+
+        if ((ret = cram_index_flush_jobs(q, fp, 0)) < 0)
+            goto err;
     }
 
+    if (owned)
+        cram_free_container(c);
+
     return 0;
+
+ err:
+    // Other jobs may still be using the container
+    if (q)
+        cram_index_flush_jobs(q, fp, 1);
+    if (job)
+        cram_index_job_finish(job, fp);
+    if (owned)
+        cram_free_container(c);
+
+    return ret;
 }
 
 
@@ -702,6 +878,8 @@ int cram_index_container(cram_fd *fd,
  * fn_idx is the filename of the index file to be written;
  * if NULL, we add ".crai" to fn_base to get the index filename.
  *
+ * If fd has a thread pool, slices are indexed in parallel.
+ *
  * Returns 0 on success,
  *         negative on failure (-1 for read failure, -4 for write failure)
  */
@@ -711,6 +889,8 @@ int cram_index_build(cram_fd *fd, const char *fn_base, const char *fn_idx) {
     BGZF *fp;
     kstring_t fn_idx_str = {0};
     int64_t last_ref = -9, last_start = -9;
+    hts_tpool_process *q = NULL;
+    int ret = 0;
 
     // Useful for cram_index_build_multiref
     cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS, SAM_RNAME | SAM_POS | SAM_CIGAR);
@@ -729,44 +909,68 @@ int cram_index_build(cram_fd *fd, const char *fn_base, const char *fn_idx) {
 
     free(fn_idx_str.s);
 
+    if (fd->pool) {
+        int n = hts_tpool_size(fd->pool);
+        if (!(q = hts_tpool_process_init(fd->pool, n*2, 0))) {
+            bgzf_close(fp);
+            return -1;
+        }
+    }
+
     cpos = htell(fd->fp);
     while ((c = cram_read_container(fd))) {
         if (fd->err) {
             perror("Cram container read");
-            return -1;
+            ret = -1;
+            break;
         }
 
         hpos = htell(fd->fp);
 
-        if (!(c->comp_hdr_block = cram_read_block(fd)))
-            return -1;
+        if (!(c->comp_hdr_block = cram_read_block(fd))) {
+            ret = -1;
+            break;
+        }
         assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
 
         c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
-        if (!c->comp_hdr)
-            return -1;
+        if (!c->comp_hdr) {
+            ret = -1;
+            break;
+        }
 
         if (c->ref_seq_id == last_ref && c->ref_seq_start < last_start) {
             hts_log_error("CRAM file is not sorted by chromosome / position");
-            return -2;
+            ret = -2;
+            break;
         }
         last_ref = c->ref_seq_id;
         last_start = c->ref_seq_start;
 
-        if (cram_index_container(fd, c, fp, cpos) < 0) {
-            bgzf_close(fp);
-            return -1;
-        }
+        hpos += c->length;
+        ret = cram_index_container(fd, c, fp, q, cpos);
+        c = NULL; // freed by cram_index_container
+        if (ret < 0)
+            break;
 
         cpos = htell(fd->fp);
-        assert(cpos == hpos + c->length);
+        assert(cpos == hpos);
+    }
 
+    if (c && ret < 0)
         cram_free_container(c);
+    if (ret == 0 && fd->err)
+        ret = -1;
+
+    if (q) {
+        int ret2 = cram_index_flush_jobs(q, fp, 1);
+        if (ret == 0)
+            ret = ret2;
+        hts_tpool_process_destroy(q);
     }
-    if (fd->err) {
-        bgzf_close(fp);
-        return -1;
-    }
 
-    return (bgzf_close(fp) >= 0)? 0 : -4;
+    if (bgzf_close(fp) < 0 && ret == 0)
+        ret = -4;
+
+    return ret;
 }
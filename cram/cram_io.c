@@ -61,13 +61,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
 #include <math.h>
 #include <time.h>
 #include <stdint.h>
+#ifdef HAVE_FLOCK
+#include <sys/file.h>
+#endif
 
 #ifdef HAVE_LIBDEFLATE
 #include <libdeflate.h>
-#define crc32(a,b,c) libdeflate_crc32((a),(b),(c))
 #endif
 
 #include "cram.h"
@@ -75,6 +80,10 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "../htslib/hts.h"
 #include "open_trace_file.h"
 #include "rANS_static.h"
+#include "rANS_static4x16.h"
+#include "arith_dynamic.h"
+#include "fqzcomp_qual.h"
+#include "tokenise_name3.h"
 
 //#define REF_DEBUG
 
@@ -92,12 +101,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "../htslib/faidx.h"
 #include "../hts_internal.h"
 
+// Uses PCLMULQDQ (or libdeflate's equivalent) when available
+#define crc32(a,b,c) hts_crc32((a),(b),(c))
+
 #ifndef PATH_MAX
 #define PATH_MAX FILENAME_MAX
 #endif
 
 #define TRIAL_SPAN 50
 #define NTRIALS 3
+#define MAX_SPAN_GROWTH 8
 
 
 /* ----------------------------------------------------------------------
@@ -913,6 +926,7 @@ cram_block *cram_new_block(enum cram_content_type content_type,
     b->alloc = 0;
     b->byte = 0;
     b->bit = 7; // MSB
+    b->comp_crc_data = NULL;
 
     return b;
 }
@@ -985,6 +999,7 @@ cram_block *cram_read_block(cram_fd *fd) {
     b->idx = 0;
     b->byte = 0;
     b->bit = 7; // MSB
+    b->comp_crc_data = NULL;
 
     return b;
 }
@@ -1050,6 +1065,10 @@ int cram_write_block(cram_fd *fd, cram_block *b) {
 
         if (b->method == RAW) {
             b->crc32 = crc32(crc, b->data ? b->data : (uc*)"", b->uncomp_size);
+        } else if (b->data && b->data == b->comp_crc_data
+                   && b->comp_size == b->comp_crc_size) {
+            // Already checksummed by cram_compress_block2()
+            b->crc32 = hts_crc32_combine(crc, b->comp_crc, b->comp_size);
         } else {
             b->crc32 = crc32(crc, b->data ? b->data : (uc*)"", b->comp_size);
         }
@@ -1178,6 +1197,87 @@ int cram_uncompress_block(cram_block *b) {
         break;
     }
 
+#ifdef CRAM_EXPERIMENTAL_V31_CODECS
+    case RANS_PR0: {
+        unsigned int usize = b->uncomp_size, usize2 = usize;
+        uncomp = (char *)rans_uncompress_4x16(b->data, b->comp_size, &usize2);
+        if (!uncomp)
+            return -1;
+        if (usize != usize2) {
+            free(uncomp);
+            return -1;
+        }
+        free(b->data);
+        b->data = (unsigned char *)uncomp;
+        b->alloc = usize2;
+        b->method = RAW;
+        b->uncomp_size = usize2; // Just incase it differs
+        break;
+    }
+
+    case ARITH_PR0: {
+        unsigned int usize = b->uncomp_size, usize2 = usize;
+        uncomp = (char *)arith_uncompress(b->data, b->comp_size, &usize2);
+        if (!uncomp)
+            return -1;
+        if (usize != usize2) {
+            free(uncomp);
+            return -1;
+        }
+        free(b->data);
+        b->data = (unsigned char *)uncomp;
+        b->alloc = usize2;
+        b->method = RAW;
+        b->uncomp_size = usize2; // Just incase it differs
+        break;
+    }
+
+    case FQZ: {
+        size_t usize;
+        uncomp = fqz_decompress((char *)b->data, b->comp_size, &usize);
+        if (!uncomp)
+            return -1;
+        if (usize != b->uncomp_size) {
+            free(uncomp);
+            return -1;
+        }
+        free(b->data);
+        b->data = (unsigned char *)uncomp;
+        b->alloc = usize;
+        b->method = RAW;
+        break;
+    }
+
+    case TOK3: {
+        uint32_t usize;
+        uncomp = (char *)tok3_decode_names(b->data, b->comp_size, &usize);
+        if (!uncomp)
+            return -1;
+        if (usize != b->uncomp_size) {
+            free(uncomp);
+            return -1;
+        }
+        free(b->data);
+        b->data = (unsigned char *)uncomp;
+        b->alloc = usize;
+        b->method = RAW;
+        break;
+    }
+#else
+    case RANS_PR0:
+    case ARITH_PR0:
+        // Not yet checked against other CRAM 3.1 implementations.
+        hts_log_error("CRAM 3.1 rANS-Nx16 and arithmetic coded blocks are not supported by this version");
+        return -1;
+
+    case FQZ:
+    case TOK3:
+        // Our layouts differ from the CRAM 3.1 specification, so we cannot
+        // decode blocks written by other implementations.
+        hts_log_error("CRAM 3.1 fqzcomp and name tokeniser blocks are not supported by this version");
+        return -1;
+#endif
+
     default:
         return -1;
     }
@@ -1185,7 +1285,134 @@ int cram_uncompress_block(cram_block *b) {
     return 0;
 }
 
-static char *cram_compress_by_method(char *in, size_t in_size,
+/*
+ * Relative cost of each compression method, used to scale the trial sizes
+ * so faster methods are preferred when the ratios are similar.  The
+ * penalties only apply at the lower compression levels.
+ */
+static double cram_method_cost(int method, int level) {
+    double fast, mid;
+
+    switch (method) {
+    case GZIP:
+        fast = 1.04; mid = 1.02; break;
+    case BZIP2:
+        fast = 1.08; mid = 1.03; break;
+    case LZMA:
+        fast = 1.10; mid = 1.05; break;
+    case RANS1:
+    case RANS_PR1:
+    case RANS_PR9:
+    case RANS_PR129:
+    case RANS_PR193:
+        fast = 1.02; mid = 1.01; break;
+    case ARITH_PR0:
+    case ARITH_PR1:
+    case ARITH_PR64:
+    case ARITH_PR9:
+    case ARITH_PR128:
+    case ARITH_PR129:
+    case ARITH_PR192:
+    case ARITH_PR193:
+        fast = 1.06; mid = 1.03; break;
+    case FQZ:
+    case FQZ_b:
+    case FQZ_c:
+    case FQZ_d:
+        fast = 1.10; mid = 1.05; break;
+    case TOK3:
+        fast = 1.02; mid = 1.01; break;
+    case TOKA:
+        fast = 1.04; mid = 1.02; break;
+    default:
+        return 1.0;
+    }
+
+    return level <= 3 ? fast : level <= 6 ? mid : 1.0;
+}
+
+/*
+ * Maps the internal RANS_PR* and ARITH_PR* variants to the order flags
+ * given to rans_compress_4x16 and arith_compress.
+ */
+static int cram_method_order(enum cram_block_method method) {
+    switch (method) {
+    case RANS_PR1:   case ARITH_PR1:   return 1;
+    case RANS_PR64:  case ARITH_PR64:  return RANS_ORDER_RLE;
+    case RANS_PR9:   case ARITH_PR9:   return RANS_ORDER_STRIPE | 1;
+    case RANS_PR128: case ARITH_PR128: return RANS_ORDER_PACK;
+    case RANS_PR129: case ARITH_PR129: return RANS_ORDER_PACK | 1;
+    case RANS_PR192: case ARITH_PR192:
+        return RANS_ORDER_PACK | RANS_ORDER_RLE;
+    case RANS_PR193: case ARITH_PR193:
+        return RANS_ORDER_PACK | RANS_ORDER_RLE | 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Maps internal-only methods to the method recorded in the block header.
+ */
+static enum cram_block_method cram_method_external(enum cram_block_method m) {
+    switch (m) {
+    case GZIP_RLE:
+        return GZIP;
+    case RANS1:
+        return RANS0;
+    case RANS_PR1: case RANS_PR64: case RANS_PR9: case RANS_PR128:
+    case RANS_PR129: case RANS_PR192: case RANS_PR193:
+        return RANS_PR0;
+    case ARITH_PR1: case ARITH_PR64: case ARITH_PR9: case ARITH_PR128:
+    case ARITH_PR129: case ARITH_PR192: case ARITH_PR193:
+        return ARITH_PR0;
+    case FQZ_b: case FQZ_c: case FQZ_d:
+        return FQZ;
+    case TOKA:
+        return TOK3;
+    default:
+        return m;
+    }
+}
+
+/*
+ * Compresses quality values with fqzcomp, using the slice's records to
+ * find the length and flags of each quality string.  Fails if the block
+ * holds anything beyond the records' preserved quality strings.
+ */
+static char *cram_compress_fqz(cram_slice *s, char *in, size_t in_size,
+                               size_t *out_size, int strat) {
+    fqz_slice fs = {0};
+    char *comp;
+    int i;
+
+    if (!s)
+        return fqz_compress(NULL, in, in_size, out_size, strat);
+
+    fs.len = malloc(s->hdr->num_records * sizeof(*fs.len));
+    fs.flags = malloc(s->hdr->num_records * sizeof(*fs.flags));
+    if (!fs.len || !fs.flags) {
+        free(fs.len);
+        free(fs.flags);
+        return NULL;
+    }
+
+    for (i = 0; i < s->hdr->num_records; i++) {
+        cram_record *cr = &s->crecs[i];
+        if (!(cr->cram_flags & CRAM_FLAG_PRESERVE_QUAL_SCORES) ||
+            cr->len <= 0)
+            continue;
+        fs.len[fs.num_records] = cr->len;
+        fs.flags[fs.num_records++] = cr->flags;
+    }
+
+    comp = fqz_compress(&fs, in, in_size, out_size, strat);
+    free(fs.len);
+    free(fs.flags);
+    return comp;
+}
+
+static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
                                      int content_id, size_t *out_size,
                                      enum cram_block_method method,
                                      int level, int strat) {
@@ -1250,6 +1477,66 @@ static char *cram_compress_by_method(char *in, size_t in_size,
         return (char *)cp;
     }
 
+    case RANS_PR0:
+    case RANS_PR1:
+    case RANS_PR64:
+    case RANS_PR9:
+    case RANS_PR128:
+    case RANS_PR129:
+    case RANS_PR192:
+    case RANS_PR193: {
+        unsigned int out_size_i;
+        unsigned char *cp;
+        int order = cram_method_order(method);
+
+        // 32 interleaved states cost a little more to store but permit
+        // SIMD decoding, so use them once that overhead is negligible.
+        if (in_size >= 65536)
+            order |= RANS_ORDER_X32;
+
+        cp = rans_compress_4x16((unsigned char *)in, in_size, &out_size_i,
+                                order);
+        *out_size = out_size_i;
+        return (char *)cp;
+    }
+
+    case ARITH_PR0:
+    case ARITH_PR1:
+    case ARITH_PR64:
+    case ARITH_PR9:
+    case ARITH_PR128:
+    case ARITH_PR129:
+    case ARITH_PR192:
+    case ARITH_PR193: {
+        unsigned int out_size_i;
+        unsigned char *cp;
+
+        cp = arith_compress((unsigned char *)in, in_size, &out_size_i,
+                            cram_method_order(method));
+        *out_size = out_size_i;
+        return (char *)cp;
+    }
+
+    case FQZ:
+    case FQZ_b:
+    case FQZ_c:
+    case FQZ_d:
+        return cram_compress_fqz(s, in, in_size, out_size,
+                                 method == FQZ ? 0 : method - FQZ_b + 1);
+
+    case TOK3:
+    case TOKA: {
+        int out_size_i;
+        unsigned char *cp;
+
+        if (in_size > INT_MAX)
+            return NULL;
+        cp = tok3_encode_names(in, in_size, level, method == TOKA,
+                               &out_size_i);
+        *out_size = out_size_i;
+        return (char *)cp;
+    }
+
     case RAW:
         break;
 
@@ -1260,6 +1547,189 @@ static char *cram_compress_by_method(char *in, size_t in_size,
     return NULL;
 }
 
+/*
+ * Compresses a block with one of the internal method variants, as used
+ * in the method trials.
+ */
+static char *cram_compress_trial(cram_slice *s, cram_block *b, int m,
+                                 int level, size_t *out_size) {
+    int lvl = level, st = 0, meth = m;
+
+    switch (m) {
+    case GZIP:     st = Z_FILTERED; break;
+    case GZIP_RLE: meth = GZIP; lvl = 1; st = Z_RLE; break;
+    case RANS0:
+    case RANS1:    lvl = 0; break;
+    default:       break;
+    }
+
+    return cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
+                                   b->content_id, out_size, meth, lvl, st);
+}
+
+/*
+ * Work shared by cram_parallel_for() between the calling thread and any
+ * helper jobs on fd->tqueue.  Each index is claimed by exactly one thread.
+ * The caller also runs tasks itself, so it only ever waits on tasks that
+ * are actively running, and the last one to drop its reference frees the
+ * structure; helper jobs may start long after the caller has moved on.
+ */
+typedef struct {
+    int (*func)(void *arg, int i);
+    void *arg;
+    int n, next, running, ref, err;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} cram_pfor;
+
+static void cram_pfor_release(cram_pfor *t) {
+    int ref;
+
+    pthread_mutex_lock(&t->lock);
+    ref = --t->ref;
+    pthread_mutex_unlock(&t->lock);
+    if (ref)
+        return;
+
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->done);
+    free(t);
+}
+
+static void cram_pfor_run(cram_pfor *t) {
+    pthread_mutex_lock(&t->lock);
+    while (t->next < t->n) {
+        int i = t->next++, r;
+        t->running++;
+        pthread_mutex_unlock(&t->lock);
+
+        r = t->func(t->arg, i);
+
+        pthread_mutex_lock(&t->lock);
+        if (r < 0)
+            t->err = 1;
+        if (--t->running == 0)
+            pthread_cond_signal(&t->done);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void *cram_pfor_thread(void *arg) {
+    cram_pfor_run((cram_pfor *)arg);
+    cram_pfor_release((cram_pfor *)arg);
+    return NULL;
+}
+
+static void cram_pfor_discard(void *arg) {
+    cram_pfor_release((cram_pfor *)arg);
+}
+
+/*
+ * Calls func(arg, i) for every i in [0, n), using idle threads from
+ * fd->pool alongside the calling thread.  It is safe to call from within
+ * a pool worker.  Without a pool the calls are simply made in turn.
+ *
+ * Returns 0 on success
+ *        -1 if any call failed
+ */
+int cram_parallel_for(cram_fd *fd, int n, int (*func)(void *arg, int i),
+                      void *arg) {
+    cram_pfor *t;
+    int i, nhelp, err;
+
+    if (!fd->tqueue || n < 2) {
+        for (err = i = 0; i < n; i++)
+            err |= func(arg, i) < 0;
+        return err ? -1 : 0;
+    }
+
+    if (!(t = calloc(1, sizeof(*t))))
+        return -1;
+    t->func = func;
+    t->arg = arg;
+    t->n = n;
+    t->ref = 1;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->done, NULL);
+
+    // Helpers are dispatched without blocking; if the queue is full
+    // we simply do more of the work ourselves.
+    nhelp = MIN(n, hts_tpool_size(fd->pool)) - 1;
+    for (i = 0; i < nhelp; i++) {
+        pthread_mutex_lock(&t->lock);
+        t->ref++;
+        pthread_mutex_unlock(&t->lock);
+        if (hts_tpool_dispatch3(fd->pool, fd->tqueue, cram_pfor_thread, t,
+                                cram_pfor_discard, NULL, 1) < 0) {
+            cram_pfor_release(t);
+            break;
+        }
+    }
+
+    cram_pfor_run(t);
+
+    pthread_mutex_lock(&t->lock);
+    while (t->running)
+        pthread_cond_wait(&t->done, &t->lock);
+    err = t->err;
+    pthread_mutex_unlock(&t->lock);
+    cram_pfor_release(t);
+
+    return err ? -1 : 0;
+}
+
+/*
+ * The method trials for one block, run via cram_parallel_for().
+ */
+typedef struct {
+    cram_slice *s;
+    cram_block *b;
+    int level;
+    int meth[CRAM_MAX_METHOD];
+    char **comp;
+    size_t *sz;
+} cram_trials;
+
+static int cram_trials_run(void *arg, int i) {
+    cram_trials *t = (cram_trials *)arg;
+    int m = t->meth[i];
+
+    t->comp[m] = cram_compress_trial(t->s, t->b, m, t->level, &t->sz[m]);
+    return 0;
+}
+
+/*
+ * Compresses block 'b' with every method in the 'method' bit field,
+ * filling out comp[m] and sz[m].  Failed methods have comp[m] NULL.
+ *
+ * With a thread pool the methods are spread over idle workers.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_compress_trials(cram_fd *fd, cram_slice *s, cram_block *b,
+                                int method, int level,
+                                char **comp, size_t *sz) {
+    cram_trials t = {s, b, level, {0}, comp, sz};
+    int m, n = 0;
+
+    for (m = 1; m < CRAM_MAX_METHOD; m++)
+        if (method & (1u<<m))
+            t.meth[n++] = m;
+
+    return cram_parallel_for(fd, n, cram_trials_run, &t);
+}
+
+/*
+ * Records the method chosen for block 'b' in its metrics, for
+ * cram_method_report().  Called with fd->metrics_lock held.
+ */
+static void cram_metrics_record(cram_metrics *metrics, cram_block *b) {
+    metrics->content_id = b->content_id;
+    metrics->used[b->method]++;
+    metrics->usz += b->uncomp_size;
+    metrics->csz += b->comp_size;
+}
 
 /*
  * Compresses a block using one of two different zlib strategies. If we only
@@ -1273,6 +1743,16 @@ static char *cram_compress_by_method(char *in, size_t in_size,
  */
 int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
                         int method, int level) {
+    return cram_compress_block2(fd, NULL, b, metrics, method, level);
+}
+
+/*
+ * As cram_compress_block, but with the slice the block belongs to, which
+ * the FQZ method needs to find the records' quality strings.  With 's'
+ * NULL, FQZ treats the block as a single quality string.
+ */
+int cram_compress_block2(cram_fd *fd, cram_slice *s, cram_block *b,
+                         cram_metrics *metrics, int method, int level) {
 
     char *comp = NULL;
     size_t comp_size = 0;
@@ -1311,13 +1791,9 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
         pthread_mutex_lock(&fd->metrics_lock);
         if (metrics->trial > 0 || --metrics->next_trial <= 0) {
             size_t sz_best = INT_MAX;
-            size_t sz_gz_rle = 0;
-            size_t sz_gz_def = 0;
-            size_t sz_rans0 = 0;
-            size_t sz_rans1 = 0;
-            size_t sz_bzip2 = 0;
-            size_t sz_lzma = 0;
-            int method_best = 0;
+            size_t sz[CRAM_MAX_METHOD] = {0};
+            char *comp_m[CRAM_MAX_METHOD] = {NULL};
+            int method_best = 0, m;
             char *c_best = NULL, *c = NULL;
 
             if (metrics->revised_method)
@@ -1326,117 +1802,35 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
                 metrics->revised_method = method;
 
             if (metrics->next_trial <= 0) {
-                metrics->next_trial = TRIAL_SPAN;
-                metrics->trial = NTRIALS;
-                metrics->sz_gz_rle /= 2;
-                metrics->sz_gz_def /= 2;
-                metrics->sz_rans0  /= 2;
-                metrics->sz_rans1  /= 2;
-                metrics->sz_bzip2  /= 2;
-                metrics->sz_lzma   /= 2;
+                metrics->next_trial = metrics->span;
+                metrics->trial = fd->ntrials;
+                for (m = 0; m < CRAM_MAX_METHOD; m++)
+                    metrics->sz[m] /= 2;
             }
 
             pthread_mutex_unlock(&fd->metrics_lock);
 
-            if (method & (1<<GZIP_RLE)) {
-                c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-                                            b->content_id, &sz_gz_rle, GZIP, 1, Z_RLE);
-                if (c && sz_best > sz_gz_rle) {
-                    sz_best = sz_gz_rle;
-                    method_best = GZIP_RLE;
-                    if (c_best)
-                        free(c_best);
-                    c_best = c;
-                } else if (c) {
-                    free(c);
-                } else {
-                    sz_gz_rle = b->uncomp_size*2+1000;
-                }
-
-                //fprintf(stderr, "Block %d; %d->%d\n", b->content_id, b->uncomp_size, sz_gz_rle);
-            }
-
-            if (method & (1<<GZIP)) {
-                c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-                                            b->content_id, &sz_gz_def, GZIP, level,
-                                            Z_FILTERED);
-                if (c && sz_best > sz_gz_def) {
-                    sz_best = sz_gz_def;
-                    method_best = GZIP;
-                    if (c_best)
-                        free(c_best);
-                    c_best = c;
-                } else if (c) {
-                    free(c);
-                } else {
-                    sz_gz_def = b->uncomp_size*2+1000;
-                }
-
-                //fprintf(stderr, "Block %d; %d->%d\n", b->content_id, b->uncomp_size, sz_gz_def);
-            }
-
-            if (method & (1<<RANS0)) {
-                c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-                                            b->content_id, &sz_rans0, RANS0, 0, 0);
-                if (c && sz_best > sz_rans0) {
-                    sz_best = sz_rans0;
-                    method_best = RANS0;
-                    if (c_best)
-                        free(c_best);
-                    c_best = c;
-                } else if (c) {
-                    free(c);
-                } else {
-                    sz_rans0 = b->uncomp_size*2+1000;
-                }
-            }
+            if (cram_compress_trials(fd, s, b, method, level, comp_m, sz) < 0)
+                return -1;
 
-            if (method & (1<<RANS1)) {
-                c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-                                            b->content_id, &sz_rans1, RANS1, 0, 0);
-                if (c && sz_best > sz_rans1) {
-                    sz_best = sz_rans1;
-                    method_best = RANS1;
-                    if (c_best)
-                        free(c_best);
-                    c_best = c;
-                } else if (c) {
-                    free(c);
-                } else {
-                    sz_rans1 = b->uncomp_size*2+1000;
-                }
-            }
+            for (m = 1; m < CRAM_MAX_METHOD; m++) {
+                if (!(method & (1u<<m)))
+                    continue;
 
-            if (method & (1<<BZIP2)) {
-                c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-                                            b->content_id, &sz_bzip2, BZIP2, level, 0);
-                if (c && sz_best > sz_bzip2) {
-                    sz_best = sz_bzip2;
-                    method_best = BZIP2;
+                c = comp_m[m];
+                if (c && sz_best > sz[m]) {
+                    sz_best = sz[m];
+                    method_best = m;
                     if (c_best)
                         free(c_best);
                     c_best = c;
                 } else if (c) {
                     free(c);
                 } else {
-                    sz_bzip2 = b->uncomp_size*2+1000;
+                    sz[m] = b->uncomp_size*2+1000;
                 }
-            }
 
-            if (method & (1<<LZMA)) {
-                c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-                                            b->content_id, &sz_lzma, LZMA, level, 0);
-                if (c && sz_best > sz_lzma) {
-                    sz_best = sz_lzma;
-                    method_best = LZMA;
-                    if (c_best)
-                        free(c_best);
-                    c_best = c;
-                } else if (c) {
-                    free(c);
-                } else {
-                    sz_lzma = b->uncomp_size*2+1000;
-                }
+                //fprintf(stderr, "Block %d; %d->%d\n", b->content_id, b->uncomp_size, sz[m]);
             }
 
             //fprintf(stderr, "sz_best = %d\n", sz_best);
@@ -1448,46 +1842,30 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
             b->comp_size = sz_best;
 
             pthread_mutex_lock(&fd->metrics_lock);
-            metrics->sz_gz_rle += sz_gz_rle;
-            metrics->sz_gz_def += sz_gz_def;
-            metrics->sz_rans0  += sz_rans0;
-            metrics->sz_rans1  += sz_rans1;
-            metrics->sz_bzip2  += sz_bzip2;
-            metrics->sz_lzma   += sz_lzma;
+            cram_metrics_record(metrics, b);
+            for (m = 0; m < CRAM_MAX_METHOD; m++)
+                metrics->sz[m] += sz[m];
             if (--metrics->trial == 0) {
                 int best_method = RAW;
                 int best_sz = INT_MAX;
+                int last_method = metrics->method == GZIP &&
+                    metrics->strat == Z_RLE ? GZIP_RLE : metrics->method;
 
                 // Scale methods by cost
-                if (fd->level <= 3) {
-                    metrics->sz_rans1  *= 1.02;
-                    metrics->sz_gz_def *= 1.04;
-                    metrics->sz_bzip2  *= 1.08;
-                    metrics->sz_lzma   *= 1.10;
-                } else if (fd->level <= 6) {
-                    metrics->sz_rans1  *= 1.01;
-                    metrics->sz_gz_def *= 1.02;
-                    metrics->sz_bzip2  *= 1.03;
-                    metrics->sz_lzma   *= 1.05;
-                }
-
-                if (method & (1<<GZIP_RLE) && best_sz > metrics->sz_gz_rle)
-                    best_sz = metrics->sz_gz_rle, best_method = GZIP_RLE;
-
-                if (method & (1<<GZIP) && best_sz > metrics->sz_gz_def)
-                    best_sz = metrics->sz_gz_def, best_method = GZIP;
-
-                if (method & (1<<RANS0) && best_sz > metrics->sz_rans0)
-                    best_sz = metrics->sz_rans0, best_method = RANS0;
+                if (fd->level <= 6)
+                    for (m = 0; m < CRAM_MAX_METHOD; m++)
+                        metrics->sz[m] *= cram_method_cost(m, fd->level);
 
-                if (method & (1<<RANS1) && best_sz > metrics->sz_rans1)
-                    best_sz = metrics->sz_rans1, best_method = RANS1;
+                for (m = 1; m < CRAM_MAX_METHOD; m++)
+                    if (method & (1u<<m) && best_sz > metrics->sz[m])
+                        best_sz = metrics->sz[m], best_method = m;
 
-                if (method & (1<<BZIP2) && best_sz > metrics->sz_bzip2)
-                    best_sz = metrics->sz_bzip2, best_method = BZIP2;
-
-                if (method & (1<<LZMA) && best_sz > metrics->sz_lzma)
-                    best_sz = metrics->sz_lzma, best_method = LZMA;
+                // Trial less often while the choice is stable
+                if (best_method == last_method)
+                    metrics->span = MIN(metrics->span * 2,
+                                        fd->trial_span * MAX_SPAN_GROWTH);
+                else
+                    metrics->span = fd->trial_span;
 
                 if (best_method == GZIP_RLE) {
                     metrics->method = GZIP;
@@ -1503,64 +1881,18 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
                 // for this block type.
 #define MAXDELTA 0.20
 #define MAXFAILS 4
-                if (best_method == GZIP_RLE) {
-                    metrics->gz_rle_cnt = 0;
-                    metrics->gz_rle_extra = 0;
-                } else if (best_sz < metrics->sz_gz_rle) {
-                    double r = (double)metrics->sz_gz_rle / best_sz - 1;
-                    if (++metrics->gz_rle_cnt >= MAXFAILS &&
-                        (metrics->gz_rle_extra += r) >= MAXDELTA)
-                        method &= ~(1<<GZIP_RLE);
-                }
-
-                if (best_method == GZIP) {
-                    metrics->gz_def_cnt = 0;
-                    metrics->gz_def_extra = 0;
-                } else if (best_sz < metrics->sz_gz_def) {
-                    double r = (double)metrics->sz_gz_def / best_sz - 1;
-                    if (++metrics->gz_def_cnt >= MAXFAILS &&
-                        (metrics->gz_def_extra += r) >= MAXDELTA)
-                        method &= ~(1<<GZIP);
-                }
-
-                if (best_method == RANS0) {
-                    metrics->rans0_cnt = 0;
-                    metrics->rans0_extra = 0;
-                } else if (best_sz < metrics->sz_rans0) {
-                    double r = (double)metrics->sz_rans0 / best_sz - 1;
-                    if (++metrics->rans0_cnt >= MAXFAILS &&
-                        (metrics->rans0_extra += r) >= MAXDELTA)
-                        method &= ~(1<<RANS0);
-                }
-
-                if (best_method == RANS1) {
-                    metrics->rans1_cnt = 0;
-                    metrics->rans1_extra = 0;
-                } else if (best_sz < metrics->sz_rans1) {
-                    double r = (double)metrics->sz_rans1 / best_sz - 1;
-                    if (++metrics->rans1_cnt >= MAXFAILS &&
-                        (metrics->rans1_extra += r) >= MAXDELTA)
-                        method &= ~(1<<RANS1);
-                }
-
-                if (best_method == BZIP2) {
-                    metrics->bzip2_cnt = 0;
-                    metrics->bzip2_extra = 0;
-                } else if (best_sz < metrics->sz_bzip2) {
-                    double r = (double)metrics->sz_bzip2 / best_sz - 1;
-                    if (++metrics->bzip2_cnt >= MAXFAILS &&
-                        (metrics->bzip2_extra += r) >= MAXDELTA)
-                        method &= ~(1<<BZIP2);
-                }
-
-                if (best_method == LZMA) {
-                    metrics->lzma_cnt = 0;
-                    metrics->lzma_extra = 0;
-                } else if (best_sz < metrics->sz_lzma) {
-                    double r = (double)metrics->sz_lzma / best_sz - 1;
-                    if (++metrics->lzma_cnt >= MAXFAILS &&
-                        (metrics->lzma_extra += r) >= MAXDELTA)
-                        method &= ~(1<<LZMA);
+                for (m = 1; m < CRAM_MAX_METHOD; m++) {
+                    if (!(method & (1u<<m)))
+                        continue;
+                    if (best_method == m) {
+                        metrics->cnt[m] = 0;
+                        metrics->extra[m] = 0;
+                    } else if (best_sz < metrics->sz[m]) {
+                        double r = (double)metrics->sz[m] / best_sz - 1;
+                        if (++metrics->cnt[m] >= MAXFAILS &&
+                            (metrics->extra[m] += r) >= MAXDELTA)
+                            method &= ~(1u<<m);
+                    }
                 }
 
                 //if (method != metrics->revised_method)
@@ -1574,20 +1906,33 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
             method = metrics->method;
 
             pthread_mutex_unlock(&fd->metrics_lock);
-            comp = cram_compress_by_method((char *)b->data, b->uncomp_size,
+            comp = cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
                                            b->content_id, &comp_size, method,
                                            level, strat);
+            if (!comp && method != GZIP) {
+                // The specialised codecs reject some data, e.g. FQZ on
+                // lossy qualities, so fall back to a general method.
+                method = GZIP;
+                comp = cram_compress_by_method(s, (char *)b->data,
+                                               b->uncomp_size, b->content_id,
+                                               &comp_size, method, level,
+                                               Z_FILTERED);
+            }
             if (!comp)
                 return -1;
             free(b->data);
             b->data = (unsigned char *)comp;
             b->comp_size = comp_size;
             b->method = method;
+
+            pthread_mutex_lock(&fd->metrics_lock);
+            cram_metrics_record(metrics, b);
+            pthread_mutex_unlock(&fd->metrics_lock);
         }
 
     } else {
         // no cached metrics, so just do zlib?
-        comp = cram_compress_by_method((char *)b->data, b->uncomp_size,
+        comp = cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
                                        b->content_id, &comp_size, GZIP, level, Z_FILTERED);
         if (!comp) {
             hts_log_error("Compression failed");
@@ -1603,8 +1948,16 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
                  b->content_id, b->uncomp_size, b->comp_size,
                  cram_block_method2str(b->method));
 
-    if (b->method == RANS1)
-        b->method = RANS0; // Spec just has RANS (not 0/1) with auto-sensing
+    // The spec just has RANS (not 0/1) etc, with auto-sensing of the order
+    b->method = cram_method_external(b->method);
+
+    // Checksum the data now, while it's in this (possibly worker) thread's
+    // cache, rather than in cram_write_block() on the writing thread.
+    if (CRAM_MAJOR_VERS(fd->version) >= 3 && b->method != RAW) {
+        b->comp_crc = crc32(0L, b->data, b->comp_size);
+        b->comp_crc_data = b->data;
+        b->comp_crc_size = b->comp_size;
+    }
 
     return 0;
 }
@@ -1615,6 +1968,7 @@ cram_metrics *cram_new_metrics(void) {
         return NULL;
     m->trial = NTRIALS-1;
     m->next_trial = TRIAL_SPAN;
+    m->span = TRIAL_SPAN;
     m->method = RAW;
     m->strat = 0;
     m->revised_method = 0;
@@ -1629,11 +1983,109 @@ char *cram_block_method2str(enum cram_block_method m) {
     case BZIP2:    return "BZIP2";
     case LZMA:     return "LZMA";
     case RANS0:    return "RANS0";
+    case RANS_PR0: return "RANS_PR0";
+    case ARITH_PR0: return "ARITH_PR0";
     case RANS1:    return "RANS1";
     case GZIP_RLE: return "GZIP_RLE";
+    case RANS_PR1:   return "RANS_PR1";
+    case RANS_PR64:  return "RANS_PR64";
+    case RANS_PR9:   return "RANS_PR9";
+    case RANS_PR128: return "RANS_PR128";
+    case RANS_PR129: return "RANS_PR129";
+    case RANS_PR192: return "RANS_PR192";
+    case RANS_PR193: return "RANS_PR193";
+    case ARITH_PR1:   return "ARITH_PR1";
+    case ARITH_PR64:  return "ARITH_PR64";
+    case ARITH_PR9:   return "ARITH_PR9";
+    case ARITH_PR128: return "ARITH_PR128";
+    case ARITH_PR129: return "ARITH_PR129";
+    case ARITH_PR192: return "ARITH_PR192";
+    case ARITH_PR193: return "ARITH_PR193";
+    case FQZ:      return "FQZ";
+    case FQZ_b:    return "FQZ_b";
+    case FQZ_c:    return "FQZ_c";
+    case FQZ_d:    return "FQZ_d";
+    case TOK3:     return "TOK3";
+    case TOKA:     return "TOKA";
     case BM_ERROR: break;
     }
-    return "?";
+    return "?";
+}
+
+static const char *cram_ds_names[DS_END] = {
+    "CORE", "aux", "OQ", "BQ", "BD", "BI", "FZ", "oq", "os", "oz",
+    "ref", "RN", "QS", "IN", "SC",
+    "BF", "CF", "AP", "RG", "MQ", "NS", "MF", "TS", "NP", "NF", "RL",
+    "FN", "FC", "FP", "DL", "BA", "BS", "TL", "RI", "RS", "PD", "HC",
+    "BB", "QQ", "TN", "RN_len", "SC_len", "BB_len", "QQ_len",
+    "TC", "TM", "TV",
+};
+
+static int cram_report_metrics(kstring_t *str, const char *name,
+                               cram_metrics *m) {
+    int i;
+
+    if (!m || !m->usz)
+        return 0;
+
+    if (ksprintf(str, "%-6s %8d %12"PRId64" %12"PRId64, name, m->content_id,
+                 m->usz, m->csz) < 0)
+        return -1;
+    for (i = 0; i < CRAM_MAX_METHOD; i++)
+        if (m->used[i] &&
+            ksprintf(str, " %s:%"PRId64,
+                     cram_block_method2str(i), m->used[i]) < 0)
+            return -1;
+
+    return kputc('\n', str) < 0 ? -1 : 0;
+}
+
+static int cram_cmp_int(const void *a, const void *b) {
+    int ia = *(const int *)a, ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+int cram_method_report(cram_fd *fd, kstring_t *str) {
+    int i, n = 0, *keys = NULL, ret = -1;
+    khint_t k;
+
+    if (kputs("series       id   uncomp_size    comp_size methods\n",
+              str) < 0)
+        return -1;
+
+    pthread_mutex_lock(&fd->metrics_lock);
+    for (i = 0; i < DS_END; i++)
+        if (cram_report_metrics(str, cram_ds_names[i], fd->m[i]) < 0)
+            goto err;
+
+    // Tags, sorted by their key for a stable order
+    if (fd->tags_used && kh_size(fd->tags_used)) {
+        if (!(keys = malloc(kh_size(fd->tags_used) * sizeof(*keys))))
+            goto err;
+        for (k = kh_begin(fd->tags_used); k != kh_end(fd->tags_used); k++)
+            if (kh_exist(fd->tags_used, k))
+                keys[n++] = kh_key(fd->tags_used, k);
+        qsort(keys, n, sizeof(*keys), cram_cmp_int);
+
+        for (i = 0; i < n; i++) {
+            char name[5];
+            name[0] = keys[i] >> 16;
+            name[1] = keys[i] >> 8;
+            name[2] = ':';
+            name[3] = keys[i];
+            name[4] = 0;
+            k = kh_get(m_metrics, fd->tags_used, keys[i]);
+            if (cram_report_metrics(str, name,
+                                    kh_val(fd->tags_used, k)) < 0)
+                goto err;
+        }
+    }
+    ret = 0;
+
+ err:
+    pthread_mutex_unlock(&fd->metrics_lock);
+    free(keys);
+    return ret;
 }
 
 char *cram_content_type2str(enum cram_content_type t) {
@@ -2251,6 +2703,352 @@ static unsigned get_int_threadid() {
     return h;
 }
 
+/* ----------------------------------------------------------------------
+ * Reference cache (REF_CACHE) management.
+ *
+ * Cache entries are immutable files named by the MD5 of the sequence.
+ * They are only ever created via a temporary file and rename(), so readers
+ * may mmap them and share them freely between processes.  Evicting an
+ * entry only unlinks it, which leaves any existing mappings intact.
+ *
+ * If REF_CACHE_SIZE is set, the directory tree holding the cache is
+ * trimmed back to this many bytes after each new entry is written,
+ * removing the least recently used files first.  Cache hits update the
+ * file modification time as atime is frequently unavailable.
+ */
+
+typedef struct {
+    char *path;
+    off_t size;
+    time_t mtime;
+} ref_cache_file;
+
+/*
+ * Returns the REF_CACHE_SIZE limit in bytes, or 0 if the cache is unbounded.
+ */
+static int64_t ref_cache_max_size(void) {
+    char *str = getenv("REF_CACHE_SIZE"), *end;
+    long long sz;
+
+    if (!str || !*str)
+        return 0;
+
+    sz = hts_parse_decimal(str, &end, 0);
+    if (*end || sz <= 0) {
+        hts_log_warning("Ignoring invalid REF_CACHE_SIZE \"%s\"", str);
+        return 0;
+    }
+
+    return sz;
+}
+
+/*
+ * Fills out root with the fixed directory part of a REF_CACHE pattern;
+ * everything up to the last '/' before the first % expansion.
+ *
+ * Returns 0 on success
+ *        -1 if there is no usable root (too long, or the filesystem root)
+ */
+static int ref_cache_root(char *root, const char *local_cache) {
+    const char *pc = strchr(local_cache, '%');
+    size_t len = pc ? pc - local_cache : strlen(local_cache);
+
+    if (pc)
+        while (len > 0 && local_cache[len-1] != '/')
+            len--;
+    while (len > 1 && local_cache[len-1] == '/')
+        len--;
+
+    if (len >= PATH_MAX)
+        return -1;
+
+    if (len == 0) {
+        strcpy(root, ".");
+    } else {
+        memcpy(root, local_cache, len);
+        root[len] = 0;
+    }
+
+    return strcmp(root, "/") == 0 ? -1 : 0;
+}
+
+/*
+ * Takes an advisory lock on the cache directory root.  Writers hold a
+ * shared lock while their temporary file exists, and trimming holds an
+ * exclusive one.  The lock is released by ref_cache_unlock().
+ *
+ * Returns a file descriptor on success
+ *        -1 if the lock could not be obtained (or locking is unsupported)
+ */
+static int ref_cache_lock(const char *root, int exclusive, int wait) {
+#ifdef HAVE_FLOCK
+    char lock_fn[PATH_MAX];
+    int fd, op = (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB);
+
+    if (snprintf(lock_fn, PATH_MAX, "%s/.lock", root) >= PATH_MAX)
+        return -1;
+
+    if ((fd = open(lock_fn, O_RDONLY | O_CREAT, 0666)) < 0)
+        return -1;
+
+    while (flock(fd, op) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static void ref_cache_unlock(int fd) {
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * Returns the part of a REF_CACHE pattern that follows the directory given
+ * by ref_cache_root(), i.e. the layout of the entries below that root.
+ */
+static const char *ref_cache_layout(const char *local_cache) {
+    const char *pc = strchr(local_cache, '%');
+    size_t len = pc ? pc - local_cache : strlen(local_cache);
+
+    if (pc)
+        while (len > 0 && local_cache[len-1] != '/')
+            len--;
+    while (local_cache[len] == '/')
+        len++;
+
+    return local_cache + len;
+}
+
+/*
+ * Matches n lower-case hex digits at the start of s, as found in the
+ * MD5 strings used to name cache entries.  Returns the number matched.
+ */
+static size_t ref_cache_hex(const char *s, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+            break;
+    return i;
+}
+
+/*
+ * Checks whether rel, a path relative to the cache root, is one that
+ * expand_cache_path() could have made from layout and an MD5 string, or
+ * a temporary file for one.  This mirrors expand_cache_path(): %s takes
+ * the rest of the MD5, %Ns takes N more characters of it and any part
+ * left over is appended as a final "/<hex>" path component.
+ *
+ * Returns 1 for cache entries, 2 for temporary files and 0 otherwise.
+ */
+static int ref_cache_name_type(const char *layout, const char *rel) {
+    const char *lp = layout, *rp = rel;
+    size_t used = 0, l;
+
+    while (*lp) {
+        if (*lp == '%' && lp[1] == 's') {
+            l = 32 - used;
+            lp += 2;
+        } else if (*lp == '%' && lp[1] >= '0' && lp[1] <= '9') {
+            char *endp;
+            l = strtol(lp+1, &endp, 10);
+            if (*endp != 's') {
+                // Copied through as-is by expand_cache_path()
+                if (rp[0] != '%' || rp[1] != lp[1])
+                    return 0;
+                lp += 2; rp += 2;
+                continue;
+            }
+            l = MIN(l, 32 - used);
+            lp = endp + 1;
+        } else if (*lp == '%') {
+            if (rp[0] != '%' || rp[1] != lp[1] || !lp[1])
+                return 0;
+            lp += 2; rp += 2;
+            continue;
+        } else {
+            if (*rp++ != *lp++)
+                return 0;
+            continue;
+        }
+
+        if (ref_cache_hex(rp, l) != l)
+            return 0;
+        rp += l;
+        used += l;
+    }
+
+    if (used < 32) {
+        if (rp > rel && rp[-1] != '/' && *rp++ != '/')
+            return 0;
+        if (ref_cache_hex(rp, 32 - used) != 32 - used)
+            return 0;
+        rp += 32 - used;
+    }
+
+    if (*rp == 0)
+        return 1;
+
+    // Temporary files are "<entry>.tmp_<pid>_<thread>_<time>"
+    if (strncmp(rp, ".tmp_", 5) != 0 || !rp[5])
+        return 0;
+    for (rp += 5; *rp; rp++)
+        if (!((*rp >= '0' && *rp <= '9') || *rp == '_'))
+            return 0;
+    return 2;
+}
+
+/*
+ * Recursively lists the cache entries below dir, appending them to *files.
+ * Only files named as layout specifies (see ref_cache_name_type()) are
+ * considered, and we descend no deeper than the layout's directories.
+ * Orphaned temporary files are removed if remove_tmp is set.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int ref_cache_scan(const char *dir, size_t rel_off, const char *layout,
+                          int depth, int remove_tmp,
+                          ref_cache_file **files, size_t *nfiles,
+                          size_t *afiles, int64_t *total) {
+    DIR *d;
+    struct dirent *de;
+    struct stat sb;
+    kstring_t path = {0, 0, NULL};
+    int ret = 0;
+
+    if (!(d = opendir(dir)))
+        return 0; // Vanished or unreadable; not fatal
+
+    while ((de = readdir(d))) {
+        int type;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        path.l = 0;
+        if (ksprintf(&path, "%s/%s", dir, de->d_name) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (lstat(path.s, &sb) != 0)
+            continue;
+
+        if (S_ISDIR(sb.st_mode)) {
+            if (depth > 0
+                && ref_cache_scan(path.s, rel_off, layout, depth - 1,
+                                  remove_tmp, files, nfiles, afiles,
+                                  total) < 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (!S_ISREG(sb.st_mode)
+            || !(type = ref_cache_name_type(layout, path.s + rel_off)))
+            continue;
+
+        if (type == 2) {
+            if (remove_tmp)
+                unlink(path.s);
+            continue;
+        }
+
+        if (*nfiles == *afiles) {
+            size_t new_sz = *afiles ? *afiles * 2 : 256;
+            ref_cache_file *f = realloc(*files, new_sz * sizeof(*f));
+            if (!f) {
+                ret = -1;
+                break;
+            }
+            *files = f;
+            *afiles = new_sz;
+        }
+
+        (*files)[*nfiles].path = ks_release(&path);
+        (*files)[*nfiles].size = sb.st_size;
+        (*files)[*nfiles].mtime = sb.st_mtime;
+        (*nfiles)++;
+        *total += sb.st_size;
+    }
+
+    free(path.s);
+    closedir(d);
+    return ret;
+}
+
+static int ref_cache_file_cmp(const void *av, const void *bv) {
+    const ref_cache_file *a = (const ref_cache_file *) av;
+    const ref_cache_file *b = (const ref_cache_file *) bv;
+    return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+/*
+ * Evicts the least recently used cache entries below root until the
+ * total size is no more than max_size bytes.  If another process is
+ * currently writing to or trimming the cache we leave it for them.
+ * Only files matching the local_cache pattern are ever removed, so
+ * anything else sharing the directory tree is left alone.
+ */
+static void ref_cache_trim(const char *root, const char *local_cache,
+                           int64_t max_size) {
+    ref_cache_file *files = NULL;
+    size_t nfiles = 0, afiles = 0, i;
+    const char *layout = ref_cache_layout(local_cache), *cp;
+    int64_t total = 0;
+    int lock_fd, depth = 1;
+
+    // Directories in the layout, plus the one expand_cache_path() may add
+    for (cp = layout; *cp; cp++)
+        if (*cp == '/')
+            depth++;
+
+    lock_fd = ref_cache_lock(root, 1, 0);
+#ifdef HAVE_FLOCK
+    if (lock_fd < 0)
+        return;
+#endif
+
+    // With the exclusive lock held, any temporary files are left over
+    // from writers that died, so they can be cleaned up too.
+    if (ref_cache_scan(root, strlen(root) + 1, layout, depth, lock_fd >= 0,
+                       &files, &nfiles, &afiles, &total) < 0) {
+        hts_log_warning("Failed to scan reference cache %s", root);
+        goto out;
+    }
+
+    if (total > max_size) {
+        qsort(files, nfiles, sizeof(*files), ref_cache_file_cmp);
+        for (i = 0; i < nfiles && total > max_size; i++) {
+            hts_log_info("Evicting reference cache entry '%s'", files[i].path);
+            if (unlink(files[i].path) == 0 || errno == ENOENT)
+                total -= files[i].size;
+        }
+    }
+
+ out:
+    for (i = 0; i < nfiles; i++)
+        free(files[i].path);
+    free(files);
+    ref_cache_unlock(lock_fd);
+}
+
+/*
+ * Records a cache hit for the LRU policy.  Failure (e.g. due to the
+ * entry belonging to another user) is harmless.
+ */
+static void ref_cache_touch(const char *path) {
+    (void) utime(path, NULL);
+}
+
 /*
  * Queries the M5 string from the header and attempts to populate the
  * reference from this using the REF_PATH environment.
@@ -2305,8 +3103,34 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
             local_path = 1;
     }
 
-#ifndef HAVE_MMAP
+#ifdef HAVE_MMAP
+    /*
+     * Cache entries are raw sequence, written atomically and never
+     * modified, so map them in read-only.  This avoids a private heap copy
+     * per process; concurrent users share the same page cache pages.
+     */
+    if (local_path) {
+        struct stat sb;
+
+        if (0 == stat(path, &sb)
+            && S_ISREG(sb.st_mode)
+            && sb.st_size > 0
+            && (mf = mfopen(path, "rbm"))) {
+            r->seq = mf->data;
+            r->mf = mf;
+            r->length = mf->size;
+            r->offset = r->line_length = r->bases_per_line = 0;
+            r->is_md5 = 1;
+            ref_cache_touch(path);
+            return 0;
+        }
+        local_path = 0;
+    }
+#else
     char *path2;
+    if (local_path)
+        ref_cache_touch(path);
+
     /* Search local files in REF_PATH; we can open them and return as above */
     if (!local_path && (path2 = find_path(tag->str+3, ref_path))) {
         int len = snprintf(path, PATH_MAX, "%s", path2);
@@ -2401,6 +3225,8 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
     if (local_cache && *local_cache) {
         int pid = (int) getpid();
         unsigned thrid = get_int_threadid();
+        int64_t max_size = ref_cache_max_size();
+        int lock_fd = -1, have_root;
         hFILE *fp;
 
         if (*cache_root && !is_directory(cache_root)) {
@@ -2415,6 +3241,11 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
         hts_log_info("Writing cache file '%s'", path);
         mkdir_prefix(path, 01777);
 
+        // Hold off cache trimming while our temporary file exists
+        have_root = ref_cache_root(cache_root, local_cache) == 0;
+        if (have_root)
+            lock_fd = ref_cache_lock(cache_root, 0, 1);
+
         do {
             // Attempt to further uniquify the temporary filename
             unsigned t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
@@ -2426,6 +3257,7 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
         } while (fp == NULL && errno == EEXIST);
         if (!fp) {
             perror(path_tmp);
+            ref_cache_unlock(lock_fd);
 
             // Not fatal - we have the data already so keep going.
             return 0;
@@ -2439,6 +3271,7 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
         if (!(md5 = hts_md5_init())) {
             hclose_abruptly(fp);
             unlink(path_tmp);
+            ref_cache_unlock(lock_fd);
             return -1;
         }
         hts_md5_update(md5, r->seq, r->length);
@@ -2450,6 +3283,7 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
             hts_log_error("Mismatching md5sum for downloaded reference");
             hclose_abruptly(fp);
             unlink(path_tmp);
+            ref_cache_unlock(lock_fd);
             return -1;
         }
 
@@ -2464,6 +3298,10 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
             else
                 unlink(path_tmp);
         }
+        ref_cache_unlock(lock_fd);
+
+        if (have_root && max_size > 0)
+            ref_cache_trim(cache_root, local_cache, max_size);
     }
 
     return 0;
@@ -3505,16 +4343,12 @@ void reset_metrics(cram_fd *fd) {
         if (!m)
             continue;
 
-        m->trial = NTRIALS;
-        m->next_trial = TRIAL_SPAN;
+        m->trial = fd->ntrials;
+        m->next_trial = fd->trial_span;
+        m->span = fd->trial_span;
         m->revised_method = 0;
 
-        m->sz_gz_rle = 0;
-        m->sz_gz_def = 0;
-        m->sz_rans0  = 0;
-        m->sz_rans1  = 0;
-        m->sz_bzip2  = 0;
-        m->sz_lzma   = 0;
+        memset(m->sz, 0, sizeof(m->sz));
     }
 }
 
@@ -3714,6 +4548,10 @@ void cram_free_slice(cram_slice *s) {
     if (s->crecs)
         free(s->crecs);
 
+    free(s->cons_ref);
+    free(s->bams);
+    free(s->bam_data);
+
     if (s->features)
         free(s->features);
 
@@ -3793,20 +4631,15 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs) {
 }
 
 /*
- * Loads an entire slice.
- * FIXME: In 1.0 the native unit of slices within CRAM is broken
- * as slices contain references to objects in other slices.
- * To work around this while keeping the slice oriented outer loop
- * we read all slices and stitch them together into a fake large
- * slice instead.
+ * Reads a slice header block, returning a slice with just s->hdr and
+ * s->hdr_block filled out.  Use cram_read_slice_blocks() to read the rest.
  *
  * Returns cram_slice ptr on success
  *         NULL on failure
  */
-cram_slice *cram_read_slice(cram_fd *fd) {
+cram_slice *cram_read_slice_hdr(cram_fd *fd) {
     cram_block *b = cram_read_block(fd);
     cram_slice *s = calloc(1, sizeof(*s));
-    int i, n, max_id, min_id;
 
     if (!b || !s)
         goto err;
@@ -3830,13 +4663,35 @@ cram_slice *cram_read_slice(cram_fd *fd) {
         goto err;
     }
 
+    return s;
+
+ err:
+    if (b)
+        cram_free_block(b);
+    if (s) {
+        s->hdr_block = NULL;
+        cram_free_slice(s);
+    }
+    return NULL;
+}
+
+/*
+ * Reads the data blocks following a slice header read by
+ * cram_read_slice_hdr(), and initialises the slice for decoding.
+ *
+ * Returns 0 on success
+ *        -1 on failure, in which case the slice should be freed
+ */
+int cram_read_slice_blocks(cram_fd *fd, cram_slice *s) {
+    int i, n, max_id, min_id;
+
     s->block = calloc(n = s->hdr->num_blocks, sizeof(*s->block));
     if (!s->block)
-        goto err;
+        return -1;
 
     for (max_id = i = 0, min_id = INT_MAX; i < n; i++) {
         if (!(s->block[i] = cram_read_block(fd)))
-            goto err;
+            return -1;
 
         if (s->block[i]->content_type == EXTERNAL) {
             if (max_id < s->block[i]->content_id)
@@ -3847,7 +4702,7 @@ cram_slice *cram_read_slice(cram_fd *fd) {
     }
 
     if (!(s->block_by_id = calloc(512, sizeof(s->block[0]))))
-        goto err;
+        return -1;
 
     for (i = 0; i < n; i++) {
         if (s->block[i]->content_type != EXTERNAL)
@@ -3863,28 +4718,41 @@ cram_slice *cram_read_slice(cram_fd *fd) {
     s->cigar_alloc = 0;
     s->ncigar = 0;
 
-    if (!(s->seqs_blk = cram_new_block(EXTERNAL, 0)))      goto err;
-    if (!(s->qual_blk = cram_new_block(EXTERNAL, DS_QS)))  goto err;
-    if (!(s->name_blk = cram_new_block(EXTERNAL, DS_RN)))  goto err;
-    if (!(s->aux_blk  = cram_new_block(EXTERNAL, DS_aux))) goto err;
-    if (!(s->base_blk = cram_new_block(EXTERNAL, DS_IN)))  goto err;
-    if (!(s->soft_blk = cram_new_block(EXTERNAL, DS_SC)))  goto err;
+    if (!(s->seqs_blk = cram_new_block(EXTERNAL, 0)))      return -1;
+    if (!(s->qual_blk = cram_new_block(EXTERNAL, DS_QS)))  return -1;
+    if (!(s->name_blk = cram_new_block(EXTERNAL, DS_RN)))  return -1;
+    if (!(s->aux_blk  = cram_new_block(EXTERNAL, DS_aux))) return -1;
+    if (!(s->base_blk = cram_new_block(EXTERNAL, DS_IN)))  return -1;
+    if (!(s->soft_blk = cram_new_block(EXTERNAL, DS_SC)))  return -1;
 
     s->crecs = NULL;
 
     s->last_apos = s->hdr->ref_seq_start;
     s->decode_md = fd->decode_md;
 
-    return s;
+    return 0;
+}
 
- err:
-    if (b)
-        cram_free_block(b);
-    if (s) {
-        s->hdr_block = NULL;
+/*
+ * Loads an entire slice.
+ * FIXME: In 1.0 the native unit of slices within CRAM is broken
+ * as slices contain references to objects in other slices.
+ * To work around this while keeping the slice oriented outer loop
+ * we read all slices and stitch them together into a fake large
+ * slice instead.
+ *
+ * Returns cram_slice ptr on success
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice(cram_fd *fd) {
+    cram_slice *s = cram_read_slice_hdr(fd);
+
+    if (s && cram_read_slice_blocks(fd, s) != 0) {
         cram_free_slice(s);
+        return NULL;
     }
-    return NULL;
+
+    return s;
 }
 
 
@@ -3912,8 +4780,9 @@ cram_file_def *cram_read_file_def(cram_fd *fd) {
         return NULL;
     }
 
-    if (def->major_version > 3) {
-        hts_log_error("CRAM version number mismatch. Expected 1.x, 2.x or 3.x, got %d.%d",
+    if (def->major_version > 3 ||
+        (def->major_version == 3 && def->minor_version > 1)) {
+        hts_log_error("CRAM version number mismatch. Expected 1.x, 2.x, 3.0 or 3.1, got %d.%d",
                       def->major_version, def->minor_version);
         free(def);
         return NULL;
@@ -3932,6 +4801,12 @@ cram_file_def *cram_read_file_def(cram_fd *fd) {
  *        -1 on failure
  */
 int cram_write_file_def(cram_fd *fd, cram_file_def *def) {
+    if (def->major_version > 3 ||
+        (def->major_version == 3 && def->minor_version > 1)) {
+        hts_log_error("Unable to write CRAM version %d.%d",
+                      def->major_version, def->minor_version);
+        return -1;
+    }
     return (hwrite(fd->fp, &def->magic[0], 26) == 26) ? 0 : -1;
 }
 
@@ -4125,6 +5000,12 @@ int cram_write_SAM_hdr(cram_fd *fd, sam_hdr_t *hdr) {
     size_t header_len;
     int blank_block = (CRAM_MAJOR_VERS(fd->version) >= 3);
 
+    /* Generated references are flagged with a slice header tag */
+    if (fd->embed_ref == 2 && CRAM_MAJOR_VERS(fd->version) < 3) {
+        hts_log_error("Generated references need CRAM version 3.0 or later");
+        return -1;
+    }
+
     /* Write CRAM MAGIC if not yet written. */
     if (fd->file_def->major_version == 0) {
         fd->file_def->major_version = CRAM_MAJOR_VERS(fd->version);
@@ -4142,7 +5023,7 @@ int cram_write_SAM_hdr(cram_fd *fd, sam_hdr_t *hdr) {
     }
 
     /* Fix M5 strings */
-    if (fd->refs && !fd->no_ref) {
+    if (fd->refs && !fd->no_ref && fd->embed_ref != 2) {
         int i;
         for (i = 0; i < hdr->hrecs->nref; i++) {
             sam_hrec_type_t *ty;
@@ -4448,10 +5329,11 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
     if (!fd)
         return NULL;
 
-    fd->level = 5;
+    fd->level = CRAM_DEFAULT_LEVEL;
     for (i = 0; mode[i]; i++) {
         if (mode[i] >= '0' && mode[i] <= '9') {
             fd->level = mode[i] - '0';
+            fd->level_set = 1;
             break;
         }
     }
@@ -4524,6 +5406,7 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
     fd->use_bz2 = 0;
     fd->use_rans = (CRAM_MAJOR_VERS(fd->version) >= 3);
     fd->use_lzma = 0;
+    fd->use_arith = 0;
     fd->multi_seq = -1;
     fd->multi_seq_user = -1;
     fd->unsorted   = 0;
@@ -4531,11 +5414,14 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
     fd->store_md = 0;
     fd->store_nm = 0;
     fd->last_RI_count = 0;
+    fd->trial_span = TRIAL_SPAN;
+    fd->ntrials = NTRIALS;
 
     fd->index       = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
+    fd->tqueue      = NULL;
     fd->job_pending = NULL;
     fd->ooc         = 0;
     fd->required_fields = INT_MAX;
@@ -4649,7 +5535,16 @@ int cram_close(cram_fd *fd) {
 
         if (0 != cram_flush_result(fd))
             return -1;
+    }
+
+    if (fd->mode == 'w' && hts_verbose >= HTS_LOG_INFO) {
+        kstring_t ks = {0, 0, NULL};
+        if (cram_method_report(fd, &ks) == 0)
+            hts_log_info("Compression methods used:\n%s", ks.s);
+        free(ks.s);
+    }
 
+    if (fd->pool && fd->eof >= 0) {
         if (fd->mode == 'w')
             fd->ctr = NULL; // prevent double freeing
 
@@ -4660,6 +5555,7 @@ int cram_close(cram_fd *fd) {
         //fprintf(stderr, "CRAM: destroy queue %p\n", fd->rqueue);
 
         hts_tpool_process_destroy(fd->rqueue);
+        hts_tpool_process_destroy(fd->tqueue);
     }
 
     if (fd->mode == 'w') {
@@ -4850,6 +5746,10 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
         fd->use_lzma = va_arg(args, int);
         break;
 
+    case CRAM_OPT_USE_ARITH:
+        fd->use_arith = va_arg(args, int);
+        break;
+
     case CRAM_OPT_SHARED_REF:
         fd->shared_ref = 1;
         refs = va_arg(args, refs_t *);
@@ -4882,8 +5782,8 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
         }
         if (!((major == 1 &&  minor == 0) ||
               (major == 2 && (minor == 0 || minor == 1)) ||
-              (major == 3 &&  minor == 0))) {
-            hts_log_error("Unknown version string; use 1.0, 2.0, 2.1 or 3.0");
+              (major == 3 && (minor == 0 || minor == 1)))) {
+            hts_log_error("Unknown version string; use 1.0, 2.0, 2.1, 3.0 or 3.1");
             errno = EINVAL;
             return -1;
         }
@@ -4905,6 +5805,7 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
                 return -1;
 
             fd->rqueue = hts_tpool_process_init(fd->pool, nthreads*2, 0);
+            fd->tqueue = hts_tpool_process_init(fd->pool, nthreads*2, 1);
             pthread_mutex_init(&fd->metrics_lock, NULL);
             pthread_mutex_init(&fd->ref_lock, NULL);
             pthread_mutex_init(&fd->range_lock, NULL);
@@ -4922,6 +5823,8 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
             fd->rqueue = hts_tpool_process_init(fd->pool,
                                                 p->qsize ? p->qsize : hts_tpool_size(fd->pool)*2,
                                                 0);
+            fd->tqueue = hts_tpool_process_init(fd->pool,
+                                                hts_tpool_size(fd->pool)*2, 1);
             pthread_mutex_init(&fd->metrics_lock, NULL);
             pthread_mutex_init(&fd->ref_lock, NULL);
             pthread_mutex_init(&fd->range_lock, NULL);
@@ -4952,7 +5855,60 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
 
     case HTS_OPT_COMPRESSION_LEVEL:
         fd->level = va_arg(args, int);
+        fd->level_set = 1;
+        break;
+
+    case HTS_OPT_PROFILE: {
+        // Explicitly chosen levels take precedence over the profile's
+        enum hts_profile_option prof = va_arg(args, int);
+        switch (prof) {
+        case HTS_PROFILE_FAST:
+            if (!fd->level_set)
+                fd->level = 1;
+            fd->seqs_per_slice = SEQS_PER_SLICE;
+            fd->trial_span = TRIAL_SPAN*4;
+            fd->ntrials = 1;
+            break;
+
+        case HTS_PROFILE_NORMAL:
+            fd->seqs_per_slice = SEQS_PER_SLICE;
+            fd->trial_span = TRIAL_SPAN;
+            fd->ntrials = NTRIALS;
+            break;
+
+        case HTS_PROFILE_SMALL:
+            if (!fd->level_set)
+                fd->level = 6;
+            fd->use_bz2 = 1;
+            fd->seqs_per_slice = SEQS_PER_SLICE*5/2;
+            fd->trial_span = TRIAL_SPAN;
+            fd->ntrials = NTRIALS;
+            break;
+
+        case HTS_PROFILE_ARCHIVE:
+            if (!fd->level_set)
+                fd->level = 7;
+            fd->use_bz2 = 1;
+            fd->use_arith = 1;
+            if (fd->level > 7)
+                fd->use_lzma = 1;
+            fd->seqs_per_slice = SEQS_PER_SLICE*10;
+            fd->trial_span = TRIAL_SPAN/2;
+            fd->ntrials = NTRIALS+1;
+            break;
+
+        default:
+            hts_log_error("Unknown profile %d", prof);
+            errno = EINVAL;
+            return -1;
+        }
+        fd->bases_per_slice = fd->seqs_per_slice * 500;
+
+        pthread_mutex_lock(&fd->metrics_lock);
+        reset_metrics(fd);
+        pthread_mutex_unlock(&fd->metrics_lock);
         break;
+    }
 
     default:
         hts_log_error("Unknown CRAM option code %d", opt);
@@ -468,6 +468,30 @@ int cram_uncompress_block(cram_block *b);
 int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
                         int method, int level);
 
+/*! Compresses a block belonging to slice 's'.
+ *
+ * As cram_compress_block, but also permits methods that need the slice's
+ * records, such as FQZ for quality values.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_compress_block2(cram_fd *fd, cram_slice *s, cram_block *b,
+                         cram_metrics *metrics, int method, int level);
+
+/*! Calls func(arg, i) for every i from 0 to n-1.
+ *
+ * Uses idle threads from the fd's thread pool, if any, alongside the
+ * calling thread.  Safe to call from within a thread pool job.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 if any call failed
+ */
+int cram_parallel_for(cram_fd *fd, int n, int (*func)(void *arg, int i),
+                      void *arg);
+
 cram_metrics *cram_new_metrics(void);
 char *cram_block_method2str(enum cram_block_method m);
 char *cram_content_type2str(enum cram_content_type t);
@@ -499,6 +523,21 @@ static inline cram_block *cram_get_block_by_id(cram_slice *slice, int id) {
     return NULL;
 }
 
+/*
+ * External blocks are read compressed and only uncompressed, and CRC
+ * checked, when a codec first needs their contents.  This way blocks for
+ * data series that are not needed (see CRAM_OPT_REQUIRED_FIELDS) are
+ * never decompressed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static inline int cram_uncompress_block_lazy(cram_block *b) {
+    if (b->method == RAW && b->crc32_checked)
+        return 0;
+    return cram_uncompress_block(b);
+}
+
 /* --- Accessor macros for manipulating blocks on a byte by byte basis --- */
 
 /* Block size and data pointer. */
@@ -786,6 +825,25 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs);
  */
 cram_slice *cram_read_slice(cram_fd *fd);
 
+/*! Reads just the header of a slice.
+ *
+ * The slice returned has only its hdr and hdr_block fields set.  Either
+ * free it or call cram_read_slice_blocks() to read the remainder.
+ *
+ * @return
+ * Returns cram_slice ptr on success;
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice_hdr(cram_fd *fd);
+
+/*! Reads the data blocks of a slice returned by cram_read_slice_hdr().
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure, after which the slice should be freed
+ */
+int cram_read_slice_blocks(cram_fd *fd, cram_slice *s);
+
 
 
 /**@}*/
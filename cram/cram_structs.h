@@ -84,12 +84,21 @@ KHASH_MAP_INIT_STR(map, pmap_t)
 
 struct hFILE;
 
+#define CRAM_DEFAULT_LEVEL 5
 #define SEQS_PER_SLICE 10000
 #define BASES_PER_SLICE (SEQS_PER_SLICE*500)
 #define SLICE_PER_CNT  1
 
 #define CRAM_SUBST_MATRIX "CGTNAGTNACTNACGNACGT"
 
+/*
+ * Local-use CRAM 3 slice header tag (type 'c', value 1) marking an
+ * embedded reference as a consensus built by the encoder (embed_ref=2)
+ * rather than a copy of the real reference.  MD and NM must not be
+ * computed from such a reference.
+ */
+#define CRAM_TAG_GENREF "gr"
+
 #define MAX_STAT_VAL 1024
 //#define MAX_STAT_VAL 16
 typedef struct cram_stats {
@@ -201,11 +210,19 @@ enum cram_block_method {
     LZMA     = 3,
     RANS     = 4,  // Generic; either order
     RANS0    = 4,
+    RANS_PR0 = 5,  // rANS Nx16 (CRAM 3.1); order and transforms auto-sensed
+    ARITH_PR0 = 6, // Adaptive arithmetic coder (CRAM 3.1)
+    FQZ      = 7,  // fqzcomp quality codec (CRAM 3.1)
+    TOK3     = 8,  // Read name tokeniser (CRAM 3.1)
     RANS1    = 10, // Not externalised; stored as RANS (generic)
     GZIP_RLE = 11, // NB: not externalised in CRAM
+    RANS_PR1 = 12, // ... through to TOKA = 29; not externalised
 };
 */
 
+// Method is a bit-field in cram_compress_block, so must stay below 32
+#define CRAM_MAX_METHOD 32
+
 /* Now in htslib/cram.h
 enum cram_content_type {
     CT_ERROR           = -1,
@@ -224,33 +241,26 @@ struct cram_metrics {
     int trial;
     int next_trial;
 
-    // aggregate sizes during trials
-    int sz_gz_rle;
-    int sz_gz_def;
-    int sz_rans0;
-    int sz_rans1;
-    int sz_bzip2;
-    int sz_lzma;
+    // aggregate sizes during trials, indexed by method
+    int sz[CRAM_MAX_METHOD];
 
     // resultant method from trials
     int method;
     int strat;
 
     // Revisions of method, to allow culling of continually failing ones.
-    int gz_rle_cnt;
-    int gz_def_cnt;
-    int rans0_cnt;
-    int rans1_cnt;
-    int bzip2_cnt;
-    int lzma_cnt;
+    int cnt[CRAM_MAX_METHOD];
     int revised_method;
 
-    double gz_rle_extra;
-    double gz_def_extra;
-    double rans0_extra;
-    double rans1_extra;
-    double bzip2_extra;
-    double lzma_extra;
+    double extra[CRAM_MAX_METHOD];
+
+    // Blocks between trials; doubles while the same method keeps winning
+    int span;
+
+    // Methods chosen, for cram_method_report()
+    int content_id;
+    int64_t used[CRAM_MAX_METHOD];
+    int64_t usz, csz;
 };
 
 // Hash aux key (XX:i) to cram_metrics
@@ -278,6 +288,12 @@ struct cram_block {
 
     int crc32_checked;
     uint32_t crc_part;
+
+    // When writing, CRC32 of the compressed data, valid while data and
+    // comp_size still match comp_crc_data and comp_crc_size
+    uint32_t comp_crc;
+    unsigned char *comp_crc_data;
+    int32_t comp_crc_size;
 };
 
 struct cram_codec; /* defined in cram_codecs.h */
@@ -350,6 +366,7 @@ struct cram_block_slice_hdr {
     int32_t *block_content_ids;
     int32_t ref_base_id;    /* if content_type == MAPPED_SLICE */
     unsigned char md5[16];
+    int ref_generated;      /* embedded ref is a consensus (CRAM_TAG_GENREF) */
 };
 
 struct ref_entry;
@@ -542,6 +559,13 @@ typedef union cram_feature {
  * is the logical unit for decoding a number of
  * sequences.
  */
+/* A BAM record converted from a slice; its data lives in the slice */
+typedef struct {
+    bam1_core_t core;
+    uint32_t l_data;
+    size_t data;                 // offset into cram_slice bam_data
+} cram_bam_rec;
+
 struct cram_slice {
     cram_block_slice_hdr *hdr;
     cram_block *hdr_block;
@@ -589,6 +613,7 @@ struct cram_slice {
     int ref_start;             // start position of current reference;
     int ref_end;               // end position of current reference;
     int ref_id;
+    char *cons_ref;            // consensus generated when encoding, if any
 
     // For going from BAM to CRAM; an array of auxiliary blocks per type
     int naux_block;
@@ -599,6 +624,11 @@ struct cram_slice {
 
     int max_rec, curr_rec;       // current and max recs per slice
     int slice_num;               // To be copied into c->curr_slice in decode
+
+    // Records converted to BAM by the decoding thread, with their data
+    // held contiguously in bam_data.  See cram_slice_to_bams().
+    cram_bam_rec *bams;
+    uint8_t *bam_data;
 };
 
 /*-----------------------------------------------------------------------------
@@ -714,7 +744,10 @@ struct cram_fd {
 
     // compression level and metrics
     int level;
+    int level_set;                      // level was chosen explicitly
     cram_metrics *m[DS_END];
+    int trial_span;                     // blocks between method trials
+    int ntrials;                        // blocks per method trial
     khash_t(m_metrics) *tags_used; // cram_metrics[], per tag types in use.
 
     // options
@@ -728,6 +761,7 @@ struct cram_fd {
     int use_bz2;
     int use_rans;
     int use_lzma;
+    int use_arith;
     int shared_ref;
     unsigned int required_fields;
     int store_md;
@@ -758,6 +792,7 @@ struct cram_fd {
     int own_pool;
     hts_tpool *pool;
     hts_tpool_process *rqueue;
+    hts_tpool_process *tqueue;          // for cram_parallel_for()
     pthread_mutex_t metrics_lock;
     pthread_mutex_t ref_lock;
     pthread_mutex_t range_lock;
@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The CRAM 3.1 fqzcomp quality codec; see fqzcomp_qual.h.
+ *
+ * Written for htslib rather than taken from htscodecs, and the layout
+ * below does not yet match the specification's, so it is only used in
+ * builds with CRAM_EXPERIMENTAL_V31_CODECS.
+ *
+ * Stream layout:
+ *
+ *   uncompressed size as uint7
+ *   version byte (FQZ_VERS)
+ *   gflags byte (GFLAG_*)
+ *   pflags byte (PFLAG_*)
+ *   max_sym byte; the number of quality symbols (0 meaning 256)
+ *   qbits << 4 | qshift
+ *   qloc  << 4 | sloc
+ *   ploc  << 4 | dloc
+ *   symbol to quality map of max_sym bytes, if PFLAG_HAVE_QMAP
+ *   qtab, ptab and dtab, if PFLAG_HAVE_QTAB, _PTAB and _DTAB
+ *   range coder output
+ *
+ * The tables are non-decreasing runs starting at 0 and rising by one at
+ * a time, so are stored as the uint7 run length of each successive value.
+ * Missing tables are zero, except qtab which defaults to the identity.
+ *
+ * For each record the range coder holds its length (four bytes, or only
+ * for the first record without PFLAG_DO_LEN), a reverse flag with
+ * GFLAG_DO_REV, a duplicate flag with PFLAG_DO_DEDUP and the READ2
+ * selector with PFLAG_DO_SEL, followed by the quality symbols.  Reversed
+ * records are coded in the order they were sequenced.
+ *
+ * The context for each symbol is
+ *
+ *   (previous symbols & ((1<<qbits)-1)) << qloc
+ *   + ptab[min(1023, symbols left in the record)] << ploc
+ *   + dtab[min(255,  number of changes of symbol so far)] << dloc
+ *   + selector << sloc
+ *
+ * where "previous symbols" accumulates qtab[sym] shifted by qshift each
+ * time.
+ *
+ * This is not yet the layout in the CRAM 3.1 specification, which after
+ * gflags has an optional parameter block count and selector table, gives
+ * each parameter block a 16-bit starting context and run-length codes the
+ * tables differently.  Until it is, cram_encode.c does not write FQZ
+ * blocks by default.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fqzcomp_qual.h"
+#include "c_range_coder.h"
+#include "c_simple_model.h"
+#include "varint.h"
+
+#define FQZ_VERS 5
+
+#define GFLAG_DO_REV    4
+
+#define PFLAG_DO_DEDUP  2
+#define PFLAG_DO_LEN    4
+#define PFLAG_DO_SEL    8
+#define PFLAG_HAVE_QMAP 16
+#define PFLAG_HAVE_PTAB 32
+#define PFLAG_HAVE_DTAB 64
+#define PFLAG_HAVE_QTAB 128
+
+#define CTX_BITS  16
+#define QTAB_SIZE 256
+#define PTAB_SIZE 1024
+#define DTAB_SIZE 256
+
+// The BAM flags used, to avoid a dependency on sam.h
+#define FQZ_FREVERSE 16
+#define FQZ_FREAD2   128
+
+typedef struct {
+    int gflags, pflags, max_sym;
+    int qbits, qshift, qloc, sloc, ploc, dloc;
+    uint8_t  qmap[256];        // symbol to quality value
+    uint32_t qtab[QTAB_SIZE];
+    uint32_t ptab[PTAB_SIZE];  // pre-shifted by ploc
+    uint32_t dtab[DTAB_SIZE];  // pre-shifted by dloc
+} fqz_param;
+
+typedef struct {
+    uint32_t qctx;   // accumulated previous symbols
+    uint32_t p;      // symbols left in the record
+    uint32_t delta;  // changes of symbol so far
+    uint32_t prevq;
+    uint32_t s;      // selector
+} fqz_state;
+
+/*
+ * Quality models are created on first use of a context, as most of the
+ * 64k possible contexts are normally unused.
+ */
+typedef struct {
+    uint32_t *idx;       // context to model number + 1, or 0 if unused
+    SIMPLE_MODEL *qual;
+    uint32_t nqual, qual_alloc;
+    int max_sym;
+    SIMPLE_MODEL len[4];
+    SIMPLE_MODEL rev, dup, sel;
+} fqz_model;
+
+static int fqz_model_init(fqz_model *m, int max_sym) {
+    int i;
+
+    memset(m, 0, sizeof(*m));
+    if (!(m->idx = calloc(1 << CTX_BITS, sizeof(*m->idx))))
+        return -1;
+    m->max_sym = max_sym;
+    for (i = 0; i < 4; i++)
+        SIMPLE_MODEL_init(&m->len[i], 256);
+    SIMPLE_MODEL_init(&m->rev, 2);
+    SIMPLE_MODEL_init(&m->dup, 2);
+    SIMPLE_MODEL_init(&m->sel, 2);
+
+    return 0;
+}
+
+static void fqz_model_free(fqz_model *m) {
+    free(m->idx);
+    free(m->qual);
+}
+
+static inline SIMPLE_MODEL *fqz_qual_model(fqz_model *m, uint32_t ctx) {
+    if (!m->idx[ctx]) {
+        if (m->nqual == m->qual_alloc) {
+            uint32_t n = m->qual_alloc ? m->qual_alloc * 2 : 256;
+            SIMPLE_MODEL *q = realloc(m->qual, n * sizeof(*q));
+            if (!q)
+                return NULL;
+            m->qual = q;
+            m->qual_alloc = n;
+        }
+        SIMPLE_MODEL_init(&m->qual[m->nqual], m->max_sym);
+        m->idx[ctx] = ++m->nqual;
+    }
+
+    return &m->qual[m->idx[ctx]-1];
+}
+
+static inline uint32_t fqz_context(fqz_param *pm, fqz_state *st) {
+    uint32_t ctx = (st->qctx & ((1u << pm->qbits) - 1)) << pm->qloc;
+    ctx += pm->ptab[st->p < PTAB_SIZE ? st->p : PTAB_SIZE-1];
+    ctx += pm->dtab[st->delta < DTAB_SIZE ? st->delta : DTAB_SIZE-1];
+    ctx += st->s << pm->sloc;
+    return ctx & ((1u << CTX_BITS) - 1);
+}
+
+static inline void fqz_update(fqz_param *pm, fqz_state *st, uint32_t q) {
+    st->qctx = (st->qctx << pm->qshift) + pm->qtab[q];
+    st->delta += st->prevq != q;
+    st->prevq = q;
+    st->p--;
+}
+
+/*-----------------------------------------------------------------------------
+ * Parameter tables
+ */
+
+static uint8_t *store_array(uint8_t *cp, uint32_t *tab, int n) {
+    uint32_t v = 0;
+    int i = 0;
+
+    while (i < n) {
+        uint32_t run = 0;
+        while (i < n && tab[i] == v)
+            i++, run++;
+        cp += var_put_u32(cp, run);
+        v++;
+    }
+
+    return cp;
+}
+
+/*
+ * Reads a table stored by store_array, shifting the values left by
+ * 'shift'.  Returns the number of bytes consumed, or 0 on error.
+ */
+static int read_array(uint8_t *cp, uint8_t *cp_end, uint32_t *tab, int n,
+                      int shift) {
+    uint8_t *start = cp;
+    uint32_t v = 0;
+    int i = 0;
+
+    while (i < n) {
+        uint32_t run;
+        int k = var_get_u32(cp, cp_end, &run);
+        if (!k || run > n - i || v >= (1u << CTX_BITS))
+            return 0;
+        cp += k;
+        while (run--)
+            tab[i++] = v << shift;
+        v++;
+    }
+
+    return cp - start;
+}
+
+static int nbits(uint32_t v) {
+    int n = 0;
+    while (v >> n)
+        n++;
+    return n;
+}
+
+/* Chooses parameters for strategy 'strat' from the data and records */
+static void fqz_pick_params(fqz_param *pm, fqz_slice *s, uint8_t *in,
+                            size_t in_size, int strat, uint8_t *sym_of) {
+    static const struct {
+        int nq, pbits, dbits;
+    } strats[FQZ_NSTRAT] = {
+        {2, 2, 2}, {1, 4, 3}, {3, 2, 2}, {2, 0, 4}
+    };
+    size_t hist[256] = {0}, i;
+    uint32_t max_len = 0, ndup = 0, sel_seen = 0, rev_seen = 0;
+    int nsym = 0, maxq = 0, q, r, avail, pbits, dbits, sel;
+
+    memset(pm, 0, sizeof(*pm));
+
+    for (i = 0; i < in_size; i++)
+        hist[in[i]]++;
+    for (q = 0; q < 256; q++) {
+        if (hist[q]) {
+            nsym++;
+            maxq = q+1;
+        }
+    }
+
+    // Map qualities to a dense alphabet when that narrows it
+    if (nsym < maxq) {
+        pm->pflags |= PFLAG_HAVE_QMAP;
+        for (nsym = q = 0; q < 256; q++) {
+            if (hist[q]) {
+                pm->qmap[nsym] = q;
+                sym_of[q] = nsym++;
+            }
+        }
+        pm->max_sym = nsym;
+    } else {
+        for (q = 0; q < 256; q++)
+            pm->qmap[q] = sym_of[q] = q;
+        pm->max_sym = maxq ? maxq : 1;
+    }
+
+    // Large alphabets only keep the top 6 bits of each previous symbol
+    pm->qshift = nbits(pm->max_sym - 1);
+    if (pm->qshift < 1)
+        pm->qshift = 1;
+    if (pm->qshift > 6) {
+        pm->pflags |= PFLAG_HAVE_QTAB;
+        for (q = 0; q < QTAB_SIZE; q++)
+            pm->qtab[q] = q >> (pm->qshift - 6);
+        pm->qshift = 6;
+    } else {
+        for (q = 0; q < QTAB_SIZE; q++)
+            pm->qtab[q] = q;
+    }
+
+    for (r = 0, i = 0; r < s->num_records; i += s->len[r++]) {
+        uint32_t len = s->len[r];
+        if (max_len < len)
+            max_len = len;
+        if (r && len == s->len[r-1] &&
+            memcmp(in + i, in + i - len, len) == 0)
+            ndup++;
+        sel_seen |= 1 << ((s->flags[r] & FQZ_FREAD2) != 0);
+        rev_seen |= (s->flags[r] & FQZ_FREVERSE) != 0;
+        if (r && len != s->len[0])
+            pm->pflags |= PFLAG_DO_LEN;
+    }
+    if (s->num_records && s->len[0] == 0)
+        pm->pflags |= PFLAG_DO_LEN;
+    if (ndup * 100 > (uint32_t)s->num_records)
+        pm->pflags |= PFLAG_DO_DEDUP;
+    if (rev_seen)
+        pm->gflags |= GFLAG_DO_REV;
+
+    // Share the context bits out, giving priority to previous qualities
+    sel = sel_seen == 3;
+    if (sel)
+        pm->pflags |= PFLAG_DO_SEL;
+    pm->qbits = strats[strat].nq * pm->qshift;
+    if (pm->qbits > 12)
+        pm->qbits = 12;
+    avail = CTX_BITS - sel - pm->qbits;
+    pbits = strats[strat].pbits < avail ? strats[strat].pbits : avail;
+    if (max_len >= PTAB_SIZE)
+        max_len = PTAB_SIZE-1;
+    while (pbits && (1u << pbits) > max_len + 1)
+        pbits--;
+    avail -= pbits;
+    dbits = strats[strat].dbits < avail ? strats[strat].dbits : avail;
+
+    pm->qloc = 0;
+    pm->sloc = sel ? CTX_BITS-1 : 0;
+
+    if (pbits) {
+        uint32_t p, nb = 1u << pbits;
+        pm->pflags |= PFLAG_HAVE_PTAB;
+        pm->ploc = pm->qbits;
+        for (p = 0; p < PTAB_SIZE; p++) {
+            uint32_t b = p * nb / (max_len + 1);
+            pm->ptab[p] = b < nb ? b : nb-1;
+        }
+    }
+
+    if (dbits) {
+        uint32_t d, nb = 1u << dbits;
+        pm->pflags |= PFLAG_HAVE_DTAB;
+        pm->dloc = pm->qbits + pbits;
+        for (d = 0; d < DTAB_SIZE; d++) {
+            uint32_t b = nbits(d);
+            pm->dtab[d] = b < nb ? b : nb-1;
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Encoder
+ */
+
+char *fqz_compress(fqz_slice *s, char *in_c, size_t in_size,
+                   size_t *out_size, int strat) {
+    uint8_t *in = (uint8_t *)in_c, *out = NULL, *cp, sym_of[256] = {0};
+    uint32_t len1 = in_size, flags1 = 0, p;
+    fqz_slice s1 = {1, &len1, &flags1};
+    fqz_param pm;
+    fqz_model m;
+    RangeCoder rc;
+    size_t i, tot, bound;
+    int r;
+
+    if (strat < 0 || strat >= FQZ_NSTRAT || in_size > UINT32_MAX)
+        return NULL;
+    if (!s)
+        s = &s1;
+    for (tot = 0, r = 0; r < s->num_records; r++)
+        tot += s->len[r];
+    if (tot != in_size)
+        return NULL;
+
+    fqz_pick_params(&pm, s, in, in_size, strat, sym_of);
+    if (fqz_model_init(&m, pm.max_sym) < 0)
+        return NULL;
+
+    bound = in_size + in_size/4 + (size_t)s->num_records*6 + 4096;
+    if (!(out = malloc(bound)))
+        goto err;
+
+    // Header
+    cp = out;
+    cp += var_put_u32(cp, in_size);
+    *cp++ = FQZ_VERS;
+    *cp++ = pm.gflags;
+    *cp++ = pm.pflags;
+    *cp++ = pm.max_sym & 0xff;
+    *cp++ = (pm.qbits << 4) | pm.qshift;
+    *cp++ = (pm.qloc  << 4) | pm.sloc;
+    *cp++ = (pm.ploc  << 4) | pm.dloc;
+    if (pm.pflags & PFLAG_HAVE_QMAP) {
+        memcpy(cp, pm.qmap, pm.max_sym);
+        cp += pm.max_sym;
+    }
+    if (pm.pflags & PFLAG_HAVE_QTAB)
+        cp = store_array(cp, pm.qtab, QTAB_SIZE);
+    if (pm.pflags & PFLAG_HAVE_PTAB) {
+        cp = store_array(cp, pm.ptab, PTAB_SIZE);
+        for (p = 0; p < PTAB_SIZE; p++)
+            pm.ptab[p] <<= pm.ploc;
+    }
+    if (pm.pflags & PFLAG_HAVE_DTAB) {
+        cp = store_array(cp, pm.dtab, DTAB_SIZE);
+        for (p = 0; p < DTAB_SIZE; p++)
+            pm.dtab[p] <<= pm.dloc;
+    }
+
+    RC_SetOutput(&rc, cp, out + bound);
+    RC_StartEncode(&rc);
+
+    for (i = 0, r = 0; r < s->num_records; i += s->len[r++]) {
+        uint32_t len = s->len[r], rev = 0, j;
+        fqz_state st;
+
+        if (r == 0 || (pm.pflags & PFLAG_DO_LEN))
+            for (j = 0; j < 4; j++)
+                SIMPLE_MODEL_encodeSymbol(&m.len[j], &rc,
+                                          (len >> (8*j)) & 0xff);
+
+        if (pm.gflags & GFLAG_DO_REV) {
+            rev = (s->flags[r] & FQZ_FREVERSE) != 0;
+            SIMPLE_MODEL_encodeSymbol(&m.rev, &rc, rev);
+        }
+
+        if (pm.pflags & PFLAG_DO_DEDUP) {
+            int dup = r && len == s->len[r-1] &&
+                memcmp(in + i, in + i - len, len) == 0;
+            SIMPLE_MODEL_encodeSymbol(&m.dup, &rc, dup);
+            if (dup)
+                continue;
+        }
+
+        st.qctx = 0;
+        st.p = len;
+        st.delta = 0;
+        st.prevq = 0;
+        st.s = 0;
+        if (pm.pflags & PFLAG_DO_SEL) {
+            st.s = (s->flags[r] & FQZ_FREAD2) != 0;
+            SIMPLE_MODEL_encodeSymbol(&m.sel, &rc, st.s);
+        }
+
+        for (j = 0; j < len; j++) {
+            uint32_t q = sym_of[in[i + (rev ? len-1-j : j)]];
+            SIMPLE_MODEL *sm = fqz_qual_model(&m, fqz_context(&pm, &st));
+            if (!sm)
+                goto err;
+            SIMPLE_MODEL_encodeSymbol(sm, &rc, q);
+            fqz_update(&pm, &st, q);
+        }
+    }
+
+    RC_FinishEncode(&rc);
+    if (rc.err)
+        goto err;
+
+    *out_size = (cp - out) + RC_OutSize(&rc);
+    fqz_model_free(&m);
+    return (char *)out;
+
+ err:
+    fqz_model_free(&m);
+    free(out);
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Decoder
+ */
+
+char *fqz_decompress(char *in_c, size_t in_size, size_t *out_size) {
+    uint8_t *in = (uint8_t *)in_c, *cp = in, *cp_end = in + in_size;
+    uint8_t *out = NULL;
+    uint32_t total, i, len = 0, prev_len = 0;
+    fqz_param pm;
+    fqz_model m;
+    RangeCoder rc;
+    int n, model_ok = 0;
+
+    memset(&pm, 0, sizeof(pm));
+
+    if (!(n = var_get_u32(cp, cp_end, &total)))
+        return NULL;
+    cp += n;
+    if (cp_end - cp < 7 || cp[0] != FQZ_VERS)
+        return NULL;
+    pm.gflags  = cp[1];
+    pm.pflags  = cp[2];
+    pm.max_sym = cp[3] ? cp[3] : 256;
+    pm.qbits   = cp[4] >> 4;
+    pm.qshift  = cp[4] & 15;
+    pm.qloc    = cp[5] >> 4;
+    pm.sloc    = cp[5] & 15;
+    pm.ploc    = cp[6] >> 4;
+    pm.dloc    = cp[6] & 15;
+    cp += 7;
+    if (pm.gflags & ~GFLAG_DO_REV || pm.pflags & 1)
+        return NULL;
+
+    if (pm.pflags & PFLAG_HAVE_QMAP) {
+        if (cp_end - cp < pm.max_sym)
+            return NULL;
+        memcpy(pm.qmap, cp, pm.max_sym);
+        cp += pm.max_sym;
+    } else {
+        for (i = 0; i < 256; i++)
+            pm.qmap[i] = i;
+    }
+
+    if (pm.pflags & PFLAG_HAVE_QTAB) {
+        if (!(n = read_array(cp, cp_end, pm.qtab, QTAB_SIZE, 0)))
+            return NULL;
+        cp += n;
+    } else {
+        for (i = 0; i < QTAB_SIZE; i++)
+            pm.qtab[i] = i;
+    }
+    if (pm.pflags & PFLAG_HAVE_PTAB) {
+        if (!(n = read_array(cp, cp_end, pm.ptab, PTAB_SIZE, pm.ploc)))
+            return NULL;
+        cp += n;
+    }
+    if (pm.pflags & PFLAG_HAVE_DTAB) {
+        if (!(n = read_array(cp, cp_end, pm.dtab, DTAB_SIZE, pm.dloc)))
+            return NULL;
+        cp += n;
+    }
+
+    if (fqz_model_init(&m, pm.max_sym) < 0)
+        return NULL;
+    model_ok = 1;
+    if (!(out = malloc(total ? total : 1)))
+        goto err;
+
+    RC_SetInput(&rc, cp, cp_end);
+    RC_StartDecode(&rc);
+
+    for (i = 0; i < total; i += len) {
+        uint32_t rev = 0, j;
+        fqz_state st;
+
+        if (i == 0 || (pm.pflags & PFLAG_DO_LEN)) {
+            for (len = 0, j = 0; j < 4; j++)
+                len |= (uint32_t)SIMPLE_MODEL_decodeSymbol(&m.len[j], &rc)
+                    << (8*j);
+            if (len == 0 && !(pm.pflags & PFLAG_DO_LEN))
+                goto err;
+        }
+        if (rc.err || len > total - i)
+            goto err;
+
+        if (pm.gflags & GFLAG_DO_REV)
+            rev = SIMPLE_MODEL_decodeSymbol(&m.rev, &rc);
+
+        if (pm.pflags & PFLAG_DO_DEDUP) {
+            if (SIMPLE_MODEL_decodeSymbol(&m.dup, &rc)) {
+                if (len != prev_len || i < len)
+                    goto err;
+                memcpy(out + i, out + i - len, len);
+                continue;
+            }
+        }
+        prev_len = len;
+
+        st.qctx = 0;
+        st.p = len;
+        st.delta = 0;
+        st.prevq = 0;
+        st.s = 0;
+        if (pm.pflags & PFLAG_DO_SEL)
+            st.s = SIMPLE_MODEL_decodeSymbol(&m.sel, &rc);
+
+        for (j = 0; j < len; j++) {
+            SIMPLE_MODEL *sm = fqz_qual_model(&m, fqz_context(&pm, &st));
+            uint32_t q;
+            if (!sm)
+                goto err;
+            q = SIMPLE_MODEL_decodeSymbol(sm, &rc);
+            out[i + (rev ? len-1-j : j)] = pm.qmap[q];
+            fqz_update(&pm, &st, q);
+        }
+    }
+    if (rc.err)
+        goto err;
+
+    fqz_model_free(&m);
+    *out_size = total;
+    return (char *)out;
+
+ err:
+    if (model_ok)
+        fqz_model_free(&m);
+    free(out);
+    return NULL;
+}
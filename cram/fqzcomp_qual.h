@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FQZCOMP_QUAL_H
+#define FQZCOMP_QUAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The CRAM 3.1 fqzcomp quality score codec.
+ *
+ * Each quality value is encoded with an adaptive arithmetic model chosen
+ * by a 16-bit context built from the previous qualities in the record,
+ * the distance to the end of the record, the number of times the quality
+ * has changed so far and a selector bit for READ2.  Record lengths,
+ * duplicate records and reverse complemented records are coded in the
+ * same stream, so decoding needs no other information.
+ */
+
+/* Per-record information for the encoder */
+typedef struct {
+    int num_records;
+    uint32_t *len;    // quality string length of each record
+    uint32_t *flags;  // BAM flags, for BAM_FREAD2 and BAM_FREVERSE
+} fqz_slice;
+
+/* Number of built-in parameter strategies; see fqz_compress */
+#define FQZ_NSTRAT 4
+
+/*
+ * Compresses in_size bytes of concatenated quality strings, which must
+ * match the record lengths in 's'.  If 's' is NULL the data is treated as
+ * a single record.  'strat' (0 to FQZ_NSTRAT-1) selects how the context
+ * bits are shared between previous qualities, position and delta:
+ *   0: two previous qualities, some position and delta
+ *   1: one previous quality, more position and delta
+ *   2: three previous qualities, for binned quality values
+ *   3: two previous qualities and delta, no position
+ *
+ * Returns a malloced buffer holding *out_size bytes on success,
+ *         NULL on failure.
+ */
+char *fqz_compress(fqz_slice *s, char *in, size_t in_size,
+                   size_t *out_size, int strat);
+
+/*
+ * Uncompresses in_size bytes of 'in'.
+ *
+ * Returns a malloced buffer holding *out_size bytes on success,
+ *         NULL on failure.
+ */
+char *fqz_decompress(char *in, size_t in_size, size_t *out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FQZCOMP_QUAL_H */
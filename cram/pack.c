@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+
+static int pack_shift(int nsym) {
+    if (nsym <= 1)  return 0;
+    if (nsym <= 2)  return 1;
+    if (nsym <= 4)  return 2;
+    if (nsym <= 16) return 4;
+    return -1;
+}
+
+uint32_t hts_packed_len(uint32_t len, int nsym) {
+    int bits = pack_shift(nsym);
+    if (bits <= 0)
+        return 0;
+    return (uint32_t)(((uint64_t)len * bits + 7) / 8);
+}
+
+uint8_t *hts_pack(const uint8_t *data, uint32_t len,
+                  uint8_t *meta, int *meta_len, uint32_t *out_len) {
+    int present[256] = {0}, nsym = 0, bits, per_byte, j;
+    uint8_t map[256];
+    uint32_t i, plen;
+    uint8_t *out;
+
+    for (i = 0; i < len; i++)
+        present[data[i]] = 1;
+
+    for (j = 0; j < 256; j++) {
+        if (!present[j])
+            continue;
+        if (nsym == 16)
+            return NULL;
+        map[j] = nsym;
+        meta[1 + nsym++] = j;
+    }
+    meta[0] = nsym;
+    *meta_len = nsym + 1;
+
+    bits = pack_shift(nsym);
+    plen = hts_packed_len(len, nsym);
+    if (!(out = malloc(plen ? plen : 1)))
+        return NULL;
+    *out_len = plen;
+
+    if (bits == 0)
+        return out;
+
+    per_byte = 8 / bits;
+    for (i = 0; i < plen; i++) {
+        uint32_t k, end = (i+1) * per_byte;
+        uint8_t c = 0;
+        int s = 0;
+        if (end > len)
+            end = len;
+        for (k = i * per_byte; k < end; k++, s += bits)
+            c |= map[data[k]] << s;
+        out[i] = c;
+    }
+
+    return out;
+}
+
+int hts_unpack_meta(const uint8_t *meta, uint32_t meta_len,
+                    uint8_t *map, int *nsym) {
+    int n, j;
+
+    if (meta_len < 1)
+        return 0;
+    n = meta[0];
+    if (n > 16 || meta_len < (uint32_t)n + 1)
+        return 0;
+    for (j = 0; j < n; j++)
+        map[j] = meta[j+1];
+    // Unused slots decode to 0 rather than garbage on corrupt input.
+    for (; j < 16; j++)
+        map[j] = 0;
+    *nsym = n;
+
+    return n + 1;
+}
+
+int hts_unpack(const uint8_t *in, uint32_t in_len,
+               uint8_t *out, uint32_t out_len,
+               int nsym, const uint8_t *map) {
+    int bits = pack_shift(nsym), per_byte, mask;
+    uint32_t i, k;
+
+    if (bits < 0)
+        return -1;
+
+    if (bits == 0) {
+        if (out_len && nsym == 0)
+            return -1;
+        memset(out, nsym ? map[0] : 0, out_len);
+        return 0;
+    }
+
+    if (in_len < hts_packed_len(out_len, nsym))
+        return -1;
+
+    per_byte = 8 / bits;
+    mask = (1 << bits) - 1;
+    for (i = k = 0; k + per_byte <= out_len; i++) {
+        uint8_t c = in[i];
+        int j;
+        for (j = 0; j < per_byte; j++, c >>= bits)
+            out[k++] = map[c & mask];
+    }
+    if (k < out_len) {
+        uint8_t c = in[i];
+        for (; k < out_len; k++, c >>= bits)
+            out[k] = map[c & mask];
+    }
+
+    return 0;
+}
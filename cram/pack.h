@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CRAM_PACK_H
+#define CRAM_PACK_H
+
+#include <stdint.h>
+
+/*
+ * Bit-packing of data with a small alphabet, as used by the PACK
+ * transform of the CRAM 3.1 entropy coders.
+ *
+ * Data with at most 16 distinct symbols is mapped to symbol indices and
+ * stored as 4, 2, 1 or 0 bits per value (for 16, 4, 2 or 1 distinct
+ * symbols respectively), earlier values occupying the lower bits.
+ */
+
+/*
+ * Packs 'len' bytes of 'data'.  On success the symbol map is written to
+ * 'meta' (1 byte symbol count followed by the symbols themselves; at
+ * most 17 bytes), its length to *meta_len and the packed length to
+ * *out_len.
+ *
+ * Returns a malloced buffer holding the packed data (which may be of
+ * zero length), or NULL if the data has more than 16 distinct symbols or
+ * on memory failure.
+ */
+uint8_t *hts_pack(const uint8_t *data, uint32_t len,
+                  uint8_t *meta, int *meta_len, uint32_t *out_len);
+
+/*
+ * Decodes a symbol map written by hts_pack.  Fills out map[] and *nsym.
+ * Returns the number of bytes consumed, or 0 on error.
+ */
+int hts_unpack_meta(const uint8_t *meta, uint32_t meta_len,
+                    uint8_t *map, int *nsym);
+
+/*
+ * Returns the number of packed bytes required to hold 'len' values with
+ * an alphabet of 'nsym' symbols.
+ */
+uint32_t hts_packed_len(uint32_t len, int nsym);
+
+/*
+ * Reverses hts_pack, expanding 'in' (of length 'in_len') to 'out_len'
+ * bytes in 'out'.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int hts_unpack(const uint8_t *in, uint32_t in_len,
+               uint8_t *out, uint32_t out_len,
+               int nsym, const uint8_t *map);
+
+#endif /* CRAM_PACK_H */
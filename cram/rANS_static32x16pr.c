@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SIMD decoders for 32-way interleaved rANS-Nx16 streams; see
+ * rANS_static32x16pr.h.
+ *
+ * The 32 states are held in vector registers (4 AVX2, 2 AVX-512 or 8
+ * SSE4.1 vectors).  Each step looks up the slot of every state in a
+ * packed table, updates the states and then renormalises.  States are
+ * renormalised in ascending order, matching the scalar decoder, so a
+ * vector's lanes needing a new 16-bit word take consecutive words from
+ * the input.  This is done with a permutation (or expand instruction) of
+ * the next 8 or 16 input words selected by the mask of lanes needing
+ * renormalisation.
+ *
+ * The implementations are compiled with per-function target attributes,
+ * so no special compiler flags are needed, and chosen at run time from
+ * the CPU features.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rANS_static4x16.h"
+#include "rANS_static32x16pr.h"
+#include "rANS_word.h"
+
+#if defined(__x86_64__) || defined(__i386__) || \
+    defined(_M_X64) || defined(_M_IX86)
+#  if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#    define RANS_SIMD
+#    define RANS_TARGET(t) __attribute__((target(t)))
+#    include <immintrin.h>
+#  elif defined(_MSC_VER)
+#    define RANS_SIMD
+#    define RANS_TARGET(t)
+#    include <intrin.h>
+#    include <immintrin.h>
+#  endif
+#endif
+
+#define TF_SHIFT 12
+#define TOTFREQ (1<<TF_SHIFT)
+
+#ifdef RANS_SIMD
+
+/*-----------------------------------------------------------------------------
+ * CPU detection
+ */
+
+#ifdef _MSC_VER
+int rans_cpu_detect(void) {
+    int r[4], max, cpu = 0;
+    unsigned long long xcr0 = 0;
+
+    __cpuid(r, 0);
+    max = r[0];
+    __cpuid(r, 1);
+    if (r[2] & (1<<19))
+        cpu |= RANS_CPU_SSE4;
+    if ((r[2] & (1<<27)) && (r[2] & (1<<28))) // OSXSAVE and AVX
+        xcr0 = _xgetbv(0);
+    if (max >= 7 && (xcr0 & 6) == 6) {
+        __cpuidex(r, 7, 0);
+        if (r[1] & (1<<5))
+            cpu |= RANS_CPU_AVX2;
+        if ((r[1] & (1<<16)) && (xcr0 & 0xe6) == 0xe6)
+            cpu |= RANS_CPU_AVX512;
+    }
+
+    return cpu;
+}
+#else
+int rans_cpu_detect(void) {
+    int cpu = 0;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        cpu |= RANS_CPU_SSE4;
+    if (__builtin_cpu_supports("avx2"))
+        cpu |= RANS_CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        cpu |= RANS_CPU_AVX512;
+
+    return cpu;
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+ * Renormalisation lookup tables, indexed by the mask of lanes needing a
+ * new word.  Each lane with its bit set takes the next unused word.
+ */
+
+static uint8_t  nbits[256];
+static uint32_t perm8[256][8];     // AVX2 permutevar8x32 indices
+static uint8_t  shuf4[16][16];     // SSSE3 pshufb indices for 4 lanes
+
+static void init_tables(void) {
+    int m, j;
+
+    for (m = 0; m < 256; m++) {
+        int n = 0;
+        for (j = 0; j < 8; j++) {
+            perm8[m][j] = n;
+            if (m & (1<<j))
+                n++;
+        }
+        nbits[m] = n;
+    }
+
+    for (m = 0; m < 16; m++) {
+        int n = 0;
+        for (j = 0; j < 4; j++) {
+            if (m & (1<<j)) {
+                shuf4[m][j*4+0] = n*2;
+                shuf4[m][j*4+1] = n*2+1;
+                n++;
+            } else {
+                shuf4[m][j*4+0] = 0x80;
+                shuf4[m][j*4+1] = 0x80;
+            }
+            shuf4[m][j*4+2] = 0x80;
+            shuf4[m][j*4+3] = 0x80;
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * AVX2: 4 vectors of 8 states
+ */
+
+RANS_TARGET("avx2")
+static inline __m256i avx2_decode(__m256i R, __m256i e, int shift) {
+    const __m256i m12 = _mm256_set1_epi32(0xfff);
+    __m256i f = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(e, 8),
+                                                  m12),
+                                 _mm256_set1_epi32(1));
+    __m256i b = _mm256_srli_epi32(e, 20);
+    __m256i x = _mm256_srl_epi32(R, _mm_cvtsi32_si128(shift));
+    return _mm256_add_epi32(_mm256_mullo_epi32(f, x), b);
+}
+
+RANS_TARGET("avx2")
+static inline __m256i avx2_renorm(__m256i R, uint8_t **cpp) {
+    // States are below 2^31 after decoding valid data, so a signed
+    // comparison suffices.  Corrupt data only yields corrupt output.
+    __m256i lt = _mm256_cmpgt_epi32(_mm256_set1_epi32(RANS_WORD_L), R);
+    int msk = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+    __m256i w, idx;
+
+    if (!msk)
+        return R;
+
+    w = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)*cpp));
+    idx = _mm256_loadu_si256((__m256i *)perm8[msk]);
+    w = _mm256_permutevar8x32_epi32(w, idx);
+    *cpp += 2*nbits[msk];
+
+    return _mm256_blendv_epi8(R, _mm256_or_si256(_mm256_slli_epi32(R, 16), w),
+                              lt);
+}
+
+/* Packs the low bytes of S[0..3] into 32 consecutive bytes */
+RANS_TARGET("avx2")
+static inline void avx2_store_syms(uint8_t *out, __m256i *S) {
+    __m256i p01 = _mm256_packus_epi32(S[0], S[1]);
+    __m256i p23 = _mm256_packus_epi32(S[2], S[3]);
+    __m256i p = _mm256_packus_epi16(p01, p23);
+    p = _mm256_permutevar8x32_epi32(p, _mm256_setr_epi32(0,4,1,5,2,6,3,7));
+    _mm256_storeu_si256((__m256i *)out, p);
+}
+
+RANS_TARGET("avx2")
+static uint32_t rans_dec32_O0_avx2(uint32_t *R, uint8_t **cpp,
+                                   uint8_t *cp_end, const uint32_t *sfb,
+                                   uint8_t *out, uint32_t out_sz) {
+    const __m256i mask = _mm256_set1_epi32(TOTFREQ-1);
+    const __m256i m8 = _mm256_set1_epi32(0xff);
+    uint8_t *cp = *cpp;
+    __m256i Rv[4], S[4];
+    uint32_t i;
+    int v;
+
+    for (v = 0; v < 4; v++)
+        Rv[v] = _mm256_loadu_si256((__m256i *)(R + 8*v));
+
+    for (i = 0; i + 32 <= out_sz && cp_end - cp >= 64; i += 32) {
+        for (v = 0; v < 4; v++) {
+            __m256i m = _mm256_and_si256(Rv[v], mask);
+            __m256i e = _mm256_i32gather_epi32((const int *)sfb, m, 4);
+            S[v] = _mm256_and_si256(e, m8);
+            Rv[v] = avx2_decode(Rv[v], e, TF_SHIFT);
+        }
+        for (v = 0; v < 4; v++)
+            Rv[v] = avx2_renorm(Rv[v], &cp);
+        avx2_store_syms(out + i, S);
+    }
+
+    for (v = 0; v < 4; v++)
+        _mm256_storeu_si256((__m256i *)(R + 8*v), Rv[v]);
+    *cpp = cp;
+
+    return i;
+}
+
+RANS_TARGET("avx2")
+static uint32_t rans_dec32_O1_avx2(uint32_t *R, uint8_t *last,
+                                   uint8_t **cpp, uint8_t *cp_end,
+                                   const uint32_t *sfb, int shift,
+                                   uint8_t *out, uint32_t isz) {
+    const __m256i mask = _mm256_set1_epi32((1<<shift)-1);
+    const __m256i m8 = _mm256_set1_epi32(0xff);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    uint8_t *cp = *cpp, syms[32];
+    __m256i Rv[4], Lv[4];
+    uint32_t k;
+    int v, z;
+
+    for (v = 0; v < 4; v++) {
+        Rv[v] = _mm256_loadu_si256((__m256i *)(R + 8*v));
+        Lv[v] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(last+8*v)));
+    }
+
+    for (k = 0; k < isz && cp_end - cp >= 64; k++) {
+        for (v = 0; v < 4; v++) {
+            __m256i m = _mm256_and_si256(Rv[v], mask);
+            __m256i idx = _mm256_or_si256(_mm256_sll_epi32(Lv[v], sh), m);
+            __m256i e = _mm256_i32gather_epi32((const int *)sfb, idx, 4);
+            Lv[v] = _mm256_and_si256(e, m8);
+            Rv[v] = avx2_decode(Rv[v], e, shift);
+        }
+        for (v = 0; v < 4; v++)
+            Rv[v] = avx2_renorm(Rv[v], &cp);
+        avx2_store_syms(syms, Lv);
+        for (z = 0; z < 32; z++)
+            out[z*isz + k] = syms[z];
+    }
+
+    for (v = 0; v < 4; v++) {
+        _mm256_storeu_si256((__m256i *)(R + 8*v), Rv[v]);
+    }
+    if (k) {
+        for (z = 0; z < 32; z++)
+            last[z] = out[z*isz + k-1];
+    }
+    *cpp = cp;
+
+    return k;
+}
+
+/*-----------------------------------------------------------------------------
+ * AVX-512: 2 vectors of 16 states
+ */
+
+RANS_TARGET("avx512f")
+static inline __m512i avx512_decode(__m512i R, __m512i e, int shift) {
+    const __m512i m12 = _mm512_set1_epi32(0xfff);
+    __m512i f = _mm512_add_epi32(_mm512_and_si512(_mm512_srli_epi32(e, 8),
+                                                  m12),
+                                 _mm512_set1_epi32(1));
+    __m512i b = _mm512_srli_epi32(e, 20);
+    __m512i x = _mm512_srl_epi32(R, _mm_cvtsi32_si128(shift));
+    return _mm512_add_epi32(_mm512_mullo_epi32(f, x), b);
+}
+
+RANS_TARGET("avx512f")
+static inline __m512i avx512_renorm(__m512i R, uint8_t **cpp) {
+    __mmask16 lt = _mm512_cmplt_epu32_mask(R,
+                                           _mm512_set1_epi32(RANS_WORD_L));
+    __m512i w;
+
+    if (!lt)
+        return R;
+
+    // Expand places consecutive words into the lanes selected by lt
+    w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)*cpp));
+    w = _mm512_maskz_expand_epi32(lt, w);
+    *cpp += 2*(nbits[lt & 0xff] + nbits[lt >> 8]);
+
+    return _mm512_mask_or_epi32(R, lt, _mm512_slli_epi32(R, 16), w);
+}
+
+RANS_TARGET("avx512f")
+static uint32_t rans_dec32_O0_avx512(uint32_t *R, uint8_t **cpp,
+                                     uint8_t *cp_end, const uint32_t *sfb,
+                                     uint8_t *out, uint32_t out_sz) {
+    const __m512i mask = _mm512_set1_epi32(TOTFREQ-1);
+    uint8_t *cp = *cpp;
+    __m512i R0, R1;
+    uint32_t i;
+
+    R0 = _mm512_loadu_si512((void *)R);
+    R1 = _mm512_loadu_si512((void *)(R+16));
+
+    for (i = 0; i + 32 <= out_sz && cp_end - cp >= 64; i += 32) {
+        __m512i m0 = _mm512_and_si512(R0, mask);
+        __m512i m1 = _mm512_and_si512(R1, mask);
+        __m512i e0 = _mm512_i32gather_epi32(m0, (const void *)sfb, 4);
+        __m512i e1 = _mm512_i32gather_epi32(m1, (const void *)sfb, 4);
+
+        R0 = avx512_decode(R0, e0, TF_SHIFT);
+        R1 = avx512_decode(R1, e1, TF_SHIFT);
+        R0 = avx512_renorm(R0, &cp);
+        R1 = avx512_renorm(R1, &cp);
+
+        _mm_storeu_si128((__m128i *)(out+i),    _mm512_cvtepi32_epi8(e0));
+        _mm_storeu_si128((__m128i *)(out+i+16), _mm512_cvtepi32_epi8(e1));
+    }
+
+    _mm512_storeu_si512((void *)R, R0);
+    _mm512_storeu_si512((void *)(R+16), R1);
+    *cpp = cp;
+
+    return i;
+}
+
+RANS_TARGET("avx512f")
+static uint32_t rans_dec32_O1_avx512(uint32_t *R, uint8_t *last,
+                                     uint8_t **cpp, uint8_t *cp_end,
+                                     const uint32_t *sfb, int shift,
+                                     uint8_t *out, uint32_t isz) {
+    const __m512i mask = _mm512_set1_epi32((1<<shift)-1);
+    const __m512i m8 = _mm512_set1_epi32(0xff);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    uint8_t *cp = *cpp, syms[32];
+    __m512i R0, R1, L0, L1;
+    uint32_t k;
+    int z;
+
+    R0 = _mm512_loadu_si512((void *)R);
+    R1 = _mm512_loadu_si512((void *)(R+16));
+    L0 = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)last));
+    L1 = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)(last+16)));
+
+    for (k = 0; k < isz && cp_end - cp >= 64; k++) {
+        __m512i i0 = _mm512_or_si512(_mm512_sll_epi32(L0, sh),
+                                     _mm512_and_si512(R0, mask));
+        __m512i i1 = _mm512_or_si512(_mm512_sll_epi32(L1, sh),
+                                     _mm512_and_si512(R1, mask));
+        __m512i e0 = _mm512_i32gather_epi32(i0, (const void *)sfb, 4);
+        __m512i e1 = _mm512_i32gather_epi32(i1, (const void *)sfb, 4);
+
+        L0 = _mm512_and_si512(e0, m8);
+        L1 = _mm512_and_si512(e1, m8);
+        R0 = avx512_decode(R0, e0, shift);
+        R1 = avx512_decode(R1, e1, shift);
+        R0 = avx512_renorm(R0, &cp);
+        R1 = avx512_renorm(R1, &cp);
+
+        _mm_storeu_si128((__m128i *)syms,      _mm512_cvtepi32_epi8(L0));
+        _mm_storeu_si128((__m128i *)(syms+16), _mm512_cvtepi32_epi8(L1));
+        for (z = 0; z < 32; z++)
+            out[z*isz + k] = syms[z];
+    }
+
+    _mm512_storeu_si512((void *)R, R0);
+    _mm512_storeu_si512((void *)(R+16), R1);
+    if (k) {
+        for (z = 0; z < 32; z++)
+            last[z] = out[z*isz + k-1];
+    }
+    *cpp = cp;
+
+    return k;
+}
+
+/*-----------------------------------------------------------------------------
+ * SSE4.1: 8 vectors of 4 states.  Lacking a gather instruction, table
+ * lookups are done with scalar loads.
+ */
+
+RANS_TARGET("sse4.1")
+static inline __m128i sse4_decode(__m128i R, __m128i e, int shift) {
+    const __m128i m12 = _mm_set1_epi32(0xfff);
+    __m128i f = _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(e, 8), m12),
+                              _mm_set1_epi32(1));
+    __m128i b = _mm_srli_epi32(e, 20);
+    __m128i x = _mm_srl_epi32(R, _mm_cvtsi32_si128(shift));
+    return _mm_add_epi32(_mm_mullo_epi32(f, x), b);
+}
+
+RANS_TARGET("sse4.1")
+static inline __m128i sse4_renorm(__m128i R, uint8_t **cpp) {
+    __m128i lt = _mm_cmpgt_epi32(_mm_set1_epi32(RANS_WORD_L), R);
+    int msk = _mm_movemask_ps(_mm_castsi128_ps(lt));
+    __m128i w;
+
+    if (!msk)
+        return R;
+
+    w = _mm_loadl_epi64((__m128i *)*cpp);
+    w = _mm_shuffle_epi8(w, _mm_loadu_si128((__m128i *)shuf4[msk]));
+    *cpp += 2*nbits[msk];
+
+    return _mm_blendv_epi8(R, _mm_or_si128(_mm_slli_epi32(R, 16), w), lt);
+}
+
+RANS_TARGET("sse4.1")
+static inline __m128i sse4_gather(const uint32_t *sfb, __m128i idx) {
+    uint32_t i[4];
+    _mm_storeu_si128((__m128i *)i, idx);
+    return _mm_setr_epi32(sfb[i[0]], sfb[i[1]], sfb[i[2]], sfb[i[3]]);
+}
+
+/* Packs the low bytes of S[0..7] into 32 consecutive bytes */
+RANS_TARGET("sse4.1")
+static inline void sse4_store_syms(uint8_t *out, __m128i *S) {
+    const __m128i m8 = _mm_set1_epi32(0xff);
+    int v;
+    for (v = 0; v < 8; v += 4) {
+        __m128i p01 = _mm_packus_epi32(_mm_and_si128(S[v+0], m8),
+                                       _mm_and_si128(S[v+1], m8));
+        __m128i p23 = _mm_packus_epi32(_mm_and_si128(S[v+2], m8),
+                                       _mm_and_si128(S[v+3], m8));
+        _mm_storeu_si128((__m128i *)(out + v*4),
+                         _mm_packus_epi16(p01, p23));
+    }
+}
+
+RANS_TARGET("sse4.1")
+static uint32_t rans_dec32_O0_sse4(uint32_t *R, uint8_t **cpp,
+                                   uint8_t *cp_end, const uint32_t *sfb,
+                                   uint8_t *out, uint32_t out_sz) {
+    const __m128i mask = _mm_set1_epi32(TOTFREQ-1);
+    uint8_t *cp = *cpp;
+    __m128i Rv[8], E[8];
+    uint32_t i;
+    int v;
+
+    for (v = 0; v < 8; v++)
+        Rv[v] = _mm_loadu_si128((__m128i *)(R + 4*v));
+
+    for (i = 0; i + 32 <= out_sz && cp_end - cp >= 64; i += 32) {
+        for (v = 0; v < 8; v++) {
+            E[v] = sse4_gather(sfb, _mm_and_si128(Rv[v], mask));
+            Rv[v] = sse4_decode(Rv[v], E[v], TF_SHIFT);
+        }
+        for (v = 0; v < 8; v++)
+            Rv[v] = sse4_renorm(Rv[v], &cp);
+        sse4_store_syms(out + i, E);
+    }
+
+    for (v = 0; v < 8; v++)
+        _mm_storeu_si128((__m128i *)(R + 4*v), Rv[v]);
+    *cpp = cp;
+
+    return i;
+}
+
+RANS_TARGET("sse4.1")
+static uint32_t rans_dec32_O1_sse4(uint32_t *R, uint8_t *last,
+                                   uint8_t **cpp, uint8_t *cp_end,
+                                   const uint32_t *sfb, int shift,
+                                   uint8_t *out, uint32_t isz) {
+    const __m128i mask = _mm_set1_epi32((1<<shift)-1);
+    const __m128i m8 = _mm_set1_epi32(0xff);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    uint8_t *cp = *cpp, syms[32];
+    __m128i Rv[8], Lv[8];
+    uint32_t k;
+    int v, z;
+
+    for (v = 0; v < 8; v++) {
+        Rv[v] = _mm_loadu_si128((__m128i *)(R + 4*v));
+        Lv[v] = _mm_setr_epi32(last[4*v], last[4*v+1],
+                               last[4*v+2], last[4*v+3]);
+    }
+
+    for (k = 0; k < isz && cp_end - cp >= 64; k++) {
+        for (v = 0; v < 8; v++) {
+            __m128i idx = _mm_or_si128(_mm_sll_epi32(Lv[v], sh),
+                                       _mm_and_si128(Rv[v], mask));
+            __m128i e = sse4_gather(sfb, idx);
+            Lv[v] = _mm_and_si128(e, m8);
+            Rv[v] = sse4_decode(Rv[v], e, shift);
+        }
+        for (v = 0; v < 8; v++)
+            Rv[v] = sse4_renorm(Rv[v], &cp);
+        sse4_store_syms(syms, Lv);
+        for (z = 0; z < 32; z++)
+            out[z*isz + k] = syms[z];
+    }
+
+    for (v = 0; v < 8; v++)
+        _mm_storeu_si128((__m128i *)(R + 4*v), Rv[v]);
+    if (k) {
+        for (z = 0; z < 32; z++)
+            last[z] = out[z*isz + k-1];
+    }
+    *cpp = cp;
+
+    return k;
+}
+
+/*-----------------------------------------------------------------------------
+ * Selection
+ */
+
+static volatile int tables_done = 0;
+
+rans_dec32_O0_fn rans_dec32_O0_select(int cpu) {
+    if (!tables_done) {
+        // Idempotent, so a race merely duplicates the work
+        init_tables();
+        tables_done = 1;
+    }
+
+    if (cpu & RANS_CPU_AVX512)
+        return rans_dec32_O0_avx512;
+    if (cpu & RANS_CPU_AVX2)
+        return rans_dec32_O0_avx2;
+    if (cpu & RANS_CPU_SSE4)
+        return rans_dec32_O0_sse4;
+    return NULL;
+}
+
+rans_dec32_O1_fn rans_dec32_O1_select(int cpu) {
+    if (!tables_done) {
+        init_tables();
+        tables_done = 1;
+    }
+
+    if (cpu & RANS_CPU_AVX512)
+        return rans_dec32_O1_avx512;
+    if (cpu & RANS_CPU_AVX2)
+        return rans_dec32_O1_avx2;
+    if (cpu & RANS_CPU_SSE4)
+        return rans_dec32_O1_sse4;
+    return NULL;
+}
+
+#else /* RANS_SIMD */
+
+int rans_cpu_detect(void) {
+    return 0;
+}
+
+rans_dec32_O0_fn rans_dec32_O0_select(int cpu) {
+    return NULL;
+}
+
+rans_dec32_O1_fn rans_dec32_O1_select(int cpu) {
+    return NULL;
+}
+
+#endif /* RANS_SIMD */
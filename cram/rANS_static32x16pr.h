@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RANS_STATIC32x16PR_H
+#define RANS_STATIC32x16PR_H
+
+#include <stdint.h>
+
+/*
+ * SIMD decoders for the 32-way interleaved (RANS_ORDER_X32) variant of
+ * the rANS-Nx16 codec.  These are internal to rANS_static4x16pr.c, which
+ * parses the frequency tables and finishes any data left over by the
+ * vectorised loops with its scalar code.
+ */
+
+/*
+ * Decoder lookup table entry for a cumulative frequency slot: symbol in
+ * bits 0-7, frequency minus one in bits 8-19 and slot minus the symbol's
+ * start in bits 20-31.
+ */
+#define RANS_SLOT(sym, freq, bias) \
+    ((uint32_t)(sym) | ((uint32_t)(freq)-1) << 8 | (uint32_t)(bias) << 20)
+
+/*
+ * Decodes whole groups of 32 symbols with order-0 frequencies, using the
+ * 4096 entry table sfb.  R holds the 32 states and *cp the input, both of
+ * which are updated.  Stops early when fewer than 64 bytes of input
+ * remain.  Returns the number of symbols decoded.
+ */
+typedef uint32_t (*rans_dec32_O0_fn)(uint32_t *R, uint8_t **cp,
+                                     uint8_t *cp_end, const uint32_t *sfb,
+                                     uint8_t *out, uint32_t out_sz);
+
+/*
+ * As above for order-1, with 'last' holding each state's context and sfb
+ * indexed by (context << shift) + slot.  Decodes symbol k of each of the
+ * 32 segments of length isz in turn, returning the number of k values
+ * completed.
+ */
+typedef uint32_t (*rans_dec32_O1_fn)(uint32_t *R, uint8_t *last,
+                                     uint8_t **cp, uint8_t *cp_end,
+                                     const uint32_t *sfb, int shift,
+                                     uint8_t *out, uint32_t isz);
+
+/*
+ * Returns the best available decoders permitted by the RANS_CPU_* bits
+ * in 'cpu', or NULL when only the scalar code is usable.
+ */
+rans_dec32_O0_fn rans_dec32_O0_select(int cpu);
+rans_dec32_O1_fn rans_dec32_O1_select(int cpu);
+
+/* Returns the RANS_CPU_* features supported by this CPU */
+int rans_cpu_detect(void);
+
+#endif /* RANS_STATIC32x16PR_H */
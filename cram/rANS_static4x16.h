@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RANS_STATIC4x16_H
+#define RANS_STATIC4x16_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The CRAM 3.1 rANS-Nx16 codec.
+ *
+ * This is an evolution of the rANS 4x8 codec in rANS_static.h, using
+ * 16-bit renormalisation, a choice of 4 or 32 interleaved states and a
+ * set of optional data transforms selected via the order flags below.
+ * The bottom bit of order selects order-0 or order-1 entropy encoding.
+ */
+#define RANS_ORDER_X32    0x04 // 32 interleaved states instead of 4
+#define RANS_ORDER_STRIPE 0x08 // Split into 4 byte-interleaved streams
+#define RANS_ORDER_NOSZ   0x10 // Don't store the uncompressed size
+#define RANS_ORDER_CAT    0x20 // No entropy encoding; data copied verbatim
+#define RANS_ORDER_RLE    0x40 // Run length encode before entropy encoding
+#define RANS_ORDER_PACK   0x80 // Bit-pack small alphabets (<= 16 symbols)
+
+/* Returns the maximum compressed size for in_size bytes with 'order' */
+unsigned int rans_compress_bound_4x16(unsigned int in_size, int order);
+
+/*
+ * Compresses in_size bytes of 'in'.  If 'out' is NULL a buffer is
+ * allocated, otherwise *out_size must hold the capacity of 'out' (see
+ * rans_compress_bound_4x16).  On success *out_size is set to the
+ * compressed size.
+ *
+ * Returns the output buffer on success, NULL on failure.
+ */
+unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
+                                     unsigned char *out, unsigned int *out_size,
+                                     int order);
+unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
+                                  unsigned int *out_size, int order);
+
+/*
+ * Uncompresses in_size bytes of 'in'.  If 'out' is non-NULL, *out_size
+ * holds its capacity.  Streams encoded with RANS_ORDER_NOSZ require
+ * *out_size to be the exact uncompressed size.  On success *out_size is
+ * set to the uncompressed size.
+ *
+ * Returns the output buffer on success, NULL on failure.
+ */
+unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
+                                       unsigned char *out, unsigned int *out_size);
+unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
+                                    unsigned int *out_size);
+
+/*
+ * RANS_ORDER_X32 streams are decoded with SIMD code when the CPU supports
+ * it, chosen at run time.  rans_set_cpu restricts this to the features in
+ * 'mask', with 0 forcing the scalar decoder.  It is intended for testing
+ * and benchmarking and is not thread safe.
+ */
+#define RANS_CPU_SSE4   0x01
+#define RANS_CPU_AVX2   0x02
+#define RANS_CPU_AVX512 0x04
+void rans_set_cpu(int mask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RANS_STATIC4x16_H */
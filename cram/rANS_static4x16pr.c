@@ -0,0 +1,1062 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The CRAM 3.1 rANS-Nx16 codec; see rANS_static4x16.h.
+ *
+ * This was written for htslib from the CRAM 3.1 specification, with the
+ * entropy coder core taken from rANS_word.h.  It does not share code with
+ * the htscodecs library and has not yet been checked against streams that
+ * it produces, which is why CRAM_EXPERIMENTAL_V31_CODECS gates its use.
+ *
+ * Stream layout:
+ *
+ *   flags byte (the order value with unused transforms cleared)
+ *   uncompressed size as uint7, unless RANS_ORDER_NOSZ
+ *
+ *   RANS_ORDER_STRIPE:
+ *       byte N, N compressed sizes as uint7 and then N sub-streams, each a
+ *       complete rANS-Nx16 stream in its own right.  Sub-stream i holds
+ *       bytes i, i+N, i+2N, ... of the input.
+ *
+ *   RANS_ORDER_PACK:
+ *       symbol map (see pack.h) and packed length as uint7.
+ *
+ *   RANS_ORDER_RLE:
+ *       uint7 (meta-data length * 2 + uncompressed flag), uint7 literal
+ *       length, then either the raw meta-data or a uint7 compressed size
+ *       followed by an order-0 4-way encoding of it.  See rle.h.
+ *
+ *   The remaining data (after PACK and RLE transforms) is then stored
+ *   verbatim (RANS_ORDER_CAT) or as an order-0 / order-1 rANS stream with
+ *   4 or 32 interleaved states.
+ *
+ * Order-0 streams hold the symbol alphabet, frequencies as uint7 summing
+ * to 4096, the initial states (4 bytes each) and then the 16-bit
+ * renormalisation words.  Symbol i is coded using state i % N.
+ *
+ * Order-1 streams start with a byte holding the frequency precision
+ * (10 or 12 bits) in the top nibble and a bit flagging whether the
+ * frequency table is itself order-0 compressed.  The table holds the
+ * context alphabet and then a row of uint7 frequencies per context, with
+ * a run-length byte following each zero frequency.  The input is split
+ * into N contiguous segments, one per state, with the last state also
+ * taking any remainder.  Each segment starts with a context of 0.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "rANS_static4x16.h"
+#include "rANS_static32x16pr.h"
+#include "rANS_word.h"
+#include "varint.h"
+#include "pack.h"
+#include "rle.h"
+
+#define TF_SHIFT 12
+#define TOTFREQ (1<<TF_SHIFT)
+
+// Order-1 frequency precision; lower for small inputs to shrink tables
+#define TF_SHIFT_O1 12
+#define TF_SHIFT_O1_SMALL 10
+#define O1_SMALL_SIZE 100000
+
+#define NSTRIPE 4
+
+/*-----------------------------------------------------------------------------
+ * SIMD decoder selection
+ */
+
+// RANS_CPU_* features in use, or -1 before detection.  Detection is
+// idempotent so racing threads merely repeat it.
+static volatile int rans_cpu = -1;
+
+static int rans_get_cpu(void) {
+    if (rans_cpu < 0)
+        rans_cpu = rans_cpu_detect();
+    return rans_cpu;
+}
+
+void rans_set_cpu(int mask) {
+    rans_cpu = rans_cpu_detect() & mask;
+}
+
+/*-----------------------------------------------------------------------------
+ * Frequency table handling
+ */
+
+/*
+ * Normalises F[0..255], which sums to 'size', so that it sums to exactly
+ * 1<<bits while keeping every non-zero entry non-zero.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int normalise_freq(uint32_t *F, uint32_t size, uint32_t bits) {
+    uint32_t F0[256], tot = 1u << bits;
+    uint64_t tr;
+    int j, M, loop;
+
+    if (!size)
+        return 0;
+    memcpy(F0, F, sizeof(F0));
+
+    tr = ((uint64_t)tot << 31) / size + (1u << 30) / size;
+    for (loop = 0; loop < 1000; loop++) {
+        int64_t fsum = 0, diff;
+        for (M = j = 0; j < 256; j++) {
+            if (!F0[j]) {
+                F[j] = 0;
+                continue;
+            }
+            if (F0[M] < F0[j])
+                M = j;
+            if ((F[j] = (F0[j] * tr) >> 31) == 0)
+                F[j] = 1;
+            fsum += F[j];
+        }
+
+        // Correct rounding errors by adjusting the most frequent symbol,
+        // provided this doesn't distort it too much.
+        diff = (int64_t)tot - fsum;
+        if (diff >= 0 || -diff < F[M] / 2) {
+            F[M] += diff;
+            return 0;
+        }
+        tr = tr * 0.95;
+    }
+
+    return -1;
+}
+
+/*
+ * Writes the set of symbols with non-zero F[] to cp.  Runs of
+ * consecutive symbols are written as the first symbol followed by a
+ * count of the remaining ones.  Terminated by a zero byte.
+ */
+static uint8_t *encode_alphabet(uint8_t *cp, uint32_t *F) {
+    int rle = 0, j;
+
+    for (j = 0; j < 256; j++) {
+        if (!F[j])
+            continue;
+        if (rle) {
+            rle--;
+            continue;
+        }
+        *cp++ = j;
+        if (j && F[j-1]) {
+            for (rle = j+1; rle < 256 && F[rle]; rle++)
+                ;
+            rle -= j+1;
+            *cp++ = rle;
+        }
+    }
+    *cp++ = 0;
+
+    return cp;
+}
+
+/* Reverses encode_alphabet.  Returns bytes consumed, or 0 on error. */
+static int decode_alphabet(uint8_t *cp, uint8_t *cp_end, uint8_t *A) {
+    uint8_t *op = cp;
+    int rle = 0, j;
+
+    memset(A, 0, 256);
+    if (cp >= cp_end)
+        return 0;
+
+    j = *cp++;
+    do {
+        A[j] = 1;
+        if (!rle && j+1 < 256 && cp < cp_end && *cp == j+1) {
+            if (cp_end - cp < 2)
+                return 0;
+            j = *cp++;
+            rle = *cp++;
+        } else if (rle) {
+            rle--;
+            j++;
+            if (j > 255)
+                return 0;
+        } else {
+            if (cp >= cp_end)
+                return 0;
+            j = *cp++;
+        }
+    } while (j);
+
+    return cp - op;
+}
+
+/*-----------------------------------------------------------------------------
+ * Order-0 codec
+ */
+
+static unsigned char *rans_compress_O0_4x16(int N, unsigned char *in,
+                                            unsigned int in_size,
+                                            unsigned char *out,
+                                            unsigned int *out_size) {
+    uint8_t *cp = out, *ptr, *out_end = out + *out_size;
+    uint32_t F[256] = {0}, i, x;
+    RansEncSymbol syms[256];
+    RansState R[32];
+    int j, z;
+
+    for (i = 0; i < in_size; i++)
+        F[in[i]]++;
+    if (normalise_freq(F, in_size, TF_SHIFT) < 0)
+        return NULL;
+
+    cp = encode_alphabet(cp, F);
+    for (x = j = 0; j < 256; j++) {
+        if (!F[j])
+            continue;
+        cp += var_put_u32(cp, F[j]);
+        RansEncSymbolInit(&syms[j], x, F[j], TF_SHIFT);
+        x += F[j];
+    }
+
+    for (z = 0; z < N; z++)
+        RansEncInit(&R[z]);
+
+    // Worst case is 2 bytes per symbol plus the states; check once here
+    // rather than in the inner loop.
+    ptr = out_end;
+    if ((uint64_t)(out_end - cp) < 2*(uint64_t)in_size + 4*N)
+        return NULL;
+
+    // Symbol i uses state i%N; peel off the partial final group first.
+    for (i = in_size; i % N; ) {
+        i--;
+        RansEncPutSymbol(&R[i % N], &ptr, &syms[in[i]]);
+    }
+    while (i) {
+        i -= N;
+        for (z = N-1; z >= 0; z--)
+            RansEncPutSymbol(&R[z], &ptr, &syms[in[i+z]]);
+    }
+
+    for (z = N-1; z >= 0; z--)
+        RansEncFlush(&R[z], &ptr);
+
+    memmove(cp, ptr, out_end - ptr);
+    *out_size = (cp - out) + (out_end - ptr);
+    return out;
+}
+
+static unsigned char *rans_uncompress_O0_4x16(int N, unsigned char *in,
+                                              unsigned int in_size,
+                                              unsigned char *out,
+                                              unsigned int out_sz) {
+    uint8_t *cp = in, *cp_end = in + in_size;
+    uint32_t F[256] = {0}, C[256], x, i, *sfb = NULL;
+    uint8_t A[256], *ssym = NULL;
+    RansState R[32];
+    rans_dec32_O0_fn dec32;
+    int j, n, z;
+
+    if (!(n = decode_alphabet(cp, cp_end, A)))
+        return NULL;
+    cp += n;
+
+    for (x = j = 0; j < 256; j++) {
+        if (!A[j])
+            continue;
+        if (!(n = var_get_u32(cp, cp_end, &F[j])) || F[j] > TOTFREQ)
+            return NULL;
+        cp += n;
+        C[j] = x;
+        x += F[j];
+    }
+    if (x != TOTFREQ)
+        return NULL;
+
+    if (!(ssym = malloc(TOTFREQ)))
+        return NULL;
+    for (j = 0; j < 256; j++)
+        if (F[j])
+            memset(ssym + C[j], j, F[j]);
+
+    if (cp_end - cp < 4*N)
+        goto err;
+    for (z = 0; z < N; z++)
+        RansDecInit(&R[z], &cp);
+
+    i = 0;
+    if (N == 32 && (dec32 = rans_dec32_O0_select(rans_get_cpu()))) {
+        if (!(sfb = malloc(TOTFREQ * sizeof(*sfb))))
+            goto err;
+        for (x = 0; x < TOTFREQ; x++)
+            sfb[x] = RANS_SLOT(ssym[x], F[ssym[x]], x - C[ssym[x]]);
+        i = dec32(R, &cp, cp_end, sfb, out, out_sz);
+    }
+
+    // Scalar decoding of everything the SIMD code left
+    for (; i < out_sz; i += N) {
+        int zn = out_sz - i < N ? out_sz - i : N;
+        for (z = 0; z < zn; z++) {
+            uint32_t m = R[z] & (TOTFREQ-1);
+            uint8_t s = ssym[m];
+            out[i+z] = s;
+            R[z] = F[s] * (R[z] >> TF_SHIFT) + m - C[s];
+            if (RansDecRenormSafe(&R[z], &cp, cp_end) < 0)
+                goto err;
+        }
+    }
+
+    free(ssym);
+    free(sfb);
+    return out;
+
+ err:
+    free(ssym);
+    free(sfb);
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Order-1 codec
+ */
+
+// Bytes needed for the uncompressed order-1 frequency table
+#define O1_TABLE_MAX (257*257*3 + 512)
+
+static unsigned char *rans_compress_O1_4x16(int N, unsigned char *in,
+                                            unsigned int in_size,
+                                            unsigned char *out,
+                                            unsigned int *out_size) {
+    uint8_t *cp = out, *ptr, *out_end = out + *out_size;
+    uint8_t *tab = NULL, *ctab = NULL, *tp;
+    uint32_t (*F)[256] = NULL, T[256] = {0}, A[256] = {0}, i, k, isz;
+    RansEncSymbol (*syms)[256] = NULL;
+    RansState R[32];
+    unsigned int ctab_len;
+    int j, z, shift;
+    unsigned char *ret = NULL;
+
+    shift = in_size < O1_SMALL_SIZE ? TF_SHIFT_O1_SMALL : TF_SHIFT_O1;
+    isz = in_size / N;
+
+    F = calloc(256, sizeof(*F));
+    syms = malloc(256 * sizeof(*syms));
+    tab = malloc(O1_TABLE_MAX);
+    if (!F || !syms || !tab)
+        goto err;
+
+    // Gather statistics using exactly the contexts used during encoding
+    for (z = 0; z < N; z++) {
+        uint32_t end = z == N-1 ? in_size : (z+1)*isz;
+        uint8_t last = 0;
+        for (i = z*isz; i < end; i++) {
+            F[last][in[i]]++;
+            T[last]++;
+            last = in[i];
+        }
+    }
+
+    // Alphabet of contexts and symbols; 0 is always a context
+    A[0] = 1;
+    for (j = 0; j < 256; j++)
+        for (z = 0; z < 256; z++)
+            if (F[j][z])
+                A[j] = A[z] = 1;
+
+    tp = encode_alphabet(tab, A);
+    for (j = 0; j < 256; j++) {
+        uint32_t x;
+        int run = 0;
+
+        if (!A[j])
+            continue;
+        if (T[j] && normalise_freq(F[j], T[j], shift) < 0)
+            goto err;
+
+        for (z = 0; z < 256; z++) {
+            if (!A[z])
+                continue;
+            if (run) {
+                run--;
+                continue;
+            }
+            tp += var_put_u32(tp, F[j][z]);
+            if (!F[j][z]) {
+                int k2;
+                for (k2 = z+1; k2 < 256 && run < 255; k2++) {
+                    if (!A[k2])
+                        continue;
+                    if (F[j][k2])
+                        break;
+                    run++;
+                }
+                *tp++ = run;
+            }
+        }
+
+        for (x = z = 0; z < 256; z++) {
+            if (!F[j][z])
+                continue;
+            RansEncSymbolInit(&syms[j][z], x, F[j][z], shift);
+            x += F[j][z];
+        }
+    }
+
+    // Store the table, compressing it when that helps
+    ctab_len = (tp - tab) * 2 + 1024;
+    if (!(ctab = malloc(ctab_len)))
+        goto err;
+    if (tp - tab > 64 &&
+        rans_compress_O0_4x16(4, tab, tp - tab, ctab, &ctab_len) &&
+        ctab_len < tp - tab) {
+        *cp++ = (shift << 4) | 1;
+        cp += var_put_u32(cp, tp - tab);
+        cp += var_put_u32(cp, ctab_len);
+        memcpy(cp, ctab, ctab_len);
+        cp += ctab_len;
+    } else {
+        *cp++ = shift << 4;
+        memcpy(cp, tab, tp - tab);
+        cp += tp - tab;
+    }
+
+    for (z = 0; z < N; z++)
+        RansEncInit(&R[z]);
+
+    ptr = out_end;
+    if (cp > out_end ||
+        (uint64_t)(out_end - cp) < 2*(uint64_t)in_size + 4*N)
+        goto err;
+
+    // The remainder beyond N*isz belongs to the last segment
+    for (i = in_size; i-- > N*isz; ) {
+        uint8_t ctx = i == (N-1)*isz ? 0 : in[i-1];
+        RansEncPutSymbol(&R[N-1], &ptr, &syms[ctx][in[i]]);
+    }
+
+    for (k = isz; k-- > 0; ) {
+        for (z = N-1; z >= 0; z--) {
+            uint32_t idx = z*isz + k;
+            uint8_t ctx = k ? in[idx-1] : 0;
+            RansEncPutSymbol(&R[z], &ptr, &syms[ctx][in[idx]]);
+        }
+    }
+
+    for (z = N-1; z >= 0; z--)
+        RansEncFlush(&R[z], &ptr);
+
+    memmove(cp, ptr, out_end - ptr);
+    *out_size = (cp - out) + (out_end - ptr);
+    ret = out;
+
+ err:
+    free(F);
+    free(syms);
+    free(tab);
+    free(ctab);
+    return ret;
+}
+
+typedef struct {
+    uint16_t F[256];
+    uint16_t C[256];
+} o1_row;
+
+static unsigned char *rans_uncompress_O1_4x16(int N, unsigned char *in,
+                                              unsigned int in_size,
+                                              unsigned char *out,
+                                              unsigned int out_sz) {
+    uint8_t *cp = in, *cp_end = in + in_size, *tab = NULL, *tp, *tp_end;
+    uint8_t A[256], *ssym = NULL, *row_sym[256], last[32];
+    o1_row *rows = NULL, *row_ptr[256];
+    uint32_t i, k, isz, tot, *sfb = NULL;
+    RansState R[32];
+    rans_dec32_O1_fn dec32;
+    int j, z, n, shift, nrows = 0;
+    unsigned char *ret = NULL;
+
+    if (cp >= cp_end)
+        return NULL;
+    shift = *cp >> 4;
+    if (shift != TF_SHIFT_O1 && shift != TF_SHIFT_O1_SMALL)
+        return NULL;
+    tot = 1u << shift;
+
+    if (*cp++ & 1) {
+        uint32_t ulen, clen;
+        if (!(n = var_get_u32(cp, cp_end, &ulen)))
+            return NULL;
+        cp += n;
+        if (!(n = var_get_u32(cp, cp_end, &clen)))
+            return NULL;
+        cp += n;
+        if (clen > cp_end - cp || ulen > O1_TABLE_MAX)
+            return NULL;
+        if (!(tab = malloc(ulen)))
+            return NULL;
+        if (!rans_uncompress_O0_4x16(4, cp, clen, tab, ulen))
+            goto err;
+        cp += clen;
+        tp = tab;
+        tp_end = tab + ulen;
+    } else {
+        tp = cp;
+        tp_end = cp_end;
+    }
+
+    if (!(n = decode_alphabet(tp, tp_end, A)))
+        goto err;
+    tp += n;
+
+    for (j = 0; j < 256; j++)
+        nrows += A[j];
+
+    // One extra row serves any context without data, to keep corrupt
+    // input from indexing unallocated memory.
+    rows = calloc(nrows+1, sizeof(*rows));
+    ssym = calloc((size_t)(nrows+1), tot);
+    if (!rows || !ssym)
+        goto err;
+    for (j = 0; j < 256; j++) {
+        row_ptr[j] = &rows[nrows];
+        row_sym[j] = ssym + (size_t)nrows * tot;
+    }
+
+    for (n = j = 0; j < 256; j++) {
+        o1_row *r;
+        uint32_t x;
+        int run = 0;
+
+        if (!A[j])
+            continue;
+        r = &rows[n];
+
+        for (z = 0; z < 256; z++) {
+            uint32_t f;
+            int m;
+            if (!A[z])
+                continue;
+            if (run) {
+                run--;
+                continue;
+            }
+            if (!(m = var_get_u32(tp, tp_end, &f)) || f > tot)
+                goto err;
+            tp += m;
+            r->F[z] = f;
+            if (!f) {
+                if (tp >= tp_end)
+                    goto err;
+                run = *tp++;
+            }
+        }
+
+        for (x = z = 0; z < 256; z++) {
+            r->C[z] = x;
+            x += r->F[z];
+        }
+        if (x) {
+            uint8_t *s = ssym + (size_t)n * tot;
+            if (x != tot)
+                goto err;
+            for (z = 0; z < 256; z++)
+                if (r->F[z])
+                    memset(s + r->C[z], z, r->F[z]);
+            row_ptr[j] = r;
+            row_sym[j] = s;
+        }
+        n++;
+    }
+
+    if (!tab)
+        cp = tp;
+
+    if (cp_end - cp < 4*N)
+        goto err;
+    for (z = 0; z < N; z++) {
+        RansDecInit(&R[z], &cp);
+        last[z] = 0;
+    }
+
+    isz = out_sz / N;
+    k = 0;
+    if (N == 32 && (dec32 = rans_dec32_O1_select(rans_get_cpu()))) {
+        // Flat table indexed by context and slot.  Contexts without data
+        // keep zero entries, which decode harmlessly if the data is corrupt.
+        if (!(sfb = calloc((size_t)256 << shift, sizeof(*sfb))))
+            goto err;
+        for (j = 0; j < 256; j++) {
+            uint32_t *t = sfb + ((size_t)j << shift);
+            o1_row *r = row_ptr[j];
+            if (r == &rows[nrows])
+                continue;
+            for (i = 0; i < tot; i++) {
+                uint8_t s = row_sym[j][i];
+                t[i] = RANS_SLOT(s, r->F[s], i - r->C[s]);
+            }
+        }
+        k = dec32(R, last, &cp, cp_end, sfb, shift, out, isz);
+    }
+
+    // Scalar decoding of everything the SIMD code left
+    for (; k < isz; k++) {
+        for (z = 0; z < N; z++) {
+            uint32_t m = R[z] & (tot-1);
+            uint8_t s = row_sym[last[z]][m];
+            o1_row *r = row_ptr[last[z]];
+            out[z*isz + k] = s;
+            R[z] = r->F[s] * (R[z] >> shift) + m - r->C[s];
+            if (RansDecRenormSafe(&R[z], &cp, cp_end) < 0)
+                goto err;
+            last[z] = s;
+        }
+    }
+
+    for (i = N*isz; i < out_sz; i++) {
+        uint32_t m = R[N-1] & (tot-1);
+        uint8_t s = row_sym[last[N-1]][m];
+        o1_row *r = row_ptr[last[N-1]];
+        out[i] = s;
+        R[N-1] = r->F[s] * (R[N-1] >> shift) + m - r->C[s];
+        if (RansDecRenormSafe(&R[N-1], &cp, cp_end) < 0)
+            goto err;
+        last[N-1] = s;
+    }
+
+    ret = out;
+
+ err:
+    free(tab);
+    free(rows);
+    free(ssym);
+    free(sfb);
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * Top level encoder and decoder, handling the data transforms.
+ */
+
+unsigned int rans_compress_bound_4x16(unsigned int in_size, int order) {
+    uint64_t sz;
+
+    if (order & RANS_ORDER_STRIPE) {
+        int o2 = (order & ~RANS_ORDER_STRIPE) | RANS_ORDER_NOSZ;
+        sz = 1 + 5 + 1 + NSTRIPE * (5 + (uint64_t)
+             rans_compress_bound_4x16(in_size / NSTRIPE + 1, o2));
+    } else {
+        // Transform meta-data, order-1 table and states, plus headroom
+        // for the encoder's 2 bytes per symbol worst-case check.
+        sz = 2 * (uint64_t)in_size + O1_TABLE_MAX + 1024
+            + 4 * 32 + 64;
+    }
+
+    return sz > UINT_MAX ? UINT_MAX : sz;
+}
+
+static unsigned char *rans_compress_stripe(unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size,
+                                           int order) {
+    unsigned char *sub[NSTRIPE] = {NULL}, *part = NULL, *cp = out, *ret = NULL;
+    unsigned int sub_len[NSTRIPE];
+    int o2 = (order & ~RANS_ORDER_STRIPE) | RANS_ORDER_NOSZ, z;
+    uint64_t need;
+
+    if (!(part = malloc(in_size / NSTRIPE + 1)))
+        return NULL;
+
+    for (z = 0; z < NSTRIPE; z++) {
+        unsigned int ulen = in_size / NSTRIPE + (z < in_size % NSTRIPE), i;
+        for (i = 0; i < ulen; i++)
+            part[i] = in[i*NSTRIPE + z];
+        if (!(sub[z] = rans_compress_4x16(part, ulen, &sub_len[z], o2)))
+            goto err;
+    }
+
+    need = 1 + 5 + 1 + NSTRIPE*5;
+    for (z = 0; z < NSTRIPE; z++)
+        need += sub_len[z];
+    if (need > *out_size)
+        goto err;
+
+    *cp++ = RANS_ORDER_STRIPE | (order & RANS_ORDER_NOSZ);
+    if (!(order & RANS_ORDER_NOSZ))
+        cp += var_put_u32(cp, in_size);
+    *cp++ = NSTRIPE;
+    for (z = 0; z < NSTRIPE; z++)
+        cp += var_put_u32(cp, sub_len[z]);
+    for (z = 0; z < NSTRIPE; z++) {
+        memcpy(cp, sub[z], sub_len[z]);
+        cp += sub_len[z];
+    }
+
+    *out_size = cp - out;
+    ret = out;
+
+ err:
+    for (z = 0; z < NSTRIPE; z++)
+        free(sub[z]);
+    free(part);
+    return ret;
+}
+
+unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
+                                     unsigned char *out, unsigned int *out_size,
+                                     int order) {
+    unsigned char *packed = NULL, *lit = NULL, *meta = NULL, *cmeta = NULL;
+    unsigned char *out_free = NULL, *cp, *out_end, *data = in;
+    unsigned int data_len = in_size, c_size;
+    int N = (order & RANS_ORDER_X32) ? 32 : 4;
+    int flags = order & (RANS_ORDER_X32 | RANS_ORDER_NOSZ | 1);
+    int hdr;
+
+    if (!out) {
+        *out_size = rans_compress_bound_4x16(in_size, order);
+        if (!(out = out_free = malloc(*out_size)))
+            return NULL;
+    }
+    out_end = out + *out_size;
+
+    if ((order & RANS_ORDER_STRIPE) && in_size >= NSTRIPE) {
+        unsigned int osz = *out_size;
+        if (rans_compress_stripe(in, in_size, out, &osz, order) &&
+            osz <= in_size + 6) {
+            *out_size = osz;
+            return out;
+        }
+        goto cat;
+    }
+
+    if (*out_size < 6 + 17 + 5 + 10)
+        goto fail;
+
+    cp = out + 1;
+    if (!(order & RANS_ORDER_NOSZ))
+        cp += var_put_u32(cp, in_size);
+    hdr = cp - out;
+
+    if (in_size == 0)
+        goto cat;
+
+    if (order & RANS_ORDER_PACK) {
+        uint8_t pmeta[17];
+        int pmeta_len;
+        uint32_t plen;
+        if ((packed = hts_pack(in, in_size, pmeta, &pmeta_len, &plen))) {
+            memcpy(cp, pmeta, pmeta_len);
+            cp += pmeta_len;
+            cp += var_put_u32(cp, plen);
+            data = packed;
+            data_len = plen;
+            flags |= RANS_ORDER_PACK;
+        }
+    }
+
+    if ((order & RANS_ORDER_RLE) && data_len) {
+        uint32_t lit_len, meta_len;
+        unsigned int cmeta_len;
+
+        lit = malloc(data_len);
+        meta = malloc(RLE_META_BOUND(data_len));
+        if (!lit || !meta)
+            goto fail;
+
+        if (rle_encode(data, data_len, lit, &lit_len, meta, &meta_len) == 0) {
+            cmeta_len = rans_compress_bound_4x16(meta_len, 0);
+            if (!(cmeta = malloc(cmeta_len)))
+                goto fail;
+            if (!rans_compress_O0_4x16(4, meta, meta_len, cmeta, &cmeta_len)
+                || cmeta_len >= meta_len)
+                cmeta_len = 0;
+
+            if ((uint64_t)(out_end - cp) < 15 + (cmeta_len ? cmeta_len
+                                                             : meta_len))
+                goto cat;
+
+            cp += var_put_u32(cp, meta_len*2 + !cmeta_len);
+            cp += var_put_u32(cp, lit_len);
+            if (cmeta_len) {
+                cp += var_put_u32(cp, cmeta_len);
+                memcpy(cp, cmeta, cmeta_len);
+                cp += cmeta_len;
+            } else {
+                memcpy(cp, meta, meta_len);
+                cp += meta_len;
+            }
+            data = lit;
+            data_len = lit_len;
+            flags |= RANS_ORDER_RLE;
+        }
+    }
+
+    if (order & RANS_ORDER_CAT) {
+        if ((uint64_t)(out_end - cp) < data_len)
+            goto cat;
+        memcpy(cp, data, data_len);
+        cp += data_len;
+        flags |= RANS_ORDER_CAT;
+    } else if (data_len) {
+        c_size = out_end - cp;
+        if (!((order & 1)
+              ? rans_compress_O1_4x16(N, data, data_len, cp, &c_size)
+              : rans_compress_O0_4x16(N, data, data_len, cp, &c_size)))
+            goto cat;
+        if (c_size >= data_len) {
+            // Keep the transforms but skip the entropy encoding
+            memcpy(cp, data, data_len);
+            c_size = data_len;
+            flags |= RANS_ORDER_CAT;
+        }
+        cp += c_size;
+    } else {
+        // Everything was described by the transform meta-data
+        flags |= RANS_ORDER_CAT;
+    }
+
+    // Store uncompressed if the entropy encoding didn't help
+    if (cp - out > in_size + hdr)
+        goto cat;
+
+    out[0] = flags;
+    *out_size = cp - out;
+    goto done;
+
+ cat:
+    if (*out_size < in_size + 6)
+        goto fail;
+    cp = out;
+    *cp++ = RANS_ORDER_CAT | (order & RANS_ORDER_NOSZ);
+    if (!(order & RANS_ORDER_NOSZ))
+        cp += var_put_u32(cp, in_size);
+    memcpy(cp, in, in_size);
+    *out_size = cp - out + in_size;
+
+ done:
+    free(packed);
+    free(lit);
+    free(meta);
+    free(cmeta);
+    return out;
+
+ fail:
+    free(packed);
+    free(lit);
+    free(meta);
+    free(cmeta);
+    free(out_free);
+    return NULL;
+}
+
+unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
+                                  unsigned int *out_size, int order) {
+    return rans_compress_to_4x16(in, in_size, NULL, out_size, order);
+}
+
+static unsigned char *rans_uncompress_stripe(unsigned char *cp,
+                                             unsigned char *cp_end,
+                                             unsigned char *out,
+                                             unsigned int out_sz) {
+    uint32_t clen[256];
+    unsigned char *part = NULL;
+    int N, z, n;
+
+    if (cp >= cp_end || (N = *cp++) == 0)
+        return NULL;
+    for (z = 0; z < N; z++) {
+        if (!(n = var_get_u32(cp, cp_end, &clen[z])))
+            return NULL;
+        cp += n;
+    }
+
+    if (!(part = malloc(out_sz / N + 1)))
+        return NULL;
+
+    for (z = 0; z < N; z++) {
+        unsigned int ulen = out_sz / N + (z < out_sz % N), i;
+        if (clen[z] > cp_end - cp ||
+            !rans_uncompress_to_4x16(cp, clen[z], part, &ulen) ||
+            ulen != out_sz / N + (z < out_sz % N))
+            goto err;
+        for (i = 0; i < ulen; i++)
+            out[i*N + z] = part[i];
+        cp += clen[z];
+    }
+
+    free(part);
+    return out;
+
+ err:
+    free(part);
+    return NULL;
+}
+
+unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
+                                       unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp = in, *cp_end = in + in_size, *out_free = NULL;
+    unsigned char *packed = NULL, *lit = NULL, *meta = NULL, *data;
+    uint32_t usize, data_len, plen = 0, lit_len = 0, meta_len = 0;
+    uint8_t map[16];
+    int order, N, nsym = 0, n;
+
+    if (in_size < 1)
+        return NULL;
+    order = *cp++;
+    N = (order & RANS_ORDER_X32) ? 32 : 4;
+
+    if (order & RANS_ORDER_NOSZ) {
+        usize = *out_size;
+    } else {
+        if (!(n = var_get_u32(cp, cp_end, &usize)))
+            return NULL;
+        cp += n;
+    }
+
+    if (out) {
+        if (usize > *out_size)
+            return NULL;
+    } else {
+        if (!(out = out_free = malloc(usize ? usize : 1)))
+            return NULL;
+    }
+
+    if (order & RANS_ORDER_STRIPE) {
+        if (!rans_uncompress_stripe(cp, cp_end, out, usize))
+            goto err;
+        *out_size = usize;
+        return out;
+    }
+
+    data_len = usize;
+    if (order & RANS_ORDER_PACK) {
+        if (!(n = hts_unpack_meta(cp, cp_end - cp, map, &nsym)))
+            goto err;
+        cp += n;
+        if (!(n = var_get_u32(cp, cp_end, &plen)))
+            goto err;
+        cp += n;
+        if (plen != hts_packed_len(usize, nsym))
+            goto err;
+        data_len = plen;
+    }
+
+    if (order & RANS_ORDER_RLE) {
+        uint32_t mw, clen;
+        if (!(n = var_get_u32(cp, cp_end, &mw)))
+            goto err;
+        cp += n;
+        if (!(n = var_get_u32(cp, cp_end, &lit_len)))
+            goto err;
+        cp += n;
+        meta_len = mw >> 1;
+        if (lit_len > data_len || meta_len > RLE_META_BOUND(data_len))
+            goto err;
+        if (!(meta = malloc(meta_len ? meta_len : 1)))
+            goto err;
+        if (mw & 1) {
+            if (meta_len > cp_end - cp)
+                goto err;
+            memcpy(meta, cp, meta_len);
+            cp += meta_len;
+        } else {
+            if (!(n = var_get_u32(cp, cp_end, &clen)))
+                goto err;
+            cp += n;
+            if (clen > cp_end - cp ||
+                !rans_uncompress_O0_4x16(4, cp, clen, meta, meta_len))
+                goto err;
+            cp += clen;
+        }
+
+        if (!(lit = malloc(lit_len ? lit_len : 1)))
+            goto err;
+        data = lit;
+        data_len = lit_len;
+    } else if (order & RANS_ORDER_PACK) {
+        if (!(packed = malloc(plen ? plen : 1)))
+            goto err;
+        data = packed;
+    } else {
+        data = out;
+    }
+
+    // Entropy decoding stage
+    if (order & RANS_ORDER_CAT) {
+        if (data_len > cp_end - cp)
+            goto err;
+        memcpy(data, cp, data_len);
+    } else if (data_len) {
+        if (!((order & 1)
+              ? rans_uncompress_O1_4x16(N, cp, cp_end - cp, data, data_len)
+              : rans_uncompress_O0_4x16(N, cp, cp_end - cp, data, data_len)))
+            goto err;
+    }
+
+    if (order & RANS_ORDER_RLE) {
+        uint32_t rle_out_len = (order & RANS_ORDER_PACK) ? plen : usize;
+        unsigned char *rle_out = out;
+        if (order & RANS_ORDER_PACK) {
+            if (!(packed = malloc(plen ? plen : 1)))
+                goto err;
+            rle_out = packed;
+        }
+        if (rle_decode(lit, lit_len, meta, meta_len, rle_out, rle_out_len) < 0)
+            goto err;
+    }
+
+    if (order & RANS_ORDER_PACK) {
+        if (hts_unpack(packed, plen, out, usize, nsym, map) < 0)
+            goto err;
+    }
+
+    free(packed);
+    free(lit);
+    free(meta);
+    *out_size = usize;
+    return out;
+
+ err:
+    free(packed);
+    free(lit);
+    free(meta);
+    free(out_free);
+    return NULL;
+}
+
+unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
+                                    unsigned int *out_size) {
+    return rans_uncompress_to_4x16(in, in_size, NULL, out_size);
+}
@@ -0,0 +1,166 @@
+/* rans_word.h: derived from rans_byte.h by Fabian 'ryg' Giesen,
+ * https://github.com/rygorous/ryg_rans
+ *
+ * This is a public-domain implementation of several rANS variants. rANS is an
+ * entropy coder from the ANS family, as described in Jarek Duda's paper
+ * "Asymmetric numeral systems" (http://arxiv.org/abs/1311.2540).
+ */
+
+/*-------------------------------------------------------------------------- */
+
+// Word-aligned rANS encoder/decoder, as used by the CRAM 3.1 rANS-Nx16
+// codec.
+//
+// This differs from rANS_byte.h in renormalising 16 bits at a time.  The
+// state lives in [RANS_WORD_L, RANS_WORD_L << 16) so at most one 16-bit
+// word is emitted or consumed per symbol, removing the renormalisation
+// loop.  Words are stored little-endian.
+//
+// As with rANS_byte.h, symbols are encoded in reverse order and the
+// encoder writes backwards from the end of the output buffer.
+
+#ifndef RANS_WORD_HEADER
+#define RANS_WORD_HEADER
+
+#include <stdint.h>
+
+#ifdef assert
+#define RansAssert assert
+#else
+#define RansAssert(x)
+#endif
+
+// L ('l' in the paper) is the lower bound of our normalization interval.
+#define RANS_WORD_L (1u << 15)
+
+// State for a rANS encoder. Yep, that's all there is to it.
+typedef uint32_t RansState;
+
+// Initialize a rANS encoder.
+static inline void RansEncInit(RansState* r)
+{
+    *r = RANS_WORD_L;
+}
+
+// Flushes the rANS encoder.
+static inline void RansEncFlush(RansState* r, uint8_t** pptr)
+{
+    uint32_t x = *r;
+    uint8_t* ptr = *pptr;
+
+    ptr -= 4;
+    ptr[0] = (uint8_t) (x >> 0);
+    ptr[1] = (uint8_t) (x >> 8);
+    ptr[2] = (uint8_t) (x >> 16);
+    ptr[3] = (uint8_t) (x >> 24);
+
+    *pptr = ptr;
+}
+
+// Initializes a rANS decoder.
+// Unlike the encoder, the decoder works forwards as you'd expect.
+static inline void RansDecInit(RansState* r, uint8_t** pptr)
+{
+    uint32_t x;
+    uint8_t* ptr = *pptr;
+
+    x  = ((uint32_t) ptr[0]) << 0;
+    x |= ((uint32_t) ptr[1]) << 8;
+    x |= ((uint32_t) ptr[2]) << 16;
+    x |= ((uint32_t) ptr[3]) << 24;
+    ptr += 4;
+
+    *pptr = ptr;
+    *r = x;
+}
+
+// Returns the current cumulative frequency (map it to a symbol yourself!)
+static inline uint32_t RansDecGet(RansState* r, uint32_t scale_bits)
+{
+    return *r & ((1u << scale_bits) - 1);
+}
+
+// Encoder symbol description.  See rANS_byte.h for an explanation of
+// the reciprocal parameters.
+typedef struct {
+    uint32_t x_max;     // (Exclusive) upper bound of pre-normalization interval
+    uint32_t rcp_freq;  // Fixed-point reciprocal frequency
+    uint32_t bias;      // Bias
+    uint16_t cmpl_freq; // Complement of frequency: (1 << scale_bits) - freq
+    uint16_t rcp_shift; // Reciprocal shift
+} RansEncSymbol;
+
+// Initializes an encoder symbol to start "start" and frequency "freq"
+static inline void RansEncSymbolInit(RansEncSymbol* s, uint32_t start, uint32_t freq, uint32_t scale_bits)
+{
+    RansAssert(scale_bits <= 16);
+    RansAssert(start <= (1u << scale_bits));
+    RansAssert(freq <= (1u << scale_bits) - start);
+
+    s->x_max = ((RANS_WORD_L >> scale_bits) << 16) * freq;
+    s->cmpl_freq = (uint16_t) ((1 << scale_bits) - freq);
+    if (freq < 2) {
+        s->rcp_freq = ~0u;
+        s->rcp_shift = 0;
+        s->bias = start + (1 << scale_bits) - 1;
+    } else {
+        uint32_t shift = 0;
+        while (freq > (1u << shift))
+            shift++;
+
+        s->rcp_freq = (uint32_t) (((1ull << (shift + 31)) + freq-1) / freq);
+        s->rcp_shift = shift - 1;
+        s->bias = start;
+    }
+
+    s->rcp_shift += 32; // Avoid the extra >>32 in RansEncPutSymbol
+}
+
+// Encodes a given symbol.
+static inline void RansEncPutSymbol(RansState* r, uint8_t** pptr, RansEncSymbol const* sym)
+{
+    RansAssert(sym->x_max != 0); // can't encode symbol with freq=0
+
+    // renormalize; a single word always suffices
+    uint32_t x = *r;
+    if (x >= sym->x_max) {
+        uint8_t* ptr = *pptr - 2;
+        ptr[0] = (uint8_t) (x & 0xff);
+        ptr[1] = (uint8_t) ((x >> 8) & 0xff);
+        x >>= 16;
+        *pptr = ptr;
+    }
+
+    uint32_t q = (uint32_t) (((uint64_t)x * sym->rcp_freq) >> sym->rcp_shift);
+    *r = x + sym->bias + q * sym->cmpl_freq;
+}
+
+// Advances in the bit stream by "popping" a single symbol with range start
+// "start" and frequency "freq". No renormalization happens.
+static inline void RansDecAdvanceStep(RansState* r, uint32_t start, uint32_t freq, uint32_t scale_bits)
+{
+    uint32_t mask = (1u << scale_bits) - 1;
+
+    // s, x = D(x)
+    uint32_t x = *r;
+    *r = freq * (x >> scale_bits) + (x & mask) - start;
+}
+
+// Renormalize, with checks for falling off the end of the input.
+// Returns 0 on success, -1 if more data was needed than is available.
+static inline int RansDecRenormSafe(RansState* r, uint8_t** pptr, uint8_t *ptr_end)
+{
+    uint32_t x = *r;
+    uint8_t* ptr = *pptr;
+
+    if (x >= RANS_WORD_L)
+        return 0;
+    if (ptr_end - ptr < 2)
+        return -1;
+
+    *r = (x << 16) | ptr[0] | (ptr[1] << 8);
+    *pptr = ptr + 2;
+    return 0;
+}
+
+#endif // RANS_WORD_HEADER
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rle.h"
+#include "varint.h"
+
+int rle_encode(const uint8_t *in, uint32_t in_len,
+               uint8_t *lit, uint32_t *lit_len,
+               uint8_t *meta, uint32_t *meta_len) {
+    int64_t saved[256] = {0};
+    uint8_t use_rle[256] = {0};
+    uint32_t i, j, nl = 0, nm;
+    int nrle = 0, s;
+
+    // Each run turns N literals into one literal plus (typically) one
+    // byte of run length.  Only keep the symbols where this is a win.
+    for (i = 0; i < in_len; i = j) {
+        for (j = i+1; j < in_len && in[j] == in[i]; j++)
+            ;
+        saved[in[i]] += (int64_t)(j - i) - 2;
+    }
+
+    nm = 1;
+    for (s = 0; s < 256; s++) {
+        if (saved[s] > 0) {
+            use_rle[s] = 1;
+            meta[nm++] = s;
+            nrle++;
+        }
+    }
+    if (!nrle)
+        return -1;
+    meta[0] = nrle & 0xff; // 256 stored as 0
+
+    for (i = 0; i < in_len; i = j) {
+        uint8_t c = in[i];
+        lit[nl++] = c;
+        if (!use_rle[c]) {
+            j = i+1;
+            continue;
+        }
+        for (j = i+1; j < in_len && in[j] == c; j++)
+            ;
+        nm += var_put_u32(meta + nm, j - i - 1);
+    }
+
+    *lit_len = nl;
+    *meta_len = nm;
+    return 0;
+}
+
+int rle_decode(const uint8_t *lit, uint32_t lit_len,
+               const uint8_t *meta, uint32_t meta_len,
+               uint8_t *out, uint32_t out_len) {
+    const uint8_t *meta_end = meta + meta_len;
+    const uint8_t *lit_end = lit + lit_len;
+    uint8_t use_rle[256] = {0};
+    uint32_t k = 0;
+    int nrle, i;
+
+    if (meta_len < 1)
+        return -1;
+    nrle = *meta++ ? meta[-1] : 256;
+    if (meta_end - meta < nrle)
+        return -1;
+    for (i = 0; i < nrle; i++)
+        use_rle[*meta++] = 1;
+
+    while (lit < lit_end) {
+        uint8_t c = *lit++;
+        if (use_rle[c]) {
+            uint32_t run;
+            int n = var_get_u32(meta, meta_end, &run);
+            if (!n || run >= out_len - k)
+                return -1;
+            meta += n;
+            memset(out + k, c, run + 1);
+            k += run + 1;
+        } else {
+            if (k >= out_len)
+                return -1;
+            out[k++] = c;
+        }
+    }
+
+    return k == out_len ? 0 : -1;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CRAM_RLE_H
+#define CRAM_RLE_H
+
+#include <stdint.h>
+
+/*
+ * Run length encoding, as used by the RLE transform of the CRAM 3.1
+ * entropy coders.
+ *
+ * Only a subset of symbols, chosen by rle_encode, are run-length
+ * encoded.  The input is split into a literal stream, where each run of
+ * an RLE symbol is reduced to a single copy, and a meta-data stream
+ * holding the number of RLE symbols (0 meaning 256), the symbols
+ * themselves and then the length minus one of each run as a 7-bit
+ * variable sized integer.  Both streams are then entropy encoded.
+ */
+
+/*
+ * Returns the worst-case size of the meta-data buffer for rle_encode on
+ * 'len' bytes of input.
+ */
+#define RLE_META_BOUND(len) ((len) + 257 + 5)
+
+/*
+ * Splits in[0..in_len-1] into literals (at most in_len bytes) and
+ * run-length meta-data (at most RLE_META_BOUND(in_len) bytes).
+ *
+ * Returns 0 on success, or -1 if no symbol benefits from run-length
+ * encoding, in which case lit and meta are undefined.
+ */
+int rle_encode(const uint8_t *in, uint32_t in_len,
+               uint8_t *lit, uint32_t *lit_len,
+               uint8_t *meta, uint32_t *meta_len);
+
+/*
+ * Reverses rle_encode, filling out all 'out_len' bytes of out.
+ * Returns 0 on success, -1 on malformed or truncated input.
+ */
+int rle_decode(const uint8_t *lit, uint32_t lit_len,
+               const uint8_t *meta, uint32_t meta_len,
+               uint8_t *out, uint32_t out_len);
+
+#endif /* CRAM_RLE_H */
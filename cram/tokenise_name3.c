@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The CRAM 3.1 read name tokeniser; see tokenise_name3.h.
+ *
+ * This is not the htscodecs tokeniser and, as with fqzcomp_qual.c, its
+ * layout differs from the specification's, so CRAM_EXPERIMENTAL_V31_CODECS
+ * gates its use.
+ *
+ * Stream layout:
+ *
+ *   uncompressed length, 4 bytes little-endian
+ *   number of names, 4 bytes little-endian
+ *   flags byte (TOK3_ARITH)
+ *   separator byte
+ *
+ * followed by the token streams.  Each starts with a byte holding the
+ * token type (N_*), with ST_NEW_POS set on the first stream of each token
+ * position.  With ST_DUP set, two further bytes give the position and
+ * type of an earlier identical stream.  Otherwise the stream's size is
+ * given as uint7 followed by its rANS-Nx16 or arithmetic coded data.
+ *
+ * Position 0 holds one N_DUP or N_DIFF type per name, plus 4 byte
+ * distances back to the name duplicated or compared against (0 meaning
+ * none).  Positions 1 onwards hold a type per token of each name being
+ * diffed, ending with N_END, plus the values of literal and delta
+ * tokens in the stream for their type.  Names compared against are
+ * re-tokenised by the decoder, so their tokens need not be remembered.
+ *
+ * The CRAM 3.1 specification has no separator byte in the header, so
+ * until the layouts are reconciled cram_encode.c does not write TOK3
+ * blocks by default.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tokenise_name3.h"
+#include "rANS_static4x16.h"
+#include "arith_dynamic.h"
+#include "varint.h"
+
+#define MAX_TOKENS 128
+#define MAX_POS (MAX_TOKENS+2) // positions, including 0 and the final END
+#define MAX_DIGITS 9           // longer numbers are stored as text
+
+enum name_type {
+    N_TYPE = 0, N_ALPHA, N_CHAR, N_DIGITS0, N_DZLEN, N_DUP, N_DIFF,
+    N_DIGITS, N_DELTA, N_DELTA0, N_MATCH, N_NOP, N_END, N_NTYPES
+};
+
+#define TOK3_ARITH 1
+
+#define ST_NEW_POS 0x80
+#define ST_DUP     0x40
+
+typedef struct {
+    int type;            // N_ALPHA, N_CHAR, N_DIGITS or N_DIGITS0
+    const uint8_t *s;    // token text
+    int len;
+    uint32_t val;        // value of N_DIGITS and N_DIGITS0
+} token;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len, alloc, pos;
+} tok_stream;
+
+#define IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/*
+ * Splits a name into tokens.  Letters and numbers form a token per run,
+ * anything else a token per character.  Returns the number of tokens.
+ */
+static int tokenise(const uint8_t *name, int len, token *tok) {
+    int i = 0, n = 0;
+
+    while (i < len) {
+        token *t = &tok[n++];
+        int j = i;
+
+        t->s = name + i;
+        t->val = 0;
+        if (n == MAX_TOKENS) {
+            // Any remainder is kept as a single literal
+            t->type = N_ALPHA;
+            j = len;
+        } else if (IS_ALPHA(name[i])) {
+            while (j < len && IS_ALPHA(name[j]))
+                j++;
+            t->type = N_ALPHA;
+        } else if (IS_DIGIT(name[i])) {
+            while (j < len && IS_DIGIT(name[j]))
+                j++;
+            if (j - i > MAX_DIGITS) {
+                t->type = N_ALPHA;
+            } else {
+                int k;
+                for (k = i; k < j; k++)
+                    t->val = t->val * 10 + name[k] - '0';
+                t->type = name[i] == '0' && j - i > 1 ? N_DIGITS0 : N_DIGITS;
+            }
+        } else {
+            j = i+1;
+            t->type = N_CHAR;
+        }
+        t->len = j - i;
+        i = j;
+    }
+
+    return n;
+}
+
+static int st_put(tok_stream *s, const void *data, size_t len) {
+    if (s->len + len > s->alloc) {
+        size_t alloc = (s->len + len) * 2 + 64;
+        uint8_t *buf = realloc(s->buf, alloc);
+        if (!buf)
+            return -1;
+        s->buf = buf;
+        s->alloc = alloc;
+    }
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+    return 0;
+}
+
+static int st_put_u8(tok_stream *s, uint8_t v) {
+    return st_put(s, &v, 1);
+}
+
+static int st_put_u32(tok_stream *s, uint32_t v) {
+    uint8_t b[4] = {v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24};
+    return st_put(s, b, 4);
+}
+
+static int st_get_u8(tok_stream *s) {
+    return s->pos < s->len ? s->buf[s->pos++] : -1;
+}
+
+static int st_get_u32(tok_stream *s, uint32_t *v) {
+    uint8_t *b = s->buf + s->pos;
+    if (s->len - s->pos < 4)
+        return -1;
+    *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    s->pos += 4;
+    return 0;
+}
+
+static void free_streams(tok_stream *st) {
+    int i;
+    if (!st)
+        return;
+    for (i = 0; i < MAX_POS * N_NTYPES; i++)
+        free(st[i].buf);
+    free(st);
+}
+
+/*-----------------------------------------------------------------------------
+ * Encoder
+ */
+
+static uint32_t hash_name(const uint8_t *s, int len) {
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++)
+        h = (h ^ s[i]) * 16777619u;
+    return h;
+}
+
+/* Compresses a stream with whichever codec transforms work best */
+static uint8_t *compress_stream(uint8_t *in, size_t len, int level,
+                                int use_arith, unsigned int *out_len) {
+    static const int orders[] = {0, 1, 64, 65, 128, 129, 192, 193};
+    int norders = level < 3 ? 2 : sizeof(orders)/sizeof(*orders), i;
+    uint8_t *best = NULL;
+
+    for (i = 0; i < norders; i++) {
+        unsigned int clen;
+        uint8_t *c = use_arith
+            ? arith_compress(in, len, &clen, orders[i])
+            : rans_compress_4x16(in, len, &clen, orders[i]);
+        if (!c)
+            continue;
+        if (!best || clen < *out_len) {
+            free(best);
+            best = c;
+            *out_len = clen;
+        } else {
+            free(c);
+        }
+    }
+
+    return best;
+}
+
+uint8_t *tok3_encode_names(char *blk, int len, int level, int use_arith,
+                           int *out_len) {
+    uint8_t *in = (uint8_t *)blk, *cp, *end, sep;
+    tok_stream *st = NULL, out = {0};
+    token *tok = NULL, *ptok = NULL, *tmp;
+    uint32_t *hash = NULL, *name_off = NULL, hmask, nnames = 0, n;
+    int nptok = 0, ntok, t, p;
+
+    if (len <= 0)
+        return NULL;
+    sep = in[len-1];
+    if (sep != 0 && memchr(in, 0, len))
+        return NULL;
+
+    for (cp = in, end = in + len; cp < end; cp++)
+        nnames += *cp == sep;
+
+    for (hmask = 1; hmask < nnames * 2; hmask *= 2)
+        ;
+    hash = calloc(hmask--, sizeof(*hash));
+    name_off = malloc((nnames + 1) * sizeof(*name_off));
+    st = calloc(MAX_POS * N_NTYPES, sizeof(*st));
+    tok = malloc(MAX_TOKENS * sizeof(*tok));
+    ptok = malloc(MAX_TOKENS * sizeof(*ptok));
+    if (!hash || !name_off || !st || !tok || !ptok)
+        goto err;
+
+#define ST(p, type) (&st[(p) * N_NTYPES + (type)])
+
+    for (cp = in, n = 0; n < nnames; n++) {
+        uint8_t *name = cp;
+        int nlen = (uint8_t *)memchr(cp, sep, end - cp) - cp;
+        uint32_t h = hash_name(name, nlen) & hmask, dup = 0;
+
+        name_off[n] = cp - in;
+        cp += nlen + 1;
+        name_off[n+1] = cp - in;
+
+        // Look for an identical earlier name
+        while (hash[h]) {
+            uint32_t j = hash[h] - 1;
+            if (name_off[j+1] - name_off[j] == nlen + 1 &&
+                memcmp(in + name_off[j], name, nlen) == 0) {
+                dup = n - j;
+                break;
+            }
+            h = (h+1) & hmask;
+        }
+        hash[h] = n+1;
+
+        ntok = tokenise(name, nlen, tok);
+
+        if (dup) {
+            if (st_put_u8(ST(0, N_TYPE), N_DUP) < 0 ||
+                st_put_u32(ST(0, N_DUP), dup) < 0)
+                goto err;
+        } else {
+            if (st_put_u8(ST(0, N_TYPE), N_DIFF) < 0 ||
+                st_put_u32(ST(0, N_DIFF), n ? 1 : 0) < 0)
+                goto err;
+
+            for (t = 0; t < ntok; t++) {
+                token *c = &tok[t], *pt = t < nptok ? &ptok[t] : NULL;
+                int r = 0;
+                p = t+1;
+
+                if (pt && pt->type == c->type && pt->len == c->len &&
+                    memcmp(pt->s, c->s, c->len) == 0) {
+                    r = st_put_u8(ST(p, N_TYPE), N_MATCH);
+                } else if (pt && c->type == N_DIGITS &&
+                           pt->type == N_DIGITS &&
+                           c->val >= pt->val && c->val - pt->val < 256) {
+                    r = st_put_u8(ST(p, N_TYPE), N_DELTA) |
+                        st_put_u8(ST(p, N_DELTA), c->val - pt->val);
+                } else if (pt && c->type == N_DIGITS0 &&
+                           pt->type == N_DIGITS0 && c->len == pt->len &&
+                           c->val >= pt->val && c->val - pt->val < 256) {
+                    r = st_put_u8(ST(p, N_TYPE), N_DELTA0) |
+                        st_put_u8(ST(p, N_DELTA0), c->val - pt->val);
+                } else {
+                    r = st_put_u8(ST(p, N_TYPE), c->type);
+                    switch (c->type) {
+                    case N_ALPHA:
+                        r |= st_put(ST(p, N_ALPHA), c->s, c->len) |
+                            st_put_u8(ST(p, N_ALPHA), 0);
+                        break;
+                    case N_CHAR:
+                        r |= st_put_u8(ST(p, N_CHAR), *c->s);
+                        break;
+                    case N_DIGITS:
+                        r |= st_put_u32(ST(p, N_DIGITS), c->val);
+                        break;
+                    case N_DIGITS0:
+                        r |= st_put_u32(ST(p, N_DIGITS0), c->val) |
+                            st_put_u8(ST(p, N_DZLEN), c->len);
+                        break;
+                    }
+                }
+                if (r < 0)
+                    goto err;
+            }
+            if (st_put_u8(ST(ntok+1, N_TYPE), N_END) < 0)
+                goto err;
+        }
+
+        tmp = ptok; ptok = tok; tok = tmp;
+        nptok = ntok;
+    }
+
+    // Serialise the streams
+    {
+        uint8_t hdr[10] = {
+            len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24,
+            nnames & 0xff, (nnames >> 8) & 0xff, (nnames >> 16) & 0xff,
+            nnames >> 24, use_arith ? TOK3_ARITH : 0, sep
+        };
+        if (st_put(&out, hdr, 10) < 0)
+            goto err;
+    }
+
+    for (p = 0; p < MAX_POS; p++) {
+        int type, first = 1;
+        for (type = 0; type < N_NTYPES; type++) {
+            tok_stream *s = ST(p, type);
+            uint8_t ttype = type | (first ? ST_NEW_POS : 0), *c, b[5];
+            unsigned int clen = 0;
+            int p2, t2, found = 0;
+
+            if (!s->len)
+                continue;
+            first = 0;
+
+            for (p2 = 0; p2 <= p && !found; p2++) {
+                for (t2 = 0; t2 < (p2 == p ? type : N_NTYPES); t2++) {
+                    tok_stream *s2 = ST(p2, t2);
+                    if (s2->len == s->len &&
+                        memcmp(s2->buf, s->buf, s->len) == 0) {
+                        uint8_t d[3] = {ttype | ST_DUP, p2, t2};
+                        if (st_put(&out, d, 3) < 0)
+                            goto err;
+                        found = 1;
+                        break;
+                    }
+                }
+            }
+            if (found)
+                continue;
+
+            if (!(c = compress_stream(s->buf, s->len, level, use_arith,
+                                      &clen)))
+                goto err;
+            if (st_put_u8(&out, ttype) < 0 ||
+                st_put(&out, b, var_put_u32(b, clen)) < 0 ||
+                st_put(&out, c, clen) < 0) {
+                free(c);
+                goto err;
+            }
+            free(c);
+        }
+    }
+#undef ST
+
+    free_streams(st);
+    free(hash);
+    free(name_off);
+    free(tok);
+    free(ptok);
+    *out_len = out.len;
+    return out.buf;
+
+ err:
+    free_streams(st);
+    free(hash);
+    free(name_off);
+    free(tok);
+    free(ptok);
+    free(out.buf);
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Decoder
+ */
+
+static inline int append(uint8_t *out, uint32_t *op, uint32_t out_len,
+                         const void *data, size_t len) {
+    if (len > out_len - *op)
+        return -1;
+    memcpy(out + *op, data, len);
+    *op += len;
+    return 0;
+}
+
+static inline int append_num(uint8_t *out, uint32_t *op, uint32_t out_len,
+                             uint32_t val, int width) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%0*u", width, val);
+    return append(out, op, out_len, buf, len);
+}
+
+uint8_t *tok3_decode_names(uint8_t *in, uint32_t sz, uint32_t *out_len) {
+    uint8_t *cp = in, *cp_end = in + sz, *out = NULL, sep;
+    uint32_t ulen, nnames, n, op = 0, *name_off = NULL;
+    tok_stream *st = NULL;
+    token *ptok = NULL;
+    int flags, pos = -1;
+
+    if (sz < 10)
+        return NULL;
+    ulen   = cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24);
+    nnames = cp[4] | (cp[5] << 8) | (cp[6] << 16) | ((uint32_t)cp[7] << 24);
+    flags  = cp[8];
+    sep    = cp[9];
+    cp += 10;
+    if (nnames > ulen || ulen >= INT32_MAX)
+        return NULL;
+
+    if (!(st = calloc(MAX_POS * N_NTYPES, sizeof(*st))))
+        return NULL;
+
+#define ST(p, type) (&st[(p) * N_NTYPES + (type)])
+
+    while (cp < cp_end) {
+        int ttype = *cp++, type = ttype & 0x3f;
+        tok_stream *s;
+
+        if (ttype & ST_NEW_POS)
+            pos++;
+        if (pos < 0 || pos >= MAX_POS || type >= N_NTYPES)
+            goto err;
+        s = ST(pos, type);
+        if (s->buf)
+            goto err;
+
+        if (ttype & ST_DUP) {
+            tok_stream *s2;
+            if (cp_end - cp < 2 || cp[0] >= MAX_POS || cp[1] >= N_NTYPES)
+                goto err;
+            s2 = ST(cp[0], cp[1]);
+            cp += 2;
+            if (!s2->buf || s2 == s || !(s->buf = malloc(s2->len + 1)))
+                goto err;
+            memcpy(s->buf, s2->buf, s2->len);
+            s->len = s2->len;
+        } else {
+            uint32_t clen;
+            unsigned int usize = 0;
+            int k = var_get_u32(cp, cp_end, &clen);
+            if (!k || clen > cp_end - cp - k)
+                goto err;
+            cp += k;
+            s->buf = (flags & TOK3_ARITH)
+                ? arith_uncompress(cp, clen, &usize)
+                : rans_uncompress_4x16(cp, clen, &usize);
+            if (!s->buf)
+                goto err;
+            s->len = usize;
+            cp += clen;
+        }
+    }
+
+    if (!(out = malloc(ulen + 1)) ||
+        !(name_off = malloc((nnames + 1) * sizeof(*name_off))) ||
+        !(ptok = malloc(MAX_TOKENS * sizeof(*ptok))))
+        goto err;
+
+    for (n = 0; n < nnames; n++) {
+        int type, t, nptok = 0;
+        uint32_t d;
+
+        name_off[n] = op;
+        type = st_get_u8(ST(0, N_TYPE));
+
+        if (type == N_DUP) {
+            if (st_get_u32(ST(0, N_DUP), &d) < 0 || d < 1 || d > n)
+                goto err;
+            if (append(out, &op, ulen, out + name_off[n-d],
+                       name_off[n-d+1] - name_off[n-d]) < 0)
+                goto err;
+            name_off[n+1] = op;
+            continue;
+        }
+
+        if (type != N_DIFF || st_get_u32(ST(0, N_DIFF), &d) < 0 || d > n)
+            goto err;
+        if (d)
+            nptok = tokenise(out + name_off[n-d],
+                             name_off[n-d+1] - name_off[n-d] - 1, ptok);
+
+        for (t = 0; ; t++) {
+            int p = t+1, r = 0, c;
+            token *pt = t < nptok ? &ptok[t] : NULL;
+            uint32_t v;
+
+            if (p >= MAX_POS)
+                goto err;
+            type = st_get_u8(ST(p, N_TYPE));
+            if (type == N_END)
+                break;
+
+            switch (type) {
+            case N_MATCH:
+                r = pt ? append(out, &op, ulen, pt->s, pt->len) : -1;
+                break;
+
+            case N_ALPHA: {
+                tok_stream *s = ST(p, N_ALPHA);
+                uint8_t *z;
+                if (s->pos >= s->len ||
+                    !(z = memchr(s->buf + s->pos, 0, s->len - s->pos))) {
+                    r = -1;
+                    break;
+                }
+                r = append(out, &op, ulen, s->buf + s->pos,
+                           z - (s->buf + s->pos));
+                s->pos = z - s->buf + 1;
+                break;
+            }
+
+            case N_CHAR: {
+                uint8_t ch;
+                c = st_get_u8(ST(p, N_CHAR));
+                ch = c;
+                r = c < 0 ? -1 : append(out, &op, ulen, &ch, 1);
+                break;
+            }
+
+            case N_DIGITS:
+                r = st_get_u32(ST(p, N_DIGITS), &v) < 0 ? -1
+                    : append_num(out, &op, ulen, v, 1);
+                break;
+
+            case N_DIGITS0:
+                c = st_get_u8(ST(p, N_DZLEN));
+                r = c < 0 || c > MAX_DIGITS ||
+                    st_get_u32(ST(p, N_DIGITS0), &v) < 0 ? -1
+                    : append_num(out, &op, ulen, v, c);
+                break;
+
+            case N_DELTA:
+                c = st_get_u8(ST(p, N_DELTA));
+                r = c < 0 || !pt || pt->type != N_DIGITS ? -1
+                    : append_num(out, &op, ulen, pt->val + c, 1);
+                break;
+
+            case N_DELTA0:
+                c = st_get_u8(ST(p, N_DELTA0));
+                r = c < 0 || !pt || pt->type != N_DIGITS0 ? -1
+                    : append_num(out, &op, ulen, pt->val + c, pt->len);
+                break;
+
+            default:
+                r = -1;
+            }
+            if (r < 0)
+                goto err;
+        }
+
+        if (append(out, &op, ulen, &sep, 1) < 0)
+            goto err;
+        name_off[n+1] = op;
+    }
+#undef ST
+
+    if (op != ulen)
+        goto err;
+
+    free_streams(st);
+    free(name_off);
+    free(ptok);
+    *out_len = ulen;
+    return out;
+
+ err:
+    free_streams(st);
+    free(name_off);
+    free(ptok);
+    free(out);
+    return NULL;
+}
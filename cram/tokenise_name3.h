@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TOKENISE_NAME3_H
+#define TOKENISE_NAME3_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The CRAM 3.1 read name tokeniser.
+ *
+ * Names are split into tokens of letters, numbers and single punctuation
+ * characters, and each token is compared against the same token of an
+ * earlier name.  Tokens are then recorded as matches, small numeric
+ * deltas or literals in separate streams per token position and type,
+ * each compressed with rANS-Nx16 or the adaptive arithmetic coder.
+ */
+
+/*
+ * Compresses a block of len bytes holding names each terminated by the
+ * same separator byte (normally '\0'), which must also be the last byte
+ * of the block.  'level' (1-9) controls how many codec transforms are
+ * tried for each stream.  If use_arith is non-zero the streams are
+ * compressed with the arithmetic coder rather than rANS.
+ *
+ * Returns a malloced buffer holding *out_len bytes on success,
+ *         NULL on failure or if the data is not a list of names.
+ */
+uint8_t *tok3_encode_names(char *blk, int len, int level, int use_arith,
+                           int *out_len);
+
+/*
+ * Uncompresses sz bytes of 'in'.
+ *
+ * Returns a malloced buffer holding *out_len bytes on success,
+ *         NULL on failure.
+ */
+uint8_t *tok3_decode_names(uint8_t *in, uint32_t sz, uint32_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TOKENISE_NAME3_H */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Variable sized integer encoding used by the CRAM 3.1 codecs.
+ *
+ * Values are stored big-endian in groups of 7 bits, with the top bit of
+ * each byte set when more bytes follow.  Hence 0-127 take one byte,
+ * 128-16383 two bytes, and so on up to 5 bytes for a 32-bit value.
+ */
+
+#ifndef CRAM_VARINT_H
+#define CRAM_VARINT_H
+
+#include <stdint.h>
+
+/*
+ * Writes 'i' to cp, which must have room for at least 5 bytes.
+ * Returns the number of bytes written.
+ */
+static inline int var_put_u32(uint8_t *cp, uint32_t i) {
+    uint8_t *op = cp;
+    int s = 0;
+    uint32_t x = i;
+
+    do {
+        s += 7;
+        x >>= 7;
+    } while (x && s < 35);
+
+    do {
+        s -= 7;
+        *cp++ = ((i >> s) & 0x7f) | (s ? 0x80 : 0);
+    } while (s);
+
+    return cp - op;
+}
+
+/*
+ * Reads a value from cp, reading no further than endp.
+ * Returns the number of bytes consumed, or 0 on error (truncated input
+ * or a value too large for 32 bits).
+ */
+static inline int var_get_u32(const uint8_t *cp, const uint8_t *endp,
+                              uint32_t *i) {
+    const uint8_t *op = cp;
+    uint32_t v = 0;
+    uint8_t c;
+    int n = 0;
+
+    do {
+        if (cp >= endp || ++n > 5)
+            return 0;
+        c = *cp++;
+        v = (v << 7) | (c & 0x7f);
+    } while (c & 0x80);
+
+    *i = v;
+    return cp - op;
+}
+
+#endif /* CRAM_VARINT_H */
@@ -23,6 +23,9 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.  */
 
 #define HTS_BUILDING_LIBRARY // Enables HTSLIB_EXPORT, see htslib/hts_defs.h
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For O_DIRECT
+#endif
 #include <config.h>
 
 #include <stdio.h>
@@ -31,6 +34,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <pthread/include/pthread.h>
 
@@ -521,16 +525,31 @@ void hclose_abruptly(hFILE *fp)
    However Windows insists on send()/recv() and its own closesocket()
    being used when fd happens to be a socket.  */
 
+struct fd_readahead;
+struct fd_writebehind;
+
 typedef struct {
     hFILE base;
     int fd;
     unsigned is_socket:1;
+    struct fd_readahead *ra;    // Background reader, if enabled
+    struct fd_writebehind *wb;  // Background writer, if enabled
 } hFILE_fd;
 
+static ssize_t ra_read(struct fd_readahead *ra, void *buffer, size_t nbytes);
+static off_t ra_seek(hFILE_fd *fp, off_t offset, int whence);
+static void ra_destroy(struct fd_readahead *ra);
+static ssize_t wb_write(struct fd_writebehind *wb, const char *buffer,
+                        size_t nbytes);
+static off_t wb_seek(hFILE_fd *fp, off_t offset, int whence);
+static int wb_flush(struct fd_writebehind *wb);
+static int wb_destroy(struct fd_writebehind *wb);
+
 static ssize_t fd_read(hFILE *fpv, void *buffer, size_t nbytes)
 {
     hFILE_fd *fp = (hFILE_fd *) fpv;
     ssize_t n;
+    if (fp->ra) return ra_read(fp->ra, buffer, nbytes);
     do {
         n = fp->is_socket? recv(fp->fd, buffer, nbytes, 0)
                          : read(fp->fd, buffer, nbytes);
@@ -542,6 +561,7 @@ static ssize_t fd_write(hFILE *fpv, const void *buffer, size_t nbytes)
 {
     hFILE_fd *fp = (hFILE_fd *) fpv;
     ssize_t n;
+    if (fp->wb) return wb_write(fp->wb, buffer, nbytes);
     do {
         n = fp->is_socket?  send(fp->fd, buffer, nbytes, 0)
                          : write(fp->fd, buffer, nbytes);
@@ -564,18 +584,20 @@ static ssize_t fd_write(hFILE *fpv, const void *buffer, size_t nbytes)
 static off_t fd_seek(hFILE *fpv, off_t offset, int whence)
 {
     hFILE_fd *fp = (hFILE_fd *) fpv;
+    if (fp->ra) return ra_seek(fp, offset, whence);
+    if (fp->wb) return wb_seek(fp, offset, whence);
     return lseek(fp->fd, offset, whence);
 }
 
 static int fd_flush(hFILE *fpv)
 {
+    hFILE_fd *fp = (hFILE_fd *) fpv;
     int ret = 0;
+    if (fp->wb && wb_flush(fp->wb) < 0) return -1;
     do {
 #ifdef HAVE_FDATASYNC
-        hFILE_fd *fp = (hFILE_fd *) fpv;
         ret = fdatasync(fp->fd);
 #elif defined(HAVE_FSYNC)
-        hFILE_fd *fp = (hFILE_fd *) fpv;
         ret = fsync(fp->fd);
 #endif
         // Ignore invalid-for-fsync(2) errors due to being, e.g., a pipe,
@@ -588,7 +610,9 @@ static int fd_flush(hFILE *fpv)
 static int fd_close(hFILE *fpv)
 {
     hFILE_fd *fp = (hFILE_fd *) fpv;
-    int ret;
+    int ret, err = 0;
+    if (fp->ra) ra_destroy(fp->ra);
+    if (fp->wb && wb_destroy(fp->wb) < 0) err = errno;
     do {
 #ifdef HAVE_CLOSESOCKET
         ret = fp->is_socket? closesocket(fp->fd) : close(fp->fd);
@@ -596,6 +620,10 @@ static int fd_close(hFILE *fpv)
         ret = close(fp->fd);
 #endif
     } while (ret < 0 && errno == EINTR);
+    if (ret == 0 && err) {
+        errno = err;
+        ret = -1;
+    }
     return ret;
 }
 
@@ -604,6 +632,641 @@ static const struct hFILE_backend fd_backend =
     fd_read, fd_write, fd_seek, fd_flush, fd_close
 };
 
+/************************
+ * Memory-mapped backend *
+ ************************/
+
+/* With the 'm' mode letter, a local regular file opened read-only is mapped
+   into memory and used as a fixed, immobile buffer covering the whole file,
+   as for mem: URLs.  Reads and peeks are then served straight from the page
+   cache, and seeks never reach the backend.  */
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+
+typedef struct {
+    hFILE base;
+    size_t length;
+} hFILE_mmap;
+
+static off_t mmap_seek(hFILE *fpv, off_t offset, int whence)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+static int mmap_close(hFILE *fpv)
+{
+    hFILE_mmap *fp = (hFILE_mmap *) fpv;
+    int ret = munmap(fp->base.buffer, fp->length);
+    fp->base.buffer = NULL;  // Not to be freed by hfile_destroy()
+    return ret;
+}
+
+static const struct hFILE_backend mmap_backend =
+{
+    NULL, NULL, mmap_seek, NULL, mmap_close
+};
+
+/* Maps the already opened fd, which may be closed afterwards.  Returns NULL
+   without setting errno for files that can't be mapped (e.g. pipes or empty
+   files), so that the caller can fall back to reading them normally.  */
+static hFILE *hopen_mmap(int fd, const char *mode)
+{
+    hFILE_mmap *fp;
+    struct stat sbuf;
+    void *data;
+    int save;
+
+    if (fstat(fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)
+        || sbuf.st_size <= 0 || (uint64_t) sbuf.st_size > SIZE_MAX)
+        return NULL;
+
+    data = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return NULL;
+#ifdef MADV_SEQUENTIAL
+    (void) madvise(data, sbuf.st_size, MADV_SEQUENTIAL);
+#endif
+
+    fp = (hFILE_mmap *) hfile_init_fixed(sizeof (hFILE_mmap), mode, data,
+                                         sbuf.st_size, sbuf.st_size);
+    if (fp == NULL) {
+        save = errno;
+        munmap(data, sbuf.st_size);
+        errno = save;
+        return NULL;
+    }
+
+    fp->length = sbuf.st_size;
+    fp->base.backend = &mmap_backend;
+    return &fp->base;
+}
+#endif
+
+// Windows has no fadvise() or madvise(), and files are neither mapped nor
+// read ahead there (see hfile_set_readahead()), so there the hint is dropped
+int hfile_prefetch(hFILE *fp, off_t offset, off_t length)
+{
+#if defined(HAVE_MMAP) && defined(MADV_WILLNEED)
+    if (fp->backend == &mmap_backend) {
+        hFILE_mmap *mfp = (hFILE_mmap *) fp;
+        long page = sysconf(_SC_PAGESIZE);
+        off_t start = page > 0 ? offset - offset % page : offset;
+        if (offset < 0 || length < 0 || (size_t) offset >= mfp->length)
+            return -1;
+        if ((size_t) (offset + length) > mfp->length)
+            length = mfp->length - offset;
+        if (madvise(fp->buffer + start, length + (offset - start),
+                    MADV_WILLNEED) == 0)
+            return 0;
+        return -1;
+    }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+    if (fp->backend == &fd_backend) {
+        hFILE_fd *fdp = (hFILE_fd *) fp;
+        if (!fdp->is_socket
+            && posix_fadvise(fdp->fd, offset, length, POSIX_FADV_WILLNEED) == 0)
+            return 0;
+    }
+#endif
+    return -1;
+}
+
+/*
+ * Read-ahead for local files.  A background thread reads the file in
+ * fixed, aligned chunks with pread(), keeping up to n_bufs chunks ahead of
+ * the reader's position so that the next refill_buffer() is usually a
+ * memcpy instead of a wait on storage.  Chunk k of the file is always held
+ * in slot k % n_bufs, so after a seek any chunks still inside the new window
+ * are kept and the rest are simply overwritten; chunks that have not been
+ * started yet are never read.  The window starts at one chunk after a seek
+ * elsewhere and doubles as the reader consumes chunks in order, so random
+ * access does not read much more than it uses.
+ */
+
+#define HFILE_READAHEAD_BUFS 4
+#define HFILE_READAHEAD_SIZE (256*1024)
+
+typedef struct {
+    char *data;
+    int64_t chunk;      // Chunk held in this slot, or -1 for none
+    ssize_t len;        // Bytes read, less than the chunk size only at EOF
+    int err;            // errno, if len < 0
+    int busy;           // Being read into by the background thread
+} ra_buf;
+
+struct fd_readahead {
+    int fd;
+    int n_bufs, window;
+    size_t bufsize;
+    ra_buf *buf;
+    off_t pos;          // Reader's current position
+    int64_t eof_chunk;  // First chunk seen to be short
+    int shutdown;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wanted;  // Signalled when the reader moves on
+    pthread_cond_t ready;   // Signalled when a chunk has been read
+};
+
+#ifdef HAVE_PREAD
+static void *ra_worker(void *arg)
+{
+    struct fd_readahead *ra = (struct fd_readahead *) arg;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->shutdown) {
+        int64_t first = ra->pos / ra->bufsize, k;
+        ra_buf *b = NULL;
+        for (k = first; k < first + ra->window && k <= ra->eof_chunk; k++) {
+            if (ra->buf[k % ra->n_bufs].chunk != k) {
+                b = &ra->buf[k % ra->n_bufs];
+                break;
+            }
+        }
+        if (!b) {
+            pthread_cond_wait(&ra->wanted, &ra->lock);
+            continue;
+        }
+
+        b->chunk = k;
+        b->busy = 1;
+        pthread_mutex_unlock(&ra->lock);
+
+        size_t got = 0;
+        ssize_t n = 0;
+        while (got < ra->bufsize) {
+            n = pread(ra->fd, b->data + got, ra->bufsize - got,
+                      (off_t) k * ra->bufsize + got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        b->busy = 0;
+        if (n < 0) {
+            b->len = -1;
+            b->err = errno;
+        } else {
+            b->len = got;
+            if (got < ra->bufsize && k < ra->eof_chunk) ra->eof_chunk = k;
+        }
+        pthread_cond_signal(&ra->ready);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+#endif
+
+static ssize_t ra_read(struct fd_readahead *ra, void *buffer, size_t nbytes)
+{
+    int64_t k;
+    ra_buf *b;
+    size_t off;
+    ssize_t n;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        k = ra->pos / ra->bufsize;
+        b = &ra->buf[k % ra->n_bufs];
+        if (b->chunk == k && !b->busy) break;
+        if (k > ra->eof_chunk) {
+            pthread_mutex_unlock(&ra->lock);
+            return 0;
+        }
+        pthread_cond_signal(&ra->wanted);
+        pthread_cond_wait(&ra->ready, &ra->lock);
+    }
+
+    if (b->len < 0) {
+        // Forget the failed chunk so that a later read tries again
+        b->chunk = -1;
+        errno = b->err;
+        pthread_mutex_unlock(&ra->lock);
+        return -1;
+    }
+
+    off = ra->pos - (off_t) k * ra->bufsize;
+    n = off < (size_t) b->len ? b->len - off : 0;
+    if ((size_t) n > nbytes) n = nbytes;
+    memcpy(buffer, b->data + off, n);
+    ra->pos += n;
+
+    if (n > 0 && ra->pos % ra->bufsize == 0) {
+        // Finished a chunk: read further ahead while access is sequential
+        if (ra->window < ra->n_bufs) ra->window *= 2;
+        if (ra->window > ra->n_bufs) ra->window = ra->n_bufs;
+        pthread_cond_signal(&ra->wanted);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return n;
+}
+
+static off_t ra_seek(hFILE_fd *fp, off_t offset, int whence)
+{
+    struct fd_readahead *ra = fp->ra;
+    off_t pos = lseek(fp->fd, offset, whence);
+    int i;
+    if (pos < 0) return pos;
+
+    pthread_mutex_lock(&ra->lock);
+    int64_t first = ra->pos / ra->bufsize, k = pos / ra->bufsize;
+    if (k < first || k >= first + ra->window) ra->window = 1;
+    ra->pos = pos;
+
+    // The file may have grown since EOF was seen; look again
+    ra->eof_chunk = INT64_MAX;
+    for (i = 0; i < ra->n_bufs; i++)
+        if (!ra->buf[i].busy && ra->buf[i].len >= 0
+            && (size_t) ra->buf[i].len < ra->bufsize)
+            ra->buf[i].chunk = -1;
+
+    pthread_cond_signal(&ra->wanted);
+    pthread_mutex_unlock(&ra->lock);
+
+    return pos;
+}
+
+static void ra_destroy(struct fd_readahead *ra)
+{
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->shutdown = 1;
+    pthread_cond_signal(&ra->wanted);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->wanted);
+    pthread_cond_destroy(&ra->ready);
+    for (i = 0; i < ra->n_bufs; i++)
+        free(ra->buf[i].data);
+    free(ra->buf);
+    free(ra);
+}
+
+int hfile_set_readahead(hFILE *fpv, int n_bufs, size_t bufsize)
+{
+#if defined(HAVE_PREAD) && !defined(_WIN32)
+    hFILE_fd *fp = (hFILE_fd *) fpv;
+    struct fd_readahead *ra;
+    struct stat sbuf;
+    off_t pos;
+    int i;
+
+    if (fpv->backend != &fd_backend || fp->is_socket || !fpv->readonly)
+        return -1;
+    if (fp->ra) return 0;
+    if (fstat(fp->fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)) return -1;
+    if ((pos = lseek(fp->fd, 0, SEEK_CUR)) < 0) return -1;
+
+    if (n_bufs <= 0) n_bufs = HFILE_READAHEAD_BUFS;
+    if (bufsize == 0) bufsize = HFILE_READAHEAD_SIZE;
+
+    ra = (struct fd_readahead *) calloc(1, sizeof(*ra));
+    if (!ra) return -1;
+    ra->buf = (ra_buf *) calloc(n_bufs, sizeof(*ra->buf));
+    if (!ra->buf) goto error;
+    for (i = 0; i < n_bufs; i++) {
+        ra->buf[i].chunk = -1;
+        if (!(ra->buf[i].data = malloc(bufsize))) goto error;
+    }
+    ra->fd = fp->fd;
+    ra->n_bufs = n_bufs;
+    ra->window = 1;
+    ra->bufsize = bufsize;
+    ra->pos = pos;
+    ra->eof_chunk = INT64_MAX;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->wanted, NULL);
+    pthread_cond_init(&ra->ready, NULL);
+    if (pthread_create(&ra->thread, NULL, ra_worker, ra) != 0) {
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->wanted);
+        pthread_cond_destroy(&ra->ready);
+        goto error;
+    }
+
+    fp->ra = ra;
+    return 0;
+
+ error:
+    if (ra->buf)
+        for (i = 0; i < n_bufs; i++) free(ra->buf[i].data);
+    free(ra->buf);
+    free(ra);
+    return -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Write-behind for local files, enabled by the 'd' mode letter.  Writes are
+ * gathered into two large buffers: when one fills, a background thread
+ * writes it out with pwrite() while the caller fills the other.  Where the
+ * file system allows it, O_DIRECT is also set so that output bypasses the
+ * page cache.  Buffer positions then match file offsets modulo
+ * HFILE_DIRECT_ALIGN, so whole aligned blocks can be written straight from
+ * the (aligned) buffer.  Partial blocks at the end of a buffer are carried
+ * over into the next one, and only written with O_DIRECT switched off when
+ * flushing, closing or seeking.
+ */
+
+#define HFILE_WRITEBEHIND_SIZE (4*1024*1024)
+#define HFILE_DIRECT_ALIGN 4096
+
+struct fd_writebehind {
+    int fd;
+    int direct;         // O_DIRECT is in use
+    size_t bufsize, align;
+    char *buf[2];
+    int cur;            // Buffer being filled by the caller
+    size_t start, end;  // Part of buf[cur] holding data
+    off_t base;         // File offset of buf[cur][0]
+
+    // Job for the background thread
+    int pending;
+    const char *job_data;
+    size_t job_start, job_end;
+    off_t job_base;
+    int job_all;        // Also write the partial block at the end
+
+    int err;            // errno of the first failed write
+    int shutdown;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+};
+
+static int writebehind_mode(const char *mode)
+{
+    return strchr(mode, 'd') && strchr(mode, 'w')
+        && !strchr(mode, '+') && !strchr(mode, 'a');
+}
+
+#if defined(HAVE_PWRITE) && !defined(_WIN32)
+// Writes all of data, with O_DIRECT if it's in use and direct is set.
+static int wb_pwrite(struct fd_writebehind *wb, const char *data, size_t len,
+                     off_t off, int direct)
+{
+    int flags = -1, ret = 0;
+    if (len == 0) return 0;
+
+#ifdef O_DIRECT
+    if (wb->direct && !direct) {
+        if ((flags = fcntl(wb->fd, F_GETFL)) < 0
+            || fcntl(wb->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+            return -1;
+    }
+#endif
+
+    while (len > 0) {
+        ssize_t n = pwrite(wb->fd, data, len, off);
+        if (n < 0 && errno == EINTR) continue;
+#ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && wb->direct && flags < 0) {
+            // The file system accepted O_DIRECT but not these writes;
+            // carry on without it
+            int fl = fcntl(wb->fd, F_GETFL);
+            if (fl >= 0 && fcntl(wb->fd, F_SETFL, fl & ~O_DIRECT) == 0) {
+                wb->direct = 0;
+                continue;
+            }
+        }
+#endif
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            ret = -1;
+            break;
+        }
+        data += n, len -= n, off += n;
+    }
+
+#ifdef O_DIRECT
+    if (flags >= 0 && fcntl(wb->fd, F_SETFL, flags) < 0) ret = -1;
+#endif
+    return ret;
+}
+
+static int wb_write_job(struct fd_writebehind *wb, const char *data,
+                        size_t start, size_t end, off_t base, int all)
+{
+    size_t a = wb->align, i = start;
+    size_t head = (start + a - 1) / a * a, body;
+
+    // Partial block at the start (after a seek), then whole blocks
+    if (head > end) head = end;
+    if (wb_pwrite(wb, data + i, head - i, base + i, 0) < 0) return -1;
+    i = head;
+    body = i + (end - i) / a * a;
+    if (wb_pwrite(wb, data + i, body - i, base + i, 1) < 0) return -1;
+    i = body;
+    if (all && wb_pwrite(wb, data + i, end - i, base + i, 0) < 0) return -1;
+    return 0;
+}
+
+static void *wb_worker(void *arg)
+{
+    struct fd_writebehind *wb = (struct fd_writebehind *) arg;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;) {
+        while (!wb->pending && !wb->shutdown)
+            pthread_cond_wait(&wb->work, &wb->lock);
+        if (!wb->pending) break;
+
+        pthread_mutex_unlock(&wb->lock);
+        int ret = wb_write_job(wb, wb->job_data, wb->job_start, wb->job_end,
+                               wb->job_base, wb->job_all);
+        int err = errno;
+        pthread_mutex_lock(&wb->lock);
+
+        if (ret < 0 && !wb->err) wb->err = err ? err : EIO;
+        wb->pending = 0;
+        pthread_cond_signal(&wb->done);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return NULL;
+}
+#endif
+
+// Waits for the background thread to finish its job, and reports any error
+static int wb_wait(struct fd_writebehind *wb)
+{
+    int err;
+    pthread_mutex_lock(&wb->lock);
+    while (wb->pending)
+        pthread_cond_wait(&wb->done, &wb->lock);
+    err = wb->err;
+    pthread_mutex_unlock(&wb->lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Hands the current buffer to the background thread, carrying any partial
+// block at its end over into the other buffer (unless all is set, this is
+// left for a later write).
+static int wb_submit(struct fd_writebehind *wb, int all)
+{
+    size_t a = wb->align, tail = wb->end / a * a, start;
+    const char *data = wb->buf[wb->cur];
+
+    if (wb_wait(wb) < 0) return -1;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->job_data = data;
+    wb->job_start = wb->start;
+    wb->job_end = all ? wb->end : (tail > wb->start ? tail : wb->start);
+    wb->job_base = wb->base;
+    wb->job_all = all;
+    wb->pending = 1;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+
+    start = wb->start > tail ? wb->start - tail : 0;
+    wb->cur ^= 1;
+    memcpy(wb->buf[wb->cur] + start, data + tail + start, wb->end - tail - start);
+    wb->base += tail;
+    wb->start = start;
+    wb->end -= tail;
+    return 0;
+}
+
+static ssize_t wb_write(struct fd_writebehind *wb, const char *buffer,
+                        size_t nbytes)
+{
+    size_t n = wb->bufsize - wb->end;
+    if (n > nbytes) n = nbytes;
+    memcpy(wb->buf[wb->cur] + wb->end, buffer, n);
+    wb->end += n;
+
+    if (wb->end == wb->bufsize && wb_submit(wb, 0) < 0) return -1;
+    return n;
+}
+
+static int wb_flush(struct fd_writebehind *wb)
+{
+    if (wb_submit(wb, 1) < 0) return -1;
+    return wb_wait(wb);
+}
+
+static off_t wb_seek(hFILE_fd *fp, off_t offset, int whence)
+{
+    struct fd_writebehind *wb = fp->wb;
+    off_t pos;
+
+    if (wb_flush(wb) < 0) return -1;
+
+    // pwrite() leaves the fd's own position alone, so only SEEK_END can be
+    // passed through
+    if (whence == SEEK_END) pos = lseek(fp->fd, offset, SEEK_END);
+    else if (whence == SEEK_CUR) pos = wb->base + wb->end + offset;
+    else pos = offset;
+    if (pos < 0) {
+        if (whence != SEEK_END) errno = EINVAL;
+        return -1;
+    }
+
+    wb->base = pos - pos % wb->align;
+    wb->start = wb->end = pos % wb->align;
+    return pos;
+}
+
+static int wb_destroy(struct fd_writebehind *wb)
+{
+    int ret = 0, save = 0;
+
+    if (wb_submit(wb, 1) < 0 || wb_wait(wb) < 0) {
+        ret = -1;
+        save = errno;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    wb->shutdown = 1;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->work);
+    pthread_cond_destroy(&wb->done);
+    free(wb->buf[0]);
+    free(wb->buf[1]);
+    free(wb);
+
+    if (ret < 0) errno = save;
+    return ret;
+}
+
+// Starts write-behind on a newly opened file.  Returns -1, leaving the file
+// to be written normally, if it's not a regular file.
+static int wb_init(hFILE_fd *fp)
+{
+#if defined(HAVE_PWRITE) && !defined(_WIN32)
+    struct fd_writebehind *wb;
+    struct stat sbuf;
+    void *buf[2] = { NULL, NULL };
+    int i;
+
+    if (fstat(fp->fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)) return -1;
+
+    for (i = 0; i < 2; i++)
+        if (posix_memalign(&buf[i], HFILE_DIRECT_ALIGN,
+                           HFILE_WRITEBEHIND_SIZE) != 0)
+            goto error;
+    wb = (struct fd_writebehind *) calloc(1, sizeof(*wb));
+    if (!wb) goto error;
+
+    wb->fd = fp->fd;
+    wb->buf[0] = buf[0];
+    wb->buf[1] = buf[1];
+    wb->bufsize = HFILE_WRITEBEHIND_SIZE;
+    wb->align = 1;
+#ifdef O_DIRECT
+    int flags = fcntl(fp->fd, F_GETFL);
+    if (flags >= 0 && fcntl(fp->fd, F_SETFL, flags | O_DIRECT) == 0) {
+        wb->direct = 1;
+        wb->align = HFILE_DIRECT_ALIGN;
+    }
+#endif
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    pthread_cond_init(&wb->done, NULL);
+    if (pthread_create(&wb->thread, NULL, wb_worker, wb) != 0) {
+#ifdef O_DIRECT
+        if (wb->direct) (void) fcntl(fp->fd, F_SETFL, flags);
+#endif
+        pthread_mutex_destroy(&wb->lock);
+        pthread_cond_destroy(&wb->work);
+        pthread_cond_destroy(&wb->done);
+        free(wb);
+        goto error;
+    }
+
+    fp->wb = wb;
+    return 0;
+
+ error:
+    free(buf[0]);
+    free(buf[1]);
+    return -1;
+#else
+    return -1;
+#endif
+}
+
 static size_t blksize(int fd)
 {
 #ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
@@ -621,12 +1284,25 @@ static hFILE *hopen_fd(const char *filename, const char *mode)
     int fd = open(filename, hfile_oflags(mode), 0666);
     if (fd < 0) goto error;
 
+#ifdef HAVE_MMAP
+    if (strchr(mode, 'm') && strchr(mode, 'r') && !strchr(mode, '+')) {
+        hFILE *mfp = hopen_mmap(fd, mode);
+        if (mfp) {
+            (void) close(fd);
+            return mfp;
+        }
+    }
+#endif
+
     fp = (hFILE_fd *) hfile_init(sizeof (hFILE_fd), mode, blksize(fd));
     if (fp == NULL) goto error;
 
     fp->fd = fd;
     fp->is_socket = 0;
+    fp->ra = NULL;
+    fp->wb = NULL;
     fp->base.backend = &fd_backend;
+    if (writebehind_mode(mode)) (void) wb_init(fp);
     return &fp->base;
 
 error:
@@ -692,6 +1368,8 @@ hFILE *hdopen(int fd, const char *mode)
 
     fp->fd = fd;
     fp->is_socket = (strchr(mode, 's') != NULL);
+    fp->ra = NULL;
+    fp->wb = NULL;
     fp->base.backend = &fd_backend;
     return &fp->base;
 }
@@ -1041,6 +1719,7 @@ static void load_hfile_plugins()
     hfile_add_scheme_handler("file", &file);
     hfile_add_scheme_handler("preload", &preload);
     //init_add_plugin(NULL, hfile_plugin_init_net, "knetfile");
+    init_add_plugin(NULL, hfile_plugin_init_http, "http");
     init_add_plugin(NULL, hfile_plugin_init_mem, "mem");
     init_add_plugin(NULL, hfile_plugin_init_crypt4gh_needed, "crypt4gh-needed");
 
@@ -1121,19 +1800,24 @@ hFILE *hopen(const char *fname, const char *mode, ...)
 {
     const struct hFILE_scheme_handler *handler = find_scheme_handler(fname);
     if (handler) {
+        hFILE *fp;
         if (strchr(mode, ':') == NULL
             || handler->priority < 2000
             || handler->vopen == NULL) {
-            return handler->open(fname, mode);
+            fp = handler->open(fname, mode);
         }
         else {
-            hFILE *fp;
             va_list arg;
             va_start(arg, mode);
             fp = handler->vopen(fname, mode, arg);
             va_end(arg);
-            return fp;
         }
+
+        // Remote files being read may be served from the local disk cache
+        if (fp && strchr(mode, 'r') && !strpbrk(mode, "wa+")
+            && handler->isremote(fname))
+            fp = hfile_cache_wrap(fp, fname);
+        return fp;
     }
     else if (strcmp(fname, "-") == 0) return hopen_fd_stdinout(mode);
     else return hopen_fd(fname, mode);
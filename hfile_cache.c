@@ -0,0 +1,527 @@
+/*  hfile_cache.c -- local disk cache for remote low-level file streams.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Remote files are cached as fixed-size blocks in files below
+ * $HTS_CACHE_DIR/xx/<key>/, where <key> is the MD5 of the URL and the
+ * file's ETag so that a changed remote file gets a fresh set of blocks.
+ * Files without an ETag (or Last-Modified date) are not cached, as there
+ * would be no way to tell that they had been rewritten.  Only the built-in
+ * http backend reports one, so libcurl's files are not cached.  The last block
+ * of a file is the only one that may be short.
+ *
+ * As for the CRAM reference cache, blocks are written to a temporary file
+ * and renamed into place, so concurrent readers only ever see complete
+ * blocks.  Cache hits update the modification time and trimming removes
+ * the least recently used blocks first.
+ */
+
+#define HTS_BUILDING_LIBRARY // Enables HTSLIB_EXPORT, see htslib/hts_defs.h
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+
+#include "htslib/hts.h"
+#include "htslib/hts_log.h"
+#include "htslib/kstring.h"
+#include "hfile_internal.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef _WIN32
+#define mkdir(path, mode) mkdir(path)
+#endif
+
+#define CACHE_BLOCK_SIZE (1024*1024)
+#define CACHE_DEFAULT_MAX_SIZE (1024LL*1024*1024)
+#define CACHE_TMP_MAX_AGE (24*60*60)  // Orphaned temporary files, in seconds
+
+typedef struct {
+    hFILE base;
+    hFILE *remote;
+    char *root;         // $HTS_CACHE_DIR
+    char *dir;          // Directory holding this file's blocks
+    int64_t max_size;   // Bound on the size of the whole cache
+    off_t pos;          // Reader's position
+    off_t size;         // Size of the remote file, or -1 if unknown
+    char *block;        // Contents of the current block
+    int64_t cur;        // Current block, or -1 for none
+    size_t cur_len;
+    int64_t added;      // Bytes stored in the cache via this file
+    int store_failed;
+} hFILE_cache;
+
+typedef struct {
+    char *path;
+    off_t size;
+    time_t mtime;
+} cache_file;
+
+static int64_t cache_max_size(void)
+{
+    char *str = getenv("HTS_CACHE_SIZE"), *end;
+    long long sz;
+
+    if (!str || !*str) return CACHE_DEFAULT_MAX_SIZE;
+
+    sz = hts_parse_decimal(str, &end, 0);
+    if (*end || sz <= 0) {
+        hts_log_warning("Ignoring invalid HTS_CACHE_SIZE \"%s\"", str);
+        return CACHE_DEFAULT_MAX_SIZE;
+    }
+    return sz;
+}
+
+// Makes the directory path and any missing parents up to the cache root
+static int mkdir_prefix(char *path, size_t root_len)
+{
+    char *cp = path + root_len;
+    *cp = '\0';
+    int ret = mkdir(path, 0777);
+    *cp = '/';
+    if (ret < 0 && errno != EEXIST) return -1;
+
+    for (cp++; (cp = strchr(cp, '/')) != NULL; cp++) {
+        *cp = '\0';
+        ret = mkdir(path, 0777);
+        *cp = '/';
+        if (ret < 0 && errno != EEXIST) return -1;
+    }
+    return (mkdir(path, 0777) < 0 && errno != EEXIST)? -1 : 0;
+}
+
+/* Reads all of a cached block, returning its length or -1 if it is absent
+   (or doesn't match the remote file's size, which means it is damaged).  */
+static ssize_t load_cached_block(hFILE_cache *fp, const char *path, int64_t k)
+{
+    size_t got = 0;
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) return -1;
+
+    // Read one byte more than a block so that overlong files are noticed
+    while (got <= CACHE_BLOCK_SIZE) {
+        n = read(fd, fp->block + got, CACHE_BLOCK_SIZE + 1 - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    if (n < 0 || got == 0 || got > CACHE_BLOCK_SIZE) return -1;
+    if (fp->size >= 0 && got != CACHE_BLOCK_SIZE
+        && k * CACHE_BLOCK_SIZE + got != fp->size) return -1;
+
+    // Record the hit for the LRU policy; failure to do so is harmless
+    (void) utime(path, NULL);
+    return got;
+}
+
+static void store_block(hFILE_cache *fp, const char *path)
+{
+    kstring_t tmp = { 0, 0, NULL };
+    size_t done = 0;
+    int fd;
+
+    if (ksprintf(&tmp, "%s.tmp_%ld_%lx", path, (long) getpid(),
+                 (unsigned long) (uintptr_t) fp) < 0) goto fail;
+    fd = open(tmp.s, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        if (mkdir_prefix(fp->dir, strlen(fp->root)) < 0) goto fail;
+        fd = open(tmp.s, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    }
+    if (fd < 0) goto fail;
+
+    while (done < fp->cur_len) {
+        ssize_t n = write(fd, fp->block + done, fp->cur_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (close(fd) < 0 || done < fp->cur_len || rename(tmp.s, path) < 0) {
+        unlink(tmp.s);
+        goto fail;
+    }
+
+    fp->added += done;
+    free(tmp.s);
+    return;
+
+ fail:
+    // Carry on uncached rather than failing the read
+    hts_log_warning("Can't add to cache directory %s: %s",
+                    fp->root, strerror(errno));
+    fp->store_failed = 1;
+    free(tmp.s);
+}
+
+// Makes block k current, from the cache or else from the remote file
+static int load_block(hFILE_cache *fp, int64_t k)
+{
+    kstring_t path = { 0, 0, NULL };
+    off_t off = k * CACHE_BLOCK_SIZE;
+    ssize_t n;
+
+    fp->cur = -1;
+    if (ksprintf(&path, "%s/%"PRId64, fp->dir, k) < 0) return -1;
+
+    if ((n = load_cached_block(fp, path.s, k)) >= 0) {
+        fp->cur_len = n;
+        fp->cur = k;
+        free(path.s);
+        return 0;
+    }
+
+    // Remote streams may not be able to seek, even to where they already are
+    if (htell(fp->remote) != off && hseek(fp->remote, off, SEEK_SET) < 0)
+        goto fail;
+
+    fp->cur_len = 0;
+    while (fp->cur_len < CACHE_BLOCK_SIZE) {
+        n = hread(fp->remote, fp->block + fp->cur_len,
+                  CACHE_BLOCK_SIZE - fp->cur_len);
+        if (n < 0) goto fail;
+        if (n == 0) break;
+        fp->cur_len += n;
+    }
+    fp->cur = k;
+
+    if (fp->cur_len > 0 && !fp->store_failed) store_block(fp, path.s);
+    free(path.s);
+    return 0;
+
+ fail:
+    free(path.s);
+    return -1;
+}
+
+static ssize_t cache_read(hFILE *fpv, void *buffer, size_t nbytes)
+{
+    hFILE_cache *fp = (hFILE_cache *) fpv;
+    int64_t k = fp->pos / CACHE_BLOCK_SIZE;
+    size_t off = fp->pos - k * CACHE_BLOCK_SIZE;
+
+    if (fp->size >= 0 && fp->pos >= fp->size) return 0;
+    if (fp->cur != k && load_block(fp, k) < 0) return -1;
+
+    if (off >= fp->cur_len) return 0;
+    if (nbytes > fp->cur_len - off) nbytes = fp->cur_len - off;
+    memcpy(buffer, fp->block + off, nbytes);
+    fp->pos += nbytes;
+    return nbytes;
+}
+
+static ssize_t cache_write(hFILE *fpv, const void *buffer, size_t nbytes)
+{
+    errno = EROFS;
+    return -1;
+}
+
+static off_t cache_seek(hFILE *fpv, off_t offset, int whence)
+{
+    hFILE_cache *fp = (hFILE_cache *) fpv;
+    off_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = fp->pos + offset; break;
+    case SEEK_END:
+        if (fp->size < 0) { errno = ESPIPE; return -1; }
+        pos = fp->size + offset;
+        break;
+    default: errno = EINVAL; return -1;
+    }
+
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return fp->pos = pos;
+}
+
+// Whether s is exactly n lower case hex digits, as from hts_md5_hex()
+static int is_hex_name(const char *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+            return 0;
+    return s[n] == '\0';
+}
+
+// Returns the end of the block number s starts with, or NULL if it doesn't
+static const char *block_number_end(const char *s)
+{
+    const char *cp = s;
+    while (*cp >= '0' && *cp <= '9') cp++;
+    if (cp == s || (s[0] == '0' && cp > s + 1)) return NULL;
+    return cp;
+}
+
+// Whether s is the name of a block, or of one of store_block()'s
+// temporary files (setting *tmp)
+static int is_block_name(const char *s, int *tmp)
+{
+    const char *cp = block_number_end(s);
+
+    *tmp = 0;
+    if (!cp) return 0;
+    if (*cp == '\0') return 1;
+
+    // <block>.tmp_<pid>_<hex>
+    if (strncmp(cp, ".tmp_", 5) != 0) return 0;
+    for (cp += 5; *cp >= '0' && *cp <= '9'; cp++) {}
+    if (*cp++ != '_' || *cp == '\0') return 0;
+    for (; *cp; cp++)
+        if (!((*cp >= '0' && *cp <= '9') || (*cp >= 'a' && *cp <= 'f')))
+            return 0;
+    return *tmp = 1;
+}
+
+/*
+ * Lists the cached blocks below dir, appending them to *files.  Only the
+ * layout that hfile_cache_wrap() makes is looked at: the root (depth 0)
+ * holds "xx" directories, each holding "<md5>" directories whose names
+ * start with xx, which hold the blocks named by their numbers.  Anything
+ * else is left alone, so that other files in HTS_CACHE_DIR are never
+ * evicted.  Temporary files old enough to have been orphaned by a crashed
+ * writer are removed.
+ */
+static int cache_scan(const char *dir, int depth, const char *prefix,
+                      time_t now, cache_file **files, size_t *nfiles,
+                      size_t *afiles, int64_t *total)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat sb;
+    kstring_t path = { 0, 0, NULL };
+    int ret = 0, tmp = 0;
+
+    if (!(d = opendir(dir))) return 0; // Vanished; not fatal
+
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+
+        if (depth == 0 && !is_hex_name(name, 2)) continue;
+        if (depth == 1 && !(is_hex_name(name, 32)
+                            && strncmp(name, prefix, 2) == 0)) continue;
+        if (depth == 2 && !is_block_name(name, &tmp)) continue;
+
+        path.l = 0;
+        if (ksprintf(&path, "%s/%s", dir, name) < 0) {
+            ret = -1;
+            break;
+        }
+        if (stat(path.s, &sb) != 0) continue;
+
+        if (depth < 2) {
+            if (S_ISDIR(sb.st_mode)
+                && cache_scan(path.s, depth + 1, name, now,
+                              files, nfiles, afiles, total) < 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        if (!S_ISREG(sb.st_mode)) continue;
+
+        if (tmp) {
+            if (now - sb.st_mtime > CACHE_TMP_MAX_AGE) unlink(path.s);
+            continue;
+        }
+
+        if (*nfiles == *afiles) {
+            size_t new_sz = *afiles ? *afiles * 2 : 256;
+            cache_file *f = realloc(*files, new_sz * sizeof (*f));
+            if (!f) {
+                ret = -1;
+                break;
+            }
+            *files = f;
+            *afiles = new_sz;
+        }
+
+        (*files)[*nfiles].path = ks_release(&path);
+        (*files)[*nfiles].size = sb.st_size;
+        (*files)[*nfiles].mtime = sb.st_mtime;
+        (*nfiles)++;
+        *total += sb.st_size;
+    }
+
+    free(path.s);
+    closedir(d);
+    return ret;
+}
+
+static int cache_file_cmp(const void *av, const void *bv)
+{
+    const cache_file *a = (const cache_file *) av;
+    const cache_file *b = (const cache_file *) bv;
+    return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+// Evicts the least recently used blocks until the cache fits in max_size
+static void cache_trim(const char *root, int64_t max_size)
+{
+    cache_file *files = NULL;
+    size_t nfiles = 0, afiles = 0, i;
+    int64_t total = 0;
+
+    if (cache_scan(root, 0, NULL, time(NULL),
+                   &files, &nfiles, &afiles, &total) < 0) {
+        hts_log_warning("Failed to scan cache directory %s", root);
+        goto out;
+    }
+
+    if (total > max_size) {
+        qsort(files, nfiles, sizeof (*files), cache_file_cmp);
+        for (i = 0; i < nfiles && total > max_size; i++) {
+            char *slash;
+            hts_log_debug("Evicting cached block '%s'", files[i].path);
+            if (unlink(files[i].path) == 0 || errno == ENOENT)
+                total -= files[i].size;
+            // Remove the file's directories if that was its last block.
+            // The path is <root>/xx/<md5>/<block>, so these are both
+            // directories made by the cache below the root.
+            if ((slash = strrchr(files[i].path, '/')) != NULL) {
+                *slash = '\0';
+                if (rmdir(files[i].path) == 0
+                    && (slash = strrchr(files[i].path, '/')) != NULL) {
+                    *slash = '\0';
+                    (void) rmdir(files[i].path);
+                }
+            }
+        }
+    }
+
+ out:
+    for (i = 0; i < nfiles; i++) free(files[i].path);
+    free(files);
+}
+
+static int cache_close(hFILE *fpv)
+{
+    hFILE_cache *fp = (hFILE_cache *) fpv;
+    int ret = hclose(fp->remote);
+
+    if (fp->added > 0) cache_trim(fp->root, fp->max_size);
+    free(fp->block);
+    free(fp->root);
+    free(fp->dir);
+    return ret;
+}
+
+static const struct hFILE_backend cache_backend =
+{
+    cache_read, cache_write, cache_seek, NULL, cache_close
+};
+
+hFILE *hfile_cache_wrap(hFILE *remote, const char *url)
+{
+    const char *root = getenv("HTS_CACHE_DIR");
+    const char *etag = hfile_http_etag(remote);
+    hts_md5_context *md5 = NULL;
+    unsigned char digest[16];
+    char hex[33];
+    kstring_t key = { 0, 0, NULL }, dir = { 0, 0, NULL };
+    hFILE_cache *fp = NULL;
+    off_t size;
+    size_t root_len;
+
+    // Only hierarchical URLs name files worth caching; not e.g. mem:
+    if (!root || !*root || !strstr(url, "://")) return remote;
+
+    // Without a validator, an object rewritten in place would be served
+    // from stale blocks
+    if (!etag) {
+        hts_log_debug("Not caching %s: it has no ETag", url);
+        return remote;
+    }
+
+    root_len = strlen(root);
+    while (root_len > 1 && root[root_len-1] == '/') root_len--;
+
+    size = hseek(remote, 0, SEEK_END);
+    if (size >= 0 && hseek(remote, 0, SEEK_SET) != 0) {
+        // Backends that can find the end should be able to come back
+        hts_log_warning("Not caching %s: can't seek", url);
+        return remote;
+    }
+    if (size < 0) remote->has_errno = 0;
+
+    if (ksprintf(&key, "%s\netag=%s", url, etag) < 0
+        || !(md5 = hts_md5_init())) goto fail;
+    hts_md5_update(md5, key.s, key.l);
+    hts_md5_final(digest, md5);
+    hts_md5_hex(hex, digest);
+
+    if (ksprintf(&dir, "%.*s/%.2s/%s", (int) root_len, root, hex, hex) < 0)
+        goto fail;
+
+    fp = (hFILE_cache *) hfile_init(sizeof (hFILE_cache), "r", 0);
+    if (fp == NULL) goto fail;
+    fp->remote = remote;
+    fp->dir = ks_release(&dir);
+    fp->root = strdup(root);
+    fp->block = malloc(CACHE_BLOCK_SIZE + 1);
+    if (!fp->root || !fp->block) {
+        free(fp->root);
+        free(fp->dir);
+        free(fp->block);
+        hfile_destroy(&fp->base);
+        goto fail;
+    }
+    fp->root[root_len] = '\0';
+    fp->max_size = cache_max_size();
+    fp->pos = 0;
+    fp->size = size;
+    fp->cur = -1;
+    fp->cur_len = 0;
+    fp->added = 0;
+    fp->store_failed = 0;
+    fp->base.backend = &cache_backend;
+
+    hts_md5_destroy(md5);
+    free(key.s);
+    return &fp->base;
+
+ fail:
+    hts_log_warning("Not caching %s: %s", url, strerror(errno));
+    if (md5) hts_md5_destroy(md5);
+    free(key.s);
+    free(dir.s);
+    return remote;
+}
@@ -0,0 +1,1418 @@
+/*  hfile_http.c -- built-in HTTP backend for low-level file streams.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Reads http:// URLs without needing libcurl, for which it steps aside when
+ * that plugin is available.  Objects are fetched in fixed-size chunks by
+ * "Range:" requests, each of several threads keeping its own keep-alive
+ * connection to the server.  Chunk k is held in slot k % n_bufs of a
+ * reorder buffer, so the reader takes chunks in order however they arrive.
+ * As for local read-ahead, the number of chunks fetched ahead of the read
+ * position starts at one after a seek and doubles while reading sequentially,
+ * so index queries don't pull in much more than they use while streaming
+ * keeps every connection busy.
+ *
+ * Servers that ignore "Range:" are read as a plain stream on one connection,
+ * which can't seek.  There is no TLS, so https:// needs libcurl.
+ *
+ * Files opened for writing are sent as the chunked body of a single PUT
+ * request.  With the hopen() option "upload" set to "s3", they are instead
+ * uploaded with the S3 multipart upload protocol by hfile_upload_open(),
+ * with each part in flight on a connection of its own.  Requests are not
+ * signed, so the store must accept them as they are or via credentials
+ * passed in "httphdr" headers.
+ */
+
+#define HTS_BUILDING_LIBRARY // Enables HTSLIB_EXPORT, see htslib/hts_defs.h
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define close_socket closesocket
+#else
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#define close_socket close
+#endif
+
+#include <pthread/include/pthread.h>
+
+#include "htslib/hts.h"
+#include "htslib/hts_log.h"
+#include "htslib/kstring.h"
+#include "hfile_internal.h"
+
+#ifndef EPROTONOSUPPORT
+#define EPROTONOSUPPORT ENOSYS
+#endif
+#ifndef ENOTSUP
+#define ENOTSUP EIO
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define HTTP_CHUNK_SIZE (1024*1024)
+#define HTTP_CONNECTIONS 4
+#define HTTP_MAX_REDIRECTS 5
+#define HTTP_HEADER_MAX 16384
+#define HTTP_BODY_MAX (1024*1024)  // Largest response body we'll hold
+#define HTTP_PART_SIZE (8*1024*1024)
+#define HTTP_RETRIES 3
+#define HTTP_TIMEOUT 60    // Seconds to wait on a stalled connection
+
+struct hFILE_http;
+
+typedef struct {
+    struct hFILE_http *fp;
+    int fd;             // Socket, or -1 when not connected
+    char buf[HTTP_HEADER_MAX];
+    size_t pos, len;    // Received but not yet used bytes of buf
+    int busy;           // In use for an upload request
+    pthread_t thread;
+} http_conn;
+
+typedef struct {
+    char *data;
+    int64_t chunk;      // Chunk held in this slot, or -1 for none
+    ssize_t len;        // Bytes held, less than chunk_size only at EOF
+    int err;            // errno, if len < 0
+    int busy;           // Being fetched
+} http_buf;
+
+typedef struct {
+    int status;
+    int keep_alive;
+    int chunked;
+    int64_t content_length;         // -1 if not given
+    int64_t range_start, total;     // From Content-Range:, or -1
+    char *location;
+    char *etag;                     // ETag:, or failing that Last-Modified:
+} http_response;
+
+typedef struct hFILE_http {
+    hFILE base;
+    char *host, *port, *path;
+    kstring_t headers;  // Extra request headers, each ending in CRLF
+    char *etag;         // Version of the object we opened, or NULL
+    size_t chunk_size;
+    int n_conns, n_bufs, window;
+    int ranges;         // Server honours Range:, else we're streaming
+    int64_t size;       // Object size, or -1 if unknown
+    int64_t stream_left;// Bytes left in a streamed body, or -1 if unknown
+    off_t pos;          // Reader's position
+    int64_t eof_chunk;  // First chunk seen to be short
+    http_buf *buf;
+    http_conn *conn;
+    int n_threads, shutdown;
+    int s3_upload;      // Upload with the S3 multipart protocol
+    size_t part_size;   // For S3 uploads
+    int retries;
+    int timeout;        // Seconds, for connecting, sending and receiving
+    char *upload_id;
+    pthread_mutex_t lock;
+    pthread_cond_t wanted, ready;
+} hFILE_http;
+
+static int http_status_errno(int status)
+{
+    if (status >= 200 && status < 300) return 0;
+    switch (status) {
+    case 401: case 407: return EPERM;
+    case 403: return EACCES;
+    case 404: case 410: return ENOENT;
+    case 405: case 501: return EROFS;
+    case 408: case 504: return ETIMEDOUT;
+    default: return EIO;
+    }
+}
+
+// Splits an http:// URL into its host, port and path (including any query)
+static int parse_url(hFILE_http *fp, const char *url)
+{
+    const char *host, *end, *colon;
+    size_t len;
+
+    if (strncasecmp(url, "http://", 7) != 0) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    host = url + 7;
+    end = host + strcspn(host, "/?#");
+    if (end == host || memchr(host, '@', end - host)) {
+        errno = EINVAL;  // No host, or user:password@ which we don't support
+        return -1;
+    }
+
+    colon = (*host == '[')? memchr(host, ']', end - host) : host;
+    colon = colon? memchr(colon, ':', end - colon) : NULL;
+
+    free(fp->host); free(fp->port); free(fp->path);
+    fp->port = strdup(colon && colon + 1 < end ? colon + 1 : "80");
+    if (fp->port && colon) fp->port[end - colon - 1] = '\0';
+    if (!colon) colon = end;
+    if (*host == '[' && colon > host + 1 && colon[-1] == ']') host++, colon--;
+    fp->host = malloc(colon - host + 1);
+    if (fp->host) {
+        memcpy(fp->host, host, colon - host);
+        fp->host[colon - host] = '\0';
+    }
+
+    len = strcspn(end, "#");
+    fp->path = malloc(len + 2);
+    if (fp->path) {
+        fp->path[0] = '/';
+        memcpy(fp->path + (*end != '/'), end, len);
+        fp->path[len + (*end != '/')] = '\0';
+    }
+
+    return (fp->host && fp->port && fp->path)? 0 : -1;
+}
+
+static void http_disconnect(http_conn *c)
+{
+    if (c->fd >= 0) close_socket(c->fd);
+    c->fd = -1;
+    c->pos = c->len = 0;
+}
+
+// Sets errno from the failure of the last socket call.  Winsock reports
+// errors through WSAGetLastError() rather than errno, and a send or receive
+// timeout (see set_timeouts()) otherwise shows up as EAGAIN.
+static void socket_errno(void)
+{
+#ifdef _WIN32
+    switch (WSAGetLastError()) {
+    case WSAEINTR:        errno = EINTR; break;
+    case WSAEWOULDBLOCK:
+    case WSAETIMEDOUT:    errno = ETIMEDOUT; break;
+    case WSAECONNREFUSED: errno = ECONNREFUSED; break;
+    case WSAECONNRESET:
+    case WSAECONNABORTED: errno = ECONNRESET; break;
+    case WSAENETUNREACH:
+    case WSAEHOSTUNREACH: errno = EHOSTUNREACH; break;
+    default:              errno = EIO; break;
+    }
+#else
+    if (errno == EAGAIN || errno == EWOULDBLOCK) errno = ETIMEDOUT;
+#endif
+}
+
+// Limits how long sends and receives on fd may block.  On Linux this also
+// bounds connect(); elsewhere that is left to the system's own timeout.
+static void set_timeouts(int fd, int secs)
+{
+    if (secs <= 0) return;
+#ifdef _WIN32
+    DWORD ms = (DWORD) secs * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *) &ms, sizeof ms);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *) &ms, sizeof ms);
+#else
+    struct timeval tv;
+    tv.tv_sec = secs;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *) &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void *) &tv, sizeof tv);
+#endif
+}
+
+static int http_connect(http_conn *c)
+{
+    hFILE_http *fp = c->fp;
+    struct addrinfo hints, *res, *ai;
+    int ret;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo(fp->host, fp->port, &hints, &res)) != 0) {
+        hts_log_error("Can't resolve \"%s\": %s", fp->host, gai_strerror(ret));
+        errno = EIO;
+        return -1;
+    }
+
+    errno = 0;
+    for (ai = res; ai; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            socket_errno();
+            continue;
+        }
+        set_timeouts(fd, fp->timeout);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            // Requests are sent whole, so don't hold them back
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &on, sizeof on);
+#ifdef SO_NOSIGPIPE
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *) &on, sizeof on);
+#endif
+            c->fd = fd;
+            break;
+        }
+        socket_errno();
+        close_socket(fd);
+    }
+    freeaddrinfo(res);
+
+    c->pos = c->len = 0;
+    if (c->fd < 0) {
+        if (errno == 0) errno = ECONNREFUSED;
+        return -1;
+    }
+    return 0;
+}
+
+static int send_all(http_conn *c, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(c->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) socket_errno();
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = EIO;
+        if (n <= 0) return -1;
+        data += n, len -= n;
+    }
+    return 0;
+}
+
+// Receives more into c->buf, returning the number of bytes (0 at EOF)
+static ssize_t recv_more(http_conn *c)
+{
+    ssize_t n;
+    if (c->pos > 0) {
+        memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+        c->len -= c->pos;
+        c->pos = 0;
+    }
+    if (c->len == sizeof c->buf) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    do {
+        n = recv(c->fd, c->buf + c->len, sizeof c->buf - c->len, 0);
+        if (n < 0) socket_errno();
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) c->len += n;
+    return n;
+}
+
+// Reads up to len bytes of body, returning how many (0 at EOF)
+static ssize_t read_body(http_conn *c, char *dest, size_t len)
+{
+    ssize_t n;
+    if (c->pos < c->len) {
+        n = c->len - c->pos;
+        if (n > len) n = len;
+        memcpy(dest, c->buf + c->pos, n);
+        c->pos += n;
+        return n;
+    }
+    do {
+        n = recv(c->fd, dest, len, 0);
+        if (n < 0) socket_errno();
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static int header_is(const char *line, const char *name, const char **value)
+{
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) != 0 || line[len] != ':') return 0;
+    for (line += len + 1; *line == ' ' || *line == '\t'; line++) {}
+    *value = line;
+    return 1;
+}
+
+// Parses the status line and headers, which are NUL-terminated lines
+static int parse_response(char *hdr, http_response *r)
+{
+    char *line, *next;
+    const char *v;
+    int minor;
+
+    memset(r, 0, sizeof *r);
+    r->content_length = r->range_start = r->total = -1;
+    if (sscanf(hdr, "HTTP/1.%d %d", &minor, &r->status) != 2) return -1;
+    r->keep_alive = (minor >= 1);
+
+    for (line = hdr + strlen(hdr) + 1; *line; line = next) {
+        next = line + strlen(line) + 1;
+        if (header_is(line, "Content-Length", &v)) {
+            r->content_length = strtoll(v, NULL, 10);
+        } else if (header_is(line, "Content-Range", &v)) {
+            char *end;
+            if (strncasecmp(v, "bytes ", 6) != 0) return -1;
+            v += 6;
+            if (*v != '*') r->range_start = strtoll(v, NULL, 10);
+            if ((end = strchr(v, '/')) != NULL && end[1] != '*')
+                r->total = strtoll(end + 1, NULL, 10);
+        } else if (header_is(line, "Connection", &v)) {
+            if (strncasecmp(v, "close", 5) == 0) r->keep_alive = 0;
+            else if (strncasecmp(v, "keep-alive", 10) == 0) r->keep_alive = 1;
+        } else if (header_is(line, "Transfer-Encoding", &v)) {
+            if (strncasecmp(v, "identity", 8) != 0) r->chunked = 1;
+        } else if (header_is(line, "Location", &v)) {
+            r->location = (char *) v;
+        } else if (header_is(line, "ETag", &v)) {
+            r->etag = (char *) v;
+        } else if (header_is(line, "Last-Modified", &v)) {
+            if (!r->etag) r->etag = (char *) v;
+        }
+    }
+    return 0;
+}
+
+// Formats the request line and headers, without the blank line ending them
+static int request_head(hFILE_http *fp, const char *method, const char *query,
+                        kstring_t *req)
+{
+    ksprintf(req, "%s %s%s%s HTTP/1.1\r\nHost: %s%s%s\r\n"
+             "User-Agent: htslib/%s\r\n", method, fp->path,
+             query ? (strchr(fp->path, '?') ? "&" : "?") : "",
+             query ? query : "", fp->host,
+             strcmp(fp->port, "80") ? ":" : "",
+             strcmp(fp->port, "80") ? fp->port : "", hts_version());
+    if (fp->headers.l) kputsn(fp->headers.s, fp->headers.l, req);
+    return req->s ? 0 : -1;
+}
+
+/* Reads the response headers into hdr and parses them into r.  Returns 0 on
+   success, -1 with errno set on failure, or -2 if the connection was closed
+   before any of the response arrived.  */
+static int read_response(http_conn *c, kstring_t *hdr, http_response *r)
+{
+    char *eoh = NULL, *line, *nl;
+    ssize_t n = 1;
+
+    // Look for the blank line ending the headers
+    while (!eoh) {
+        char *p;
+        for (p = c->buf + c->pos; p + 1 < c->buf + c->len; p++) {
+            if (p[0] == '\n' && p[1] == '\n') { eoh = p + 2; break; }
+            if (p[0] == '\n' && p[1] == '\r' && p + 2 < c->buf + c->len
+                && p[2] == '\n') { eoh = p + 3; break; }
+        }
+        if (!eoh && (n = recv_more(c)) <= 0) break;
+    }
+    if (!eoh) {
+        int empty = (c->len == c->pos);
+        http_disconnect(c);
+        if (n == 0) errno = EIO;
+        return (n <= 0 && empty)? -2 : -1;
+    }
+
+    // Copy as NUL-terminated lines, ending with an empty one
+    line = c->buf + c->pos;
+    hdr->l = 0;
+    while ((nl = memchr(line, '\n', eoh - line)) != NULL) {
+        size_t len = nl - line;
+        if (len > 0 && line[len-1] == '\r') len--;
+        if (kputsn(line, len, hdr) < 0 || kputc('\0', hdr) < 0) break;
+        line = nl + 1;
+    }
+    c->pos = eoh - c->buf;
+    if (line != eoh) return -1;
+
+    if (parse_response(hdr->s, r) < 0) {
+        hts_log_error("Malformed HTTP response from %s", c->fp->host);
+        http_disconnect(c);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends a request for bytes [start,end] (or the whole object if start < 0)
+   with query appended to the path and the given body, if any, and reads
+   the response headers into hdr.  A kept-alive connection may have been
+   closed by the server while idle, so failures on one are retried once on
+   a new connection.  */
+static int http_request(http_conn *c, const char *method, const char *query,
+                        int64_t start, int64_t end,
+                        const char *body, size_t body_len,
+                        kstring_t *hdr, http_response *r)
+{
+    hFILE_http *fp = c->fp;
+    kstring_t req = { 0, 0, NULL };
+    int attempt, ret = -1;
+
+    request_head(fp, method, query, &req);
+    if (start >= 0)
+        ksprintf(&req, "Range: bytes=%"PRId64"-%"PRId64"\r\n", start, end);
+    if (body) ksprintf(&req, "Content-Length: %zu\r\n", body_len);
+    if (kputs("\r\n", &req) < 0) {
+        free(req.s);
+        return -1;
+    }
+
+    for (attempt = 0; attempt < 2 && ret < 0; attempt++) {
+        int reused = (c->fd >= 0);
+
+        if (!reused && http_connect(c) < 0) break;
+        if (send_all(c, req.s, req.l) < 0
+            || (body && send_all(c, body, body_len) < 0)) {
+            http_disconnect(c);
+            if (reused) continue;
+            break;
+        }
+
+        ret = read_response(c, hdr, r);
+        if (ret == -2 && reused) continue;
+        if (ret < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(req.s);
+    return ret < 0 ? -1 : 0;
+}
+
+/* Reads a complete ranged response body for chunk k into b, which must be
+   marked busy.  Returns 0 (setting b->len) or -1 with errno set.  */
+static int fetch_chunk(http_conn *c, http_buf *b, int64_t k)
+{
+    hFILE_http *fp = c->fp;
+    int64_t start = k * fp->chunk_size, end = start + fp->chunk_size - 1;
+    kstring_t hdr = { 0, 0, NULL };
+    http_response r;
+    int ret = -1;
+
+    if (fp->size >= 0 && end >= fp->size) end = fp->size - 1;
+    if (end < start) {
+        b->len = 0;
+        return 0;
+    }
+
+    if (http_request(c, "GET", NULL, start, end, NULL, 0, &hdr, &r) < 0)
+        goto out;
+
+    if (r.status == 416) {
+        b->len = 0;
+        ret = 0;
+    } else if (r.status != 206 || r.range_start != start || r.chunked
+               || r.content_length < 0
+               || r.content_length > (int64_t) fp->chunk_size) {
+        hts_log_error("Unexpected response to range request for %s: %d",
+                      fp->path, r.status);
+        errno = r.status == 206 ? EIO : http_status_errno(r.status);
+        if (errno == 0) errno = EIO;
+        http_disconnect(c);
+        goto out;
+    } else if (fp->etag && r.etag && strcmp(fp->etag, r.etag) != 0) {
+        hts_log_error("%s changed on the server while being read", fp->path);
+        errno = EIO;
+        http_disconnect(c);
+        goto out;
+    } else {
+        size_t got = 0;
+        while (got < r.content_length) {
+            ssize_t n = read_body(c, b->data + got, r.content_length - got);
+            if (n <= 0) {
+                if (n == 0) errno = EIO;
+                http_disconnect(c);
+                goto out;
+            }
+            got += n;
+        }
+        b->len = got;
+        ret = 0;
+    }
+
+    if (!r.keep_alive) http_disconnect(c);
+
+ out:
+    free(hdr.s);
+    return ret;
+}
+
+// Reads a line of a response, without its line ending, into line
+static int read_line(http_conn *c, char *line, size_t size)
+{
+    char *nl;
+    size_t len;
+
+    while (!(nl = memchr(c->buf + c->pos, '\n', c->len - c->pos))) {
+        ssize_t n = recv_more(c);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+    }
+
+    len = nl - (c->buf + c->pos);
+    if (len > 0 && nl[-1] == '\r') len--;
+    if (len >= size) len = size - 1;
+    memcpy(line, c->buf + c->pos, len);
+    line[len] = '\0';
+    c->pos = nl + 1 - c->buf;
+    return 0;
+}
+
+static int read_exactly(http_conn *c, kstring_t *body, size_t len)
+{
+    if (body->l + len > HTTP_BODY_MAX || ks_resize(body, body->l + len + 1) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = read_body(c, body->s + body->l, len);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        body->l += n;
+        len -= n;
+    }
+    body->s[body->l] = '\0';
+    return 0;
+}
+
+// Reads all of a short response body, such as a status or error document
+static int read_small_body(http_conn *c, const http_response *r,
+                           kstring_t *body)
+{
+    char line[256];
+    ssize_t n;
+
+    body->l = 0;
+    if (ks_resize(body, 1) < 0) return -1;
+    body->s[0] = '\0';
+    if (r->status < 200 || r->status == 204 || r->status == 304) return 0;
+
+    if (r->chunked) {
+        for (;;) {
+            size_t size;
+            if (read_line(c, line, sizeof line) < 0) return -1;
+            if ((size = strtoul(line, NULL, 16)) == 0) break;
+            if (read_exactly(c, body, size) < 0
+                || read_line(c, line, sizeof line) < 0) return -1;
+        }
+        // Skip any trailer headers
+        do {
+            if (read_line(c, line, sizeof line) < 0) return -1;
+        } while (line[0]);
+        return 0;
+    }
+
+    if (r->content_length >= 0)
+        return read_exactly(c, body, r->content_length);
+
+    // Otherwise the body runs until the server closes the connection
+    while ((n = read_body(c, line, sizeof line)) > 0)
+        if (body->l + n > HTTP_BODY_MAX || kputsn(line, n, body) < 0) {
+            errno = EIO;
+            return -1;
+        }
+    http_disconnect(c);
+    return (n < 0)? -1 : 0;
+}
+
+static void *http_worker(void *arg)
+{
+    http_conn *c = (http_conn *) arg;
+    hFILE_http *fp = c->fp;
+
+    pthread_mutex_lock(&fp->lock);
+    while (!fp->shutdown) {
+        int64_t first = fp->pos / fp->chunk_size, k;
+        int64_t last = first + fp->window - 1;
+        http_buf *b = NULL;
+
+        if (fp->size >= 0 && last > (fp->size - 1) / (int64_t) fp->chunk_size)
+            last = (fp->size - 1) / (int64_t) fp->chunk_size;
+        if (fp->size >= 0 && fp->pos >= fp->size)
+            last = -1;  // Nothing to read there, e.g. after seeking to the end
+        for (k = first; k <= last && k <= fp->eof_chunk; k++) {
+            http_buf *s = &fp->buf[k % fp->n_bufs];
+            if (s->chunk != k && !s->busy) {
+                b = s;
+                break;
+            }
+        }
+        if (!b) {
+            pthread_cond_wait(&fp->wanted, &fp->lock);
+            continue;
+        }
+
+        b->chunk = k;
+        b->busy = 1;
+        pthread_mutex_unlock(&fp->lock);
+
+        int ret = fetch_chunk(c, b, k);
+        int err = errno;
+
+        pthread_mutex_lock(&fp->lock);
+        b->busy = 0;
+        if (ret < 0) {
+            b->len = -1;
+            b->err = err;
+        } else if (b->len < fp->chunk_size && k < fp->eof_chunk) {
+            fp->eof_chunk = k;
+        }
+        pthread_cond_broadcast(&fp->ready);
+    }
+    pthread_mutex_unlock(&fp->lock);
+
+    return NULL;
+}
+
+static ssize_t http_read(hFILE *fpv, void *buffer, size_t nbytes)
+{
+    hFILE_http *fp = (hFILE_http *) fpv;
+    int64_t k;
+    http_buf *b;
+    size_t off;
+    ssize_t n;
+
+    if (!fp->ranges) {
+        if (fp->stream_left == 0) return 0;
+        if (fp->stream_left > 0 && nbytes > fp->stream_left)
+            nbytes = fp->stream_left;
+        n = read_body(&fp->conn[0], buffer, nbytes);
+        if (n == 0 && fp->stream_left > 0) {
+            errno = EIO;  // Truncated
+            return -1;
+        }
+        if (n > 0) {
+            fp->pos += n;
+            if (fp->stream_left > 0) fp->stream_left -= n;
+        }
+        return n;
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    for (;;) {
+        k = fp->pos / fp->chunk_size;
+        b = &fp->buf[k % fp->n_bufs];
+        if (b->chunk == k && !b->busy) break;
+        if (k > fp->eof_chunk || (fp->size >= 0 && fp->pos >= fp->size)) {
+            pthread_mutex_unlock(&fp->lock);
+            return 0;
+        }
+        pthread_cond_broadcast(&fp->wanted);
+        pthread_cond_wait(&fp->ready, &fp->lock);
+    }
+
+    if (b->len < 0) {
+        // Forget the failed chunk so that a later read tries again
+        b->chunk = -1;
+        errno = b->err;
+        pthread_mutex_unlock(&fp->lock);
+        return -1;
+    }
+
+    off = fp->pos - k * fp->chunk_size;
+    n = off < (size_t) b->len ? b->len - off : 0;
+    if ((size_t) n > nbytes) n = nbytes;
+    memcpy(buffer, b->data + off, n);
+    fp->pos += n;
+
+    if (n > 0 && fp->pos % fp->chunk_size == 0) {
+        // Finished a chunk: fetch further ahead while reading sequentially
+        fp->window *= 2;
+        if (fp->window > fp->n_bufs) fp->window = fp->n_bufs;
+        pthread_cond_broadcast(&fp->wanted);
+    }
+    pthread_mutex_unlock(&fp->lock);
+
+    return n;
+}
+
+static ssize_t http_write(hFILE *fpv, const void *buffer, size_t nbytes)
+{
+    errno = EROFS;
+    return -1;
+}
+
+static off_t http_seek(hFILE *fpv, off_t offset, int whence)
+{
+    hFILE_http *fp = (hFILE_http *) fpv;
+    off_t pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = fp->pos + offset; break;
+    case SEEK_END:
+        if (fp->size < 0) { errno = ESPIPE; return -1; }
+        pos = fp->size + offset;
+        break;
+    default: errno = EINVAL; return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!fp->ranges) {
+        if (pos == fp->pos) return pos;
+        errno = ESPIPE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    int64_t first = fp->pos / fp->chunk_size, k = pos / fp->chunk_size;
+    if (k < first || k >= first + fp->window) fp->window = 1;
+    fp->pos = pos;
+    pthread_cond_broadcast(&fp->wanted);
+    pthread_mutex_unlock(&fp->lock);
+
+    return pos;
+}
+
+static void http_init(hFILE_http *fp)
+{
+    fp->host = fp->port = fp->path = NULL;
+    fp->headers.l = fp->headers.m = 0; fp->headers.s = NULL;
+    fp->chunk_size = HTTP_CHUNK_SIZE;
+    fp->n_conns = HTTP_CONNECTIONS;
+    fp->n_bufs = fp->n_threads = fp->shutdown = 0;
+    fp->window = 1;
+    fp->size = fp->stream_left = -1;
+    fp->pos = 0;
+    fp->eof_chunk = INT64_MAX;
+    fp->buf = NULL;
+    fp->conn = NULL;
+    fp->etag = NULL;
+    fp->s3_upload = 0;
+    fp->part_size = HTTP_PART_SIZE;
+    fp->retries = HTTP_RETRIES;
+    fp->timeout = HTTP_TIMEOUT;
+    fp->upload_id = NULL;
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->wanted, NULL);
+    pthread_cond_init(&fp->ready, NULL);
+}
+
+static int http_alloc_conns(hFILE_http *fp)
+{
+    int i;
+    if (!(fp->conn = (http_conn *) calloc(fp->n_conns, sizeof (http_conn))))
+        return -1;
+    for (i = 0; i < fp->n_conns; i++) {
+        fp->conn[i].fp = fp;
+        fp->conn[i].fd = -1;
+    }
+    return 0;
+}
+
+// Frees everything but the hFILE_http itself
+static void http_free(hFILE_http *fp)
+{
+    int i;
+
+    if (fp->conn)
+        for (i = 0; i < fp->n_conns; i++) http_disconnect(&fp->conn[i]);
+    if (fp->buf)
+        for (i = 0; i < fp->n_bufs; i++) free(fp->buf[i].data);
+    pthread_mutex_destroy(&fp->lock);
+    pthread_cond_destroy(&fp->wanted);
+    pthread_cond_destroy(&fp->ready);
+    free(fp->buf);
+    free(fp->conn);
+    free(fp->host);
+    free(fp->port);
+    free(fp->path);
+    free(fp->headers.s);
+    free(fp->etag);
+    free(fp->upload_id);
+}
+
+static int http_close(hFILE *fpv)
+{
+    hFILE_http *fp = (hFILE_http *) fpv;
+    int i;
+
+    if (fp->n_threads > 0) {
+        pthread_mutex_lock(&fp->lock);
+        fp->shutdown = 1;
+        pthread_cond_broadcast(&fp->wanted);
+        pthread_mutex_unlock(&fp->lock);
+        for (i = 0; i < fp->n_threads; i++)
+            pthread_join(fp->conn[i].thread, NULL);
+    }
+
+    http_free(fp);
+    return 0;
+}
+
+static const struct hFILE_backend http_backend =
+{
+    http_read, http_write, http_seek, NULL, http_close
+};
+
+static int parse_va_list(hFILE_http *fp, va_list args)
+{
+    const char *argtype;
+
+    while ((argtype = va_arg(args, const char *)) != NULL)
+        if (strcmp(argtype, "va_list") == 0) {
+            va_list *args2 = va_arg(args, va_list *);
+            if (args2) {
+                if (parse_va_list(fp, *args2) < 0) return -1;
+            }
+        }
+        else if (strcmp(argtype, "httphdr") == 0) {
+            const char *hdr = va_arg(args, const char *);
+            if (hdr) {
+                kputs(hdr, &fp->headers);
+                if (kputs("\r\n", &fp->headers) < 0) return -1;
+            }
+        }
+        else if (strcmp(argtype, "chunk_size") == 0) {
+            fp->chunk_size = va_arg(args, size_t);
+        }
+        else if (strcmp(argtype, "connections") == 0) {
+            fp->n_conns = va_arg(args, int);
+        }
+        else if (strcmp(argtype, "upload") == 0) {
+            const char *method = va_arg(args, const char *);
+            if (method == NULL) {
+                hts_log_error("No upload method given for http");
+                errno = EINVAL;
+                return -1;
+            }
+            if (strcmp(method, "s3") == 0) fp->s3_upload = 1;
+            else if (strcmp(method, "put") == 0) fp->s3_upload = 0;
+            else {
+                hts_log_error("Unknown upload method \"%s\" for http",
+                              method);
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        else if (strcmp(argtype, "part_size") == 0) {
+            fp->part_size = va_arg(args, size_t);
+        }
+        else if (strcmp(argtype, "retries") == 0) {
+            fp->retries = va_arg(args, int);
+        }
+        else if (strcmp(argtype, "timeout") == 0) {
+            fp->timeout = va_arg(args, int);
+        }
+        else {
+            hts_log_error("Unknown hopen() option \"%s\" for http", argtype);
+            errno = EINVAL;
+            return -1;
+        }
+
+    return 0;
+}
+
+/*
+ * Uploads, for hfile_upload_open()
+ */
+
+static http_conn *take_conn(hFILE_http *fp)
+{
+    int i;
+
+    pthread_mutex_lock(&fp->lock);
+    for (;;) {
+        for (i = 0; i < fp->n_conns; i++)
+            if (!fp->conn[i].busy) {
+                fp->conn[i].busy = 1;
+                pthread_mutex_unlock(&fp->lock);
+                return &fp->conn[i];
+            }
+        pthread_cond_wait(&fp->ready, &fp->lock);
+    }
+}
+
+static void give_conn(http_conn *c)
+{
+    hFILE_http *fp = c->fp;
+    pthread_mutex_lock(&fp->lock);
+    c->busy = 0;
+    pthread_cond_signal(&fp->ready);
+    pthread_mutex_unlock(&fp->lock);
+}
+
+/* Sends a request with the given body (if any) and reads the response,
+   returning -1 with errno set unless the status is 2xx.  */
+static int upload_request(hFILE_http *fp, const char *method,
+                          const char *query, const char *data, size_t len,
+                          kstring_t *hdr, http_response *r, kstring_t *body)
+{
+    http_conn *c = take_conn(fp);
+    int ret = http_request(c, method, query, -1, -1, data, len, hdr, r);
+
+    if (ret == 0) {
+        if (read_small_body(c, r, body) < 0) {
+            http_disconnect(c);
+            ret = -1;
+        }
+        else if (!r->keep_alive) http_disconnect(c);
+    }
+    give_conn(c);
+
+    if (ret == 0 && (r->status < 200 || r->status >= 300
+                     || strstr(body->s, "<Error>"))) {
+        hts_log_warning("%s request for %s failed with HTTP status %d",
+                        method, fp->path, r->status);
+        errno = http_status_errno(r->status);
+        if (errno == 0) errno = EIO;
+        ret = -1;
+    }
+    return ret;
+}
+
+// Returns a copy of the text of the first <tag> element in xml
+static char *xml_element(const char *xml, const char *tag)
+{
+    size_t len = strlen(tag);
+    const char *s = xml, *end;
+    char *value;
+
+    while ((s = strstr(s, "<")) != NULL) {
+        s++;
+        if (strncmp(s, tag, len) == 0 && s[len] == '>') break;
+    }
+    if (!s || !(end = strstr(s + len + 1, "</"))) return NULL;
+    s += len + 1;
+    if (!(value = malloc(end - s + 1))) return NULL;
+    memcpy(value, s, end - s);
+    value[end - s] = '\0';
+    return value;
+}
+
+static int s3_begin(void *ctx)
+{
+    hFILE_http *fp = (hFILE_http *) ctx;
+    kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL };
+    http_response r;
+    int ret = upload_request(fp, "POST", "uploads", "", 0, &hdr, &r, &body);
+
+    if (ret == 0) {
+        free(fp->upload_id);
+        if (!(fp->upload_id = xml_element(body.s, "UploadId"))) {
+            hts_log_error("No UploadId in response to starting upload of %s",
+                          fp->path);
+            errno = EIO;
+            ret = -1;
+        }
+    }
+    free(hdr.s);
+    free(body.s);
+    return ret;
+}
+
+static int s3_put_part(void *ctx, int part, const char *data, size_t len,
+                       char **tag)
+{
+    hFILE_http *fp = (hFILE_http *) ctx;
+    kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL }, query = { 0, 0, NULL };
+    http_response r;
+    int ret = -1;
+
+    if (ksprintf(&query, "partNumber=%d&uploadId=%s", part, fp->upload_id) < 0)
+        return -1;
+    if (upload_request(fp, "PUT", query.s, data, len, &hdr, &r, &body) == 0) {
+        if (!r.etag) {
+            hts_log_error("No ETag in response to upload of part %d of %s",
+                          part, fp->path);
+            errno = EIO;
+        }
+        else if ((*tag = strdup(r.etag)) != NULL) ret = 0;
+    }
+    free(query.s);
+    free(hdr.s);
+    free(body.s);
+    return ret;
+}
+
+static int s3_complete(void *ctx, int n_parts, char **tags)
+{
+    hFILE_http *fp = (hFILE_http *) ctx;
+    kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL };
+    kstring_t xml = { 0, 0, NULL }, query = { 0, 0, NULL };
+    http_response r;
+    int i, ret = -1;
+
+    kputs("<CompleteMultipartUpload>", &xml);
+    for (i = 0; i < n_parts; i++)
+        ksprintf(&xml, "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+                 i + 1, tags[i]);
+    kputs("</CompleteMultipartUpload>", &xml);
+
+    if (xml.s && ksprintf(&query, "uploadId=%s", fp->upload_id) >= 0)
+        ret = upload_request(fp, "POST", query.s, xml.s, xml.l,
+                             &hdr, &r, &body);
+    free(xml.s);
+    free(query.s);
+    free(hdr.s);
+    free(body.s);
+    return ret;
+}
+
+static void s3_abort(void *ctx)
+{
+    hFILE_http *fp = (hFILE_http *) ctx;
+    kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL }, query = { 0, 0, NULL };
+    http_response r;
+
+    if (ksprintf(&query, "uploadId=%s", fp->upload_id) >= 0)
+        (void) upload_request(fp, "DELETE", query.s, NULL, 0, &hdr, &r, &body);
+    free(query.s);
+    free(hdr.s);
+    free(body.s);
+}
+
+static int s3_put_whole(void *ctx, const char *data, size_t len)
+{
+    hFILE_http *fp = (hFILE_http *) ctx;
+    kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL };
+    http_response r;
+    int ret = upload_request(fp, "PUT", NULL, data, len, &hdr, &r, &body);
+    free(hdr.s);
+    free(body.s);
+    return ret;
+}
+
+static void s3_destroy(void *ctx)
+{
+    hFILE_http *fp = (hFILE_http *) ctx;
+    http_free(fp);
+    free(fp);
+}
+
+static const struct hFILE_upload_ops s3_upload_ops =
+{
+    s3_begin, s3_put_part, s3_complete, s3_abort, s3_put_whole, s3_destroy
+};
+
+/*
+ * Plain uploads, streamed as the chunked body of a single PUT request
+ */
+
+typedef struct {
+    hFILE base;
+    hFILE_http *http;
+    int err;            // errno of the first failed write, or 0
+} hFILE_http_put;
+
+static ssize_t put_read(hFILE *fpv, void *buffer, size_t nbytes)
+{
+    errno = EBADF;
+    return -1;
+}
+
+static ssize_t put_write(hFILE *fpv, const void *buffer, size_t nbytes)
+{
+    hFILE_http_put *fp = (hFILE_http_put *) fpv;
+    http_conn *c = &fp->http->conn[0];
+    char size[32];
+
+    // A zero-length chunk would end the body
+    if (nbytes == 0) return 0;
+    if (fp->err) {
+        errno = fp->err;
+        return -1;
+    }
+
+    snprintf(size, sizeof size, "%zx\r\n", nbytes);
+    if (send_all(c, size, strlen(size)) < 0
+        || send_all(c, buffer, nbytes) < 0 || send_all(c, "\r\n", 2) < 0) {
+        fp->err = errno;
+        return -1;
+    }
+    return nbytes;
+}
+
+static off_t put_seek(hFILE *fpv, off_t offset, int whence)
+{
+    errno = ESPIPE;
+    return -1;
+}
+
+static int put_close(hFILE *fpv)
+{
+    hFILE_http_put *fp = (hFILE_http_put *) fpv;
+    http_conn *c = &fp->http->conn[0];
+    kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL };
+    http_response r;
+    int ret = -1;
+
+    if (fp->err) {
+        errno = fp->err;
+    }
+    else if (send_all(c, "0\r\n\r\n", 5) == 0
+             && read_response(c, &hdr, &r) == 0
+             && read_small_body(c, &r, &body) == 0) {
+        if (r.status >= 200 && r.status < 300) {
+            ret = 0;
+        }
+        else {
+            hts_log_error("PUT request for %s failed with HTTP status %d",
+                          fp->http->path, r.status);
+            errno = http_status_errno(r.status);
+            if (errno == 0) errno = EIO;
+        }
+    }
+    else if (errno == 0) errno = EIO;
+
+    int save = errno;
+    free(hdr.s);
+    free(body.s);
+    http_free(fp->http);
+    free(fp->http);
+    errno = save;
+    return ret;
+}
+
+static const struct hFILE_backend http_put_backend =
+{
+    put_read, put_write, put_seek, NULL, put_close
+};
+
+static hFILE *http_put_open(hFILE_http *http, const char *mode)
+{
+    hFILE_http_put *fp;
+    kstring_t req = { 0, 0, NULL };
+
+    http->n_conns = 1;
+    if (http_alloc_conns(http) < 0) return NULL;
+
+    request_head(http, "PUT", NULL, &req);
+    if (kputs("Transfer-Encoding: chunked\r\n\r\n", &req) < 0
+        || http_connect(&http->conn[0]) < 0
+        || send_all(&http->conn[0], req.s, req.l) < 0) {
+        free(req.s);
+        return NULL;
+    }
+    free(req.s);
+
+    fp = (hFILE_http_put *) hfile_init(sizeof (hFILE_http_put), mode, 0);
+    if (fp == NULL) return NULL;
+    fp->http = http;
+    fp->err = 0;
+    fp->base.backend = &http_put_backend;
+    return &fp->base;
+}
+
+static hFILE *http_upload_open(const char *url, const char *mode,
+                               va_list args)
+{
+    hFILE_http *fp = (hFILE_http *) calloc(1, sizeof (hFILE_http));
+    hFILE *hfp;
+    int save;
+    if (fp == NULL) return NULL;
+
+    http_init(fp);
+    if (parse_va_list(fp, args) < 0 || parse_url(fp, url) < 0) goto error;
+
+    if (!fp->s3_upload) {
+        if ((hfp = http_put_open(fp, mode)) == NULL) goto error;
+        return hfp;
+    }
+
+    if (fp->part_size == 0 || fp->n_conns <= 0 || fp->retries < 0) {
+        errno = EINVAL;
+        goto error;
+    }
+    if (http_alloc_conns(fp) < 0) goto error;
+
+    return hfile_upload_open(&s3_upload_ops, fp, mode, fp->part_size,
+                             fp->n_conns, fp->retries);
+
+ error:
+    save = errno;
+    s3_destroy(fp);
+    errno = save;
+    return NULL;
+}
+
+static hFILE *http_vopen(const char *url, const char *mode, va_list args)
+{
+    hFILE_http *fp;
+    kstring_t hdr = { 0, 0, NULL };
+    http_response r;
+    int i, redirects = 0, save;
+
+    if (strchr(mode, 'w') && !strpbrk(mode, "ra+"))
+        return http_upload_open(url, mode, args);
+
+    if (strchr(mode, 'r') == NULL || strchr(mode, '+')) {
+        errno = EROFS;
+        return NULL;
+    }
+
+    fp = (hFILE_http *) hfile_init(sizeof (hFILE_http), mode, 0);
+    if (fp == NULL) return NULL;
+
+    http_init(fp);
+    fp->base.backend = &http_backend;
+
+    if (parse_va_list(fp, args) < 0 || parse_url(fp, url) < 0) goto error;
+    if (fp->chunk_size == 0 || fp->n_conns <= 0) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    fp->n_bufs = 2 * fp->n_conns;
+    fp->buf = (http_buf *) calloc(fp->n_bufs, sizeof (http_buf));
+    if (http_alloc_conns(fp) < 0 || !fp->buf) goto error;
+    for (i = 0; i < fp->n_bufs; i++) {
+        fp->buf[i].chunk = -1;
+        if (!(fp->buf[i].data = malloc(fp->chunk_size))) goto error;
+    }
+
+    // Fetch the first chunk, which also tells us the size and whether the
+    // server supports ranges
+    for (;;) {
+        if (http_request(&fp->conn[0], "GET", NULL, 0, fp->chunk_size - 1,
+                         NULL, 0, &hdr, &r) < 0)
+            goto error;
+        if (r.status < 300 || r.status >= 400 || r.status == 304) break;
+
+        if (!r.location || ++redirects > HTTP_MAX_REDIRECTS) {
+            errno = EIO;
+            goto error;
+        }
+        http_disconnect(&fp->conn[0]);
+        if (r.location[0] == '/') {
+            free(fp->path);
+            if (!(fp->path = strdup(r.location))) goto error;
+        }
+        else if (parse_url(fp, r.location) < 0) goto error;
+        hts_log_debug("Redirected to http://%s:%s%s",
+                      fp->host, fp->port, fp->path);
+    }
+
+    if (r.status == 206 && r.range_start == 0 && !r.chunked
+        && r.content_length >= 0
+        && r.content_length <= (int64_t) fp->chunk_size) {
+        http_buf *b = &fp->buf[0];
+        fp->ranges = 1;
+        fp->size = r.total;
+        b->busy = 1;
+        while (b->len < r.content_length) {
+            ssize_t n = read_body(&fp->conn[0], b->data + b->len,
+                                  r.content_length - b->len);
+            if (n <= 0) {
+                if (n == 0) errno = EIO;
+                goto error;
+            }
+            b->len += n;
+        }
+        b->busy = 0;
+        b->chunk = 0;
+        if (b->len < fp->chunk_size) fp->eof_chunk = 0;
+        if (!r.keep_alive) http_disconnect(&fp->conn[0]);
+    }
+    else if (r.status == 416) {
+        fp->ranges = 1;  // Empty
+        fp->size = 0;
+        fp->eof_chunk = 0;
+        fp->buf[0].chunk = 0;
+        http_disconnect(&fp->conn[0]);
+    }
+    else if (r.status == 200 && !r.chunked) {
+        fp->ranges = 0;
+        fp->size = fp->stream_left = r.content_length;
+        hts_log_debug("Server for %s does not support ranges; streaming",
+                      fp->host);
+    }
+    else {
+        if (r.chunked) hts_log_error("Chunked HTTP responses are not supported");
+        errno = r.chunked ? ENOTSUP : http_status_errno(r.status);
+        if (errno == 0) errno = EIO;
+        goto error;
+    }
+    if (r.etag && !(fp->etag = strdup(r.etag))) goto error;
+    free(hdr.s);
+    hdr.s = NULL;
+
+    if (fp->ranges) {
+        for (i = 0; i < fp->n_conns; i++) {
+            if (pthread_create(&fp->conn[i].thread, NULL, http_worker,
+                               &fp->conn[i]) != 0) {
+                errno = EAGAIN;
+                goto error;
+            }
+            fp->n_threads++;
+        }
+    }
+
+    return &fp->base;
+
+ error:
+    save = errno;
+    free(hdr.s);
+    http_close(&fp->base);
+    hfile_destroy(&fp->base);
+    errno = save;
+    return NULL;
+}
+
+const char *hfile_http_etag(hFILE *fpv)
+{
+    hFILE_http *fp = (hFILE_http *) fpv;
+    return (fpv->backend == &http_backend)? fp->etag : NULL;
+}
+
+static hFILE *http_open_args(const char *url, const char *mode, ...)
+{
+    va_list args;
+    va_start(args, mode);
+    hFILE *fp = http_vopen(url, mode, args);
+    va_end(args);
+    return fp;
+}
+
+static hFILE *http_open(const char *url, const char *mode)
+{
+    return http_open_args(url, mode, NULL);
+}
+
+int hfile_plugin_init_http(struct hFILE_plugin *self)
+{
+    // Lower priority than libcurl, which also handles https
+    static const struct hFILE_scheme_handler handler =
+        { http_open, hfile_always_remote, "built-in HTTP", 2000 + 10,
+          http_vopen
+        };
+
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) return -1;
+#endif
+
+    self->name = "HTTP";
+    hfile_add_scheme_handler("http", &handler);
+    return 0;
+}
@@ -51,6 +51,140 @@ extern "C" {
  */
 int hfile_set_blksize(hFILE *fp, size_t bufsiz);
 
+/*!
+  @abstract  Hints that part of a file will be read soon.
+
+  @notes  For local files this asks the operating system to start reading
+  the range in the background, so that a later seek and read there does not
+  have to wait for it.  It does not change the file position.  This uses
+  posix_fadvise(), or madvise() for memory-mapped files, so on Windows it
+  does nothing and always returns -1.
+
+  @param fp      The file stream
+  @param offset  Start of the range
+  @param length  Length of the range
+
+  @return Returns 0 if the hint was passed on, -1 if it is not supported
+  for this kind of file.
+ */
+int hfile_prefetch(hFILE *fp, off_t offset, off_t length);
+
+/*!
+  @abstract  Starts reading ahead of the current position in the background.
+
+  @notes  For local regular files opened read-only, this starts a thread
+  that reads up to n_bufs chunks of bufsize bytes beyond the current file
+  position with pread(), so reads no longer wait on storage when the
+  caller (e.g. a BGZF decompression pool) keeps up.  Seeks discard the
+  chunks outside the new read-ahead window.  It lasts until the file is
+  closed, and calling it again has no effect.
+
+  @param fp       The file stream
+  @param n_bufs   Number of chunks to read ahead, or 0 for the default
+  @param bufsize  Size of each chunk, or 0 for the default
+
+  @return Returns 0 on success, -1 if it is not supported for this file.
+ */
+int hfile_set_readahead(hFILE *fp, int n_bufs, size_t bufsize);
+
+/*!
+  @abstract  Reads data in place from an hFILE's buffer, without copying.
+
+  @notes  If at least nbytes are already buffered (as they always are for
+  memory-mapped files), returns a pointer to them and moves the file
+  position past them.  The data is only valid until the next operation
+  on the stream.
+
+  @param fp      The file stream
+  @param nbytes  Number of bytes wanted
+
+  @return Returns a pointer to the data, or NULL (having read nothing) if
+  fewer than nbytes are buffered.
+ */
+static inline const char *hfile_read_inplace(hFILE *fp, size_t nbytes)
+{
+    const char *data = fp->begin;
+    if (fp->end < fp->begin || (size_t) (fp->end - fp->begin) < nbytes)
+        return NULL;
+    fp->begin += nbytes;
+    return data;
+}
+
+/*!
+  @abstract  Wraps a remote file in a block-granular local disk cache.
+
+  @notes  If the HTS_CACHE_DIR environment variable names a directory,
+  reads of remote are served from fixed-size blocks stored below it, keyed
+  by url and the file's ETag.  Blocks missing from the cache are fetched
+  from remote and stored for next time.  Files whose backend reports no
+  ETag or Last-Modified date are not cached; at present only the built-in
+  http backend reports one (see hfile_http_etag()), so files read through
+  libcurl are passed through uncached.
+  The cache is trimmed back to HTS_CACHE_SIZE bytes (default 1G) when a
+  file that added blocks to it is closed, least recently used blocks first.
+
+  @param remote  A file opened read-only by a remote scheme handler
+  @param url     The URL it was opened from
+
+  @return Returns the caching stream, which takes over remote, or remote
+  itself if caching is disabled or not possible for this file.
+ */
+hFILE *hfile_cache_wrap(hFILE *remote, const char *url);
+
+/* Transport for hfile_upload_open().  Each function returns 0 on success,
+   or -1 and sets errno on failure, after which the request is retried.  */
+struct hFILE_upload_ops {
+    /* Starts a multipart upload, before the first part is sent.  */
+    int (*begin)(void *ctx);
+
+    /* Sends part number part (counting from 1), setting *tag to a malloc()ed
+       string identifying it to complete().  Called concurrently by up to
+       max_inflight threads.  */
+    int (*put_part)(void *ctx, int part, const char *data, size_t len,
+                    char **tag);
+
+    /* Finishes the upload from all n_parts parts sent.  */
+    int (*complete)(void *ctx, int n_parts, char **tags);
+
+    /* Cancels a failed upload; its failure is not reported.  */
+    void (*abort)(void *ctx);
+
+    /* Sends a whole file that fits within one part, without begin().  */
+    int (*put_whole)(void *ctx, const char *data, size_t len);
+
+    /* Frees ctx when the file is closed.  */
+    void (*destroy)(void *ctx);
+};
+
+/*!
+  @abstract  Opens an output stream that uploads in parts in parallel.
+
+  @notes  Output is collected into parts of part_size bytes, which are sent
+  by a pool of max_inflight threads while writing continues.  Memory use is
+  bounded by (max_inflight + 1) * part_size bytes; writes wait while all
+  the part buffers are in use.  Each request is retried up to retries times
+  before the upload fails and hclose() reports the error.
+
+  @param ops           The transport
+  @param ctx           Transport state, owned by the stream from now on
+  @param mode          Open mode, as for hopen()
+  @param part_size     Size of each part but the last
+  @param max_inflight  Maximum number of parts being sent at once
+  @param retries       Number of times to retry failed requests
+
+  @return Returns the stream, or NULL (having destroyed ctx) on failure.
+ */
+hFILE *hfile_upload_open(const struct hFILE_upload_ops *ops, void *ctx,
+                         const char *mode, size_t part_size,
+                         int max_inflight, int retries);
+
+/*!
+  @abstract  Returns the ETag (or Last-Modified date) of a built-in http file.
+  @return  The validator string, or NULL if there is none or fp is not an
+  http file opened by the built-in backend.
+ */
+const char *hfile_http_etag(hFILE *fp);
+
 struct BGZF;
 /*!
   @abstract Return the hFILE connected to a BGZF
@@ -174,8 +308,9 @@ extern int hfile_plugin_init_s3(struct hFILE_plugin *self);
 extern int hfile_plugin_init_s3_write(struct hFILE_plugin *self);
 #endif
 
-/* This one is never built as a separate plugin.  */
+/* These are never built as separate plugins.  */
 extern int hfile_plugin_init_net(struct hFILE_plugin *self);
+extern int hfile_plugin_init_http(struct hFILE_plugin *self);
 
 // Callback to allow headers to be set in http connections.  Currently used
 // to allow s3 to renew tokens when seeking.  Kept internal for now,
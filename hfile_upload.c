@@ -0,0 +1,357 @@
+/*  hfile_upload.c -- parallel multipart uploads for low-level file streams.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Output is gathered into parts of part_size bytes, and each full part is
+ * handed to a thread pool that sends it with the transport's put_part().
+ * At most max_inflight parts are being sent at once, and only one more is
+ * being filled, so memory use is bounded however fast output is produced.
+ * Writes wait for a part buffer to come free when the uploads fall behind.
+ *
+ * Failed requests are retried with exponential backoff.  If a part still
+ * fails, further writes report the error and closing the file aborts the
+ * upload.  Output that never fills a part is sent with a single put_whole()
+ * request when the file is closed.
+ */
+
+#define HTS_BUILDING_LIBRARY // Enables HTSLIB_EXPORT, see htslib/hts_defs.h
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <pthread/include/pthread.h>
+
+#include "htslib/hts_log.h"
+#include "htslib/thread_pool.h"
+#include "hfile_internal.h"
+
+#define UPLOAD_RETRY_DELAY 100000  // First retry's delay, in microseconds
+
+struct hFILE_upload;
+
+typedef struct upload_part {
+    struct hFILE_upload *fp;
+    int number;         // Counting from 1
+    size_t len;
+    char *data;
+} upload_part;
+
+typedef struct hFILE_upload {
+    hFILE base;
+    const struct hFILE_upload_ops *ops;
+    void *ctx;
+    size_t part_size;
+    int max_inflight, retries;
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    upload_part *cur;       // Part being filled, or NULL
+    upload_part **spare;    // Part buffers not in use
+    int n_spare, n_alloc;   // At most max_inflight + 1 are ever allocated
+    int n_parts;            // Parts handed to the pool so far
+    char **tags;            // Transport's identifiers for the sent parts
+    size_t m_tags;
+    off_t offset;           // Bytes written so far
+    int started, err;
+    pthread_mutex_t lock;
+    pthread_cond_t part_free;
+} hFILE_upload;
+
+// Records the first error, which fails the whole upload
+static void set_error(hFILE_upload *fp, int err)
+{
+    pthread_mutex_lock(&fp->lock);
+    if (!fp->err) fp->err = err ? err : EIO;
+    pthread_mutex_unlock(&fp->lock);
+}
+
+static int get_error(hFILE_upload *fp)
+{
+    pthread_mutex_lock(&fp->lock);
+    int err = fp->err;
+    pthread_mutex_unlock(&fp->lock);
+    return err;
+}
+
+// Waits before the given retry of a failed request
+static void retry_wait(int attempt, const char *what)
+{
+    hts_log_warning("Retrying %s (attempt %d)", what, attempt + 1);
+    usleep(UPLOAD_RETRY_DELAY << (attempt - 1));
+}
+
+static void *upload_job(void *arg)
+{
+    upload_part *p = (upload_part *) arg;
+    hFILE_upload *fp = p->fp;
+    char *tag = NULL;
+    int attempt, ret = -1, err = EIO, failed = get_error(fp);
+
+    // Once one part has failed the upload will be aborted, so don't bother
+    for (attempt = 0; !failed && attempt <= fp->retries; attempt++) {
+        if (attempt > 0) retry_wait(attempt, "upload of part");
+        ret = fp->ops->put_part(fp->ctx, p->number, p->data, p->len, &tag);
+        if (ret == 0) break;
+        err = errno;
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    if (ret == 0) fp->tags[p->number - 1] = tag;
+    else if (!fp->err) fp->err = err ? err : EIO;
+    p->len = 0;
+    fp->spare[fp->n_spare++] = p;
+    pthread_cond_signal(&fp->part_free);
+    pthread_mutex_unlock(&fp->lock);
+
+    return NULL;
+}
+
+// Returns an empty part buffer, waiting for one if too many are in flight
+static upload_part *get_part(hFILE_upload *fp)
+{
+    upload_part *p = NULL;
+
+    pthread_mutex_lock(&fp->lock);
+    while (fp->n_spare == 0 && fp->n_alloc > fp->max_inflight && !fp->err)
+        pthread_cond_wait(&fp->part_free, &fp->lock);
+
+    if (fp->err) {
+        errno = fp->err;
+    } else if (fp->n_spare > 0) {
+        p = fp->spare[--fp->n_spare];
+    } else if ((p = malloc(sizeof (upload_part))) != NULL) {
+        if ((p->data = malloc(fp->part_size)) != NULL) {
+            p->fp = fp;
+            p->len = 0;
+            fp->n_alloc++;
+        } else {
+            free(p);
+            p = NULL;
+        }
+    }
+    if (!p && !fp->err) fp->err = ENOMEM;
+    pthread_mutex_unlock(&fp->lock);
+
+    return p;
+}
+
+// Hands the current part to the pool, starting the upload if necessary
+static int send_part(hFILE_upload *fp)
+{
+    upload_part *p = fp->cur;
+    int attempt;
+
+    if (!fp->started) {
+        for (attempt = 0; attempt <= fp->retries; attempt++) {
+            if (attempt > 0) retry_wait(attempt, "start of upload");
+            if (fp->ops->begin(fp->ctx) == 0) break;
+        }
+        if (attempt > fp->retries) {
+            set_error(fp, errno);
+            return -1;
+        }
+        fp->started = 1;
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    if (fp->n_parts == fp->m_tags) {
+        size_t new_m = fp->m_tags ? fp->m_tags * 2 : 64;
+        char **tags = realloc(fp->tags, new_m * sizeof (char *));
+        if (!tags) {
+            if (!fp->err) fp->err = ENOMEM;
+            pthread_mutex_unlock(&fp->lock);
+            return -1;
+        }
+        memset(tags + fp->m_tags, 0, (new_m - fp->m_tags) * sizeof (char *));
+        fp->tags = tags;
+        fp->m_tags = new_m;
+    }
+    p->number = ++fp->n_parts;
+    pthread_mutex_unlock(&fp->lock);
+
+    if (hts_tpool_dispatch(fp->pool, fp->q, upload_job, p) < 0) {
+        set_error(fp, errno);
+        return -1;
+    }
+    fp->cur = NULL;
+    return 0;
+}
+
+static ssize_t upload_write(hFILE *fpv, const void *buffer, size_t nbytes)
+{
+    hFILE_upload *fp = (hFILE_upload *) fpv;
+    const char *data = (const char *) buffer;
+    size_t done = 0;
+
+    while (done < nbytes && !get_error(fp)) {
+        size_t n;
+        if (!fp->cur && !(fp->cur = get_part(fp))) break;
+
+        n = fp->part_size - fp->cur->len;
+        if (n > nbytes - done) n = nbytes - done;
+        memcpy(fp->cur->data + fp->cur->len, data + done, n);
+        fp->cur->len += n;
+        done += n;
+
+        if (fp->cur->len == fp->part_size && send_part(fp) < 0) break;
+    }
+
+    fp->offset += done;
+    if (done == 0 && nbytes > 0) {
+        errno = get_error(fp);
+        return -1;
+    }
+    return done;
+}
+
+static ssize_t upload_read(hFILE *fpv, void *buffer, size_t nbytes)
+{
+    errno = EBADF;
+    return -1;
+}
+
+static off_t upload_seek(hFILE *fpv, off_t offset, int whence)
+{
+    hFILE_upload *fp = (hFILE_upload *) fpv;
+
+    // Only "seeks" to where we already are are possible
+    if ((whence == SEEK_SET && offset == fp->offset)
+        || (whence == SEEK_CUR && offset == 0))
+        return fp->offset;
+
+    errno = ESPIPE;
+    return -1;
+}
+
+static int upload_flush(hFILE *fpv)
+{
+    // Parts can only be sent once they are full, so there's nothing to do
+    return 0;
+}
+
+static int upload_close(hFILE *fpv)
+{
+    hFILE_upload *fp = (hFILE_upload *) fpv;
+    int i, attempt, ret = 0;
+
+    if (!fp->started && !fp->err) {
+        // Everything fits in one request
+        const char *data = fp->cur ? fp->cur->data : "";
+        size_t len = fp->cur ? fp->cur->len : 0;
+        for (attempt = 0; attempt <= fp->retries; attempt++) {
+            if (attempt > 0) retry_wait(attempt, "upload");
+            if ((ret = fp->ops->put_whole(fp->ctx, data, len)) == 0) break;
+        }
+        if (ret < 0) set_error(fp, errno);
+    } else {
+        if (fp->cur && fp->cur->len > 0 && !get_error(fp)) send_part(fp);
+        hts_tpool_process_flush(fp->q);
+
+        for (attempt = 0; !fp->err && attempt <= fp->retries; attempt++) {
+            if (attempt > 0) retry_wait(attempt, "completion of upload");
+            if (fp->ops->complete(fp->ctx, fp->n_parts, fp->tags) == 0) break;
+        }
+        if (!fp->err && attempt > fp->retries) set_error(fp, errno);
+
+        if (fp->err && fp->started) {
+            hts_log_error("Upload failed; aborting it");
+            fp->ops->abort(fp->ctx);
+        }
+    }
+
+    hts_tpool_process_destroy(fp->q);
+    hts_tpool_destroy(fp->pool);
+
+    if (fp->cur) fp->spare[fp->n_spare++] = fp->cur;
+    for (i = 0; i < fp->n_spare; i++) {
+        free(fp->spare[i]->data);
+        free(fp->spare[i]);
+    }
+    for (i = 0; i < fp->n_parts; i++) free(fp->tags[i]);
+    free(fp->tags);
+    free(fp->spare);
+    fp->ops->destroy(fp->ctx);
+    pthread_mutex_destroy(&fp->lock);
+    pthread_cond_destroy(&fp->part_free);
+
+    if (fp->err) {
+        errno = fp->err;
+        return -1;
+    }
+    return 0;
+}
+
+static const struct hFILE_backend upload_backend =
+{
+    upload_read, upload_write, upload_seek, upload_flush, upload_close
+};
+
+hFILE *hfile_upload_open(const struct hFILE_upload_ops *ops, void *ctx,
+                         const char *mode, size_t part_size,
+                         int max_inflight, int retries)
+{
+    hFILE_upload *fp = NULL;
+
+    if (part_size == 0 || max_inflight <= 0 || retries < 0) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    fp = (hFILE_upload *) hfile_init(sizeof (hFILE_upload), mode, 0);
+    if (fp == NULL) goto error;
+
+    fp->ops = ops;
+    fp->ctx = ctx;
+    fp->part_size = part_size;
+    fp->max_inflight = max_inflight;
+    fp->retries = retries;
+    fp->cur = NULL;
+    fp->n_spare = fp->n_alloc = fp->n_parts = 0;
+    fp->tags = NULL;
+    fp->m_tags = 0;
+    fp->offset = 0;
+    fp->started = fp->err = 0;
+    fp->q = NULL;
+    fp->spare = calloc(max_inflight + 1, sizeof (upload_part *));
+    if (!fp->spare || !(fp->pool = hts_tpool_init(max_inflight))) {
+        free(fp->spare);
+        hfile_destroy(&fp->base);
+        goto error;
+    }
+    if (!(fp->q = hts_tpool_process_init(fp->pool, max_inflight, 1))) {
+        hts_tpool_destroy(fp->pool);
+        free(fp->spare);
+        hfile_destroy(&fp->base);
+        goto error;
+    }
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->part_free, NULL);
+
+    fp->base.backend = &upload_backend;
+    return &fp->base;
+
+ error:
+    ops->destroy(ctx);
+    return NULL;
+}
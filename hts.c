@@ -38,12 +38,18 @@ DEALINGS IN THE SOFTWARE.  */
 #include <errno.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <pthread/include/pthread.h>
+#ifdef HAVE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #include "htslib/hts.h"
 #include "htslib/bgzf.h"
 #include "cram/cram.h"
 #include "htslib/hfile.h"
 #include "htslib/hts_endian.h"
+#include "htslib/thread_pool.h"
 #include "version.h"
 #include "hts_internal.h"
 #include "hfile_internal.h"
@@ -758,6 +764,10 @@ int hts_opt_add(hts_opt **opts, const char *c_arg) {
              strcmp(o->arg, "USE_LZMA") == 0)
         o->opt = CRAM_OPT_USE_LZMA, o->val.i = atoi(val);
 
+    else if (strcmp(o->arg, "use_arith") == 0 ||
+             strcmp(o->arg, "USE_ARITH") == 0)
+        o->opt = CRAM_OPT_USE_ARITH, o->val.i = atoi(val);
+
     else if (strcmp(o->arg, "reference") == 0 ||
              strcmp(o->arg, "REFERENCE") == 0)
         o->opt = CRAM_OPT_REFERENCE, o->val.s = val;
@@ -822,6 +832,41 @@ int hts_opt_add(hts_opt **opts, const char *c_arg) {
              strcmp(o->arg, "LEVEL") == 0)
         o->opt = HTS_OPT_COMPRESSION_LEVEL, o->val.i = strtol(val, NULL, 0);
 
+    else if (strcmp(o->arg, "bgzf_codec") == 0 ||
+             strcmp(o->arg, "BGZF_CODEC") == 0)
+        o->opt = HTS_OPT_BGZF_CODEC, o->val.s = val;
+
+    else if (strcmp(o->arg, "fast") == 0 || strcmp(o->arg, "FAST") == 0)
+        o->opt = HTS_OPT_PROFILE, o->val.i = HTS_PROFILE_FAST;
+
+    else if (strcmp(o->arg, "normal") == 0 || strcmp(o->arg, "NORMAL") == 0)
+        o->opt = HTS_OPT_PROFILE, o->val.i = HTS_PROFILE_NORMAL;
+
+    else if (strcmp(o->arg, "small") == 0 || strcmp(o->arg, "SMALL") == 0)
+        o->opt = HTS_OPT_PROFILE, o->val.i = HTS_PROFILE_SMALL;
+
+    else if (strcmp(o->arg, "archive") == 0 || strcmp(o->arg, "ARCHIVE") == 0)
+        o->opt = HTS_OPT_PROFILE, o->val.i = HTS_PROFILE_ARCHIVE;
+
+    else if (strcmp(o->arg, "profile") == 0 ||
+             strcmp(o->arg, "PROFILE") == 0) {
+        o->opt = HTS_OPT_PROFILE;
+        if (strcmp(val, "fast") == 0)
+            o->val.i = HTS_PROFILE_FAST;
+        else if (strcmp(val, "normal") == 0)
+            o->val.i = HTS_PROFILE_NORMAL;
+        else if (strcmp(val, "small") == 0)
+            o->val.i = HTS_PROFILE_SMALL;
+        else if (strcmp(val, "archive") == 0)
+            o->val.i = HTS_PROFILE_ARCHIVE;
+        else {
+            hts_log_error("Unknown profile '%s'", val);
+            free(o->arg);
+            free(o);
+            return -1;
+        }
+    }
+
     else {
         hts_log_error("Unknown option '%s'", o->arg);
         free(o->arg);
@@ -861,6 +906,7 @@ int hts_opt_apply(htsFile *fp, hts_opt *opts) {
                 // fall through
             case CRAM_OPT_VERSION:
             case CRAM_OPT_PREFIX:
+            case HTS_OPT_BGZF_CODEC:
                 if (hts_set_opt(fp,  opts->opt,  opts->val.s) != 0)
                     return -1;
                 break;
@@ -1331,6 +1377,16 @@ int hts_set_opt(htsFile *fp, enum hts_fmt_option opt, ...) {
         va_end(args);
         if (fp->is_bgzf)
             fp->fp.bgzf->compress_level = level;
+        break;
+    }
+
+    case HTS_OPT_BGZF_CODEC: {
+        va_start(args, opt);
+        const char *codec = va_arg(args, const char *);
+        va_end(args);
+        if (fp->is_bgzf)
+            return bgzf_set_codec(fp->fp.bgzf, codec);
+        return 0;
     }
 
     default:
@@ -1606,6 +1662,7 @@ int hts_check_EOF(htsFile *fp)
 
 KSORT_INIT_STATIC(_off, hts_pair64_t, pair64_lt)
 KSORT_INIT_STATIC(_off_max, hts_pair64_max_t, pair64_lt)
+KSORT_INIT_STATIC_GENERIC(uint32_t)
 
 typedef struct {
     int32_t m, n;
@@ -1621,6 +1678,34 @@ typedef struct {
     uint64_t *offset;
 } lidx_t;
 
+/*
+ * Flat index layout, written by hts_idx_save_flat().  Everything is
+ * little-endian and every array starts on an 8 byte boundary, so a loaded
+ * file can be used in place.  The file starts with a 64 byte header:
+ *
+ *   "FLI\1", fmt, min_shift, n_lvls, n_ref, l_meta  (six 32-bit fields)
+ *   n_no_coor, meta_off, refs_off, file_size, 0    (five 64-bit fields)
+ *
+ * followed by the meta data, n_ref flat_ref_t entries and the bins,
+ * chunks and linear index of each reference in turn.  The bins of a
+ * reference are sorted by bin number so they can be binary searched.
+ */
+#define FLAT_HDR_SIZE 64
+
+typedef struct {
+    uint64_t bins_off;   // File offset of the reference's flat_bin_t array
+    uint64_t lidx_off;   // File offset of its linear index
+    uint32_t n_bin;
+    uint32_t present;    // Whether the reference has a binning index
+    uint64_t n_lidx;
+} flat_ref_t;
+
+typedef struct {
+    uint32_t bin, n_chunk;
+    uint64_t loff;
+    uint64_t chunks_off; // File offset of n_chunk hts_pair64_t
+} flat_bin_t;
+
 struct __hts_idx_t {
     int fmt, min_shift, n_lvls, n_bins;
     uint32_t l_meta;
@@ -1630,6 +1715,18 @@ struct __hts_idx_t {
     lidx_t *lidx;
     uint8_t *meta; // MUST have a terminating NUL on the end
     int tbi_n, last_tbi_tid;
+    struct {
+        uint8_t *data;   // The whole file, mapped or read in
+        size_t size;
+        int mapped;
+        const flat_ref_t *refs; // Non-NULL for flat indexes
+    } flat;
+    struct {
+        BGZF *fp;        // Index file, kept open when loaded with HTS_IDX_LAZY
+        uint64_t *voff;  // Virtual offset of each reference's data in fp
+        uint8_t *loaded; // Whether each reference has been read yet
+        pthread_mutex_t lock;
+    } lazy;
     struct {
         uint32_t last_bin, save_bin;
         hts_pos_t last_coor;
@@ -1640,6 +1737,94 @@ struct __hts_idx_t {
     } z; // keep internal states
 };
 
+static int idx_lazy_load(const hts_idx_t *idx, int tid);
+
+/*
+ * Accessors for the per-reference index data, which may be held either in
+ * the bidx hash tables and lidx arrays or in a flat index.  For indexes
+ * loaded with HTS_IDX_LAZY, these read the reference in on first use, and
+ * report a failure to do so as described for each.
+ */
+
+// Returns whether reference tid (< idx->n) has a binning index
+static inline int idx_has_tid(const hts_idx_t *idx, int tid)
+{
+    if (idx->lazy.fp) // Every reference read from a file has one
+        return 1;
+    if (idx->flat.refs)
+        return idx->flat.refs[tid].present;
+    return idx->bidx[tid] != NULL;
+}
+
+// Returns the number of bins for reference tid (< idx->n), or -1 if it
+// could not be loaded
+static inline int idx_n_bins(const hts_idx_t *idx, int tid)
+{
+    if (idx->lazy.fp && idx_lazy_load(idx, tid) < 0)
+        return -1;
+    if (idx->flat.refs)
+        return idx->flat.refs[tid].n_bin;
+    return idx->bidx[tid] ? kh_size(idx->bidx[tid]) : 0;
+}
+
+// Returns the given bin of reference tid, or NULL if it is not present or
+// the reference could not be loaded.  Callers that need to tell these
+// apart check idx_n_bins() or idx_get_lidx() first, after which the
+// reference is known to be loaded.
+// For flat indexes the result is built in tmp, with its list pointing
+// into the index data.
+static const bins_t *idx_get_bin(const hts_idx_t *idx, int tid, int bin,
+                                 bins_t *tmp)
+{
+    if (idx->lazy.fp && idx_lazy_load(idx, tid) < 0)
+        return NULL;
+    if (!idx->flat.refs) {
+        bidx_t *bidx = idx->bidx[tid];
+        khint_t k;
+        if (!bidx || (k = kh_get(bin, bidx, bin)) == kh_end(bidx))
+            return NULL;
+        return &kh_val(bidx, k);
+    } else {
+        const flat_ref_t *r = &idx->flat.refs[tid];
+        const flat_bin_t *b = (const flat_bin_t *) (idx->flat.data + r->bins_off);
+        size_t lo = 0, hi = r->n_bin;
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (b[mid].bin < (uint32_t) bin) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == r->n_bin || b[lo].bin != (uint32_t) bin)
+            return NULL;
+        b += lo;
+        if (b->chunks_off > idx->flat.size
+            || b->n_chunk > (idx->flat.size - b->chunks_off) / sizeof(hts_pair64_t)
+            || (b->chunks_off & 7) != 0) {
+            hts_log_error("Corrupted flat index: bin %d out of range", bin);
+            return NULL;
+        }
+        tmp->n = tmp->m = b->n_chunk;
+        tmp->loff = b->loff;
+        tmp->list = (hts_pair64_t *) (idx->flat.data + b->chunks_off);
+        return tmp;
+    }
+}
+
+// Returns the linear index of reference tid, or NULL if it could not be
+// loaded.  For flat indexes the result is built in tmp.
+static const lidx_t *idx_get_lidx(const hts_idx_t *idx, int tid, lidx_t *tmp)
+{
+    if (idx->lazy.fp && idx_lazy_load(idx, tid) < 0)
+        return NULL;
+    if (!idx->flat.refs)
+        return &idx->lidx[tid];
+    tmp->n = tmp->m = idx->flat.refs[tid].n_lidx;
+    tmp->offset = tmp->n
+        ? (uint64_t *) (idx->flat.data + idx->flat.refs[tid].lidx_off)
+        : NULL;
+    return tmp;
+}
+
 static char * idx_format_name(int fmt) {
     switch (fmt) {
         case HTS_FMT_CSI: return "csi";
@@ -1834,6 +2019,141 @@ int hts_idx_finish(hts_idx_t *idx, uint64_t final_offset)
     return ret;
 }
 
+// Records and bytes per batch for hts_idx_push_mt()
+#define HTS_IDX_MT_NREC 4096
+#define HTS_IDX_MT_SIZE (1<<20)
+
+typedef struct {
+    kstring_t buf;
+    hts_idx_raw_t *recs;
+    int n, m, ret;
+    hts_idx_parse_raw_f *parse_raw;
+    void *data;
+} hts_idx_batch_t;
+
+static void *hts_idx_parse_batch(void *arg)
+{
+    hts_idx_batch_t *b = (hts_idx_batch_t *) arg;
+    b->ret = b->parse_raw(b->buf.s, b->recs, b->n, b->data);
+    return b;
+}
+
+// Pushes the records of a parsed batch onto idx, or just discards them
+// if idx is NULL, and frees the batch.
+static int hts_idx_push_batch(hts_idx_t *idx, hts_idx_batch_t *b,
+                              hts_idx_report_raw_f *report_raw)
+{
+    int i, ret = idx ? b->ret : -1;
+
+    for (i = 0; ret >= 0 && i < b->n; i++) {
+        hts_idx_raw_t *r = &b->recs[i];
+        if (hts_idx_push(idx, r->tid, r->beg, r->end, r->offset,
+                         r->is_mapped) < 0) {
+            if (report_raw)
+                report_raw(b->buf.s + r->start, r->len, b->data);
+            ret = -1;
+        }
+    }
+
+    free(b->buf.s);
+    free(b->recs);
+    free(b);
+    return ret;
+}
+
+// Pushes any parsed batches, waiting for all outstanding ones if 'wait'
+// is set.  After a failure the remaining batches are discarded.
+static int hts_idx_flush_batches(hts_idx_t *idx, hts_tpool_process *q,
+                                 hts_idx_report_raw_f *report_raw, int wait)
+{
+    hts_tpool_result *r;
+    int ret = 0;
+
+    while ((r = wait && !hts_tpool_process_empty(q)
+            ? hts_tpool_next_result_wait(q)
+            : hts_tpool_next_result(q))) {
+        if (hts_idx_push_batch(ret == 0 ? idx : NULL,
+                               hts_tpool_result_data(r), report_raw) < 0)
+            ret = -1;
+        hts_tpool_delete_result(r, 0);
+    }
+
+    return ret;
+}
+
+int hts_idx_push_mt(hts_idx_t *idx, BGZF *fp, hts_tpool *p,
+                    hts_idx_read_raw_f *read_raw,
+                    hts_idx_parse_raw_f *parse_raw,
+                    hts_idx_report_raw_f *report_raw, void *data)
+{
+    hts_tpool_process *q = hts_tpool_process_init(p, 2*hts_tpool_size(p), 0);
+    hts_idx_batch_t *b = NULL;
+    int r = 1, ret;
+
+    if (!q) return -1;
+
+    while (r > 0) {
+        if (!(b = calloc(1, sizeof(*b)))) goto err;
+        b->parse_raw = parse_raw;
+        b->data = data;
+
+        while (b->n < HTS_IDX_MT_NREC && b->buf.l < HTS_IDX_MT_SIZE) {
+            size_t start = b->buf.l;
+            if ((r = read_raw(fp, &b->buf, data)) <= 0)
+                break;
+            if (b->n == b->m) {
+                int new_m = b->m ? b->m * 2 : 256;
+                hts_idx_raw_t *recs = realloc(b->recs, new_m * sizeof(*recs));
+                if (!recs) goto err;
+                b->recs = recs;
+                b->m = new_m;
+            }
+            b->recs[b->n].start = start;
+            b->recs[b->n].len = b->buf.l - start;
+            b->recs[b->n].offset = bgzf_tell(fp);
+            b->n++;
+        }
+        if (r < 0) goto err;
+        if (b->n == 0)
+            break;
+
+        // Results must be consumed while the queue is full, else the
+        // workers stall waiting for room to put them.
+        while (hts_tpool_dispatch2(p, q, hts_idx_parse_batch, b, 1) < 0) {
+            hts_tpool_result *res;
+            if (errno != EAGAIN || !(res = hts_tpool_next_result_wait(q)))
+                goto err;
+            ret = hts_idx_push_batch(idx, hts_tpool_result_data(res),
+                                     report_raw);
+            hts_tpool_delete_result(res, 0);
+            if (ret < 0) goto err;
+        }
+        b = NULL;
+
+        if (hts_idx_flush_batches(idx, q, report_raw, 0) < 0)
+            goto err;
+    }
+    if (b) {
+        free(b->buf.s);
+        free(b->recs);
+        free(b);
+    }
+
+    ret = hts_idx_flush_batches(idx, q, report_raw, 1);
+    hts_tpool_process_destroy(q);
+    return ret;
+
+ err:
+    hts_idx_flush_batches(NULL, q, NULL, 1);
+    if (b) {
+        free(b->buf.s);
+        free(b->recs);
+        free(b);
+    }
+    hts_tpool_process_destroy(q);
+    return -1;
+}
+
 int hts_idx_check_range(hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t end)
 {
     int64_t maxpos = (int64_t) 1 << (idx->min_shift + idx->n_lvls * 3);
@@ -1995,9 +2315,23 @@ void hts_idx_amend_last(hts_idx_t *idx, uint64_t offset)
     idx->z.last_off = offset;
 }
 
-void hts_idx_destroy(hts_idx_t *idx)
+// Frees the bins and linear index of reference i
+static void idx_free_ref(hts_idx_t *idx, int i)
 {
+    bidx_t *bidx = idx->bidx[i];
     khint_t k;
+    free(idx->lidx[i].offset);
+    memset(&idx->lidx[i], 0, sizeof(idx->lidx[i]));
+    if (bidx == 0) return;
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+        if (kh_exist(bidx, k))
+            free(kh_value(bidx, k).list);
+    kh_destroy(bin, bidx);
+    idx->bidx[i] = NULL;
+}
+
+void hts_idx_destroy(hts_idx_t *idx)
+{
     int i;
     if (idx == 0) return;
 
@@ -2009,16 +2343,20 @@ void hts_idx_destroy(hts_idx_t *idx)
         return;
     }
 
-    for (i = 0; i < idx->m; ++i) {
-        bidx_t *bidx = idx->bidx[i];
-        free(idx->lidx[i].offset);
-        if (bidx == 0) continue;
-        for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
-            if (kh_exist(bidx, k))
-                free(kh_value(bidx, k).list);
-        kh_destroy(bin, bidx);
-    }
+    for (i = 0; i < idx->m; ++i)
+        idx_free_ref(idx, i);
     free(idx->bidx); free(idx->lidx); free(idx->meta);
+    if (idx->lazy.fp) {
+        bgzf_close(idx->lazy.fp);
+        pthread_mutex_destroy(&idx->lazy.lock);
+    }
+    free(idx->lazy.voff); free(idx->lazy.loaded);
+#ifdef HAVE_MMAP
+    if (idx->flat.mapped)
+        munmap(idx->flat.data, idx->flat.size);
+    else
+#endif
+        free(idx->flat.data);
     free(idx);
 }
 
@@ -2056,6 +2394,22 @@ static inline void swap_bins(bins_t *p)
     }
 }
 
+static int idx_write_bin(BGZF *fp, int fmt, uint32_t bin, const bins_t *p)
+{
+    int j;
+
+    #define check(ret) if ((ret) < 0) return -1
+    check(idx_write_uint32(fp, bin));
+    if (fmt == HTS_FMT_CSI) check(idx_write_uint64(fp, p->loff));
+    check(idx_write_int32(fp, p->n));
+    for (j = 0; j < p->n; ++j) {
+        check(idx_write_uint64(fp, p->list[j].u));
+        check(idx_write_uint64(fp, p->list[j].v));
+    }
+    return 0;
+    #undef check
+}
+
 static int hts_idx_save_core(const hts_idx_t *idx, BGZF *fp, int fmt)
 {
     int32_t i, j;
@@ -2069,7 +2423,7 @@ static int hts_idx_save_core(const hts_idx_t *idx, BGZF *fp, int fmt)
     int nids = idx->n;
     if (idx->meta && idx->l_meta >= 4 && le_to_u32(idx->meta) == TBX_VCF) {
         for (i = nids = 0; i < idx->n; ++i) {
-            if (idx->bidx[i])
+            if (idx_has_tid(idx, i))
                 nids++;
         }
     }
@@ -2079,26 +2433,30 @@ static int hts_idx_save_core(const hts_idx_t *idx, BGZF *fp, int fmt)
 
     for (i = 0; i < idx->n; ++i) {
         khint_t k;
-        bidx_t *bidx = idx->bidx[i];
-        lidx_t *lidx = &idx->lidx[i];
+        lidx_t ltmp;
+        const lidx_t *lidx = idx_get_lidx(idx, i, &ltmp); // Loads lazy refs
+        bidx_t *bidx;
+
+        if (!lidx) return -1;
+        bidx = idx->flat.refs ? NULL : idx->bidx[i];
 
         // write binning index
-        if (nids == idx->n || bidx)
-            check(idx_write_int32(fp, bidx? kh_size(bidx) : 0));
+        if (nids == idx->n || idx_has_tid(idx, i))
+            check(idx_write_int32(fp, idx_n_bins(idx, i)));
         if (bidx)
             for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
-                if (kh_exist(bidx, k)) {
-                    bins_t *p = &kh_value(bidx, k);
-                    check(idx_write_uint32(fp, kh_key(bidx, k)));
-                    if (fmt == HTS_FMT_CSI) check(idx_write_uint64(fp, p->loff));
-                    //int j;for(j=0;j<p->n;++j)fprintf(stderr,"%d,%llx,%d,%llx:%llx\n",kh_key(bidx,k),kh_val(bidx, k).loff,j,p->list[j].u,p->list[j].v);
-                    check(idx_write_int32(fp, p->n));
-                    for (j = 0; j < p->n; ++j) {
-                        //fprintf(stderr, "\t%ld\t%ld\n", p->list[j].u, p->list[j].v);
-                        check(idx_write_uint64(fp, p->list[j].u));
-                        check(idx_write_uint64(fp, p->list[j].v));
-                    }
-                }
+                if (kh_exist(bidx, k))
+                    check(idx_write_bin(fp, fmt, kh_key(bidx, k), &kh_value(bidx, k)));
+        if (idx->flat.refs) {
+            const flat_ref_t *r = &idx->flat.refs[i];
+            const flat_bin_t *b = (const flat_bin_t *) (idx->flat.data + r->bins_off);
+            bins_t tmp;
+            for (j = 0; j < r->n_bin; ++j) {
+                const bins_t *p = idx_get_bin(idx, i, b[j].bin, &tmp);
+                if (!p) return -1;
+                check(idx_write_bin(fp, fmt, b[j].bin, p));
+            }
+        }
 
         // write linear index
         if (fmt != HTS_FMT_CSI) {
@@ -2168,72 +2526,508 @@ fail:
     return -1;
 }
 
-static int idx_read_core(hts_idx_t *idx, BGZF *fp, int fmt)
+/*
+ * Flat indexes
+ */
+
+// Fills *bins with the bin numbers of reference tid in ascending order
+static int idx_sorted_bins(const hts_idx_t *idx, int tid, uint32_t **bins,
+                           size_t *m)
 {
-    int32_t i, n, is_be;
-    is_be = ed_is_big();
-    if (idx == NULL) return -4;
-    for (i = 0; i < idx->n; ++i) {
-        bidx_t *h;
-        lidx_t *l = &idx->lidx[i];
-        uint32_t key;
-        int j, absent;
-        bins_t *p;
-        h = idx->bidx[i] = kh_init(bin);
+    size_t n = idx_n_bins(idx, tid), i = 0;
+
+    if (n > *m) {
+        uint32_t *b = realloc(*bins, n * sizeof(*b));
+        if (!b) return -1;
+        *bins = b;
+        *m = n;
+    }
+    if (idx->flat.refs) {
+        const flat_bin_t *b = (const flat_bin_t *)
+            (idx->flat.data + idx->flat.refs[tid].bins_off);
+        for (i = 0; i < n; i++)
+            (*bins)[i] = b[i].bin;
+    } else if (n) {
+        bidx_t *bidx = idx->bidx[tid];
+        khint_t k;
+        for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+            if (kh_exist(bidx, k))
+                (*bins)[i++] = kh_key(bidx, k);
+        ks_introsort(uint32_t, n, *bins);
+    }
+    return 0;
+}
+
+// Gets the offsets of the data for each reference, returning the file size
+// or 0 if a lazily loaded reference could not be read
+static uint64_t flat_layout(const hts_idx_t *idx, flat_ref_t *refs)
+{
+    uint64_t pos = FLAT_HDR_SIZE + ((idx->l_meta + 7) & ~(uint64_t)7);
+    int i;
+
+    pos += (uint64_t) idx->n * sizeof(flat_ref_t);
+    for (i = 0; i < idx->n; i++) {
+        lidx_t ltmp;
+        const lidx_t *lidx = idx_get_lidx(idx, i, &ltmp);
+        uint32_t bin;
+        uint64_t n_chunk = 0;
+
+        if (!lidx) return 0;
+        refs[i].present = idx_has_tid(idx, i);
+        refs[i].n_bin = idx_n_bins(idx, i);
+        refs[i].bins_off = pos;
+        if (!idx->flat.refs && idx->bidx[i]) {
+            bidx_t *bidx = idx->bidx[i];
+            khint_t k;
+            for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+                if (kh_exist(bidx, k))
+                    n_chunk += kh_val(bidx, k).n;
+        } else if (idx->flat.refs) {
+            const flat_bin_t *b = (const flat_bin_t *)
+                (idx->flat.data + idx->flat.refs[i].bins_off);
+            for (bin = 0; bin < refs[i].n_bin; bin++)
+                n_chunk += b[bin].n_chunk;
+        }
+        pos += (uint64_t) refs[i].n_bin * sizeof(flat_bin_t)
+            + n_chunk * sizeof(hts_pair64_t);
+        refs[i].lidx_off = pos;
+        refs[i].n_lidx = lidx->offset ? lidx->n : 0;
+        pos += refs[i].n_lidx * sizeof(uint64_t);
+    }
+    return pos;
+}
+
+int hts_idx_save_flat(const hts_idx_t *idx, const char *fnidx)
+{
+    flat_ref_t *refs = NULL;
+    uint32_t *bins = NULL;
+    size_t m_bins = 0;
+    kstring_t buf = { 0, 0, NULL };
+    uint8_t x[32];
+    uint64_t size, pos;
+    hFILE *fp = NULL;
+    int i;
+    size_t j, k;
+
+    if (idx == NULL || fnidx == NULL || idx->fmt == HTS_FMT_CRAI) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    #define check(ret) if ((ret) < 0) goto fail
+    #define put(p, len) check(kputsn_((p), (len), &buf))
+
+    if (!(refs = calloc(idx->n ? idx->n : 1, sizeof(*refs))))
+        return -1;
+    if (!(size = flat_layout(idx, refs)))
+        goto fail;
+    if (!(fp = hopen(fnidx, "w")))
+        goto fail;
+
+    // Header and meta data
+    memcpy(x, "FLI\1", 4);
+    i32_to_le(idx->fmt, x + 4);
+    i32_to_le(idx->min_shift, x + 8);
+    i32_to_le(idx->n_lvls, x + 12);
+    i32_to_le(idx->n, x + 16);
+    u32_to_le(idx->l_meta, x + 20);
+    u64_to_le(idx->n_no_coor, x + 24);
+    put(x, 32);
+    u64_to_le(FLAT_HDR_SIZE, x);
+    u64_to_le(FLAT_HDR_SIZE + ((idx->l_meta + 7) & ~(uint64_t)7), x + 8);
+    u64_to_le(size, x + 16);
+    u64_to_le(0, x + 24);
+    put(x, 32);
+    if (idx->l_meta) put(idx->meta, idx->l_meta);
+    memset(x, 0, 8);
+    put(x, (8 - (idx->l_meta & 7)) & 7);
+
+    // Table of contents
+    for (i = 0; i < idx->n; i++) {
+        u64_to_le(refs[i].bins_off, x);
+        u64_to_le(refs[i].lidx_off, x + 8);
+        u32_to_le(refs[i].n_bin, x + 16);
+        u32_to_le(refs[i].present, x + 20);
+        u64_to_le(refs[i].n_lidx, x + 24);
+        put(x, 32);
+    }
+    check(hwrite(fp, buf.s, buf.l));
+    pos = buf.l;
+    buf.l = 0;
+
+    // Bins, chunks and linear index of each reference
+    for (i = 0; i < idx->n; i++) {
+        uint64_t chunks_off = refs[i].bins_off
+            + (uint64_t) refs[i].n_bin * sizeof(flat_bin_t);
+        lidx_t ltmp;
+        const lidx_t *lidx = idx_get_lidx(idx, i, &ltmp);
+        bins_t tmp;
+        const bins_t *p;
+
+        if (!lidx) goto fail;
+        check(idx_sorted_bins(idx, i, &bins, &m_bins));
+        for (j = 0; j < refs[i].n_bin; j++) {
+            if (!(p = idx_get_bin(idx, i, bins[j], &tmp))) goto fail;
+            u32_to_le(bins[j], x);
+            u32_to_le(p->n, x + 4);
+            u64_to_le(p->loff, x + 8);
+            u64_to_le(chunks_off, x + 16);
+            put(x, 24);
+            chunks_off += (uint64_t) p->n * sizeof(hts_pair64_t);
+        }
+        for (j = 0; j < refs[i].n_bin; j++) {
+            p = idx_get_bin(idx, i, bins[j], &tmp);
+            for (k = 0; k < p->n; k++) {
+                u64_to_le(p->list[k].u, x);
+                u64_to_le(p->list[k].v, x + 8);
+                put(x, 16);
+            }
+        }
+        for (j = 0; j < refs[i].n_lidx; j++) {
+            u64_to_le(lidx->offset[j], x);
+            put(x, 8);
+        }
+        check(hwrite(fp, buf.s, buf.l));
+        pos += buf.l;
+        buf.l = 0;
+    }
+    #undef put
+    #undef check
+
+    if (pos != size) {
+        hts_log_error("Flat index size mismatch");
+        goto fail;
+    }
+    free(refs);
+    free(bins);
+    free(buf.s);
+    return hclose(fp) < 0 ? -1 : 0;
+
+ fail:
+    if (fp) hclose_abruptly(fp);
+    free(refs);
+    free(bins);
+    free(buf.s);
+    return -1;
+}
+
+// Reads the bins and linear index of reference i
+static int idx_read_ref(hts_idx_t *idx, BGZF *fp, int fmt, int i)
+{
+    int32_t n, is_be = ed_is_big();
+    bidx_t *h;
+    lidx_t *l = &idx->lidx[i];
+    uint32_t key;
+    int j, absent;
+    bins_t *p;
+    h = idx->bidx[i] = kh_init(bin);
+    if (h == NULL) return -2;
+    if (bgzf_read(fp, &n, 4) != 4) return -1;
+    if (is_be) ed_swap_4p(&n);
+    if (n < 0) return -3;
+    for (j = 0; j < n; ++j) {
+        khint_t k;
+        if (bgzf_read(fp, &key, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&key);
+        k = kh_put(bin, h, key, &absent);
+        if (absent <  0) return -2; // No memory
+        if (absent == 0) return -3; // Duplicate bin number
+        p = &kh_val(h, k);
+        p->list = NULL;
+        if (fmt == HTS_FMT_CSI) {
+            if (bgzf_read(fp, &p->loff, 8) != 8) return -1;
+            if (is_be) ed_swap_8p(&p->loff);
+        } else p->loff = 0;
+        if (bgzf_read(fp, &p->n, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&p->n);
+        if (p->n < 0) return -3;
+        if ((size_t) p->n > SIZE_MAX / sizeof(hts_pair64_t)) return -2;
+        p->m = p->n;
+        p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
+        if (p->list == NULL) return -2;
+        if (bgzf_read(fp, p->list, ((size_t) p->n)<<4) != ((size_t) p->n)<<4) return -1;
+        if (is_be) swap_bins(p);
+    }
+    if (fmt != HTS_FMT_CSI) { // load linear index
+        uint32_t x;
+        if (bgzf_read(fp, &x, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&x);
+        l->n = x;
+        if (l->n < 0) return -3;
+        if ((size_t) l->n > SIZE_MAX / sizeof(uint64_t)) return -2;
+        l->m = l->n;
+        l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
+        if (l->offset == NULL) return -2;
+        if (bgzf_read(fp, l->offset, l->n << 3) != l->n << 3) return -1;
+        if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
+        for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
+            if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
+        update_loff(idx, i, 0);
+    }
+    return 0;
+}
+
+static int idx_skip(BGZF *fp, uint64_t len)
+{
+    uint8_t buf[4096];
+    while (len > 0) {
+        size_t l = len < sizeof(buf) ? len : sizeof(buf);
+        if (bgzf_read(fp, buf, l) != l) return -1;
+        len -= l;
+    }
+    return 0;
+}
+
+// Moves past the data for one reference without storing it
+static int idx_skip_ref(BGZF *fp, int fmt)
+{
+    int32_t n_bin, n, j, is_be = ed_is_big();
+    if (bgzf_read(fp, &n_bin, 4) != 4) return -1;
+    if (is_be) ed_swap_4p(&n_bin);
+    if (n_bin < 0) return -3;
+    for (j = 0; j < n_bin; ++j) {
+        if (idx_skip(fp, fmt == HTS_FMT_CSI ? 12 : 4) < 0) return -1;
         if (bgzf_read(fp, &n, 4) != 4) return -1;
         if (is_be) ed_swap_4p(&n);
         if (n < 0) return -3;
-        for (j = 0; j < n; ++j) {
-            khint_t k;
-            if (bgzf_read(fp, &key, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&key);
-            k = kh_put(bin, h, key, &absent);
-            if (absent <  0) return -2; // No memory
-            if (absent == 0) return -3; // Duplicate bin number
-            p = &kh_val(h, k);
-            if (fmt == HTS_FMT_CSI) {
-                if (bgzf_read(fp, &p->loff, 8) != 8) return -1;
-                if (is_be) ed_swap_8p(&p->loff);
-            } else p->loff = 0;
-            if (bgzf_read(fp, &p->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&p->n);
-            if (p->n < 0) return -3;
-            if ((size_t) p->n > SIZE_MAX / sizeof(hts_pair64_t)) return -2;
-            p->m = p->n;
-            p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
-            if (p->list == NULL) return -2;
-            if (bgzf_read(fp, p->list, ((size_t) p->n)<<4) != ((size_t) p->n)<<4) return -1;
-            if (is_be) swap_bins(p);
-        }
-        if (fmt != HTS_FMT_CSI) { // load linear index
-            int j;
-            uint32_t x;
-            if (bgzf_read(fp, &x, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&x);
-            l->n = x;
-            if (l->n < 0) return -3;
-            if ((size_t) l->n > SIZE_MAX / sizeof(uint64_t)) return -2;
-            l->m = l->n;
-            l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
-            if (l->offset == NULL) return -2;
-            if (bgzf_read(fp, l->offset, l->n << 3) != l->n << 3) return -1;
-            if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
-            for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
-                if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
-            update_loff(idx, i, 0);
+        if (idx_skip(fp, (uint64_t) n << 4) < 0) return -1;
+    }
+    if (fmt != HTS_FMT_CSI) {
+        uint32_t x;
+        if (bgzf_read(fp, &x, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&x);
+        if (x > INT32_MAX) return -3;
+        if (idx_skip(fp, (uint64_t) x << 3) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the per-reference data.  If lazy is set, and fp can be seeked, this
+ * only records where each reference starts and keeps fp open in idx so
+ * that idx_lazy_load() can read the reference when it is first used.
+ */
+static int idx_read_core(hts_idx_t *idx, BGZF *fp, int fmt, int lazy)
+{
+    int32_t i, is_be;
+    int ret;
+    is_be = ed_is_big();
+    if (idx == NULL) return -4;
+    if (lazy && idx->n > 0 && bgzf_compression(fp) != gzip) {
+        idx->lazy.voff = (uint64_t *) malloc(idx->n * sizeof(uint64_t));
+        idx->lazy.loaded = (uint8_t *) calloc(idx->n, 1);
+        if (!idx->lazy.voff || !idx->lazy.loaded) return -2;
+        for (i = 0; i < idx->n; ++i) {
+            idx->lazy.voff[i] = bgzf_tell(fp);
+            if ((ret = idx_skip_ref(fp, fmt)) < 0) return ret;
         }
+    } else {
+        for (i = 0; i < idx->n; ++i)
+            if ((ret = idx_read_ref(idx, fp, fmt, i)) < 0) return ret;
+        lazy = 0;
     }
     if (bgzf_read(fp, &idx->n_no_coor, 8) != 8) idx->n_no_coor = 0;
     if (is_be) ed_swap_8p(&idx->n_no_coor);
+    if (lazy) {
+        if (pthread_mutex_init(&idx->lazy.lock, NULL) != 0) return -2;
+        idx->lazy.fp = fp;
+    }
+    return 0;
+}
+
+// Reads reference tid of an index loaded with HTS_IDX_LAZY, unless this
+// has already been done.  The index may be shared between threads, so this
+// is done under a lock.  On failure the reference is left empty and not
+// marked as loaded, so each later use reports the error too.
+// Returns 0 on success, -1 on failure.
+static int idx_lazy_load(const hts_idx_t *cidx, int tid)
+{
+    hts_idx_t *idx = (hts_idx_t *) cidx;
+    int ret = 0;
+    pthread_mutex_lock(&idx->lazy.lock);
+    if (!idx->lazy.loaded[tid]) {
+        if (bgzf_seek(idx->lazy.fp, idx->lazy.voff[tid], SEEK_SET) < 0
+            || idx_read_ref(idx, idx->lazy.fp, idx->fmt, tid) < 0) {
+            hts_log_error("Failed to read the index for reference %d", tid);
+            idx_free_ref(idx, tid);
+            ret = -1;
+        } else {
+            idx->lazy.loaded[tid] = 1;
+        }
+    }
+    pthread_mutex_unlock(&idx->lazy.lock);
+    return ret;
+}
+
+// Converts the contents of a flat index read into memory on a big-endian
+// machine to native byte order.  The header is left as it is.
+static int flat_swap(uint8_t *data, size_t size)
+{
+    uint32_t n_ref = le_to_u32(data + 16), i, j;
+    uint64_t refs_off = le_to_u64(data + 40), k;
+    flat_ref_t *refs;
+
+    if (refs_off > size || (refs_off & 7) != 0
+        || n_ref > (size - refs_off) / sizeof(flat_ref_t))
+        return -1;
+    refs = (flat_ref_t *) (data + refs_off);
+    for (i = 0; i < n_ref; i++) {
+        flat_bin_t *b;
+        uint64_t *l;
+        ed_swap_8p(&refs[i].bins_off);
+        ed_swap_8p(&refs[i].lidx_off);
+        ed_swap_4p(&refs[i].n_bin);
+        ed_swap_4p(&refs[i].present);
+        ed_swap_8p(&refs[i].n_lidx);
+        if (((refs[i].bins_off | refs[i].lidx_off) & 7) != 0
+            || refs[i].bins_off > size
+            || refs[i].n_bin > (size - refs[i].bins_off) / sizeof(flat_bin_t)
+            || refs[i].lidx_off > size
+            || refs[i].n_lidx > (size - refs[i].lidx_off) / sizeof(uint64_t))
+            return -1;
+        b = (flat_bin_t *) (data + refs[i].bins_off);
+        for (j = 0; j < refs[i].n_bin; j++) {
+            uint64_t *c;
+            ed_swap_4p(&b[j].bin);
+            ed_swap_4p(&b[j].n_chunk);
+            ed_swap_8p(&b[j].loff);
+            ed_swap_8p(&b[j].chunks_off);
+            if ((b[j].chunks_off & 7) != 0 || b[j].chunks_off > size
+                || b[j].n_chunk > (size - b[j].chunks_off) / sizeof(hts_pair64_t))
+                return -1;
+            c = (uint64_t *) (data + b[j].chunks_off);
+            for (k = 0; k < 2 * (uint64_t) b[j].n_chunk; k++)
+                ed_swap_8p(&c[k]);
+        }
+        l = (uint64_t *) (data + refs[i].lidx_off);
+        for (k = 0; k < refs[i].n_lidx; k++)
+            ed_swap_8p(&l[k]);
+    }
     return 0;
 }
 
-static hts_idx_t *idx_read(const char *fn)
+/*
+ * Loads a flat index.  Local files are memory mapped where possible,
+ * otherwise the file is read into memory.  Either way the data is used
+ * as it is, so only the header and table of contents are checked here;
+ * the bins are checked as they are looked up.
+ */
+static hts_idx_t *idx_read_flat(const char *fn)
+{
+    hts_idx_t *idx = NULL;
+    uint8_t *data = NULL;
+    size_t size = 0;
+    int mapped = 0, fmt, min_shift, n_lvls, n_ref;
+    uint32_t l_meta, i;
+    uint64_t meta_off, refs_off;
+    const flat_ref_t *refs;
+
+#ifdef HAVE_MMAP
+    if (!hisremote(fn) && !ed_is_big()) {
+        struct stat st;
+        int fd = open(fn, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+            && st.st_size >= FLAT_HDR_SIZE && st.st_size <= SIZE_MAX) {
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m != MAP_FAILED) {
+                data = m;
+                size = st.st_size;
+                mapped = 1;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+#endif
+    if (!data) {
+        hFILE *fp = hopen(fn, "r");
+        ssize_t got;
+        size_t alloc = 0;
+        if (!fp) return NULL;
+        do {
+            if (size + 65536 > alloc) {
+                uint8_t *d;
+                alloc = alloc ? alloc * 2 : 65536 * 4;
+                if (!(d = realloc(data, alloc))) {
+                    got = -1;
+                    break;
+                }
+                data = d;
+            }
+            if ((got = hread(fp, data + size, alloc - size)) > 0)
+                size += got;
+        } while (got > 0);
+        if (hclose(fp) < 0 || got < 0)
+            goto fail;
+        if (size < FLAT_HDR_SIZE
+            || (ed_is_big() && flat_swap(data, size) < 0))
+            goto bad;
+    }
+
+    if (memcmp(data, "FLI\1", 4) != 0)
+        goto bad;
+    fmt       = le_to_i32(data + 4);
+    min_shift = le_to_i32(data + 8);
+    n_lvls    = le_to_i32(data + 12);
+    n_ref     = le_to_i32(data + 16);
+    l_meta    = le_to_u32(data + 20);
+    meta_off  = le_to_u64(data + 32);
+    refs_off  = le_to_u64(data + 40);
+    if ((fmt != HTS_FMT_CSI && fmt != HTS_FMT_BAI && fmt != HTS_FMT_TBI)
+        || n_lvls < 0 || n_lvls > 9 || min_shift < 0 || min_shift > 62
+        || n_ref < 0 || le_to_u64(data + 48) != size
+        || meta_off > size || l_meta > size - meta_off
+        || (refs_off & 7) != 0 || refs_off > size
+        || (uint64_t) n_ref > (size - refs_off) / sizeof(flat_ref_t))
+        goto bad;
+    refs = (const flat_ref_t *) (data + refs_off);
+    for (i = 0; i < n_ref; i++) {
+        if ((refs[i].bins_off & 7) != 0 || refs[i].bins_off > size
+            || refs[i].n_bin > (size - refs[i].bins_off) / sizeof(flat_bin_t)
+            || (refs[i].lidx_off & 7) != 0 || refs[i].lidx_off > size
+            || refs[i].n_lidx > (size - refs[i].lidx_off) / sizeof(uint64_t))
+            goto bad;
+    }
+
+    if (!(idx = hts_idx_init(0, fmt, 0, min_shift, n_lvls)))
+        goto fail;
+    idx->n = n_ref;
+    idx->n_no_coor = le_to_u64(data + 24);
+    if (l_meta) {
+        if (!(idx->meta = malloc((size_t) l_meta + 1)))
+            goto fail;
+        memcpy(idx->meta, data + meta_off, l_meta);
+        idx->meta[l_meta] = '\0';
+        idx->l_meta = l_meta;
+    }
+    idx->z.finished = 1;
+    idx->flat.data = data;
+    idx->flat.size = size;
+    idx->flat.mapped = mapped;
+    idx->flat.refs = refs;
+    return idx;
+
+ bad:
+    hts_log_error("Corrupted or unsupported flat index \"%s\"", fn);
+    errno = EINVAL;
+ fail:
+    hts_idx_destroy(idx);
+#ifdef HAVE_MMAP
+    if (mapped)
+        munmap(data, size);
+    else
+#endif
+        free(data);
+    return NULL;
+}
+
+static hts_idx_t *idx_read(const char *fn, int flags)
 {
     uint8_t magic[4];
     int i, is_be;
     hts_idx_t *idx = NULL;
     uint8_t *meta = NULL;
+    int lazy = (flags & HTS_IDX_LAZY) != 0;
     BGZF *fp = bgzf_open(fn, "r");
     if (fp == NULL) return NULL;
     is_be = ed_is_big();
@@ -2257,7 +3051,7 @@ static hts_idx_t *idx_read(const char *fn)
         idx->l_meta = x[2];
         idx->meta = meta;
         meta = NULL;
-        if (idx_read_core(idx, fp, HTS_FMT_CSI) < 0) goto fail;
+        if (idx_read_core(idx, fp, HTS_FMT_CSI, lazy) < 0) goto fail;
     }
     else if (memcmp(magic, "TBI\1", 4) == 0) {
         uint8_t x[8 * 4];
@@ -2278,7 +3072,11 @@ static hts_idx_t *idx_read(const char *fn)
         if (bgzf_read(fp, idx->meta + 28, n) != n) goto fail;
         // Prevent possible strlen past the end in tbx_index_load2
         idx->meta[idx->l_meta] = '\0';
-        if (idx_read_core(idx, fp, HTS_FMT_TBI) < 0) goto fail;
+        if (idx_read_core(idx, fp, HTS_FMT_TBI, lazy) < 0) goto fail;
+    }
+    else if (memcmp(magic, "FLI\1", 4) == 0) {
+        bgzf_close(fp);
+        return idx_read_flat(fn);
     }
     else if (memcmp(magic, "BAI\1", 4) == 0) {
         uint32_t n;
@@ -2286,11 +3084,11 @@ static hts_idx_t *idx_read(const char *fn)
         if (is_be) ed_swap_4p(&n);
         if (n > INT32_MAX) goto fail;
         if ((idx = hts_idx_init(n, HTS_FMT_BAI, 0, 14, 5)) == NULL) goto fail;
-        if (idx_read_core(idx, fp, HTS_FMT_BAI) < 0) goto fail;
+        if (idx_read_core(idx, fp, HTS_FMT_BAI, lazy) < 0) goto fail;
     }
     else { errno = EINVAL; goto fail; }
 
-    bgzf_close(fp);
+    if (idx->lazy.fp != fp) bgzf_close(fp);
     return idx;
 
 fail:
@@ -2340,8 +3138,7 @@ const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid,
     const char **names = (const char**) calloc(idx->n,sizeof(const char*));
     for (i=0; i<idx->n; i++)
     {
-        bidx_t *bidx = idx->bidx[i];
-        if ( !bidx ) continue;
+        if ( !idx_has_tid(idx, i) ) continue;
         names[tid++] = getid(hdr,i);
     }
     *n = tid;
@@ -2355,11 +3152,11 @@ int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t*
         return -1;
     }
 
-    bidx_t *h = idx->bidx[tid];
-    khint_t k = kh_get(bin, h, META_BIN(idx));
-    if (k != kh_end(h)) {
-        *mapped = kh_val(h, k).list[1].u;
-        *unmapped = kh_val(h, k).list[1].v;
+    bins_t tmp;
+    const bins_t *p = idx_get_bin(idx, tid, META_BIN(idx), &tmp);
+    if (p && p->n >= 2) {
+        *mapped = p->list[1].u;
+        *unmapped = p->list[1].v;
         return 0;
     } else {
         *mapped = 0; *unmapped = 0;
@@ -2402,11 +3199,11 @@ static inline int reg2intervals(hts_itr_t *iter, const hts_idx_t *idx, int tid,
     int i, j;
     hts_pos_t b, e;
     hts_pair64_max_t *off;
-    bidx_t *bidx;
-    khint_t k;
+    bins_t tmp;
+    const bins_t *p;
     int start_n_off = iter->n_off;
 
-    if (!iter || !idx || (bidx = idx->bidx[tid]) == NULL || beg >= end)
+    if (!iter || !idx || !idx_has_tid(idx, tid) || beg >= end)
         return -1;
 
     s = min_shift + (n_lvls<<1) + n_lvls;
@@ -2417,9 +3214,7 @@ static inline int reg2intervals(hts_itr_t *iter, const hts_idx_t *idx, int tid,
         b = t + (beg>>s); e = t + (end>>s);
 
         for (i = b; i <= e; ++i) {
-            if ((k = kh_get(bin, bidx, i)) != kh_end(bidx)) {
-                bins_t *p = &kh_value(bidx, k);
-
+            if ((p = idx_get_bin(idx, tid, i, &tmp)) != NULL) {
                 if (p->n) {
                     off = realloc(iter->off, (iter->n_off + p->n) * sizeof(*off));
                     if (!off)
@@ -2478,20 +3273,21 @@ static int compare_regions(const void *r1, const void *r2) {
 uint64_t hts_itr_off(const hts_idx_t* idx, int tid) {
 
     int i;
-    bidx_t* bidx;
+    bins_t tmp;
+    const bins_t *p;
     uint64_t off0 = (uint64_t) -1;
-    khint_t k;
     switch (tid) {
     case HTS_IDX_START:
         // Find the smallest offset, note that sequence ids may not be ordered sequentially
         for (i = 0; i < idx->n; i++) {
-            bidx = idx->bidx[i];
-            k = kh_get(bin, bidx, META_BIN(idx));
-            if (k == kh_end(bidx))
+            if (idx_n_bins(idx, i) < 0)
+                return (uint64_t) -1;
+            p = idx_get_bin(idx, i, META_BIN(idx), &tmp);
+            if (!p || !p->n)
                 continue;
 
-            if (off0 > kh_val(bidx, k).list[0].u)
-                off0 = kh_val(bidx, k).list[0].u;
+            if (off0 > p->list[0].u)
+                off0 = p->list[0].u;
         }
         if (off0 == (uint64_t) -1 && idx->n_no_coor)
             off0 = 0;
@@ -2505,11 +3301,12 @@ uint64_t hts_itr_off(const hts_idx_t* idx, int tid) {
            or sequence ids are not ordered sequentially.
            See issue samtools#568 and commits b2aab8, 60c22d and cc207d. */
         for (i = 0; i < idx->n; i++) {
-            bidx = idx->bidx[i];
-            k = kh_get(bin, bidx, META_BIN(idx));
-            if (k != kh_end(bidx)) {
-                if (off0 == (uint64_t) -1 || off0 < kh_val(bidx, k).list[0].v) {
-                    off0 = kh_val(bidx, k).list[0].v;
+            if (idx_n_bins(idx, i) < 0)
+                return (uint64_t) -1;
+            p = idx_get_bin(idx, i, META_BIN(idx), &tmp);
+            if (p && p->n) {
+                if (off0 == (uint64_t) -1 || off0 < p->list[0].v) {
+                    off0 = p->list[0].v;
                 }
             }
         }
@@ -2528,12 +3325,61 @@ uint64_t hts_itr_off(const hts_idx_t* idx, int tid) {
     return off0;
 }
 
+// Computes the range of virtual offsets that can hold alignments
+// overlapping beg..end on reference tid.
+static void idx_query_offsets(const hts_idx_t *idx, int tid, hts_pos_t beg,
+                              hts_pos_t end, uint64_t *min_off,
+                              uint64_t *max_off)
+{
+    int bin;
+    bins_t tmp;
+    const bins_t *p;
+    lidx_t ltmp;
+    const lidx_t *lidx;
+
+    /* Compute 'min_off' by searching the lowest level bin containing 'beg'.
+       If the computed bin is not in the index, try the next bin to the
+       left, belonging to the same parent. If it is the first sibling bin,
+       try the parent bin. */
+    bin = hts_bin_first(idx->n_lvls) + (beg>>idx->min_shift);
+    do {
+        int first;
+        if ((p = idx_get_bin(idx, tid, bin, &tmp)) != NULL) break;
+        first = (hts_bin_parent(bin)<<3) + 1;
+        if (bin > first) --bin;
+        else bin = hts_bin_parent(bin);
+    } while (bin);
+    if (bin == 0) p = idx_get_bin(idx, tid, bin, &tmp);
+    *min_off = p ? p->loff : 0;
+    // min_off can be calculated more accurately if the
+    // linear index is available
+    lidx = idx_get_lidx(idx, tid, &ltmp);
+    if (lidx && lidx->offset
+        && beg>>idx->min_shift < lidx->n
+        && *min_off < lidx->offset[beg>>idx->min_shift])
+        *min_off = lidx->offset[beg>>idx->min_shift];
+
+    // compute max_off: a virtual offset from a bin to the right of end
+    bin = hts_bin_first(idx->n_lvls) + ((end-1) >> idx->min_shift) + 1;
+    if (bin >= idx->n_bins) bin = 0;
+    while (1) {
+        // search for an extant bin by moving right, but moving up to the
+        // parent whenever we get to a first child (which also covers falling
+        // off the RHS, which wraps around and immediately goes up to bin 0)
+        while (bin % 8 == 1) bin = hts_bin_parent(bin);
+        if (bin == 0) { *max_off = (uint64_t)-1; break; }
+        p = idx_get_bin(idx, tid, bin, &tmp);
+        if (p && p->n > 0) { *max_off = p->list[0].u; break; }
+        bin++;
+    }
+}
+
 hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t end, hts_readrec_func *readrec)
 {
-    int i, n_off, l, bin;
+    int i, n_off, l;
     hts_pair64_max_t *off;
-    khint_t k;
-    bidx_t *bidx;
+    bins_t tmp;
+    const bins_t *p;
     uint64_t min_off, max_off;
     hts_itr_t *iter;
 
@@ -2564,7 +3410,7 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t
               free(iter);
               return NULL;
             }
-            if (tid >= idx->n || (bidx = idx->bidx[tid]) == NULL) {
+            if (tid >= idx->n || !idx_has_tid(idx, tid)) {
               free(iter);
               return NULL;
             }
@@ -2572,45 +3418,21 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t
             iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
             iter->readrec = readrec;
 
-            if ( !kh_size(bidx) ) { iter->finished = 1; return iter; }
-
-            // compute min_off
-            bin = hts_bin_first(idx->n_lvls) + (beg>>idx->min_shift);
-            do {
-                int first;
-                k = kh_get(bin, bidx, bin);
-                if (k != kh_end(bidx)) break;
-                first = (hts_bin_parent(bin)<<3) + 1;
-                if (bin > first) --bin;
-                else bin = hts_bin_parent(bin);
-            } while (bin);
-            if (bin == 0) k = kh_get(bin, bidx, bin);
-            min_off = k != kh_end(bidx)? kh_val(bidx, k).loff : 0;
-            if (idx->lidx[tid].offset
-                && beg>>idx->min_shift < idx->lidx[tid].n
-                && min_off < idx->lidx[tid].offset[beg>>idx->min_shift])
-                min_off = idx->lidx[tid].offset[beg>>idx->min_shift];
-
-            // compute max_off: a virtual offset from a bin to the right of end
-            bin = hts_bin_first(idx->n_lvls) + ((end-1) >> idx->min_shift) + 1;
-            if (bin >= idx->n_bins) bin = 0;
-            while (1) {
-                // search for an extant bin by moving right, but moving up to the
-                // parent whenever we get to a first child (which also covers falling
-                // off the RHS, which wraps around and immediately goes up to bin 0)
-                while (bin % 8 == 1) bin = hts_bin_parent(bin);
-                if (bin == 0) { max_off = (uint64_t)-1; break; }
-                k = kh_get(bin, bidx, bin);
-                if (k != kh_end(bidx) && kh_val(bidx, k).n > 0) { max_off = kh_val(bidx, k).list[0].u; break; }
-                bin++;
+            n_off = idx_n_bins(idx, tid);
+            if (n_off < 0) { // Lazily loaded reference could not be read
+                free(iter);
+                return NULL;
             }
+            if ( !n_off ) { iter->finished = 1; return iter; }
+
+            idx_query_offsets(idx, tid, beg, end, &min_off, &max_off);
 
             // retrieve bins
             reg2bins(beg, end, iter, idx->min_shift, idx->n_lvls);
 
             for (i = n_off = 0; i < iter->bins.n; ++i)
-                if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx))
-                    n_off += kh_value(bidx, k).n;
+                if ((p = idx_get_bin(idx, tid, iter->bins.a[i], &tmp)) != NULL)
+                    n_off += p->n;
             if (n_off == 0) {
                 // No overlapping bins means the iterator has already finished.
                 iter->finished = 1;
@@ -2618,9 +3440,8 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t
             }
             off = calloc(n_off, sizeof(*off));
             for (i = n_off = 0; i < iter->bins.n; ++i) {
-                if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx)) {
+                if ((p = idx_get_bin(idx, tid, iter->bins.a[i], &tmp)) != NULL) {
                     int j;
-                    bins_t *p = &kh_value(bidx, k);
                     for (j = 0; j < p->n; ++j)
                         if (p->list[j].v > min_off && p->list[j].u < max_off) {
                             off[n_off].u = min_off > p->list[j].u
@@ -2665,9 +3486,7 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t
 
 int hts_itr_multi_bam(const hts_idx_t *idx, hts_itr_t *iter)
 {
-    int i, j, bin;
-    khint_t k;
-    bidx_t *bidx;
+    int i, j, n_bins;
     uint64_t min_off, max_off, t_off = (uint64_t)-1;
     int tid;
     hts_pos_t beg, end;
@@ -2701,7 +3520,12 @@ int hts_itr_multi_bam(const hts_idx_t *idx, hts_itr_t *iter)
                 }
             }
         } else {
-            if (tid >= idx->n || (bidx = idx->bidx[tid]) == NULL || !kh_size(bidx))
+            if (tid >= idx->n)
+                continue;
+            n_bins = idx_n_bins(idx, tid);
+            if (n_bins < 0)
+                return -1;
+            if (!n_bins)
                 continue;
 
             for(j=0; j<curr_reg->count; j++) {
@@ -2712,45 +3536,7 @@ int hts_itr_multi_bam(const hts_idx_t *idx, hts_itr_t *iter)
                 beg = curr_intv->beg;
                 end = curr_intv->end;
 
-                /* Compute 'min_off' by searching the lowest level bin containing 'beg'.
-                       If the computed bin is not in the index, try the next bin to the
-                       left, belonging to the same parent. If it is the first sibling bin,
-                       try the parent bin. */
-                bin = hts_bin_first(idx->n_lvls) + (beg>>idx->min_shift);
-                do {
-                    int first;
-                    k = kh_get(bin, bidx, bin);
-                    if (k != kh_end(bidx)) break;
-                    first = (hts_bin_parent(bin)<<3) + 1;
-                    if (bin > first) --bin;
-                    else bin = hts_bin_parent(bin);
-                } while (bin);
-                if (bin == 0)
-                    k = kh_get(bin, bidx, bin);
-                min_off = k != kh_end(bidx)? kh_val(bidx, k).loff : 0;
-                // min_off can be calculated more accurately if the
-                // linear index is available
-                if (idx->lidx[tid].offset
-                    && beg>>idx->min_shift < idx->lidx[tid].n
-                    && min_off < idx->lidx[tid].offset[beg>>idx->min_shift])
-                    min_off = idx->lidx[tid].offset[beg>>idx->min_shift];
-
-                // compute max_off: a virtual offset from a bin to the right of end
-                bin = hts_bin_first(idx->n_lvls) + ((end-1) >> idx->min_shift) + 1;
-                if (bin >= idx->n_bins) bin = 0;
-                while (1) {
-                    // search for an extant bin by moving right, but moving up to the
-                    // parent whenever we get to a first child (which also covers falling
-                    // off the RHS, which wraps around and immediately goes up to bin 0)
-                    while (bin % 8 == 1) bin = hts_bin_parent(bin);
-                    if (bin == 0) { max_off = (uint64_t)-1; break; }
-                    k = kh_get(bin, bidx, bin);
-                    if (k != kh_end(bidx) && kh_val(bidx, k).n > 0) {
-                        max_off = kh_val(bidx, k).list[0].u;
-                        break;
-                    }
-                    bin++;
-                }
+                idx_query_offsets(idx, tid, beg, end, &min_off, &max_off);
 
                 //convert coordinates to file offsets
                 if (reg2intervals(iter, idx, tid, beg, end, j,
@@ -3253,6 +4039,8 @@ hts_itr_t *hts_itr_regions(const hts_idx_t *idx, hts_reglist_t *reglist, int cou
         itr->finished = 0;
         itr->nocoor = 0;
         itr->multi = 1;
+        itr->gap = HTS_ITR_MULTI_GAP;
+        itr->prefetch_i = -1;
 
         for (i = 0; i < itr->n_reg; i++) {
             if (itr->reg_list[i].reg) {
@@ -3270,6 +4058,7 @@ hts_itr_t *hts_itr_regions(const hts_idx_t *idx, hts_reglist_t *reglist, int cou
                 if (itr->reg_list[i].tid < 0) {
                     if (itr->reg_list[i].tid < -1) {
                         hts_log_error("Failed to parse header");
+                        itr->reg_list = NULL; // Still owned by the caller
                         hts_itr_destroy(itr);
                         return NULL;
                     } else {
@@ -3282,6 +4071,7 @@ hts_itr_t *hts_itr_regions(const hts_idx_t *idx, hts_reglist_t *reglist, int cou
         qsort(itr->reg_list, itr->n_reg, sizeof(hts_reglist_t), compare_regions);
         if (itr_specific(idx, itr) != 0) {
             hts_log_error("Failed to create the multi-region iterator!");
+            itr->reg_list = NULL;
             hts_itr_destroy(itr);
             itr = NULL;
         }
@@ -3344,6 +4134,34 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
     return ret;
 }
 
+#define HTS_ITR_PREFETCH 4
+
+// Passes the file ranges of the current chunk and the next few after it,
+// merged where they are no more than iter->gap apart, to hfile_prefetch().
+static void itr_multi_prefetch(BGZF *fp, hts_itr_t *iter)
+{
+    hFILE *hfp = bgzf_hfile(fp);
+    int i = iter->prefetch_i < iter->i ? iter->i : iter->prefetch_i + 1;
+    int end = iter->i + 1 + HTS_ITR_PREFETCH;
+    uint64_t beg = 0, last = 0;
+
+    if (i >= end) return;
+    if (end > iter->n_off) end = iter->n_off;
+    for (; i < end; i++) {
+        uint64_t u = iter->off[i].u >> 16;
+        uint64_t v = (iter->off[i].v >> 16) + BGZF_MAX_BLOCK_SIZE;
+        if (last && u > last + (uint64_t) iter->gap) {
+            hfile_prefetch(hfp, beg, last - beg);
+            last = 0;
+        }
+        if (!last) beg = u;
+        if (v > last) last = v;
+    }
+    if (last)
+        hfile_prefetch(hfp, beg, last - beg);
+    iter->prefetch_i = end - 1;
+}
+
 int hts_itr_multi_next(htsFile *fd, hts_itr_t *iter, void *r)
 {
     void *fp;
@@ -3435,13 +4253,20 @@ int hts_itr_multi_next(htsFile *fd, hts_itr_t *iter, void *r)
                 }
             } else if (iter->i < iter->n_off) {
                 // New chunk may overlap the last one, so ensure we
-                // only seek forwards.
-                if (iter->curr_off < iter->off[iter->i].u) {
+                // only seek forwards.  If it starts shortly after the
+                // current position, read on to it instead; the records
+                // in between are filtered out below.
+                if (iter->curr_off < iter->off[iter->i].u
+                    && (iter->is_cram || iter->curr_off == 0
+                        || (iter->off[iter->i].u >> 16) - (iter->curr_off >> 16)
+                           > (uint64_t) iter->gap)) {
                     iter->curr_off = iter->off[iter->i].u;
                     if (iter->seek(fp, iter->curr_off, SEEK_SET) < 0) {
                         hts_log_error("Seek at offset %" PRIu64 " failed.", iter->curr_off);
                         return -1;
                     }
+                    if (!iter->is_cram)
+                        itr_multi_prefetch(fp, iter);
                 }
             }
         }
@@ -3820,7 +4645,7 @@ static hts_idx_t *idx_find_and_load(const char *fn, int fmt, int flags)
     if (flags & HTS_IDX_SAVE_REMOTE)
         idx = hts_idx_load3(fn, fnidx, fmt, flags);
     else
-        idx = idx_read(fnidx);
+        idx = idx_read(fnidx, flags);
     free(fnidx);
     return idx;
 }
@@ -3864,7 +4689,7 @@ hts_idx_t *hts_idx_load3(const char *fn, const char *fnidx, int fmt, int flags)
         }
     }
 
-    hts_idx_t *idx = idx_read(fnidx);
+    hts_idx_t *idx = idx_read(fnidx, flags);
     if (!idx && !(flags & HTS_IDX_SILENT_FAIL))
         hts_log_error("Could not load local index file '%s'", fnidx);
 
@@ -0,0 +1,180 @@
+/*  hts_crc32.c -- CRC32 for BGZF blocks and CRAM.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * This is the gzip CRC32 (the reflected 0x04C11DB7 polynomial), so SSE4.2's
+ * crc32 instruction, which implements CRC32C, is no use.  Instead buffers
+ * are folded 64 bytes at a time with carry-less multiplication (PCLMULQDQ)
+ * and then reduced to 32 bits, following Gopal et al., "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel,
+ * 2009).  The folding constants are those used for this polynomial by the
+ * Linux kernel.
+ *
+ * libdeflate's crc32 already does this, so it is used instead when
+ * available.  Otherwise short buffers and CPUs without PCLMULQDQ use zlib.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "hts_internal.h"
+
+#if !defined(HAVE_LIBDEFLATE) && \
+    (defined(__x86_64__) || defined(__i386__) || \
+     defined(_M_X64) || defined(_M_IX86))
+#  if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#    define CRC_PCLMUL
+#    define CRC_TARGET __attribute__((target("pclmul,sse2")))
+#    include <cpuid.h>
+#    include <immintrin.h>
+#  elif defined(_MSC_VER)
+#    define CRC_PCLMUL
+#    define CRC_TARGET
+#    include <intrin.h>
+#    include <immintrin.h>
+#  endif
+#endif
+
+#ifdef CRC_PCLMUL
+
+static int crc_cpu_detect(void) {
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 1);
+    return (r[2] & (1<<1)) != 0; // PCLMULQDQ
+#else
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+    return (c & bit_PCLMUL) != 0;
+#endif
+}
+
+// Whether PCLMULQDQ can be used, or -1 before detection.  Detection is
+// idempotent so racing threads merely repeat it.
+static volatile int crc_pclmul = -1;
+
+// x = x * k folded onto the next 16 bytes of data
+CRC_TARGET
+static inline __m128i fold16(__m128i x, __m128i k, __m128i data) {
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), data);
+}
+
+/*
+ * Updates the (non-inverted) crc with len bytes of buf, where len is at
+ * least 64 and a multiple of 16.
+ */
+CRC_TARGET
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+    const __m128i k5   = _mm_set_epi64x(0, 0x163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i x1, x2, x3, x4, t;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) buf),
+                       _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 16));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 32));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 48));
+    buf += 64; len -= 64;
+
+    // Fold four 128-bit lanes over each 64 bytes
+    while (len >= 64) {
+        x1 = fold16(x1, k1k2, _mm_loadu_si128((const __m128i *) buf));
+        x2 = fold16(x2, k1k2, _mm_loadu_si128((const __m128i *) (buf + 16)));
+        x3 = fold16(x3, k1k2, _mm_loadu_si128((const __m128i *) (buf + 32)));
+        x4 = fold16(x4, k1k2, _mm_loadu_si128((const __m128i *) (buf + 48)));
+        buf += 64; len -= 64;
+    }
+
+    // Fold them into one, and then that over the remaining 16 byte chunks
+    x1 = fold16(x1, k3k4, x2);
+    x1 = fold16(x1, k3k4, x3);
+    x1 = fold16(x1, k3k4, x4);
+    while (len >= 16) {
+        x1 = fold16(x1, k3k4, _mm_loadu_si128((const __m128i *) buf));
+        buf += 16; len -= 16;
+    }
+
+    // 128 to 64 bits, appending 32 zero bits
+    t  = _mm_clmulepi64_si128(k3k4, x1, 0x01);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+
+    // 64 to 32 bits
+    t  = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, t);
+
+    // Barrett reduction
+    t  = x1;
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, t);
+
+    return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+#endif /* CRC_PCLMUL */
+
+uint32_t hts_crc32(uint32_t crc, const void *buf, size_t len) {
+#ifdef HAVE_LIBDEFLATE
+    return libdeflate_crc32(crc, buf, len);
+#else
+    const uint8_t *p = (const uint8_t *) buf;
+
+#ifdef CRC_PCLMUL
+    if (len >= 64) {
+        if (crc_pclmul < 0)
+            crc_pclmul = crc_cpu_detect();
+        if (crc_pclmul) {
+            size_t n = len & ~(size_t) 15;
+            crc = ~crc32_pclmul(~crc, p, n);
+            p += n;
+            len -= n;
+        }
+    }
+#endif
+
+    // zlib takes an unsigned int length
+    while (len > 0) {
+        unsigned int n = len < 0x40000000 ? len : 0x40000000;
+        crc = crc32(crc, p, n);
+        p += n;
+        len -= n;
+    }
+    return crc;
+#endif
+}
+
+uint32_t hts_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    return crc32_combine(crc1, crc2, len2);
+}
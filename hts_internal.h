@@ -35,6 +35,7 @@ extern "C" {
 #endif
 
 struct hFILE;
+struct hts_tpool;
 
 struct hts_json_token {
     char type;    ///< Token type
@@ -69,6 +70,44 @@ int hts_idx_fmt(hts_idx_t *idx);
 // Check that index is capable of storing items in range beg..end
 int hts_idx_check_range(hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t end);
 
+/*
+ * Parallel index building.  Raw records are read from a BGZF file in
+ * batches on the calling thread and each batch is parsed in the thread
+ * pool.  The parsed locations are then passed to hts_idx_push() in file
+ * order, so the index is identical to one built by reading serially.
+ */
+typedef struct {
+    size_t start, len;  // Location of the raw record in the batch data
+    uint64_t offset;    // Virtual offset of the end of the record
+    hts_pos_t beg, end;
+    int tid, is_mapped;
+} hts_idx_raw_t;
+
+// Appends the next raw record to str.
+// Returns 1 on success, 0 at EOF, negative on error.
+typedef int hts_idx_read_raw_f(BGZF *fp, kstring_t *str, void *data);
+
+// Fills out tid, beg, end and is_mapped for recs[0 .. n-1] from the batch
+// data 'buf'.  Called from the worker threads.
+// Returns 0 on success, negative on error.
+typedef int hts_idx_parse_raw_f(char *buf, hts_idx_raw_t *recs, int n,
+                                void *data);
+
+// Logs the reason a raw record could not be indexed.
+typedef void hts_idx_report_raw_f(char *rec, size_t len, void *data);
+
+/*
+ * Reads fp to the end, pushing every record onto idx.  The caller is
+ * responsible for hts_idx_finish().  report may be NULL.
+ *
+ * Returns 0 on success,
+ *        -1 on failure
+ */
+int hts_idx_push_mt(hts_idx_t *idx, BGZF *fp, struct hts_tpool *p,
+                    hts_idx_read_raw_f *read_raw,
+                    hts_idx_parse_raw_f *parse_raw,
+                    hts_idx_report_raw_f *report_raw, void *data);
+
 // The CRAM implementation stores the loaded index within the cram_fd rather
 // than separately as is done elsewhere in htslib.  So if p is a pointer to
 // an hts_idx_t with p->fmt == HTS_FMT_CRAI, then it actually points to an
@@ -120,6 +159,18 @@ int bgzf_idx_push(BGZF *fp, hts_idx_t *hidx, int tid, hts_pos_t beg, hts_pos_t e
  */
 void bgzf_idx_amend_last(BGZF *fp, hts_idx_t *hidx, uint64_t offset);
 
+/*
+ * CRC32 as used by gzip, BGZF and CRAM, with the same semantics as zlib's
+ * crc32() but using carry-less multiplication where the CPU has it.
+ */
+uint32_t hts_crc32(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Returns the CRC32 of two buffers joined together, given the CRC32 of
+ * each (the second starting from 0) and the length of the second.
+ */
+uint32_t hts_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
 #ifdef __cplusplus
 }
 #endif
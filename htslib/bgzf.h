@@ -53,6 +53,7 @@ struct hFILE;
 struct hts_tpool;
 struct kstring_t;
 struct bgzf_mtaux_t;
+struct bgzf_codec;
 typedef struct __bgzidx_t bgzidx_t;
 typedef struct bgzf_cache_t bgzf_cache_t;
 struct z_stream_s;
@@ -73,6 +74,7 @@ struct BGZF {
     int idx_build_otf;  // build index on the fly, set by bgzf_index_build_init()
     struct z_stream_s *gz_stream; // for gzip-compressed files
     int64_t seeked;     // virtual offset of last seek
+    const struct bgzf_codec *codec; // deflate implementation, see bgzf_set_codec()
 };
 #ifndef HTS_BGZF_TYPEDEF
 typedef struct BGZF BGZF;
@@ -343,6 +345,36 @@ typedef struct BGZF BGZF;
     HTSLIB_EXPORT
     int bgzf_compress(void *dst, size_t *dlen, const void *src, size_t slen, int level);
 
+    /**
+     * Choose the deflate implementation used for a file's blocks.
+     *
+     * @param fp     BGZF file handle
+     * @param codec  "zlib", "libdeflate" or "isal"; NULL for the default
+     * @return       0 on success; -1 if the codec was not built in
+     *
+     * All the codecs read and write standard BGZF, so this only changes
+     * speed and, when writing, the size achieved at a given level.
+     * libdeflate accepts levels up to 12; zlib treats those as 9.  The
+     * "isal" codec uses ISA-L for decompression and checksums, and the
+     * best other codec for compression.
+     *
+     * The default codec is given by the HTS_BGZF_CODEC environment
+     * variable, or is the first of libdeflate, isal and zlib that was
+     * built in.  The default is also used by bgzf_compress().
+     *
+     * This should be called before any data is read or written.
+     */
+    HTSLIB_EXPORT
+    int bgzf_set_codec(BGZF *fp, const char *codec);
+
+    /// Name of the deflate implementation used by a file
+    HTSLIB_EXPORT
+    const char *bgzf_get_codec(BGZF *fp);
+
+    /// Name of the i-th codec that was built in, or NULL if there are fewer
+    HTSLIB_EXPORT
+    const char *bgzf_codec_name(int i);
+
     /*******************
      * bgzidx routines *
      *******************/
@@ -55,8 +55,33 @@ enum cram_block_method {
     LZMA     = 3,
     RANS     = 4,  // Generic; either order
     RANS0    = 4,
+    RANS_PR0 = 5,  // rANS Nx16 (CRAM 3.1); order and transforms auto-sensed
+    ARITH_PR0 = 6, // Adaptive arithmetic coder (CRAM 3.1)
+    FQZ      = 7,  // fqzcomp quality codec (CRAM 3.1)
+    TOK3     = 8,  // Read name tokeniser (CRAM 3.1)
     RANS1    = 10, // Not externalised; stored as RANS (generic)
     GZIP_RLE = 11, // NB: not externalised in CRAM
+
+    // Not externalised; specific orders and transforms of the CRAM 3.1
+    // codecs, stored as RANS_PR0 and ARITH_PR0 respectively.
+    RANS_PR1 = 12,   // order-1
+    RANS_PR64,       // order-0 + RLE
+    RANS_PR9,        // order-1 + 4-way stripe
+    RANS_PR128,      // order-0 + PACK
+    RANS_PR129,      // order-1 + PACK
+    RANS_PR192,      // order-0 + PACK + RLE
+    RANS_PR193,      // order-1 + PACK + RLE
+    ARITH_PR1,       // As above for the arithmetic coder
+    ARITH_PR64,
+    ARITH_PR9,
+    ARITH_PR128,
+    ARITH_PR129,
+    ARITH_PR192,
+    ARITH_PR193,     // = 25
+    FQZ_b,           // fqzcomp parameter strategies 1-3, stored as FQZ
+    FQZ_c,
+    FQZ_d,
+    TOKA,            // TOK3 using the arithmetic coder, stored as TOK3
 };
 
 enum cram_content_type {
@@ -449,6 +474,20 @@ int cram_set_option(cram_fd *fd, enum hts_fmt_option opt, ...);
 HTSLIB_EXPORT
 int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args);
 
+/*! Reports the compression methods chosen while writing.
+ *
+ * Appends one line per block content id to @p str, giving the data
+ * series or tag name, the total uncompressed and compressed sizes and
+ * the number of blocks compressed with each method.  The same report is
+ * logged at INFO level when a CRAM file being written is closed.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+HTSLIB_EXPORT
+int cram_method_report(cram_fd *fd, kstring_t *str);
+
 /*!
  * Attaches a header to a cram_fd.
  *
@@ -61,7 +61,21 @@ typedef struct hFILE {
 The usual `fopen(3)` _mode_ letters are supported: one of
 `r` (read), `w` (write), `a` (append), optionally followed by any of
 `+` (update), `e` (close on `exec(2)`), `x` (create exclusively),
+`m` (memory-map local files opened read-only, where supported),
+`d` (write local files opened with `w` in the background, bypassing the
+page cache where supported),
 `:` (indicates scheme-specific variable arguments follow).
+
+With `m`, reads are served directly from the mapping, which saves copying
+large files into the stream's buffer.  Files that cannot be mapped, such
+as pipes, are read normally.  Note that a mapped file being truncated by
+another process while it is open will result in a `SIGBUS` signal.
+
+With `d`, output is gathered into large buffers which a separate thread
+writes out while the next is filled, using `O_DIRECT` if the file system
+supports it.  This avoids filling the page cache with output that will not
+be read again.  Write errors may then only be reported by a later
+`hwrite()`, `hflush()` or `hclose()`.
 */
 HTSLIB_EXPORT
 hFILE *hopen(const char *filename, const char *mode, ...) HTS_RESULT_USED;
@@ -281,7 +281,7 @@ enum hts_fmt_option {
     CRAM_OPT_SLICES_PER_CONTAINER,
     CRAM_OPT_RANGE,
     CRAM_OPT_VERSION,    // rename to cram_version?
-    CRAM_OPT_EMBED_REF,
+    CRAM_OPT_EMBED_REF,  // 1 = copy of the reference, 2 = consensus of reads
     CRAM_OPT_IGNORE_MD5,
     CRAM_OPT_REFERENCE,  // make general
     CRAM_OPT_MULTI_SEQ_PER_SLICE,
@@ -297,6 +297,7 @@ enum hts_fmt_option {
     CRAM_OPT_BASES_PER_SLICE,
     CRAM_OPT_STORE_MD,
     CRAM_OPT_STORE_NM,
+    CRAM_OPT_USE_ARITH,
 
     // General purpose
     HTS_OPT_COMPRESSION_LEVEL = 100,
@@ -304,6 +305,16 @@ enum hts_fmt_option {
     HTS_OPT_THREAD_POOL,
     HTS_OPT_CACHE_SIZE,
     HTS_OPT_BLOCK_SIZE,
+    HTS_OPT_PROFILE,
+    HTS_OPT_BGZF_CODEC,  // char *, see bgzf_set_codec()
+};
+
+// Profiles trading encoding speed against output size, for HTS_OPT_PROFILE
+enum hts_profile_option {
+    HTS_PROFILE_FAST,
+    HTS_PROFILE_NORMAL,
+    HTS_PROFILE_SMALL,
+    HTS_PROFILE_ARCHIVE,
 };
 
 // For backwards compatibility
@@ -440,7 +451,7 @@ char *hts_format_description(const htsFormat *format);
   @param fn       The file name or "-" for stdin/stdout. For indexed files
                   with a non-standard naming, the file name can include the
                   name of the index file delimited with HTS_IDX_DELIM
-  @param mode     Mode matching / [rwa][bceguxz0-9]* /
+  @param mode     Mode matching / [rwa][bcdegmuxz0-9]* /
   @discussion
       With 'r' opens for reading; any further format mode letters are ignored
       as the format is detected by checking the first few bytes or BGZF blocks
@@ -455,6 +466,11 @@ char *hts_format_description(const htsFormat *format);
       and with non-format option letters (for any of 'r'/'w'/'a'):
         e  close the file on exec(2) (opens with O_CLOEXEC, where supported)
         x  create the file exclusively (opens with O_EXCL, where supported)
+      and for 'r' only:
+        m  memory-map local files (see hopen()), where supported
+      and for 'w' only:
+        d  write local files in the background, bypassing the page cache
+           (opens with O_DIRECT) where supported (see hopen())
       Note that there is a distinction between 'u' and '0': the first yields
       plain uncompressed output whereas the latter outputs uncompressed data
       wrapped in the zlib format.
@@ -677,8 +693,14 @@ typedef struct {
         int n, m;
         int *a;
     } bins;
+    int64_t gap;     // Multi-region iterators read through gaps of up to
+                     // this many file bytes between chunks instead of seeking
+    int prefetch_i;  // Last chunk passed to the OS as a read-ahead hint
 } hts_itr_t;
 
+/// Default for hts_itr_t::gap in multi-region iterators
+#define HTS_ITR_MULTI_GAP 65536
+
 typedef struct {
     int key;
     uint64_t min_off, max_off;
@@ -772,6 +794,21 @@ int hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt) HTS_RESULT_USED;
 HTSLIB_EXPORT
 int hts_idx_save_as(const hts_idx_t *idx, const char *fn, const char *fnidx, int fmt) HTS_RESULT_USED;
 
+/// Save an index to a file in the flat, memory-mappable layout
+/** @param idx    Index to be written
+    @param fnidx  Output filename
+    @return  0 if successful, or negative if an error occurred.
+
+The flat layout holds the same data as a BAI, CSI or TBI index, but
+uncompressed and arranged so that it can be used without decoding.
+hts_idx_load2() and hts_idx_load3() recognise it when given it as the index
+filename, and memory map local files, so loading takes constant time
+regardless of the index size.  This is intended as a local cache; the
+original index formats remain the ones to distribute.
+*/
+HTSLIB_EXPORT
+int hts_idx_save_flat(const hts_idx_t *idx, const char *fnidx) HTS_RESULT_USED;
+
 /// Load an index file
 /** @param fn   BAM/BCF/etc filename, to which .bai/.csi/etc will be added or
                 the extension substituted, to search for an existing index file.
@@ -835,6 +872,13 @@ hts_idx_t *hts_idx_load2(const char *fn, const char *fnidx);
 
         HTS_IDX_SAVE_REMOTE   Save a local copy of any remote indexes
         HTS_IDX_SILENT_FAIL   Fail silently if the index is not present
+        HTS_IDX_LAZY          Read the data for each reference when first used
+
+    With HTS_IDX_LAZY, loading the index only notes where the data for each
+    reference starts, and keeps the index file open.  The bins and linear
+    index for a reference are read the first time it is queried.  This
+    makes loading faster and uses less memory when only a few references
+    are accessed.  It has no effect on CRAM or flat indexes.
 
     The index struct returned by a successful call should be freed
     via hts_idx_destroy() when it is no longer needed.
@@ -845,6 +889,7 @@ hts_idx_t *hts_idx_load3(const char *fn, const char *fnidx, int fmt, int flags);
 /// Flags for hts_idx_load3() ( and also sam_idx_load3(), tbx_idx_load3() )
 #define HTS_IDX_SAVE_REMOTE 1
 #define HTS_IDX_SILENT_FAIL 2
+#define HTS_IDX_LAZY        4
 
 ///////////////////////////////////////////////////////////
 // Functions for accessing meta-data stored in indexes
@@ -1114,7 +1159,17 @@ int hts_itr_multi_cram(const hts_idx_t *idx, hts_itr_t *iter);
     @return An iterator on success; NULL on failure
 
     The iterator struct returned by a successful call should be freed
-    via hts_itr_destroy() when it is no longer needed.
+    via hts_itr_destroy() when it is no longer needed.  It takes ownership
+    of reglist, which hts_itr_destroy() frees; on failure reglist is left
+    for the caller to free.
+
+    When reading BGZF files, the iterator reads straight on, rather than
+    seeking, if the next chunk of the file it needs starts no more than
+    iter->gap bytes after the current position (by default
+    HTS_ITR_MULTI_GAP).  Larger values give fewer, longer reads, which can
+    be faster on network filesystems; 0 always seeks.  When it does seek,
+    it asks the operating system to start reading the next few chunks.
+    That hint is not available on Windows, where it is skipped.
  */
 HTSLIB_EXPORT
 hts_itr_t *hts_itr_regions(const hts_idx_t *idx, hts_reglist_t *reglist, int count, hts_name2id_f getid, void *hdr, hts_itr_multi_query_func *itr_specific, hts_readrec_func *readrec, hts_seek_func *seek, hts_tell_func *tell);
@@ -1138,6 +1138,7 @@ The @p flags parameter can be set to a combination of the following values:
 
         HTS_IDX_SAVE_REMOTE   Save a local copy of any remote indexes
         HTS_IDX_SILENT_FAIL   Fail silently if the index is not present
+        HTS_IDX_LAZY          Read the data for each reference when first used
 
 Note that HTS_IDX_SAVE_REMOTE has no effect for remote CRAM indexes.  They
 are always downloaded and never cached locally.
@@ -1272,6 +1273,51 @@ overlaps more than one region, it will only be returned once.
 HTSLIB_EXPORT
 hts_itr_t *sam_itr_regarray(const hts_idx_t *idx, sam_hdr_t *hdr, char **regarray, unsigned int regcount);
 
+/// Callback for sam_itr_regarray_mt()
+/** @param data    The data pointer given to sam_itr_regarray_mt()
+    @param region  Index into the region array of the region being read
+    @param hdr     The header given to sam_itr_regarray_mt()
+    @param b       Record overlapping the region
+    @return 0 to continue, or negative to stop with an error
+ */
+typedef int sam_region_func(void *data, int region, const sam_hdr_t *hdr,
+                            bam1_t *b);
+
+/// Read many regions of a file in parallel
+/** @param fp        Open file handle of the data file
+    @param hdr       Header read from @p fp
+    @param idx       Index for @p fp
+    @param regarray  Array of ref:interval region specifiers
+    @param regcount  Number of items in regarray
+    @param p         Thread pool to use, or NULL to read on this thread
+    @param func      Function to call for each record
+    @param data      Data pointer to pass to @p func
+    @return 0 on success, -1 on failure
+
+Each @p regarray entry takes one of the forms listed for sam_itr_regarray().
+Unlike that function, each region is read separately, in the same way as
+sam_itr_querys(), so a read overlapping several regions is passed on once
+for each of them.
+
+Up to one job per thread in @p p is started.  Each job opens its own handle
+on the file named by @p fp (and its reference, for CRAM), then repeatedly
+takes the next region that has not been started and reads it.  All the
+records of a region are passed to @p func in file order on the same thread,
+but calls for different regions happen concurrently, so @p func must only
+update state belonging to its region or take its own locks.  The record
+is only valid until @p func returns.
+
+@p hdr and @p idx are shared by the jobs and must not be changed while
+this runs.  For CRAM, each job loads its own index instead of using @p idx.
+The function returns once all the regions have been read, or after an
+error.  Regions on unknown references are skipped with a warning.
+ */
+HTSLIB_EXPORT
+int sam_itr_regarray_mt(htsFile *fp, sam_hdr_t *hdr, const hts_idx_t *idx,
+                        char **regarray, unsigned int regcount,
+                        struct hts_tpool *p, sam_region_func *func,
+                        void *data);
+
 /// Get the next read from a SAM/BAM/CRAM iterator
 /** @param htsfp       Htsfile pointer for the input file
     @param itr         Iterator
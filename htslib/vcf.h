@@ -1187,6 +1187,7 @@ which works for both BCF and VCF.
 
         HTS_IDX_SAVE_REMOTE   Save a local copy of any remote indexes
         HTS_IDX_SILENT_FAIL   Fail silently if the index is not present
+        HTS_IDX_LAZY          Read the data for each reference when first used
 
      Equivalent to hts_idx_load3(fn, fnidx, HTS_FMT_CSI, flags);
 */
@@ -48,6 +48,8 @@ DEALINGS IN THE SOFTWARE.  */
 #include "sam_internal.h"
 #include "htslib/hfile.h"
 #include "htslib/hts_endian.h"
+#include "htslib/kseq.h"
+#include "htslib/kstring.h"
 #include "header.h"
 
 #include "htslib/khash.h"
@@ -591,27 +593,16 @@ static int fixup_missing_qname_nul(bam1_t *b) {
     return 0;
 }
 
-/*
- * Note a second interface that returns a bam pointer instead would avoid bam_copy1
- * in multi-threaded handling.  This may be worth considering for htslib2.
- */
-int bam_read1(BGZF *fp, bam1_t *b)
+// Fills out b->core from the fixed-length fields x of a record of
+// block_len bytes, and sizes b->data for the variable-length part.
+static int bam_decode_core(bam1_t *b, uint32_t x[8], int32_t block_len,
+                           int is_be)
 {
     bam1_core_t *c = &b->core;
-    int32_t block_len, ret, i;
-    uint32_t x[8], new_l_data;
-
-    b->l_data = 0;
+    uint32_t new_l_data;
+    int i;
 
-    if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
-        if (ret == 0) return -1; // normal end-of-file
-        else return -2; // truncated
-    }
-    if (fp->is_be)
-        ed_swap_4p(&block_len);
-    if (block_len < 32) return -4;  // block_len includes core data
-    if (bgzf_read(fp, x, 32) != 32) return -3;
-    if (fp->is_be) {
+    if (is_be) {
         for (i = 0; i < 8; ++i) ed_swap_4p(x + i);
     }
     c->tid = x[0]; c->pos = (int32_t)x[1];
@@ -628,17 +619,30 @@ int bam_read1(BGZF *fp, bam1_t *b)
         return -4;
     if (realloc_bam_data(b, new_l_data) < 0) return -4;
     b->l_data = new_l_data;
+    return 0;
+}
+
+// Pads the read name, which has just been read to the start of b->data,
+// to a multiple of four bytes.
+static int bam_pad_qname(bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    int i;
 
-    if (bgzf_read(fp, b->data, c->l_qname) != c->l_qname) return -4;
     if (b->data[c->l_qname - 1] != '\0') { // Try to fix missing NUL termination
         if (fixup_missing_qname_nul(b) < 0) return -4;
     }
     for (i = 0; i < c->l_extranul; ++i) b->data[c->l_qname+i] = '\0';
     c->l_qname += c->l_extranul;
-    if (b->l_data < c->l_qname ||
-        bgzf_read(fp, b->data + c->l_qname, b->l_data - c->l_qname) != b->l_data - c->l_qname)
-        return -4;
-    if (fp->is_be) swap_data(c, b->l_data, b->data, 0);
+    return 0;
+}
+
+// Finishes decoding a record once all of b->data has been read.
+static int bam_decode_data(bam1_t *b, int is_be)
+{
+    bam1_core_t *c = &b->core;
+
+    if (is_be) swap_data(c, b->l_data, b->data, 0);
     if (bam_tag2cigar(b, 0, 0) < 0)
         return -4;
 
@@ -655,9 +659,68 @@ int bam_read1(BGZF *fp, bam1_t *b)
         }
     }
 
+    return 0;
+}
+
+/*
+ * Note a second interface that returns a bam pointer instead would avoid bam_copy1
+ * in multi-threaded handling.  This may be worth considering for htslib2.
+ */
+int bam_read1(BGZF *fp, bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    int32_t block_len, ret;
+    uint32_t x[8];
+
+    b->l_data = 0;
+
+    if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+        if (ret == 0) return -1; // normal end-of-file
+        else return -2; // truncated
+    }
+    if (fp->is_be)
+        ed_swap_4p(&block_len);
+    if (block_len < 32) return -4;  // block_len includes core data
+    if (bgzf_read(fp, x, 32) != 32) return -3;
+    if (bam_decode_core(b, x, block_len, fp->is_be) < 0) return -4;
+
+    if (bgzf_read(fp, b->data, c->l_qname) != c->l_qname) return -4;
+    if (bam_pad_qname(b) < 0) return -4;
+    if (b->l_data < c->l_qname ||
+        bgzf_read(fp, b->data + c->l_qname, b->l_data - c->l_qname) != b->l_data - c->l_qname)
+        return -4;
+    if (bam_decode_data(b, fp->is_be) < 0)
+        return -4;
+
     return 4 + block_len;
 }
 
+// As bam_read1(), but decoding a record of block_len bytes (excluding the
+// length itself) from memory.
+static int bam_decode1(const uint8_t *data, int32_t block_len, int is_be,
+                       bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    uint32_t x[8];
+    int l_qname;
+
+    b->l_data = 0;
+
+    if (block_len < 32) return -4;
+    memcpy(x, data, 32);
+    if (bam_decode_core(b, x, block_len, is_be) < 0) return -4;
+
+    l_qname = c->l_qname;
+    memcpy(b->data, data + 32, l_qname);
+    if (bam_pad_qname(b) < 0) return -4;
+    if (b->l_data < c->l_qname ||
+        32 + l_qname + (b->l_data - c->l_qname) != block_len)
+        return -4;
+    memcpy(b->data + c->l_qname, data + 32 + l_qname, b->l_data - c->l_qname);
+
+    return bam_decode_data(b, is_be);
+}
+
 int bam_write1(BGZF *fp, const bam1_t *b)
 {
     const bam1_core_t *c = &b->core;
@@ -792,7 +855,99 @@ int bam_set_qname(bam1_t *rec, const char *qname)
  *** BAM indexing ***
  ********************/
 
-static hts_idx_t *sam_index(htsFile *fp, int min_shift)
+/*
+ * Parallel indexing: the raw BAM records or SAM lines are read on the
+ * main thread and decoded by hts_idx_push_mt() in the thread pool.
+ */
+typedef struct {
+    htsFile *fp;
+    sam_hdr_t *h;
+} sam_index_mt_t;
+
+static int sam_index_read_raw(BGZF *fp, kstring_t *str, void *data)
+{
+    htsFile *hfp = ((sam_index_mt_t *) data)->fp;
+
+    if (hfp->format.format == bam) {
+        int32_t block_len;
+        ssize_t ret;
+        if ((ret = bgzf_read(fp, &block_len, 4)) != 4)
+            return ret == 0 ? 0 : -1;
+        if (fp->is_be)
+            ed_swap_4p(&block_len);
+        if (block_len < 32) return -1;
+        if (ks_resize(str, str->l + block_len) < 0) return -1;
+        if (bgzf_read(fp, str->s + str->l, block_len) != block_len)
+            return -1;
+        str->l += block_len;
+        return 1;
+    }
+
+    // The first line after the header has already been read
+    if (hfp->line.l == 0) {
+        int ret = hts_getline(hfp, KS_SEP_LINE, &hfp->line);
+        if (ret < 0) return ret == -1 ? 0 : -1;
+    }
+    // Keep the NUL terminator, as sam_parse1() expects one
+    if (kputsn(hfp->line.s, hfp->line.l, str) < 0 || kputc('\0', str) < 0)
+        return -1;
+    hfp->line.l = 0;
+    return 1;
+}
+
+// Decodes one raw record into b
+static int sam_index_decode_raw(sam_index_mt_t *s, char *rec, size_t len,
+                                bam1_t *b)
+{
+    if (s->fp->format.format == bam) {
+        if (bam_decode1((uint8_t *) rec, len, s->fp->fp.bgzf->is_be, b) < 0)
+            return -1;
+        if (b->core.tid  >= s->h->n_targets || b->core.tid  < -1 ||
+            b->core.mtid >= s->h->n_targets || b->core.mtid < -1)
+            return -1;
+        return 0;
+    } else {
+        kstring_t line = { len - 1, len, rec };
+        return sam_parse1(&line, s->h, b) < 0 ? -1 : 0;
+    }
+}
+
+static int sam_index_parse_raw(char *buf, hts_idx_raw_t *recs, int n,
+                               void *data)
+{
+    bam1_t *b = bam_init1();
+    int i;
+
+    if (!b) return -1;
+    for (i = 0; i < n; i++) {
+        if (sam_index_decode_raw(data, buf + recs[i].start, recs[i].len, b) < 0) {
+            bam_destroy1(b);
+            return -1;
+        }
+        recs[i].tid = b->core.tid;
+        recs[i].beg = b->core.pos;
+        recs[i].end = bam_endpos(b);
+        recs[i].is_mapped = !(b->core.flag&BAM_FUNMAP);
+    }
+    bam_destroy1(b);
+    return 0;
+}
+
+static void sam_index_report_raw(char *rec, size_t len, void *data)
+{
+    sam_hdr_t *h = ((sam_index_mt_t *) data)->h;
+    bam1_t *b = bam_init1();
+
+    // sam_parse1() has already split the line up, so just give the name
+    if (b && ((sam_index_mt_t *) data)->fp->format.format == sam) {
+        hts_log_error("Read '%s' cannot be indexed", rec);
+    } else if (b && sam_index_decode_raw(data, rec, len, b) == 0) {
+        hts_log_error("Read '%s' with ref_name='%s', ref_length=%"PRIhts_pos", flags=%d, pos=%"PRIhts_pos" cannot be indexed", bam_get_qname(b), sam_hdr_tid2name(h, b->core.tid), sam_hdr_tid2len(h, b->core.tid), b->core.flag, b->core.pos+1);
+    }
+    bam_destroy1(b);
+}
+
+static hts_idx_t *sam_index(htsFile *fp, int min_shift, hts_tpool *p)
 {
     int n_lvls, i, fmt, ret;
     bam1_t *b;
@@ -812,7 +967,16 @@ static hts_idx_t *sam_index(htsFile *fp, int min_shift)
     } else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
     idx = hts_idx_init(h->n_targets, fmt, bgzf_tell(fp->fp.bgzf), min_shift, n_lvls);
     b = bam_init1();
-    while ((ret = sam_read1(fp, h, b)) >= 0) {
+    if (p) {
+        sam_index_mt_t s = { fp, h };
+        // Fill in hrecs now so the workers don't all try to at once
+        if (!h->hrecs && sam_hdr_fill_hrecs(h) < 0)
+            goto err;
+        if (hts_idx_push_mt(idx, fp->fp.bgzf, p, sam_index_read_raw,
+                            sam_index_parse_raw, sam_index_report_raw, &s) < 0)
+            goto err;
+        ret = -1;
+    } else while ((ret = sam_read1(fp, h, b)) >= 0) {
         ret = hts_idx_push(idx, b->core.tid, b->core.pos, bam_endpos(b), bgzf_tell(fp->fp.bgzf), !(b->core.flag&BAM_FUNMAP));
         if (ret < 0) { // unsorted or doesn't fit
             hts_log_error("Read '%s' with ref_name='%s', ref_length=%"PRIhts_pos", flags=%d, pos=%"PRIhts_pos" cannot be indexed", bam_get_qname(b), sam_hdr_tid2name(h, b->core.tid), sam_hdr_tid2len(h, b->core.tid), b->core.flag, b->core.pos+1);
@@ -829,6 +993,7 @@ static hts_idx_t *sam_index(htsFile *fp, int min_shift)
 err:
     bam_destroy1(b);
     hts_idx_destroy(idx);
+    sam_hdr_destroy(h);
     return NULL;
 }
 
@@ -836,11 +1001,21 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
 {
     hts_idx_t *idx;
     htsFile *fp;
+    hts_tpool *pool = NULL;
     int ret = 0;
 
     if ((fp = hts_open(fn, "r")) == 0) return -2;
-    if (nthreads)
+    if (nthreads > 0 && fp->format.compression == bgzf) {
+        // Shared by BGZF decompression and record decoding in sam_index()
+        if (!(pool = hts_tpool_init(nthreads))
+            || bgzf_thread_pool(fp->fp.bgzf, pool, 0) < 0) {
+            hts_close(fp);
+            if (pool) hts_tpool_destroy(pool);
+            return -1;
+        }
+    } else if (nthreads) {
         hts_set_threads(fp, nthreads);
+    }
 
     switch (fp->format.format) {
     case cram:
@@ -856,7 +1031,7 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
             ret = -1;
             break;
         }
-        idx = sam_index(fp, min_shift);
+        idx = sam_index(fp, min_shift, pool);
         if (idx) {
             ret = hts_idx_save_as(idx, fn, fnidx, (min_shift > 0)? HTS_FMT_CSI : HTS_FMT_BAI);
             if (ret < 0) ret = -4;
@@ -870,6 +1045,8 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
         break;
     }
     hts_close(fp);
+    if (pool)
+        hts_tpool_destroy(pool);
 
     return ret;
 }
@@ -1220,13 +1397,176 @@ hts_itr_t *sam_itr_regions(const hts_idx_t *idx, sam_hdr_t *hdr, hts_reglist_t *
                    hts_itr_multi_bam, sam_readrec, bam_pseek, bam_ptell);
 }
 
+typedef struct {
+    int tid;
+    hts_pos_t beg, end;
+} sam_region_pos_t;
+
+typedef struct {
+    htsFile *fp;
+    sam_hdr_t *h;
+    const hts_idx_t *idx;
+    sam_region_pos_t *reg;
+    int n_reg, next, error;
+    pthread_mutex_t lock;
+    sam_region_func *func;
+    void *data;
+} sam_regions_mt_t;
+
+// Returns the next region not yet started, or -1 when there are none left
+static int sam_regions_next(sam_regions_mt_t *m)
+{
+    int i;
+    pthread_mutex_lock(&m->lock);
+    i = m->error || m->next >= m->n_reg ? -1 : m->next++;
+    pthread_mutex_unlock(&m->lock);
+    return i;
+}
+
+// A job for sam_itr_regarray_mt(), reading regions through its own handle
+// on the file until they run out.
+static void *sam_regions_worker(void *arg)
+{
+    sam_regions_mt_t *m = (sam_regions_mt_t *) arg;
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) m->idx;
+    htsFile *fp = hts_open(m->fp->fn, "r");
+    sam_hdr_t *h = NULL;
+    hts_idx_t *own_idx = NULL;
+    const hts_idx_t *idx = m->idx;
+    bam1_t *b = bam_init1();
+    const char *ref;
+    int i, r = 0;
+
+    if (!fp || !b)
+        goto err;
+    // Use the same reference, however it was given for the original
+    ref = m->fp->fn_aux;
+    if (!ref && m->fp->is_cram)
+        ref = m->fp->fp.cram->ref_fn;
+    if (ref && hts_set_fai_filename(fp, ref) < 0)
+        goto err;
+    if (!(h = sam_hdr_read(fp)))
+        goto err;
+    if (!idx || cidx->fmt == HTS_FMT_CRAI) {
+        // A CRAM index belongs to the cram_fd it was loaded for
+        if (!(own_idx = sam_index_load(fp, m->fp->fn)))
+            goto err;
+        idx = own_idx;
+    }
+
+    while ((i = sam_regions_next(m)) >= 0) {
+        hts_itr_t *iter;
+        if (m->reg[i].tid == -1)
+            continue;
+        iter = sam_itr_queryi(idx, m->reg[i].tid, m->reg[i].beg, m->reg[i].end);
+        if (!iter)
+            goto err;
+        while ((r = sam_itr_next(fp, iter, b)) >= 0) {
+            if (m->func(m->data, i, m->h, b) < 0) {
+                r = -2;
+                break;
+            }
+        }
+        hts_itr_destroy(iter);
+        if (r < -1)
+            goto err;
+    }
+
+ out:
+    bam_destroy1(b);
+    sam_hdr_destroy(h);
+    hts_idx_destroy(own_idx);
+    if (fp && hts_close(fp) < 0) {
+        pthread_mutex_lock(&m->lock);
+        m->error = 1;
+        pthread_mutex_unlock(&m->lock);
+    }
+    return NULL;
+
+ err:
+    pthread_mutex_lock(&m->lock);
+    m->error = 1;
+    pthread_mutex_unlock(&m->lock);
+    goto out;
+}
+
+int sam_itr_regarray_mt(htsFile *fp, sam_hdr_t *hdr, const hts_idx_t *idx,
+                        char **regarray, unsigned int regcount,
+                        hts_tpool *p, sam_region_func *func, void *data)
+{
+    sam_regions_mt_t m = { fp, hdr, idx, NULL, regcount, 0, 0 };
+    hts_tpool_process *q = NULL;
+    unsigned int i;
+    int n_jobs, ret = -1;
+
+    if (!fp || !fp->fn || !hdr || !func || (!regarray && regcount))
+        return -1;
+    if (regcount > INT_MAX) {
+        hts_log_error("Too many regions");
+        return -1;
+    }
+    m.func = func;
+    m.data = data;
+
+    // Parse the regions up front, as looking up names in the header is not
+    // thread safe.
+    if (regcount && !(m.reg = malloc(regcount * sizeof(*m.reg))))
+        return -1;
+    for (i = 0; i < regcount; i++) {
+        sam_region_pos_t *r = &m.reg[i];
+        if (strcmp(regarray[i], ".") == 0) {
+            r->tid = HTS_IDX_START; r->beg = r->end = 0;
+        } else if (strcmp(regarray[i], "*") == 0) {
+            r->tid = HTS_IDX_NOCOOR; r->beg = r->end = 0;
+        } else if (!hts_parse_region(regarray[i], &r->tid, &r->beg, &r->end,
+                                     (hts_name2id_f) bam_name2id, hdr,
+                                     HTS_PARSE_THOUSANDS_SEP)) {
+            if (r->tid != -1) {
+                hts_log_error("Failed to parse region '%s'", regarray[i]);
+                goto out;
+            }
+            hts_log_warning("Region '%s' specifies an unknown reference name. Continue anyway", regarray[i]);
+        }
+    }
+
+    if (pthread_mutex_init(&m.lock, NULL) != 0)
+        goto out;
+
+    n_jobs = p ? hts_tpool_size(p) : 1;
+    if (n_jobs > m.n_reg)
+        n_jobs = m.n_reg;
+
+    if (!p || n_jobs <= 1) {
+        if (n_jobs > 0)
+            sam_regions_worker(&m);
+    } else {
+        if (!(q = hts_tpool_process_init(p, n_jobs, 1))) {
+            m.error = 1;
+        } else {
+            for (i = 0; i < n_jobs; i++) {
+                if (hts_tpool_dispatch(p, q, sam_regions_worker, &m) < 0) {
+                    pthread_mutex_lock(&m.lock);
+                    m.error = 1;
+                    pthread_mutex_unlock(&m.lock);
+                    break;
+                }
+            }
+            hts_tpool_process_flush(q);
+            hts_tpool_process_destroy(q);
+        }
+    }
+    pthread_mutex_destroy(&m.lock);
+    ret = m.error ? -1 : 0;
+
+ out:
+    free(m.reg);
+    return ret;
+}
+
 /**********************
  *** SAM header I/O ***
  **********************/
 
-#include "htslib/kseq.h"
-#include "htslib/kstring.h"
-
 sam_hdr_t *sam_hdr_parse(size_t l_text, const char *text)
 {
     sam_hdr_t *bh = sam_hdr_init();
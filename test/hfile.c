@@ -31,9 +31,19 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <sys/stat.h>
 
+#ifndef _WIN32
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread/include/pthread.h>
+#endif
+
 #include "../htslib/hfile.h"
 #include "../htslib/hts_defs.h"
 #include "../htslib/kstring.h"
+#include "../hfile_internal.h"
 
 void HTS_NORETURN fail(const char *format, ...)
 {
@@ -78,6 +88,326 @@ char *slurp(const char *filename)
     return text;
 }
 
+// Checks seeking around in f and reading it through against its contents
+void check_seek_read(hFILE *f, const char *text, const char *message)
+{
+    static const int size[] = { 1, 13, 403, 999, 30000 };
+    char buffer[40000];
+    size_t len = strlen(text);
+    ssize_t n;
+    off_t off;
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        size_t want = size[i % 5];
+        off = (i % 7 == 0)? len - 500 + i % 3 : (i * 104729L) % len;
+        if (off + want > len) want = len - off;
+        if (hseek(f, off, SEEK_SET) != off) fail("%s: hseek", message);
+        if ((n = hread(f, buffer, size[i % 5])) != want)
+            fail("%s: hread got %d, expected %d", message, (int) n, (int) want);
+        if (memcmp(buffer, text + off, want) != 0)
+            fail("%s: hread at %ld differs", message, (long) off);
+    }
+
+    if (hseek(f, 0, SEEK_SET) != 0) fail("%s: hseek", message);
+    for (off = 0; (n = hread(f, buffer, sizeof buffer)) > 0; off += n)
+        if (off + n > len || memcmp(buffer, text + off, n) != 0)
+            fail("%s: sequential hread at %ld differs", message, (long) off);
+    if (n < 0) fail("%s: hread", message);
+    if (off != len) fail("%s: read %ld bytes of %zu", message, (long) off, len);
+}
+
+// Our built-in http: backend steps aside for libcurl when that is available
+#if !defined _WIN32 && !defined HAVE_LIBCURL
+#define TEST_HTTP
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const char *http_body;
+static int http_requests, http_version;
+static pthread_mutex_t http_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int http_request_count(void)
+{
+    pthread_mutex_lock(&http_lock);
+    int n = http_requests;
+    pthread_mutex_unlock(&http_lock);
+    return n;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        data += n, len -= n;
+    }
+    return 0;
+}
+
+/* Acts as an object store for uploads to "/upload/...", storing the result
+   of the last one in http_uploaded.  Sending part number http_fail_part fails
+   the first time, and parts are slow to arrive so that they overlap.  */
+static kstring_t http_parts[64], http_uploaded;
+static int http_fail_part, http_inflight, http_max_inflight, http_aborts;
+
+static int http_upload(const char *method, const char *query, kstring_t *body,
+                       kstring_t *hdr, kstring_t *resp)
+{
+    int part, status = 200;
+    char *s;
+
+    pthread_mutex_lock(&http_lock);
+    if (strcmp(method, "POST") == 0 && strcmp(query, "uploads") == 0) {
+        for (part = 0; part < 64; part++) http_parts[part].l = 0;
+        kputs("<InitiateMultipartUploadResult><UploadId>test-upload"
+              "</UploadId></InitiateMultipartUploadResult>", resp);
+    }
+    else if (strcmp(method, "PUT") == 0
+             && sscanf(query, "partNumber=%d&uploadId=test-upload", &part) == 1
+             && part > 0 && part < 64) {
+        if (part == http_fail_part) {
+            http_fail_part = 0;
+            status = 500;
+        }
+        else {
+            if (++http_inflight > http_max_inflight)
+                http_max_inflight = http_inflight;
+            pthread_mutex_unlock(&http_lock);
+            usleep(10000);
+            pthread_mutex_lock(&http_lock);
+            http_inflight--;
+            http_parts[part].l = 0;
+            kputsn(body->s, body->l, &http_parts[part]);
+            ksprintf(hdr, "ETag: \"part-%d\"\r\n", part);
+        }
+    }
+    else if (strcmp(method, "POST") == 0
+             && strcmp(query, "uploadId=test-upload") == 0) {
+        // Assemble the parts in the order listed, checking their ETags
+        http_uploaded.l = 0;
+        for (s = body->s; (s = strstr(s, "<PartNumber>")) != NULL; s++) {
+            int etag;
+            if (sscanf(s, "<PartNumber>%d</PartNumber><ETag>\"part-%d\"",
+                       &part, &etag) != 2 || part != etag
+                || part <= 0 || part >= 64) {
+                status = 400;
+                break;
+            }
+            kputsn(http_parts[part].s, http_parts[part].l, &http_uploaded);
+        }
+        kputs("<CompleteMultipartUploadResult/>", resp);
+    }
+    else if (strcmp(method, "PUT") == 0 && *query == '\0') {
+        http_uploaded.l = 0;
+        kputsn(body->s, body->l, &http_uploaded);
+    }
+    else if (strcmp(method, "DELETE") == 0) {
+        http_aborts++;
+        status = 204;
+    }
+    else status = 400;
+    pthread_mutex_unlock(&http_lock);
+
+    return status;
+}
+
+// Whether a chunked request body has arrived in full (without trailers)
+static int chunked_end(const kstring_t *body)
+{
+    if (body->l == 5) return memcmp(body->s, "0\r\n\r\n", 5) == 0;
+    return body->l >= 7 && memcmp(body->s + body->l - 7, "\r\n0\r\n\r\n", 7) == 0;
+}
+
+static void dechunk(kstring_t *body)
+{
+    char *in = body->s, *end;
+    size_t out = 0, size;
+
+    while ((size = strtoul(in, &end, 16)) > 0) {
+        in = strstr(end, "\r\n") + 2;
+        memmove(body->s + out, in, size);
+        out += size;
+        in += size + 2;
+    }
+    body->l = out;
+}
+
+/* Serves http_body as "/vcf.c" with byte ranges; as "/norange/vcf.c" without
+   them; as "/close/vcf.c" closing the connection after every response; as
+   "/noetag/vcf.c" without an ETag; and redirects "/redirect" to the first of
+   these.  The others carry ETag "v<http_version>".  Everything else is 404.  */
+static void *http_connection(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+    char req[8192] = "";
+    size_t len = 0;
+
+    for (;;) {
+        char method[16], path[1024], *query, *range, *eoh, *cl;
+        const char *file;
+        size_t body_len;
+        long long start = 0, end;
+        kstring_t hdr = { 0, 0, NULL }, body = { 0, 0, NULL };
+        kstring_t resp = { 0, 0, NULL };
+        size_t content_length = 0;
+        int status = 200, keep_alive = 1, etag = 1, version, upload, chunked;
+        ssize_t n;
+
+        while ((eoh = strstr(req, "\r\n\r\n")) == NULL) {
+            if (len == sizeof req - 1) goto done;
+            n = recv(fd, req + len, sizeof req - 1 - len, 0);
+            if (n <= 0) goto done;
+            len += n;
+            req[len] = '\0';
+        }
+        if (sscanf(req, "%15s %1023s HTTP/1.1", method, path) != 2) goto done;
+        pthread_mutex_lock(&http_lock);
+        http_requests++;
+        file = http_body;
+        version = http_version;
+        pthread_mutex_unlock(&http_lock);
+        body_len = strlen(file);
+        end = body_len - 1;
+
+        // Clients here don't pipeline, so the rest is the request's body
+        eoh += 4;
+        if ((cl = strstr(req, "\r\nContent-Length: ")) != NULL && cl < eoh)
+            content_length = strtoul(cl + 18, NULL, 10);
+        cl = strstr(req, "\r\nTransfer-Encoding: chunked\r\n");
+        chunked = (cl != NULL && cl < eoh);
+        kputsn(eoh, len - (eoh - req), &body);
+        while (body.l < content_length || (chunked && !chunked_end(&body))) {
+            char buf[65536];
+            if ((n = recv(fd, buf, sizeof buf, 0)) <= 0) {
+                free(body.s);
+                goto done;
+            }
+            kputsn(buf, n, &body);
+        }
+        if (chunked) dechunk(&body);
+
+        if ((query = strchr(path, '?')) != NULL) *query++ = '\0';
+        else query = "";
+
+        range = strstr(req, "\r\nRange: bytes=");
+        upload = (strncmp(path, "/upload/", 8) == 0);
+        if (upload) {
+            status = http_upload(method, query, &body, &hdr, &resp);
+        } else if (strcmp(method, "GET") != 0) {
+            status = 405;
+        } else if (strcmp(path, "/redirect") == 0) {
+            status = 302;
+        } else if (strcmp(path, "/norange/vcf.c") == 0) {
+            range = NULL;
+        } else if (strcmp(path, "/close/vcf.c") == 0) {
+            keep_alive = 0;
+        } else if (strcmp(path, "/noetag/vcf.c") == 0) {
+            etag = 0;
+        } else if (strcmp(path, "/stall") == 0) {
+            sleep(3); // Longer than the client's timeout, then hang up
+            free(body.s);
+            goto done;
+        } else if (strcmp(path, "/vcf.c") != 0) {
+            status = 404;
+        }
+
+        if (status == 200 && range && !upload) {
+            if (sscanf(range, "\r\nRange: bytes=%lld-%lld", &start, &end) != 2) {
+                free(body.s);
+                goto done;
+            }
+            if (end >= (long long) body_len) end = body_len - 1;
+            status = (start < (long long) body_len)? 206 : 416;
+        }
+
+        kstring_t head = { 0, 0, NULL };
+        ksprintf(&head, "HTTP/1.1 %d Whatever\r\n", status);
+        if (hdr.s) kputs(hdr.s, &head);
+        if (status == 206)
+            ksprintf(&head, "Content-Range: bytes %lld-%lld/%zu\r\n",
+                     start, end, body_len);
+        else if (status == 416)
+            ksprintf(&head, "Content-Range: bytes */%zu\r\n", body_len);
+        else if (status == 302)
+            kputs("Location: /vcf.c\r\n", &head);
+
+        if (upload || (status != 200 && status != 206)) {
+            // Responses other than the file itself, e.g. 302, have resp
+            if (status != 204)
+                ksprintf(&head, "Content-Length: %zu\r\n", resp.l);
+            kputs("\r\n", &head);
+            if (resp.l) kputsn(resp.s, resp.l, &head);
+        }
+        else {
+            if (etag) ksprintf(&head, "ETag: \"v%d\"\r\n", version);
+            ksprintf(&head, "Content-Length: %lld\r\n%s\r\n", end - start + 1,
+                     keep_alive? "" : "Connection: close\r\n");
+            kputsn(file + start, end - start + 1, &head);
+        }
+
+        n = send_all(fd, head.s, head.l);
+        free(head.s);
+        free(hdr.s);
+        free(body.s);
+        free(resp.s);
+        if (n < 0) break;
+        if (!keep_alive) break;
+
+        len = 0;
+        req[0] = '\0';
+    }
+
+ done:
+    close(fd);
+    return NULL;
+}
+
+static void *http_server(void *arg)
+{
+    int listen_fd = (int) (intptr_t) arg;
+    for (;;) {
+        pthread_t tid;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        if (pthread_create(&tid, NULL, http_connection, (void *) (intptr_t) fd) != 0)
+            fail("pthread_create(http_connection)");
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// Starts a server for body in the background, returning its base URL
+static char *start_http_server(const char *body, kstring_t *url)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+    pthread_t tid;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) fail("socket");
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0) fail("bind");
+    if (listen(fd, 16) < 0) fail("listen");
+    if (getsockname(fd, (struct sockaddr *) &addr, &addrlen) < 0)
+        fail("getsockname");
+
+    http_body = body;
+    if (pthread_create(&tid, NULL, http_server, (void *) (intptr_t) fd) != 0)
+        fail("pthread_create(http_server)");
+    pthread_detach(tid);
+
+    url->l = 0;
+    ksprintf(url, "http://127.0.0.1:%d", ntohs(addr.sin_port));
+    return url->s;
+}
+#endif
+
 hFILE *fin = NULL;
 hFILE *fout = NULL;
 
@@ -213,6 +543,306 @@ int main(void)
     if ((c = hgetc(fin)) != EOF) fail("preloading chars: hgetc (EOF) returned %d", c);
     if (hclose(fin) != 0) fail("preloading hclose(test/hfile_chars.tmp) for reading");
 
+    fin = hopen("test/hfile_chars.tmp", "rm");
+    if (fin == NULL) fail("hopen(\"test/hfile_chars.tmp\") for mapping");
+    for (i = 0; i < 256; i++)
+        if ((c = hgetc(fin)) != i)
+            fail("mapped chars: hgetc (%d = 0x%x) returned %d = 0x%x", i, i, c, c);
+    if ((c = hgetc(fin)) != EOF) fail("mapped chars: hgetc (EOF) returned %d", c);
+    if (hclose(fin) != 0) fail("hclose(test/hfile_chars.tmp) for mapping");
+
+    original = slurp("vcf.c");
+    fin = hopen("vcf.c", "rm");
+    if (fin == NULL) fail("hopen(\"vcf.c\", \"rm\")");
+    check_seek_read(fin, original, "mapped");
+    if (hclose(fin) != 0) fail("hclose(\"vcf.c\") mapped");
+
+    // Small read-ahead chunks, so that reads and seeks cross them often
+    fin = hopen("vcf.c", "r");
+    if (fin == NULL) fail("hopen(\"vcf.c\") for read-ahead");
+#if defined(HAVE_PREAD) && !defined(_WIN32)
+    if (hfile_set_readahead(fin, 3, 1000) < 0) fail("hfile_set_readahead");
+#else
+    // Unsupported without pread(), leaving this as a plain read test
+    if (hfile_set_readahead(fin, 3, 1000) == 0)
+        fail("hfile_set_readahead succeeded without pread()");
+#endif
+    check_seek_read(fin, original, "read-ahead");
+    if (hclose(fin) != 0) fail("hclose(\"vcf.c\") with read-ahead");
+
+    // Write-behind, over more than one of its buffers and with flushes and
+    // seeks landing part way through blocks
+    size_t len = strlen(original);
+    fout = hopen("test/hfile_wd.tmp", "wd");
+    if (fout == NULL) fail("hopen(\"test/hfile_wd.tmp\", \"wd\")");
+    for (i = 0; i < 40; i++) {
+        for (off = 0, c = 0; off < len; off += n, c++) {
+            n = size[(i + c) % 5];
+            if (off + n > len) n = len - off;
+            if (hwrite(fout, original + off, n) != n) fail("hwrite (write-behind)");
+            if (c % 97 == 0 && hflush(fout) == EOF) fail("hflush (write-behind)");
+        }
+    }
+    if (hseek(fout, len + 1001, SEEK_SET) != len + 1001) fail("hseek (write-behind)");
+    if (hwrite(fout, original + 1001, 9000) != 9000) fail("hwrite (write-behind)");
+    if (hclose(fout) != 0) fail("hclose(\"test/hfile_wd.tmp\")");
+    fout = NULL;
+
+    fin = hopen("test/hfile_wd.tmp", "r");
+    if (fin == NULL) fail("hopen(\"test/hfile_wd.tmp\") for reading");
+    for (i = 0; i < 40; i++) {
+        for (off = 0; off < len; off += n) {
+            n = (len - off < sizeof buffer)? len - off : sizeof buffer;
+            if (hread(fin, buffer, n) != n) fail("hread (write-behind)");
+            if (memcmp(buffer, original + off, n) != 0)
+                fail("test/hfile_wd.tmp copy %d differs at %ld", i, (long) off);
+        }
+    }
+    if (hread(fin, buffer, 1) != 0) fail("test/hfile_wd.tmp is too long");
+    if (hclose(fin) != 0) fail("hclose(\"test/hfile_wd.tmp\") for reading");
+    free(original);
+
+    fin = hopen("test/emptyfile", "rm");
+    if (fin == NULL) fail("hopen(\"test/emptyfile\") for mapping");
+    if (hread(fin, buffer, 100) != 0) fail("mapped test/emptyfile is non-empty");
+    if (hclose(fin) != 0) fail("hclose(\"test/emptyfile\") for mapping");
+
+#ifdef TEST_HTTP
+    {
+    kstring_t base = { 0, 0, NULL }, url = { 0, 0, NULL };
+    original = slurp("vcf.c");
+    start_http_server(original, &base);
+
+    // Small chunks, so that reads are spread over all the connections
+    ksprintf(&url, "%s/vcf.c", base.s);
+    fin = hopen(url.s, "r:", "chunk_size", (size_t) 4096, "connections", 3, NULL);
+    if (fin == NULL) fail("hopen(\"%s\") with small chunks", url.s);
+    check_seek_read(fin, original, "http");
+    if (hclose(fin) != 0) fail("hclose(\"%s\")", url.s);
+
+    fin = hopen(url.s, "r");
+    if (fin == NULL) fail("hopen(\"%s\")", url.s);
+    check_seek_read(fin, original, "http default");
+    if (hclose(fin) != 0) fail("hclose(\"%s\")", url.s);
+
+    url.l = 0;
+    ksprintf(&url, "%s/close/vcf.c", base.s);
+    fin = hopen(url.s, "r:", "chunk_size", (size_t) 10000, NULL);
+    if (fin == NULL) fail("hopen(\"%s\")", url.s);
+    check_seek_read(fin, original, "http without keep-alive");
+    if (hclose(fin) != 0) fail("hclose(\"%s\")", url.s);
+
+    url.l = 0;
+    ksprintf(&url, "%s/redirect", base.s);
+    fin = hopen(url.s, "r");
+    if (fin == NULL) fail("hopen(\"%s\")", url.s);
+    if (hread(fin, buffer, 1000) != 1000 || memcmp(buffer, original, 1000) != 0)
+        fail("hread(\"%s\")", url.s);
+    if (hclose(fin) != 0) fail("hclose(\"%s\")", url.s);
+
+    // Without ranges, the server's response is read as a stream
+    url.l = 0;
+    ksprintf(&url, "%s/norange/vcf.c", base.s);
+    fin = hopen(url.s, "r");
+    if (fin == NULL) fail("hopen(\"%s\")", url.s);
+    len = strlen(original);
+    for (off = 0; (n = hread(fin, buffer, 30000)) > 0; off += n) {
+        if (off + n > len || memcmp(buffer, original + off, n) != 0)
+            fail("hread(\"%s\") differs at %ld", url.s, (long) off);
+    }
+    if (n < 0 || off != len) fail("hread(\"%s\")", url.s);
+    if (hseek(fin, 0, SEEK_SET) >= 0 || errno != ESPIPE)
+        fail("hseek(\"%s\") backwards should have failed", url.s);
+    hclose_abruptly(fin);
+
+    // A server that stops responding is given up on
+    url.l = 0;
+    ksprintf(&url, "%s/stall", base.s);
+    errno = 0;
+    fin = hopen(url.s, "r:", "timeout", 1, NULL);
+    if (fin != NULL || errno != ETIMEDOUT)
+        fail("hopen(\"%s\") should have timed out", url.s);
+
+    url.l = 0;
+    ksprintf(&url, "%s/missing", base.s);
+    errno = 0;
+    fin = hopen(url.s, "r");
+    if (fin != NULL || errno != ENOENT)
+        fail("hopen(\"%s\") should have failed with ENOENT", url.s);
+
+    // Reading again through the disk cache needs only the opening request
+    setenv("HTS_CACHE_DIR", "test/hfile_cache.tmp", 1);
+    url.l = 0;
+    ksprintf(&url, "%s/vcf.c", base.s);
+    for (i = 0; i < 2; i++) {
+        fin = hopen(url.s, "r:", "chunk_size", (size_t) 4096, NULL);
+        if (fin == NULL) fail("hopen(\"%s\") with cache", url.s);
+        c = http_request_count();
+        check_seek_read(fin, original, "http with cache");
+        if (hclose(fin) != 0) fail("hclose(\"%s\") with cache", url.s);
+        if ((i == 0) != (http_request_count() > c))
+            fail("http with cache made %d requests on pass %d",
+                 http_request_count() - c, i + 1);
+    }
+
+    // A new ETag means the file has changed, even though its size has not
+    {
+    char *changed = strdup(original);
+    if (changed == NULL) fail("strdup");
+    for (n = 0; n < strlen(changed); n += 1000) changed[n] = '#';
+    pthread_mutex_lock(&http_lock);
+    http_body = changed;
+    http_version++;
+    pthread_mutex_unlock(&http_lock);
+    fin = hopen(url.s, "r:", "chunk_size", (size_t) 4096, NULL);
+    if (fin == NULL) fail("hopen(\"%s\") after change", url.s);
+    c = http_request_count();
+    check_seek_read(fin, changed, "http with cache after change");
+    if (hclose(fin) != 0) fail("hclose(\"%s\") after change", url.s);
+    if (http_request_count() == c) fail("stale blocks read after change");
+    pthread_mutex_lock(&http_lock);
+    http_body = original;
+    http_version--;
+    pthread_mutex_unlock(&http_lock);
+    free(changed);
+    }
+
+    // Files without an ETag are not cached at all
+    url.l = 0;
+    ksprintf(&url, "%s/noetag/vcf.c", base.s);
+    for (i = 0; i < 2; i++) {
+        fin = hopen(url.s, "r:", "chunk_size", (size_t) 4096, NULL);
+        if (fin == NULL) fail("hopen(\"%s\") with cache", url.s);
+        c = http_request_count();
+        check_seek_read(fin, original, "http with cache without ETag");
+        if (hclose(fin) != 0) fail("hclose(\"%s\") with cache", url.s);
+        if (http_request_count() == c)
+            fail("http without ETag was cached on pass %d", i + 1);
+    }
+
+    // Filling the tiny cache with another file evicts the first one's
+    // blocks, but nothing that the cache did not create
+    {
+    static const char *const foreign[] = {
+        "test/hfile_cache.tmp/other.txt",
+        "test/hfile_cache.tmp/ab/1",
+        "test/hfile_cache.tmp/ab/ab000000000000000000000000000000/notes.txt",
+        "test/hfile_cache.tmp/ab/ab000000000000000000000000000000/01",
+    };
+    mkdir("test/hfile_cache.tmp/ab", 0777);
+    mkdir("test/hfile_cache.tmp/ab/ab000000000000000000000000000000", 0777);
+    for (i = 0; i < sizeof foreign / sizeof foreign[0]; i++) {
+        FILE *f = fopen(foreign[i], "w");
+        if (f == NULL || fputs("keep me\n", f) == EOF || fclose(f) != 0)
+            fail("creating %s", foreign[i]);
+    }
+    setenv("HTS_CACHE_SIZE", "1", 1);
+    url.l = 0;
+    ksprintf(&url, "%s/close/vcf.c", base.s);
+    fin = hopen(url.s, "r");
+    if (fin == NULL) fail("hopen(\"%s\") with cache", url.s);
+    check_seek_read(fin, original, "http with full cache");
+    if (hclose(fin) != 0) fail("hclose(\"%s\") with cache", url.s);
+
+    url.l = 0;
+    ksprintf(&url, "%s/vcf.c", base.s);
+    fin = hopen(url.s, "r:", "chunk_size", (size_t) 4096, NULL);
+    if (fin == NULL) fail("hopen(\"%s\") after eviction", url.s);
+    c = http_request_count();
+    check_seek_read(fin, original, "http after eviction");
+    if (http_request_count() == c) fail("http block not evicted from cache");
+    if (hclose(fin) != 0) fail("hclose(\"%s\") after eviction", url.s);
+    for (i = 0; i < sizeof foreign / sizeof foreign[0]; i++) {
+        struct stat sb;
+        if (stat(foreign[i], &sb) != 0) fail("cache trimming removed %s", foreign[i]);
+    }
+    }
+    unsetenv("HTS_CACHE_DIR");
+    unsetenv("HTS_CACHE_SIZE");
+
+    // Plain uploads are a single PUT request, however large
+    url.l = 0;
+    ksprintf(&url, "%s/upload/vcf.c", base.s);
+    c = http_request_count();
+    fout = hopen(url.s, "w");
+    if (fout == NULL) fail("hopen(\"%s\") for PUT", url.s);
+    len = strlen(original);
+    for (off = 0; off < len; off += n) {
+        n = size[off % 5];
+        if (n > len - off) n = len - off;
+        if (hwrite(fout, original + off, n) != n) fail("hwrite for PUT");
+    }
+    if (hclose(fout) != 0) fail("hclose(\"%s\") for PUT", url.s);
+    fout = NULL;
+    if (http_uploaded.l != len || memcmp(http_uploaded.s, original, len) != 0)
+        fail("PUT %zu bytes differ from original", http_uploaded.l);
+    if (http_request_count() != c + 1)
+        fail("PUT made %d requests", http_request_count() - c);
+
+    // The server's refusal is reported when the file is closed
+    url.l = 0;
+    ksprintf(&url, "%s/vcf.c", base.s);
+    fout = hopen(url.s, "w");
+    if (fout == NULL) fail("hopen(\"%s\") for refused PUT", url.s);
+    if (hputs("hello, world!\n", fout) == EOF) fail("hputs for refused PUT");
+    if (hclose(fout) == 0) fail("hclose(\"%s\") should have failed", url.s);
+    fout = NULL;
+
+    // Upload in many small parts, three at a time, one of which is retried
+    url.l = 0;
+    ksprintf(&url, "%s/upload/vcf.c", base.s);
+    http_fail_part = 5;
+    fout = hopen(url.s, "w:", "upload", "s3", "part_size", (size_t) 10000,
+                 "connections", 3, NULL);
+    if (fout == NULL) fail("hopen(\"%s\") for upload", url.s);
+    len = strlen(original);
+    for (off = 0; off < len; off += n) {
+        n = size[off % 5];
+        if (n > len - off) n = len - off;
+        if (hwrite(fout, original + off, n) != n) fail("hwrite for upload");
+    }
+    if (hclose(fout) != 0) fail("hclose(\"%s\") for upload", url.s);
+    fout = NULL;
+    if (http_uploaded.l != len || memcmp(http_uploaded.s, original, len) != 0)
+        fail("uploaded %zu bytes differ from original", http_uploaded.l);
+    if (http_fail_part != 0) fail("upload failure was not exercised");
+    if (http_max_inflight < 2 || http_max_inflight > 3)
+        fail("upload had %d parts in flight", http_max_inflight);
+
+    // Small files are sent in one request
+    fout = hopen(url.s, "w:", "upload", "s3", NULL);
+    if (fout == NULL) fail("hopen(\"%s\") for small upload", url.s);
+    if (hputs("hello, world!\n", fout) == EOF) fail("hputs for small upload");
+    if (hclose(fout) != 0) fail("hclose(\"%s\") for small upload", url.s);
+    fout = NULL;
+    if (http_uploaded.l != 14 || memcmp(http_uploaded.s, "hello, world!\n", 14))
+        fail("small upload differs");
+
+    // The upload method must be named
+    errno = 0;
+    fout = hopen(url.s, "w:", "upload", (const char *) NULL, NULL);
+    if (fout != NULL || errno != EINVAL)
+        fail("hopen(\"%s\") with no upload method should fail", url.s);
+
+    // Parts that keep failing abort the upload
+    http_fail_part = 1;
+    fout = hopen(url.s, "w:", "upload", "s3", "part_size", (size_t) 100,
+                 "retries", 0, NULL);
+    if (fout == NULL) fail("hopen(\"%s\") for failed upload", url.s);
+    if (hwrite(fout, original, 1000) != 1000) fail("hwrite for failed upload");
+    if (hclose(fout) == 0) fail("hclose(\"%s\") should have failed", url.s);
+    fout = NULL;
+    if (http_aborts != 1) fail("failed upload was not aborted");
+
+    for (i = 0; i < 64; i++) free(http_parts[i].s);
+    free(http_uploaded.s);
+
+    free(original);
+    free(base.s);
+    free(url.s);
+    }
+#endif
+
     char* test_string = strdup("Test string");
     fin = hopen("mem:", "r:", test_string, 12);
     if (fin == NULL) fail("hopen(\"mem:\", \"r:\", ...)");
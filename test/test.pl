@@ -47,6 +47,7 @@ test_view($opts,0);
 test_view($opts,4);
 
 test_MD($opts);
+test_ref_cache($opts);
 
 test_vcf_api($opts,out=>'test-vcf-api.out');
 test_bcf2vcf($opts);
@@ -581,6 +582,35 @@ sub test_view
         testv $opts, "./test_view $tv_args $cram > $cram.sam_";
         testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
 
+        # SAM -> CRAM3.1 -> SAM, with the rANS-Nx16 and arithmetic codecs
+        testv $opts, "./test_view $tv_args -t $ref -S -C -o VERSION=3.1 $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+        testv $opts, "./test_view $tv_args -t $ref -S -l7 -C -o VERSION=3.1 -o use_arith=1 $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+
+        # SAM -> CRAM -> SAM, with the fast and archive profiles
+        testv $opts, "./test_view $tv_args -t $ref -S -C -o profile=fast $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+        # An explicit level, even the default one, overrides the profile's
+        testv $opts, "./test_view $tv_args -t $ref -S -l1 -C -o profile=fast $sam > $cram";
+        testv $opts, "./test_view $tv_args -t $ref -S -l5 -C -o profile=fast $sam > $cram.l5";
+        testv $opts, "! cmp -s $cram $cram.l5";
+        testv $opts, "./test_view $tv_args -D $cram.l5 > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+        testv $opts, "./test_view $tv_args -t $ref -S -C -o VERSION=3.1 -o archive $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+
+        # SAM -> CRAM -> SAM, without a reference and embedding a consensus
+        testv $opts, "./test_view $tv_args -S -C -o embed_ref=2 $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+        # The slice header tag marking a consensus needs CRAM 3
+        testv $opts, "! ./test_view $tv_args -S -C -o VERSION=2.1 -o embed_ref=2 $sam > $cram.v21 2>/dev/null";
+
         # Java pre-made CRAM -> SAM
         my $jcram = "${base}_java.cram";
         if (-e $jcram) {
@@ -615,6 +645,39 @@ sub test_view
     testv $opts, "./test_view $tv_args range.bam $regions > range.tmp";
     testv $opts, "./compare_sam.pl range.tmp range.out";
 
+    # Reading the index lazily
+    testv $opts, "./test_view $tv_args -L range.bam $regions > range.tmp";
+    testv $opts, "./compare_sam.pl range.tmp range.out";
+
+    # Reading each region in parallel
+    testv $opts, "./test_view $tv_args -P range.bam $regions > range.tmp";
+    testv $opts, "./compare_sam.pl range.tmp range.out";
+    testv $opts, "./test_view $tv_args -P -i reference=ce.fa range.cram $regions > range.tmp";
+    testv $opts, "./compare_sam.pl range.tmp range.out";
+
+    # Multi-region iterator, with chunks either always seeked to or read
+    # through up to a large gap, must give the same records
+    my $mregions = "CHROMOSOME_I:900-1000 CHROMOSOME_I:2000-2200 CHROMOSOME_II:1300-1400 CHROMOSOME_III:2100-2200 CHROMOSOME_IV:2400-2500";
+    testv $opts, "./test_view $tv_args -M range.bam $mregions > range.tmp.gap";
+    testv $opts, "awk '\$3 == \"CHROMOSOME_IV\" { f = 1 } END { exit !f }' range.tmp.gap";
+    testv $opts, "./test_view $tv_args -M -g 0 range.bam $mregions > range.tmp.gap0";
+    testv $opts, "./test_view $tv_args -M -g 1000000000 range.bam $mregions > range.tmp.gapbig";
+    testv $opts, "cmp range.tmp.gap range.tmp.gap0";
+    testv $opts, "cmp range.tmp.gap range.tmp.gapbig";
+
+    # The same queries through a flat (memory-mapped) copy of the index
+    testv $opts, "cp range.bam range.tmp.bam";
+    testv $opts, "./test_index -b -f range.tmp.fli range.tmp.bam";
+    testv $opts, "./test_view $tv_args 'range.tmp.bam##idx##range.tmp.fli' $regions > range.tmp";
+    testv $opts, "./compare_sam.pl range.tmp range.out";
+
+    # Queries on a reference whose lazily loaded index can't be read must
+    # fail, rather than return no records
+    dup_bai_bin("range.bam.bai", "range.tmp.bad.bai");
+    testv $opts, "! ./test_view $tv_args -L 'range.tmp.bam##idx##range.tmp.bad.bai' CHROMOSOME_I:1000-1100 > range.tmp 2>&1";
+    testv $opts, "! ./test_view $tv_args -L -M 'range.tmp.bam##idx##range.tmp.bad.bai' CHROMOSOME_I:1000-1100 > range.tmp 2>&1";
+    testv $opts, "./test_view $tv_args -L 'range.tmp.bam##idx##range.tmp.bad.bai' CHROMOSOME_II:2980-2980 > range.tmp";
+
     if ($test_view_failures == 0) {
         passed($opts, "range.cram tests");
     } else {
@@ -682,6 +745,25 @@ sub test_view
     }
 }
 
+# Copies a BAI index, giving the second bin of the first reference the same
+# number as the first.  Loading that reference then fails, but the index
+# can still be skipped over when it is loaded lazily.
+sub dup_bai_bin
+{
+    my ($in, $out) = @_;
+    open(my $fh, '<:raw', $in) || error("$in: $!");
+    local $/;
+    my $bai = <$fh>;
+    close($fh);
+    my ($n_bin) = unpack("V", substr($bai, 8, 4));
+    error("$in: first reference has too few bins") if $n_bin < 2;
+    my ($bin, $n_chunk) = unpack("VV", substr($bai, 12, 8));
+    substr($bai, 12 + 8 + 16 * $n_chunk, 4) = pack("V", $bin);
+    open($fh, '>:raw', $out) || error("$out: $!");
+    print $fh $bai;
+    close($fh);
+}
+
 # Tests CRAM's ability to correctly preserve MD and NM, irrespective of whether
 # they are correct.
 sub test_MD
@@ -749,37 +831,37 @@ sub test_index
     # BAM
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -b -m 14 -x $$opts{tmp}/index.bam.csi $$opts{path}/index.sam > $$opts{tmp}/index.bam", "$$opts{tmp}/index.bam.csi", "$$opts{path}/index.bam.csi", gz=>1);
     unlink("$$opts{tmp}/index.bam.csi");
-    test_compare($opts,"$$opts{path}/test_index -c $$opts{tmp}/index.bam", "$$opts{tmp}/index.bam.csi", "$$opts{path}/index.bam.csi", gz=>1);
+    test_compare($opts,"$$opts{path}/test_index $nthreads -c $$opts{tmp}/index.bam", "$$opts{tmp}/index.bam.csi", "$$opts{path}/index.bam.csi", gz=>1);
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -b -m 0 -x $$opts{tmp}/index.bam.bai $$opts{path}/index.sam > $$opts{tmp}/index.bam", "$$opts{tmp}/index.bam.bai", "$$opts{path}/index.bam.bai");
     unlink("$$opts{tmp}/index.bam.bai");
-    test_compare($opts,"$$opts{path}/test_index -b $$opts{tmp}/index.bam", "$$opts{tmp}/index.bam.bai", "$$opts{path}/index.bam.bai");
+    test_compare($opts,"$$opts{path}/test_index $nthreads -b $$opts{tmp}/index.bam", "$$opts{tmp}/index.bam.bai", "$$opts{path}/index.bam.bai");
 
     # SAM
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -z -m 14 -x $$opts{tmp}/index.sam.gz.csi $$opts{path}/index.sam > $$opts{tmp}/index.sam.gz", "$$opts{tmp}/index.sam.gz.csi", "$$opts{path}/index.sam.gz.csi", gz=>1);
     unlink("$$opts{tmp}/index.bam.bai");
-    test_compare($opts,"$$opts{path}/test_index -c $$opts{tmp}/index.sam.gz", "$$opts{tmp}/index.sam.gz.csi", "$$opts{path}/index.sam.gz.csi", gz=>1);
+    test_compare($opts,"$$opts{path}/test_index $nthreads -c $$opts{tmp}/index.sam.gz", "$$opts{tmp}/index.sam.gz.csi", "$$opts{path}/index.sam.gz.csi", gz=>1);
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -z -m 0 -x $$opts{tmp}/index.sam.gz.bai $$opts{path}/index.sam > $$opts{tmp}/index.sam.gz", "$$opts{tmp}/index.sam.gz.bai", "$$opts{path}/index.sam.gz.bai");
     unlink("$$opts{tmp}/index.sam.gz.bai");
-    test_compare($opts,"$$opts{path}/test_index -b $$opts{tmp}/index.sam.gz", "$$opts{tmp}/index.sam.gz.bai", "$$opts{path}/index.sam.gz.bai");
+    test_compare($opts,"$$opts{path}/test_index $nthreads -b $$opts{tmp}/index.sam.gz", "$$opts{tmp}/index.sam.gz.bai", "$$opts{path}/index.sam.gz.bai");
 
     # CRAM
     local $ENV{REF_PATH} = $$opts{m5_dir};
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -C -x $$opts{tmp}/index.cram.crai $$opts{path}/index.sam > $$opts{tmp}/index.cram", "$$opts{tmp}/index.cram.crai", "$$opts{path}/index.cram.crai", gz=>1);
     unlink("$$opts{tmp}/index.cram.crai");
-    test_compare($opts,"$$opts{path}/test_index $$opts{tmp}/index.cram", "$$opts{tmp}/index.cram.crai", "$$opts{path}/index.cram.crai", gz=>1);
+    test_compare($opts,"$$opts{path}/test_index $nthreads $$opts{tmp}/index.cram", "$$opts{tmp}/index.cram.crai", "$$opts{path}/index.cram.crai", gz=>1);
 
     # BCF
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -b -m 14 -x $$opts{tmp}/index.bcf.csi $$opts{path}/index.vcf > $$opts{tmp}/index.bcf", "$$opts{tmp}/index.bcf.csi", "$$opts{path}/index.bcf.csi", gz=>1);
     unlink("$$opts{tmp}/index.bcf.csi");
-    test_compare($opts,"$$opts{path}/test_index -c $$opts{tmp}/index.bcf", "$$opts{tmp}/index.bcf.csi", "$$opts{path}/index.bcf.csi", gz=>1);
+    test_compare($opts,"$$opts{path}/test_index $nthreads -c $$opts{tmp}/index.bcf", "$$opts{tmp}/index.bcf.csi", "$$opts{path}/index.bcf.csi", gz=>1);
 
     # VCF
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -z -m 14 -x $$opts{tmp}/index.vcf.gz.csi $$opts{path}/index.vcf > $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.csi", "$$opts{path}/index.vcf.gz.csi", gz=>1);
     unlink("$$opts{tmp}/index.vcf.gz.csi");
-    test_compare($opts,"$$opts{path}/test_index -c $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.csi", "$$opts{path}/index.vcf.gz.csi", gz=>1);
+    test_compare($opts,"$$opts{path}/test_index $nthreads -c $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.csi", "$$opts{path}/index.vcf.gz.csi", gz=>1);
     test_compare($opts,"$$opts{path}/test_view $nthreads -l 0 -z -m 0 -x $$opts{tmp}/index.vcf.gz.tbi $$opts{path}/index.vcf > $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.tbi", "$$opts{path}/index.vcf.gz.tbi", gz=>1);
     unlink("$$opts{tmp}/index.vcf.gz.tbi");
-    test_compare($opts,"$$opts{path}/test_index -t $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.tbi", "$$opts{path}/index.vcf.gz.tbi", gz=>1);
+    test_compare($opts,"$$opts{path}/test_index $nthreads -t $$opts{tmp}/index.vcf.gz", "$$opts{tmp}/index.vcf.gz.tbi", "$$opts{path}/index.vcf.gz.tbi", gz=>1);
 
     # Tabix and custom index names
     _cmd("$$opts{bin}/tabix -fp vcf $$opts{tmp}/index.vcf.gz");
@@ -798,6 +880,89 @@ sub test_bcf2vcf
              cmd => "$$opts{path}/test_view $$opts{path}/tabix/vcf_file.bcf");
 }
 
+sub ref_cache_files
+{
+    my ($dir) = @_;
+    my ($n, $sz) = (0, 0);
+    foreach my $f (glob("$dir/*/*")) {
+        next unless -f $f;
+        $n++;
+        $sz += -s $f;
+    }
+    return ($n, $sz);
+}
+
+sub test_ref_cache
+{
+    my ($opts) = @_;
+
+    # Build a CRAM whose @SQ UR: tags point at a reference that no longer
+    # exists, so sequences can only be found via REF_PATH or REF_CACHE.
+    my $ref = "$$opts{tmp}/ref_cache_ce.fa";
+    my $cram = "$$opts{tmp}/ref_cache.tmp.cram";
+    my $cache = "$$opts{tmp}/ref_cache";
+    cmd("cp ce.fa $ref");
+
+    print "test_ref_cache:\n";
+    $test_view_failures = 0;
+    testv $opts, "./test_view -t $ref -C ce#5b.sam > $cram";
+    unlink($ref, "$ref.fai");
+
+    # Populate the cache, using a file: URL as a stand-in for the server
+    local $ENV{REF_PATH} = "URL=file:://$$opts{m5_dir}/%s";
+    local $ENV{REF_CACHE} = "$cache/%2s/%s";
+    testv $opts, "./test_view -D $cram > $cram.sam_";
+    testv $opts, "./compare_sam.pl -nomd ce#5b.sam $cram.sam_";
+    my ($n, $sz) = ref_cache_files($cache);
+    if ($n != 5) {
+        print STDERR "Expected 5 reference cache entries, found $n\n";
+        $test_view_failures++;
+    }
+
+    # Served purely from the cache
+    $ENV{REF_PATH} = "$$opts{tmp}/no_such_dir";
+    testv $opts, "./test_view -D $cram > $cram.sam_";
+    testv $opts, "./compare_sam.pl -nomd ce#5b.sam $cram.sam_";
+
+    # Size-bounded cache must evict down to REF_CACHE_SIZE
+    $ENV{REF_PATH} = "URL=file:://$$opts{m5_dir}/%s";
+    $ENV{REF_CACHE} = "$cache.bounded/%2s/%s";
+    local $ENV{REF_CACHE_SIZE} = 20000;
+
+    # Old files that don't fit the REF_CACHE layout must not be evicted
+    my @foreign = map { "$cache.bounded/$_" }
+        ("notes.txt", "0123456789abcdef0123456789abcdef",
+         "ab/cafe", "ab/cd/0123456789abcdef0123456789ab");
+    foreach my $f (@foreign) {
+        (my $d = $f) =~ s{/[^/]*$}{};
+        cmd("mkdir -p $d");
+        open(my $fh, '>', $f) || error("$f: $!");
+        print $fh "x" x 30000;
+        close($fh);
+        utime(0, 0, $f);
+    }
+
+    testv $opts, "./test_view -D $cram > $cram.sam_";
+    testv $opts, "./compare_sam.pl -nomd ce#5b.sam $cram.sam_";
+    foreach my $f (@foreign) {
+        next if -f $f;
+        print STDERR "Reference cache trimming removed $f\n";
+        $test_view_failures++;
+    }
+    unlink(@foreign);
+    ($n, $sz) = ref_cache_files("$cache.bounded");
+    if ($n == 0 || $sz > 20000) {
+        print STDERR "Bounded reference cache holds $n entries, $sz bytes\n";
+        $test_view_failures++;
+    }
+
+    if ($test_view_failures == 0) {
+        passed($opts, "reference cache");
+    } else {
+        failed($opts, "reference cache", "$test_view_failures subtests failed");
+    }
+}
+
 sub test_vcf_api
 {
     my ($opts,%args) = @_;
@@ -393,12 +393,12 @@ static int setup(const char *src, Files *f) {
     return -1;
 }
 
-static int test_read(Files *f) {
+static int test_read(Files *f, const char *mode) {
     BGZF* bgz;
     ssize_t bg_got, f_got;
     unsigned char bg_buf[BUFSZ], f_buf[BUFSZ];
 
-    bgz = try_bgzf_open(f->src_bgzf, "r", __func__);
+    bgz = try_bgzf_open(f->src_bgzf, mode, __func__);
     if (!bgz) return -1;
 
     do {
@@ -937,7 +937,8 @@ int main(int argc, char **argv) {
 
     // Try reading an existing file
     if (test_check_EOF(f.src_bgzf, 1) != 0) goto out;
-    if (test_read(&f) != 0) goto out;
+    if (test_read(&f, "r") != 0) goto out;
+    if (test_read(&f, "rm") != 0) goto out;
 
     // Try writing some data and reading it back
     if (test_write_read(&f, "wu", USE_BGZF_OPEN, 0, 0) != 0) goto out;
@@ -959,6 +960,12 @@ int main(int argc, char **argv) {
     if (test_write_read(&f, "w", USE_BGZF_OPEN, 2, 2) != 0) goto out;
     if (test_check_EOF(f.tmp_bgzf, 1) != 0) goto out;
 
+    // Try writing with write-behind (and O_DIRECT, if supported)
+    if (test_write_read(&f, "wd", USE_BGZF_OPEN, 0, 2) != 0) goto out;
+    if (test_check_EOF(f.tmp_bgzf, 1) != 0) goto out;
+    if (test_write_read(&f, "wd", USE_BGZF_OPEN, 2, 2) != 0) goto out;
+    if (test_check_EOF(f.tmp_bgzf, 1) != 0) goto out;
+
     // Embedded EOF block
     if (test_embed_eof(&f, "w", 0) != 0) goto out;
     if (test_embed_eof(&f, "w", 1) != 0) goto out;
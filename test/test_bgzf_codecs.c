@@ -0,0 +1,247 @@
+/* test/test_bgzf_codecs.c -- compare the speed of BGZF deflate codecs
+
+   Copyright (C) 2020 Genome Research Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Compresses each file at each level with every codec built into the
+ * library, then reads the result back with every codec, checking that the
+ * data survives and reporting the compression ratio and speeds.  E.g.
+ *
+ *     test/test_bgzf_codecs -n 5 test/ce.fa 'test/ce#large_seq.sam'
+ *
+ * With -n 1 it is quick enough to run as a round-trip test.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../htslib/bgzf.h"
+#include "../htslib/hfile.h"
+
+#define MAX_LEVELS 16
+
+static char *slurp(const char *fn, size_t *len)
+{
+    hFILE *fp = hopen(fn, "r");
+    char *buf = NULL, *new_buf;
+    size_t size = 0;
+    ssize_t n;
+
+    *len = 0;
+    if (!fp) goto fail;
+    do {
+        if (*len == size) {
+            size = size ? size * 2 : 1 << 20;
+            if (!(new_buf = realloc(buf, size))) goto fail;
+            buf = new_buf;
+        }
+        n = hread(fp, buf + *len, size - *len);
+        if (n < 0) goto fail;
+        *len += n;
+    } while (n > 0);
+    if (hclose(fp) < 0) { fp = NULL; goto fail; }
+    return buf;
+
+ fail:
+    fprintf(stderr, "Couldn't read %s : %s\n", fn, strerror(errno));
+    if (fp) hclose_abruptly(fp);
+    free(buf);
+    return NULL;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double mb_per_sec(size_t len, int iters, double secs)
+{
+    return secs > 0 ? (double) len * iters / secs / 1e6 : 0;
+}
+
+// Writes the data with the given codec and level; returns the time taken
+static double write_bgzf(const char *tmp_name, const char *codec, int level,
+                         const char *data, size_t len, int iters, off_t *clen)
+{
+    clock_t start = clock();
+    int i;
+
+    for (i = 0; i < iters; i++) {
+        BGZF *fp = bgzf_open(tmp_name, "w");
+        if (!fp) return -1;
+        fp->compress_level = level;
+        if (bgzf_set_codec(fp, codec) < 0
+            || bgzf_write(fp, data, len) != len || bgzf_flush(fp) < 0) {
+            bgzf_close(fp);
+            return -1;
+        }
+        *clen = htell(fp->fp);
+        if (bgzf_close(fp) < 0) return -1;
+    }
+
+    return elapsed(start);
+}
+
+// Reads back what write_bgzf() wrote and checks it matches
+static double read_bgzf(const char *tmp_name, const char *codec,
+                        const char *data, size_t len, char *buf, int iters)
+{
+    clock_t start = clock();
+    int i;
+
+    for (i = 0; i < iters; i++) {
+        BGZF *fp = bgzf_open(tmp_name, "r");
+        ssize_t n;
+        if (!fp) return -1;
+        if (bgzf_set_codec(fp, codec) < 0) {
+            bgzf_close(fp);
+            return -1;
+        }
+        n = bgzf_read(fp, buf, len + 1);
+        if (bgzf_close(fp) < 0 || n != len || memcmp(buf, data, len) != 0) {
+            fprintf(stderr, "Data read with %s does not match\n", codec);
+            return -1;
+        }
+    }
+
+    return elapsed(start);
+}
+
+static int parse_levels(const char *str, int *levels)
+{
+    int n = 0;
+    char *end;
+
+    while (*str && n < MAX_LEVELS) {
+        long level = strtol(str, &end, 10);
+        if (end == str || level < 1 || level > 12) return -1;
+        levels[n++] = level;
+        str = *end == ',' ? end + 1 : end;
+    }
+
+    return *str ? -1 : n;
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "Usage: test_bgzf_codecs [-n ITERATIONS] [-l LEVEL,...] FILE...\n");
+}
+
+int main(int argc, char **argv)
+{
+    int levels[MAX_LEVELS], n_levels = 9, iters = 3, opt, i, j, k, w;
+    int ret = EXIT_SUCCESS;
+
+    for (i = 0; i < 9; i++) levels[i] = i + 1;
+
+    while ((opt = getopt(argc, argv, "hl:n:")) >= 0) {
+        switch (opt) {
+        case 'l':
+            if ((n_levels = parse_levels(optarg, levels)) <= 0) {
+                fprintf(stderr, "Invalid level list \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if ((iters = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid iteration count \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %-10s %5s %7s %11s", "File", "Codec", "Level", "Ratio",
+           "Write MB/s");
+    for (k = 0; bgzf_codec_name(k); k++)
+        printf(" %11s", bgzf_codec_name(k));
+    printf("  (read MB/s)\n");
+
+    for (; optind < argc; optind++) {
+        const char *fn = argv[optind];
+        size_t len;
+        char *data = slurp(fn, &len), *buf, *tmp_name;
+
+        if (!data) return EXIT_FAILURE;
+        buf = malloc(len + 1);
+        tmp_name = malloc(strlen(fn) + 8);
+        if (!buf || !tmp_name) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        sprintf(tmp_name, "%s.tmp.gz", fn);
+
+        for (w = 0; bgzf_codec_name(w); w++) {
+            const char *codec = bgzf_codec_name(w);
+            for (i = 0; i < n_levels; i++) {
+                off_t clen = 0;
+                double secs = write_bgzf(tmp_name, codec, levels[i],
+                                         data, len, iters, &clen);
+                if (secs < 0) {
+                    fprintf(stderr, "Writing %s with %s at level %d failed\n",
+                            fn, codec, levels[i]);
+                    ret = EXIT_FAILURE;
+                    continue;
+                }
+                printf("%-24s %-10s %5d %7.3f %11.1f", fn, codec, levels[i],
+                       clen > 0 ? (double) len / clen : 0,
+                       mb_per_sec(len, iters, secs));
+
+                // Everything must be readable with every codec
+                for (j = 0; bgzf_codec_name(j); j++) {
+                    secs = read_bgzf(tmp_name, bgzf_codec_name(j),
+                                     data, len, buf, iters);
+                    if (secs < 0) {
+                        printf(" %11s", "FAILED");
+                        ret = EXIT_FAILURE;
+                    } else {
+                        printf(" %11.1f", mb_per_sec(len, iters, secs));
+                    }
+                }
+                printf("\n");
+            }
+        }
+
+        unlink(tmp_name);
+        free(tmp_name);
+        free(buf);
+        free(data);
+    }
+
+    return ret;
+}
@@ -0,0 +1,248 @@
+/* test/test_cram_codecs.c -- Test the CRAM 3.1 quality and name codecs
+
+   Copyright (C) 2020 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+
+#include <config.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "../cram/fqzcomp_qual.h"
+#include "../cram/tokenise_name3.h"
+
+#define NREC 1000
+#define MAX_LEN 250
+
+// Simple deterministic generator so failures are reproducible
+static uint32_t rnd_state = 12345;
+static uint32_t rnd(void) {
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+// Flips a few bits and possibly truncates, checking the decoder copes
+static void corrupt_and_decode(char *comp, size_t clen, int is_names) {
+    int k;
+
+    for (k = 0; k < 10; k++) {
+        char *c = malloc(clen);
+        size_t len = k & 1 ? clen - rnd() % (clen/2 + 1) : clen;
+        int n = 1 + rnd() % 3;
+        if (!c)
+            return;
+        memcpy(c, comp, clen);
+        while (n--)
+            c[rnd() % clen] ^= 1 << (rnd() % 8);
+        if (is_names) {
+            uint32_t ulen;
+            free(tok3_decode_names((uint8_t *)c, len, &ulen));
+        } else {
+            size_t ulen;
+            free(fqz_decompress(c, len, &ulen));
+        }
+        free(c);
+    }
+}
+
+/*
+ * Qualities that drift and decline along each read, with binned values,
+ * varying lengths, reverse complemented and duplicate records as
+ * selected by the 'variant' bits.
+ */
+static int test_fqz(int variant, int verbose) {
+    uint32_t len[NREC], flags[NREC];
+    char *qual = malloc(NREC * MAX_LEN), *comp, *uncomp;
+    size_t tot = 0, clen, ulen;
+    fqz_slice s = { NREC, len, flags };
+    int r, strat, res = 0;
+
+    if (!qual)
+        return -1;
+
+    for (r = 0; r < NREC; r++) {
+        int q = 38;
+        uint32_t j;
+
+        len[r] = variant & 1 ? 50 + rnd() % (MAX_LEN-50) : 150;
+        flags[r] = (rnd() & 1 ? 128 : 64) | (variant & 2 && rnd() & 1 ? 16 : 0);
+        if (variant & 4 && r && rnd() % 20 == 0) {
+            len[r] = len[r-1];
+            memcpy(qual + tot, qual + tot - len[r], len[r]);
+            tot += len[r];
+            continue;
+        }
+        for (j = 0; j < len[r]; j++) {
+            q += rnd() % 5 - 2 - (j > len[r] * 3 / 4);
+            q = q < 2 ? 2 : q > 41 ? 41 : q;
+            qual[tot++] = 33 + (variant & 8 ? q / 8 * 8 : q);
+        }
+    }
+
+    for (strat = 0; strat < FQZ_NSTRAT; strat++) {
+        comp = fqz_compress(&s, qual, tot, &clen, strat);
+        if (!comp) {
+            fprintf(stderr, "fqz_compress failed: variant %d strat %d\n",
+                    variant, strat);
+            res = -1;
+            continue;
+        }
+        uncomp = fqz_decompress(comp, clen, &ulen);
+        if (!uncomp || ulen != tot || memcmp(uncomp, qual, tot) != 0) {
+            fprintf(stderr, "fqzcomp round trip failed: variant %d "
+                    "strat %d\n", variant, strat);
+            res = -1;
+        } else if (verbose) {
+            fprintf(stderr, "fqzcomp variant %2d strat %d: %zu -> %zu\n",
+                    variant, strat, tot, clen);
+        }
+        corrupt_and_decode(comp, clen, 0);
+        free(uncomp);
+        free(comp);
+    }
+
+    // Lengths not matching the data must be rejected
+    len[0]++;
+    comp = fqz_compress(&s, qual, tot, &clen, 0);
+    if (comp) {
+        fprintf(stderr, "fqz_compress accepted mismatched lengths\n");
+        free(comp);
+        res = -1;
+    }
+
+    // No record information
+    comp = fqz_compress(NULL, qual, tot, &clen, 0);
+    uncomp = comp ? fqz_decompress(comp, clen, &ulen) : NULL;
+    if (!uncomp || ulen != tot || memcmp(uncomp, qual, tot) != 0) {
+        fprintf(stderr, "fqzcomp round trip without records failed\n");
+        res = -1;
+    }
+    free(comp);
+    free(uncomp);
+
+    free(qual);
+    return res;
+}
+
+/*
+ * Names in Illumina, SRA and random styles, with duplicates and a
+ * choice of separator.
+ */
+static int test_tok3(int variant, int verbose) {
+    char *names = malloc(NREC * 64), sep = variant & 4 ? '\n' : '\0';
+    uint32_t *start = malloc(NREC * sizeof(*start)), ulen;
+    int n, len = 0, x = 1000, y = 2000, level, arith, res = 0;
+
+    if (!names || !start) {
+        free(names);
+        free(start);
+        return -1;
+    }
+
+    for (n = 0; n < NREC; n++) {
+        start[n] = len;
+        if (n && rnd() % 4 == 0) {
+            // Duplicate of a recent name, as for read pairs
+            uint32_t d = 1 + rnd() % (n < 20 ? n : 20);
+            uint32_t l = (n-d+1 < n ? start[n-d+1] : len) - start[n-d];
+            memmove(names + len, names + start[n-d], l);
+            len += l;
+            continue;
+        }
+        switch (variant & 3) {
+        case 0:
+            x += rnd() % 50;
+            if (x > 30000) {
+                x = 1000;
+                y += rnd() % 3000;
+            }
+            len += sprintf(names + len, "HSQ1008:141:D0CC8ACXX:2:1101:%d:%d",
+                           x, y);
+            break;
+        case 1:
+            len += sprintf(names + len, "SRR%09d.%d", n + 1000, n);
+            break;
+        default: {
+            int l = rnd() % 30, j;
+            for (j = 0; j < l; j++) {
+                char c = 1 + rnd() % 255;
+                names[len++] = c == sep ? 'x' : c;
+            }
+            break;
+        }
+        }
+        names[len++] = sep;
+    }
+
+    for (level = 1; level <= 9; level += 8) {
+        for (arith = 0; arith < 2; arith++) {
+            int clen;
+            uint8_t *comp = tok3_encode_names(names, len, level, arith,
+                                              &clen), *uncomp;
+            if (!comp) {
+                fprintf(stderr, "tok3_encode_names failed: variant %d\n",
+                        variant);
+                res = -1;
+                continue;
+            }
+            uncomp = tok3_decode_names(comp, clen, &ulen);
+            if (!uncomp || ulen != len || memcmp(uncomp, names, len) != 0) {
+                fprintf(stderr, "tok3 round trip failed: variant %d "
+                        "level %d arith %d\n", variant, level, arith);
+                res = -1;
+            } else if (verbose) {
+                fprintf(stderr, "tok3 variant %d level %d arith %d: "
+                        "%d -> %d\n", variant, level, arith, len, clen);
+            }
+            corrupt_and_decode((char *)comp, clen, 1);
+            free(uncomp);
+            free(comp);
+        }
+    }
+
+    free(names);
+    free(start);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0, opt, res = 0, v;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (v = 0; v < 16; v++)
+        res |= test_fqz(v, verbose);
+    for (v = 0; v < 8; v++)
+        res |= test_tok3(v, verbose);
+
+    return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
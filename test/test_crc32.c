@@ -0,0 +1,113 @@
+/* test/test_crc32.c -- check hts_crc32() against zlib's crc32()
+
+   Copyright (C) 2020 Genome Research Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The carry-less multiplication code folds 64 and then 16 bytes at a
+ * time and leaves the tail to zlib, so every length up to a few thousand
+ * is tried at several alignments, along with a large buffer that is also
+ * checksummed in pieces and joined with hts_crc32_combine().
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "../hts_internal.h"
+
+#define MAX_LEN    3000
+#define MAX_OFFSET 5
+#define BIG_LEN    (200 * 1024)
+
+static int failures = 0;
+
+static void check(const char *what, size_t off, size_t len,
+                  uint32_t got, uint32_t expected) {
+    if (got != expected) {
+        fprintf(stderr, "%s: offset %zu length %zu: got %08x, expected %08x\n",
+                what, off, len, got, expected);
+        failures++;
+    }
+}
+
+static void fill(unsigned char *buf, size_t len) {
+    uint32_t x = 12345;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        x = x * 1103515245 + 12345;
+        buf[i] = x >> 24;
+    }
+}
+
+int main(void) {
+    unsigned char *buf = malloc(BIG_LEN + MAX_OFFSET);
+    size_t off, len, split;
+    uint32_t crc, zcrc;
+
+    if (!buf) {
+        perror("test_crc32");
+        return EXIT_FAILURE;
+    }
+    fill(buf, BIG_LEN + MAX_OFFSET);
+
+    // Every length at every offset, from zero and from a running CRC
+    for (off = 0; off < MAX_OFFSET; off++) {
+        for (len = 0; len < MAX_LEN; len++) {
+            check("hts_crc32", off, len, hts_crc32(0, buf + off, len),
+                  crc32(0, buf + off, len));
+            check("hts_crc32 continued", off, len,
+                  hts_crc32(0x12345678, buf + off, len),
+                  crc32(0x12345678, buf + off, len));
+        }
+    }
+
+    // A large buffer, whole and split at and around the block boundaries
+    for (off = 0; off < MAX_OFFSET; off++) {
+        zcrc = crc32(0, buf + off, BIG_LEN);
+        check("hts_crc32 large", off, BIG_LEN,
+              hts_crc32(0, buf + off, BIG_LEN), zcrc);
+
+        for (split = 0; split <= 260; split++) {
+            size_t at = split < 130 ? split : BIG_LEN - (split - 130);
+            crc = hts_crc32(0, buf + off, at);
+            check("hts_crc32 split", off, at,
+                  hts_crc32(crc, buf + off + at, BIG_LEN - at), zcrc);
+            check("hts_crc32_combine", off, at,
+                  hts_crc32_combine(crc,
+                                    hts_crc32(0, buf + off + at,
+                                              BIG_LEN - at),
+                                    BIG_LEN - at), zcrc);
+        }
+    }
+
+    free(buf);
+
+    if (failures) {
+        fprintf(stderr, "test_crc32: %d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
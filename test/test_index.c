@@ -35,18 +35,23 @@ void usage(FILE *fp) {
     fprintf(fp, "  -c       Use CSI index (BAM, SAM, VCF, BCF)\n");
     fprintf(fp, "  -t       Use TBI index (VCF) \n");
     fprintf(fp, "  -m bits  Adjust min_shift; implies CSI\n");
+    fprintf(fp, "  -@ INT   Number of threads to use\n");
+    fprintf(fp, "  -f FILE  Also save a flat copy of the index to FILE\n");
     fprintf(fp, "\nThe default index format is CSI for sam/bam/vcf/bcf and CRAI for crams\n");
     exit(fp == stderr ? 1 : 0);
 }
 
 int main(int argc, char **argv) {
-    int c, min_shift = 14;
+    int c, min_shift = 14, nthreads = 0;
+    const char *flat_fn = NULL;
 
-    while ((c = getopt(argc, argv, "bctm:")) >= 0) {
+    while ((c = getopt(argc, argv, "bctm:@:f:")) >= 0) {
         switch (c) {
         case 't': case 'b': min_shift = 0; break;
         case 'c': min_shift = 14; break;
         case 'm': min_shift = atoi(optarg); break;
+        case '@': nthreads = atoi(optarg); break;
+        case 'f': flat_fn = optarg; break;
         case 'h': usage(stdout);
         default:  usage(stderr);
         }
@@ -60,13 +65,15 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    int ret;
+    int ret, fmt;
     if (in->format.format == sam ||
         in->format.format == bam ||
         in->format.format == cram) {
-        ret = sam_index_build(argv[optind], min_shift);
+        ret = sam_index_build3(argv[optind], NULL, min_shift, nthreads);
+        fmt = min_shift > 0 ? HTS_FMT_CSI : HTS_FMT_BAI;
     } else {
-        ret = bcf_index_build(argv[optind], min_shift);
+        ret = bcf_index_build3(argv[optind], NULL, min_shift, nthreads);
+        fmt = min_shift > 0 ? HTS_FMT_CSI : HTS_FMT_TBI;
     }
 
     if (ret < 0) {
@@ -74,6 +81,15 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    if (flat_fn) {
+        hts_idx_t *idx = hts_idx_load(argv[optind], fmt);
+        if (!idx || hts_idx_save_flat(idx, flat_fn) < 0) {
+            fprintf(stderr, "Failed to save flat index \"%s\"\n", flat_fn);
+            exit(1);
+        }
+        hts_idx_destroy(idx);
+    }
+
     if (hts_close(in) < 0) {
         fprintf(stderr, "Error closing \"%s\"\n", argv[optind]);
         exit(1);
@@ -0,0 +1,456 @@
+/* test/test_rans.c -- Test the rANS-Nx16 codec and its SIMD decoders
+
+   Copyright (C) 2020 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+
+#include <config.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "../cram/rANS_static4x16.h"
+
+// Decoder implementations to compare; 0 is the scalar code.  Levels the
+// CPU lacks fall back to a lower one, so are harmless to test.
+static const int cpu_levels[] = {
+    0, RANS_CPU_SSE4, RANS_CPU_AVX2, RANS_CPU_AVX512
+};
+#define NLEVELS (sizeof(cpu_levels)/sizeof(*cpu_levels))
+
+static const int orders[] = {
+    0, 1,
+    RANS_ORDER_X32, RANS_ORDER_X32 | 1,
+    RANS_ORDER_X32 | RANS_ORDER_RLE, RANS_ORDER_X32 | RANS_ORDER_RLE | 1,
+    RANS_ORDER_X32 | RANS_ORDER_PACK, RANS_ORDER_X32 | RANS_ORDER_PACK | 1,
+    RANS_ORDER_X32 | RANS_ORDER_STRIPE | 1,
+};
+#define NORDERS (sizeof(orders)/sizeof(*orders))
+
+static const unsigned int sizes[] = {
+    0, 1, 31, 32, 33, 1000, 4099, 65536, 100001, 300007
+};
+#define NSIZES (sizeof(sizes)/sizeof(*sizes))
+
+// Simple deterministic generator so failures are reproducible
+static uint32_t rnd_state = 12345;
+static uint32_t rnd(void) {
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+enum data_type { UNIFORM, QUAL, RUNS, FOUR_SYMS, NTYPES };
+static const char *type_names[] = { "uniform", "qual", "runs", "four_syms" };
+
+static void fill(unsigned char *buf, unsigned int len, enum data_type type) {
+    unsigned int i;
+    unsigned char q = 30;
+
+    for (i = 0; i < len; i++) {
+        switch (type) {
+        case UNIFORM:
+            buf[i] = rnd() & 0xff;
+            break;
+        case QUAL:
+            // A drifting value with occasional jumps, like quality scores
+            if (rnd() % 8 == 0)
+                q = 33 + rnd() % 40;
+            buf[i] = q + rnd() % 3;
+            break;
+        case RUNS:
+            buf[i] = i && rnd() % 16 ? buf[i-1] : rnd() % 6;
+            break;
+        case FOUR_SYMS:
+            buf[i] = "ACGT"[rnd() % 4];
+            break;
+        default:
+            abort();
+        }
+    }
+}
+
+/*
+ * Known-answer streams.  These were written by rans_compress_4x16() when
+ * the codec was added and are kept as they are, so that the scalar and
+ * each SIMD decoder are checked against the same recorded bytes rather
+ * than only against whatever the encoder currently produces.  Each one
+ * decodes to kat_fill() of the given length.
+ */
+static const unsigned char kat_o0[] = {
+    0x00, 0x82, 0x2c, 0x21, 0x22, 0x03, 0x00, 0x86, 0x33, 0x89, 0x77, 0x89,
+    0x08, 0x84, 0x4b, 0x82, 0x03, 0x02, 0xc5, 0x00, 0x00, 0xed, 0x70, 0x46,
+    0x09, 0x37, 0x97, 0x4e, 0x00, 0x1d, 0x60, 0x04, 0x00, 0x78, 0xf7, 0x30,
+    0xc4, 0x6e, 0x10, 0x8d, 0x31, 0x39, 0x77, 0xfb, 0xe6, 0x3f, 0xe8, 0xb1,
+    0x73, 0x80, 0xef, 0xc7, 0x7d, 0xb4, 0xec, 0x4a, 0x3a, 0xdd, 0x49, 0x3b,
+    0xc6, 0x5d, 0x53, 0x9c, 0x87, 0x0c, 0x73, 0x71, 0x02, 0x91, 0xa6, 0xe9,
+    0x0f, 0x40, 0x3e, 0x47, 0xf0, 0x33, 0x51, 0x58, 0x09, 0x3e, 0xeb, 0x71,
+    0x46, 0xcf, 0x31, 0x1f, 0x4d, 0xe2, 0x5f, 0x53, 0x91, 0xad, 0xf7, 0x15,
+    0x58, 0x32, 0x53, 0x03, 0x16, 0x2a, 0x06, 0xc2, 0x4d, 0x32, 0x9b, 0xe3,
+    0x5e, 0x7a, 0x3d
+};
+
+static const unsigned char kat_o1[] = {
+    0x01, 0x82, 0x2c, 0xa0, 0x00, 0x21, 0x22, 0x03, 0x00, 0x00, 0x01, 0x84,
+    0x00, 0x00, 0x00, 0x82, 0x00, 0x82, 0x00, 0x00, 0x00, 0x83, 0x4d, 0x83,
+    0x6f, 0x44, 0x00, 0x01, 0x00, 0x00, 0x82, 0x4e, 0x83, 0x3e, 0x81, 0x53,
+    0x16, 0x0b, 0x00, 0x00, 0x0c, 0x82, 0x09, 0x84, 0x37, 0x81, 0x34, 0x00,
+    0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0x82, 0x55, 0x83, 0x20, 0x81, 0x73,
+    0x00, 0x00, 0x3c, 0x00, 0x00, 0x3c, 0x83, 0x63, 0x83, 0x25, 0x03, 0x99,
+    0x9a, 0x1e, 0xca, 0xe6, 0xdc, 0x01, 0xea, 0xc7, 0x15, 0x00, 0xea, 0xdd,
+    0x02, 0x00, 0x8f, 0x0a, 0xfc, 0x8c, 0x6e, 0xc2, 0x94, 0xa6, 0x65, 0x8e,
+    0x83, 0xa8, 0xd3, 0x57, 0xe0, 0xf9, 0x7d, 0x97, 0x82, 0x1d, 0x73, 0x9f,
+    0x82, 0xf0, 0xff, 0x9b, 0x27, 0x89, 0x7d, 0x9d, 0x3a, 0xe4, 0xfd, 0xe0,
+    0xac, 0x5a, 0xbc, 0x9f, 0x46, 0x4c, 0xea, 0x7a, 0xe5, 0x89, 0xed, 0xea,
+    0xa6, 0x77, 0xff, 0x5a, 0x0a, 0x7e, 0xba, 0xda
+};
+
+static const unsigned char kat_x32_o0[] = {
+    0x04, 0x90, 0x00, 0x21, 0x22, 0x03, 0x00, 0x84, 0x24, 0x88, 0x68, 0x87,
+    0x68, 0x87, 0x00, 0x84, 0x0c, 0x57, 0xe3, 0x00, 0x00, 0xbc, 0x81, 0x00,
+    0x00, 0x86, 0xd4, 0x8b, 0x53, 0x12, 0x22, 0xbe, 0x40, 0xb0, 0xf5, 0x05,
+    0x00, 0xd3, 0x85, 0x00, 0x00, 0x8d, 0x25, 0x04, 0x00, 0x28, 0x11, 0x01,
+    0x00, 0x20, 0xd3, 0x76, 0x4d, 0xa8, 0x44, 0xbe, 0x48, 0x2f, 0x91, 0x00,
+    0x00, 0x62, 0x53, 0xd8, 0x02, 0x07, 0x05, 0x61, 0x27, 0xcc, 0x75, 0x03,
+    0x00, 0xe6, 0xe5, 0x00, 0x00, 0x98, 0xd1, 0x8b, 0x2a, 0xee, 0xe0, 0x00,
+    0x00, 0xae, 0xc1, 0x00, 0x00, 0x6a, 0xb1, 0x06, 0x00, 0x36, 0x66, 0x55,
+    0x08, 0xf6, 0x92, 0xf8, 0x03, 0x82, 0x72, 0x01, 0x00, 0xf8, 0x91, 0x08,
+    0x1b, 0xdb, 0x61, 0x05, 0x00, 0xf4, 0x01, 0x2e, 0x08, 0x58, 0x65, 0x01,
+    0x00, 0x03, 0xf2, 0x08, 0x3a, 0x2b, 0xc3, 0x08, 0x00, 0xcf, 0xd2, 0x35,
+    0x00, 0xde, 0x10, 0x01, 0x00, 0x90, 0x93, 0x0c, 0x00, 0x34, 0xf6, 0x00,
+    0x00, 0x7f, 0x20, 0xe2, 0xa0, 0x50, 0x26, 0x6a, 0xf8, 0x36, 0x37, 0xd1,
+    0x84, 0x4b, 0x98, 0xc2, 0x37, 0x1d, 0xd3, 0x92, 0x72, 0x7d, 0xf8, 0xf8,
+    0x56, 0x99, 0x2f, 0x1b, 0x3f, 0x33, 0x4f, 0x35, 0x9f, 0x33, 0x8a, 0xd0,
+    0xb1, 0xb8, 0x95, 0x03, 0x20, 0xee, 0x97, 0x50, 0x9b, 0xa0, 0xac, 0xfa,
+    0xcd, 0x68, 0x1e, 0x70, 0xe2, 0x53, 0x1b, 0xcd, 0x6c, 0x0b, 0xd9, 0x5d,
+    0x3b, 0x69, 0x14, 0x16, 0xd2, 0xd7, 0xa5, 0xc5, 0x54, 0x9a, 0xc6, 0x94,
+    0x67, 0xb1, 0x47, 0x4a, 0xcc, 0x72, 0x9d, 0x5b, 0xd9, 0x5a, 0xb9, 0x47,
+    0x44, 0xb3, 0x04, 0x89, 0xc1, 0x90, 0xab, 0xae, 0x88, 0x10, 0xba, 0xff,
+    0xd4, 0xbd, 0x79, 0x71, 0x89, 0x0a, 0x8e, 0x92, 0x01, 0x0c, 0x6c, 0x21,
+    0x0d, 0x92, 0xba, 0x48, 0x2c, 0x47, 0x2d, 0x29, 0xc9, 0xed, 0x46, 0xa4,
+    0x72, 0x97, 0xd4, 0x36, 0xf7, 0x59, 0x28, 0x81, 0x6e, 0x19, 0x17, 0x1d,
+    0x6a, 0x61, 0xf9, 0x2d, 0xa1, 0x53, 0xbf, 0x92, 0xdc, 0xe5, 0xaa, 0x24,
+    0xa5, 0xb2, 0xc1, 0x16, 0xed, 0x0d, 0x6d, 0x7b, 0x6e, 0xd1, 0xd5, 0xfe,
+    0x09, 0x7e, 0xe7, 0x6e, 0xcd, 0xfa, 0x3d, 0x69, 0xde, 0xdd, 0x76, 0xfe,
+    0x96, 0xbc, 0x3b, 0xde, 0x48, 0xff, 0xb8, 0x60, 0xb3, 0x41, 0x44, 0x1b,
+    0x06, 0xe2, 0x20, 0xae, 0x41, 0x9b, 0xf9, 0x75, 0x0a, 0x16, 0x3b, 0x07,
+    0x98, 0x0d, 0x88, 0xa1, 0x1c, 0x48, 0x79, 0xa7, 0xfb, 0xb1, 0x94, 0xb8,
+    0xa1, 0x14, 0xd6, 0x6f, 0x55, 0xe9, 0x7d, 0xf2, 0x1c, 0x61, 0xb9, 0x45,
+    0x9e, 0x5d, 0x01, 0xcd, 0x01, 0xb3, 0x0c, 0xd3, 0xed, 0x5f, 0x7a, 0xb5,
+    0x07, 0x21, 0xb6, 0x60, 0x76, 0x55, 0x3c, 0x73, 0xcb, 0x22, 0x37, 0xd7,
+    0xc6, 0xb6, 0x8d, 0x4c, 0x2a, 0x9e, 0xf4, 0x7b, 0xf3, 0x78, 0xc3, 0xa6,
+    0x94, 0x27, 0x5e, 0x26, 0xad, 0x8b, 0x4d, 0xcb, 0xbb, 0xef, 0xc8, 0xe1,
+    0x27, 0x39, 0xea, 0xef, 0xf3, 0x0a, 0x1c, 0x2d, 0xef, 0xda, 0x3c, 0x77,
+    0x3f, 0x0c, 0x9e, 0x40, 0xef, 0x26, 0x9b, 0xaf, 0x1e, 0xee, 0xee, 0x61,
+    0x4c, 0x61, 0x15, 0x15, 0xe6, 0xdc, 0x02, 0x68, 0xe8, 0x82, 0x74, 0xa6,
+    0x16, 0xad, 0x15, 0x88, 0xc5, 0x81, 0x15, 0x65, 0x18, 0x41, 0xa9, 0x98,
+    0x08, 0xc5, 0xad, 0x02, 0x55, 0x7f, 0xd3, 0xde, 0x84, 0x04, 0xe7, 0x57,
+    0x27, 0xdd, 0x29, 0xd5, 0x84, 0x36, 0x84, 0x80, 0xe3, 0xd2, 0x67, 0x66,
+    0xf9, 0x18, 0xda, 0xe2, 0xa8, 0x94, 0xdf, 0x54, 0xcd, 0xc9, 0x97, 0x08,
+    0xf6, 0x99, 0x37, 0xf7, 0xb7, 0x5e, 0xfc, 0xc7, 0xdc, 0x53, 0xae, 0xf2,
+    0x9e, 0x50, 0x53, 0x6b, 0xf4, 0x4f, 0x46, 0xa8, 0x1b, 0xab, 0x86, 0x09,
+    0x94, 0x07, 0x55, 0xac, 0x92, 0x7a, 0x47, 0x80, 0x73, 0xa2, 0xa8, 0x37,
+    0x69, 0xb3, 0x03, 0x19, 0xc8, 0x0c, 0x53, 0xb2, 0x58, 0x45, 0x9a, 0xb6,
+    0x6c, 0x5f, 0x2a, 0xbc, 0xd9, 0xe4, 0x38, 0x89, 0xd8, 0xcb, 0xa7, 0x4b,
+    0xb6, 0xa7, 0xb7, 0x6e, 0x9a, 0x41, 0xe6, 0x95, 0x28, 0x9d, 0x39, 0x3f,
+    0xc7, 0x4e, 0x84, 0x33, 0x7d, 0x22, 0x77, 0x49, 0xdb, 0xae, 0xff, 0x7e,
+    0x8f, 0x10, 0x0f, 0xbf, 0x7c, 0x8a, 0xfe, 0x77, 0xfa, 0xe9, 0x0c, 0xc2,
+    0xa1, 0xef, 0x58, 0x6b, 0xe4, 0x04, 0xd2, 0xe4, 0x45, 0x22, 0xdb, 0xba,
+    0xdd, 0xc9, 0xca, 0xca, 0x5d, 0xdd, 0xab, 0x68, 0x6d, 0xb0, 0xfa, 0x19,
+    0x2f, 0xbd, 0x5f, 0xbe, 0xec, 0xda, 0x7e, 0x72, 0xfb, 0xe5, 0x0c, 0x24,
+    0x5e, 0x5d, 0x71, 0x2d, 0xda, 0xf6, 0x97, 0xa8, 0xc5, 0xdc, 0xa1, 0x0c,
+    0x6a, 0xf0, 0x08, 0x9c, 0x89, 0x0c, 0x96, 0x14, 0xd4, 0x38, 0x62, 0x24,
+    0x18, 0x64, 0xb2, 0x64, 0xb2, 0x08, 0x83, 0x54, 0x62, 0xb0, 0xa2, 0x5c,
+    0x93, 0xa4, 0xb5, 0x44, 0x64, 0x60, 0xee, 0x14, 0x0c, 0x48, 0x6f, 0x4c,
+    0xae, 0x54, 0x3e, 0xec, 0x6f, 0x7c, 0x8f, 0x38, 0xff, 0x94, 0x71, 0xb0,
+    0xc0, 0x54, 0x36, 0xc0, 0x00, 0xf4, 0xc1, 0x94, 0xe1, 0x1c, 0xf5, 0xbc,
+    0x61
+};
+
+static const unsigned char kat_x32_o1[] = {
+    0x05, 0x90, 0x00, 0xa0, 0x00, 0x21, 0x22, 0x03, 0x00, 0x00, 0x00, 0x40,
+    0x83, 0x20, 0x81, 0x60, 0x81, 0x60, 0x60, 0x00, 0x00, 0x83, 0x49, 0x83,
+    0x68, 0x26, 0x16, 0x13, 0x00, 0x00, 0x81, 0x6d, 0x83, 0x64, 0x82, 0x09,
+    0x18, 0x0e, 0x00, 0x00, 0x10, 0x82, 0x1e, 0x84, 0x10, 0x81, 0x30, 0x12,
+    0x00, 0x00, 0x10, 0x2b, 0x81, 0x3a, 0x83, 0x7a, 0x82, 0x11, 0x00, 0x00,
+    0x24, 0x18, 0x18, 0x83, 0x54, 0x83, 0x58, 0x51, 0x80, 0xa8, 0x01, 0x4f,
+    0xdd, 0xbf, 0x03, 0x07, 0x8c, 0x06, 0x02, 0x20, 0x0a, 0x51, 0x00, 0x5a,
+    0x08, 0xe1, 0x00, 0x7c, 0xb2, 0x00, 0x00, 0x81, 0xda, 0x0d, 0x00, 0xdf,
+    0xd2, 0x01, 0x00, 0x53, 0x61, 0x86, 0x51, 0x50, 0xc0, 0x2a, 0x00, 0x4f,
+    0xd3, 0xdd, 0x00, 0xa5, 0x32, 0x09, 0x00, 0xdf, 0x99, 0x29, 0x01, 0xad,
+    0xb7, 0x0b, 0x00, 0x1a, 0x78, 0x1a, 0x00, 0xdb, 0x1a, 0x01, 0x00, 0x10,
+    0x82, 0x08, 0x00, 0xd2, 0xa9, 0x13, 0x00, 0x9c, 0x3e, 0xe9, 0x03, 0x06,
+    0x91, 0x67, 0x2c, 0x3a, 0xff, 0x58, 0x09, 0x79, 0x7c, 0x21, 0x00, 0x90,
+    0x0e, 0x39, 0x06, 0xb5, 0xd5, 0xd0, 0x22, 0xeb, 0xbb, 0x01, 0x05, 0xd8,
+    0x47, 0xab, 0x69, 0xb8, 0x34, 0x02, 0x00, 0x39, 0x33, 0x84, 0x5c, 0x4e,
+    0x37, 0x01, 0x00, 0xd7, 0x22, 0x3a, 0x01, 0x5c, 0xdd, 0x05, 0x00, 0xe6,
+    0xc0, 0x52, 0x2c, 0xd9, 0x3c, 0x2d, 0x71, 0x5f, 0xed, 0x4e, 0x8a, 0x53,
+    0x2e, 0x0a, 0x1d, 0x1e, 0x05, 0xe0, 0xd3, 0x86, 0x4d, 0xe2, 0x5f, 0x15,
+    0x78, 0xb9, 0x07, 0x4b, 0x08, 0x54, 0x63, 0xe6, 0x02, 0xe4, 0xf1, 0x61,
+    0xd7, 0x6b, 0x59, 0x9c, 0x84, 0x0b, 0x18, 0x48, 0xaa, 0x31, 0xac, 0x29,
+    0x2a, 0xbb, 0x50, 0x29, 0x7d, 0x71, 0x0e, 0x64, 0x32, 0x03, 0x89, 0x3e,
+    0x18, 0x40, 0xa4, 0xb9, 0xac, 0xce, 0x12, 0x94, 0x15, 0xe9, 0xaf, 0x78,
+    0x8c, 0x94, 0x69, 0xd2, 0x9c, 0xfe, 0xa1, 0xad, 0x67, 0x22, 0x81, 0x4e,
+    0xae, 0x81, 0xee, 0x68, 0xc2, 0xcd, 0x83, 0x95, 0x57, 0xe5, 0x0d, 0x90,
+    0x81, 0x15, 0x38, 0x33, 0xe8, 0x7a, 0xec, 0x11, 0xdb, 0xf7, 0x80, 0x69,
+    0x65, 0x24, 0x61, 0x18, 0x1a, 0x48, 0xe1, 0xcf, 0x89, 0x30, 0x8b, 0x65,
+    0xa7, 0x59, 0x76, 0x23, 0x11, 0xed, 0xfe, 0xfa, 0x49, 0xfd, 0x9d, 0x0e,
+    0x27, 0x4a, 0xea, 0x81, 0x8c, 0xd0, 0x80, 0x21, 0x3c, 0x73, 0xcf, 0xcc,
+    0x62, 0x45, 0xc9, 0xd6, 0xf3, 0x18, 0xad, 0xd4, 0xaa, 0xed, 0xd9, 0xa2,
+    0x2a, 0xfd, 0x39, 0xf4, 0xa5, 0xa0, 0xd6, 0xb5, 0x0b, 0x08, 0xb2, 0x19,
+    0x75, 0xf3, 0x1b, 0x76, 0x4e, 0x45, 0xac, 0xbb, 0x98, 0xd6, 0x93, 0xb1,
+    0xac, 0x04, 0x73, 0xd0, 0xf8, 0x64, 0x21, 0x00, 0x5a, 0x0f, 0xe9, 0xa6,
+    0xe5, 0xb5, 0xb0, 0x99, 0xf4, 0x51, 0x06, 0x8b, 0x4d, 0x5e, 0x8e, 0x84,
+    0x89, 0xce, 0x8f, 0x90, 0x16, 0x4a, 0x2a, 0x21, 0x8b, 0x18, 0x63, 0xf5,
+    0x6d, 0xee, 0xef, 0x79, 0xaa, 0x4c, 0xed, 0x19, 0x3e, 0x2d, 0x0b, 0xe2,
+    0x7f, 0x3c, 0x6f, 0x13, 0xf6, 0x6a, 0x3e, 0x66, 0xdc, 0xdd, 0xe4, 0x35,
+    0xb8, 0x40, 0x05, 0xe0, 0xa4, 0x2a, 0x30, 0x63, 0xfa, 0x87, 0x72, 0x31,
+    0x87, 0xd2, 0x52, 0xa3, 0x03, 0xc8, 0x45, 0xfb, 0xb1, 0xb5, 0xa5, 0x4a,
+    0xf4, 0x8e, 0xbc, 0x40, 0xbd, 0x75, 0x63, 0xc6, 0xb8, 0x26, 0x40, 0xc5,
+    0x5a, 0x8c, 0xf5, 0x11, 0xc4, 0x4e, 0x32, 0x89, 0xb3, 0xf2, 0x2e, 0x62,
+    0x0f, 0x31, 0xb5, 0x8f, 0xef, 0x07, 0x53, 0xf5, 0x69, 0x72, 0x27, 0x22,
+    0xc1, 0x74, 0x67, 0xac, 0xb9, 0xa2, 0x1f, 0x73, 0x7a, 0xf4, 0x1c, 0x03,
+    0x2a, 0x40, 0x41, 0x90, 0x92, 0xdc, 0x05, 0xf9, 0xa0, 0xee, 0x47, 0x0e,
+    0x1c, 0xf6, 0x09, 0xd8, 0x3b, 0x24, 0x9c, 0xe6, 0x6d, 0x5e, 0xad, 0x5b,
+    0xfe, 0x98, 0x45, 0x97, 0xe3, 0x62, 0xd5, 0xdc, 0x9b, 0x24, 0xfa, 0xa6,
+    0x61, 0x18, 0x8f, 0xc2, 0xf4, 0x5d, 0x44, 0x1d, 0x56, 0x10, 0x9e, 0xe6,
+    0x4d, 0x21, 0xe1, 0xb4, 0x0b, 0x45, 0x89, 0x96, 0x13, 0x6f, 0x47, 0xac,
+    0x81, 0xf0, 0x14, 0xfb, 0xee, 0x35, 0xa0, 0x29, 0x34, 0xbe, 0x5f, 0xdd,
+    0x7a, 0xd3, 0x92, 0x41, 0x48, 0x1e, 0x59
+};
+
+static const unsigned char kat_x32_rle_o1[] = {
+    0x45, 0x88, 0x00, 0x83, 0x52, 0x86, 0x0a, 0x5f, 0x00, 0x01, 0x05, 0x23,
+    0x24, 0x00, 0x00, 0x8e, 0x29, 0x88, 0x1e, 0x84, 0x55, 0x82, 0x2a, 0x81,
+    0x64, 0x11, 0x23, 0x11, 0x11, 0x16, 0xed, 0x00, 0x00, 0xe2, 0x1f, 0x54,
+    0x00, 0xfd, 0x0f, 0x8c, 0x5f, 0x4a, 0x9e, 0x00, 0x00, 0x1f, 0x74, 0xdd,
+    0x37, 0x60, 0xcb, 0xf5, 0x47, 0x66, 0xbc, 0x35, 0x0a, 0x69, 0xfb, 0xc6,
+    0x58, 0x7f, 0xc8, 0xaa, 0xd2, 0x05, 0xbf, 0xf5, 0xf7, 0xb3, 0xed, 0x62,
+    0xc3, 0xd9, 0xbc, 0x84, 0x05, 0xdf, 0x9b, 0x18, 0xa5, 0x18, 0xa4, 0x93,
+    0x65, 0x2f, 0x16, 0x8e, 0x19, 0x78, 0x7f, 0x49, 0x09, 0x37, 0x0a, 0x84,
+    0xa1, 0xdd, 0x04, 0x5b, 0x4f, 0x6b, 0x2a, 0xa0, 0x00, 0x21, 0x22, 0x03,
+    0x00, 0x00, 0x00, 0x81, 0x60, 0x83, 0x00, 0x60, 0x81, 0x20, 0x81, 0x20,
+    0x00, 0x00, 0x83, 0x3c, 0x83, 0x6f, 0x2f, 0x17, 0x0f, 0x00, 0x00, 0x81,
+    0x74, 0x83, 0x5b, 0x82, 0x06, 0x1d, 0x0e, 0x00, 0x00, 0x12, 0x85, 0x01,
+    0x00, 0x00, 0x82, 0x49, 0x24, 0x00, 0x00, 0x26, 0x60, 0x82, 0x65, 0x00,
+    0x00, 0x84, 0x15, 0x00, 0x00, 0x10, 0x21, 0x21, 0x83, 0x61, 0x83, 0x4d,
+    0x1f, 0xd9, 0x00, 0x00, 0x3b, 0x60, 0x01, 0x00, 0xda, 0xa9, 0x00, 0x00,
+    0xf6, 0xaf, 0x9d, 0x10, 0x57, 0x26, 0x01, 0x00, 0x3c, 0x09, 0x0e, 0x00,
+    0x35, 0x58, 0xf4, 0x00, 0x83, 0x7f, 0x7e, 0x0f, 0x13, 0xf0, 0x01, 0x00,
+    0xc6, 0x9e, 0x02, 0x00, 0xa0, 0x06, 0x2e, 0x00, 0x64, 0x8c, 0x00, 0x00,
+    0x83, 0x91, 0x27, 0x00, 0x0b, 0xb4, 0x21, 0x00, 0x75, 0xa3, 0x00, 0x00,
+    0x82, 0x25, 0x9e, 0x05, 0x7d, 0x0b, 0x13, 0x00, 0x65, 0xb3, 0x00, 0x00,
+    0xff, 0xa5, 0xeb, 0x27, 0xf3, 0x74, 0xef, 0x7c, 0x47, 0xc7, 0x00, 0x00,
+    0x86, 0x38, 0xaf, 0x00, 0xa5, 0xa6, 0x0c, 0x00, 0x61, 0x66, 0x03, 0x09,
+    0xce, 0x7c, 0xe8, 0x00, 0x27, 0x86, 0x03, 0x00, 0x95, 0x75, 0x38, 0x01,
+    0x66, 0x71, 0x1f, 0x00, 0x09, 0x57, 0x1e, 0x02, 0xd2, 0x26, 0xf6, 0x15,
+    0x18, 0xd5, 0x03, 0x00, 0x52, 0x7b, 0xbe, 0x2e, 0xbe, 0x74, 0x74, 0x4a,
+    0x49, 0x3d, 0xc2, 0xbd, 0x98, 0x27, 0x5c, 0x75, 0x84, 0xa3, 0xc0, 0x45,
+    0x08, 0x3e, 0x9f, 0x3e, 0x61, 0xfd, 0x20, 0x81, 0xbb, 0x25, 0x24, 0x8d,
+    0x03, 0x9e, 0xa1, 0x1d, 0xfe, 0xc7, 0x8f, 0x1b, 0xd5, 0x3a, 0x0a, 0xa3,
+    0x18, 0x04, 0x24, 0x6c, 0x97, 0x18, 0x98, 0x9d, 0x6b, 0x98, 0x7d, 0xf3,
+    0xe8, 0x94, 0x1a, 0xca, 0xba, 0xe6, 0x4f, 0xda, 0x20, 0x56, 0xdc, 0x3f,
+    0x4b, 0xc1, 0x27, 0x26, 0xe4, 0x55, 0x09, 0x5e, 0x80, 0x40, 0x54, 0xd0,
+    0x24, 0x83, 0x61, 0x8c, 0xdf, 0xf0, 0x43, 0xfd, 0x5e, 0xd5, 0xb3, 0xc9,
+    0x56, 0x25, 0x0e, 0xdf, 0xfa, 0x30, 0xe0, 0x5f, 0xa3, 0x07, 0xcd, 0x50,
+    0xa1, 0xa4, 0xaa, 0xc8, 0xb7, 0x9f, 0x39, 0xcf, 0x5f, 0x53, 0xdd, 0x2b,
+    0xca, 0xa3, 0x91, 0x48, 0xd0, 0x37, 0xe1, 0x48, 0x3c, 0xda, 0x50, 0xec,
+    0xf8, 0xe0
+};
+
+static const unsigned char kat_x32_pack_o0[] = {
+    0x84, 0x88, 0x00, 0x05, 0x21, 0x22, 0x23, 0x24, 0x25, 0x84, 0x00, 0x00,
+    0x01, 0x00, 0x03, 0x04, 0x00, 0x10, 0x11, 0x03, 0x20, 0x21, 0x03, 0x30,
+    0x31, 0x03, 0x41, 0x42, 0x02, 0x00, 0x82, 0x10, 0x81, 0x60, 0x08, 0x08,
+    0x82, 0x20, 0x84, 0x28, 0x82, 0x00, 0x40, 0x10, 0x10, 0x82, 0x28, 0x84,
+    0x48, 0x81, 0x28, 0x10, 0x08, 0x18, 0x78, 0x83, 0x50, 0x81, 0x60, 0x10,
+    0x08, 0x81, 0x58, 0x81, 0x78, 0xe5, 0x11, 0xbf, 0x08, 0x4d, 0xd1, 0xf7,
+    0x01, 0xbb, 0xf3, 0x00, 0x00, 0x96, 0x81, 0xdd, 0x42, 0x22, 0xc4, 0xc1,
+    0x6d, 0xdf, 0xf2, 0x4e, 0x26, 0x0f, 0xa5, 0x23, 0x1e, 0x7b, 0xc1, 0xce,
+    0x15, 0x5e, 0x00, 0xae, 0x16, 0x88, 0x12, 0x8f, 0x00, 0xc9, 0xe3, 0x91,
+    0x03, 0xbd, 0xf0, 0x05, 0x00, 0xe8, 0x12, 0x0b, 0x03, 0xca, 0x22, 0x12,
+    0x00, 0x24, 0xb1, 0xf1, 0x0f, 0xa9, 0x94, 0xd5, 0x09, 0x50, 0x50, 0x04,
+    0x23, 0xc3, 0x01, 0x97, 0x00, 0x35, 0x34, 0x71, 0x20, 0xb0, 0xa7, 0x75,
+    0x00, 0x44, 0xf9, 0x31, 0x00, 0x4e, 0x35, 0x02, 0x00, 0x5d, 0x05, 0xa0,
+    0x06, 0xbc, 0xd4, 0x2a, 0x0f, 0xe3, 0x08, 0xda, 0x17, 0x2f, 0x57, 0x6d,
+    0x01, 0x8f, 0x94, 0x93, 0x02, 0x3a, 0xc9, 0x53, 0x01, 0xbd, 0x25, 0xa4,
+    0x03, 0x04, 0xe7, 0x6d, 0x2f, 0x78, 0x87, 0x09, 0x13, 0x01, 0x9a, 0x8a,
+    0x0c, 0xbf, 0xcf, 0x56, 0x7a, 0x30, 0x63, 0xf4, 0xc1, 0x6a, 0xb1, 0xde,
+    0x97, 0xaa, 0xcb, 0xe9, 0xbb, 0xc9, 0xd3, 0x69, 0x4c, 0x11, 0xf0, 0x53,
+    0x74, 0xbb, 0xc8, 0x7d, 0x75, 0xa0, 0x77, 0x86, 0xca, 0x27, 0x6a, 0x63,
+    0x6b, 0x6c, 0x4a, 0xb0, 0xb8, 0x53, 0x45, 0xcc, 0xc3, 0xf8, 0x92, 0x14,
+    0xb0, 0x28, 0xcb, 0x54, 0x54, 0x05, 0x7a, 0x7f, 0x25, 0x43, 0x88, 0x41,
+    0x5d, 0xdb, 0x51, 0xe3, 0x22, 0x05, 0x46, 0xb1, 0x69, 0x03, 0x51, 0x0e,
+    0xed, 0xdf, 0x1d, 0x08, 0xcc, 0x27, 0x05, 0x15, 0x29, 0x85, 0xd0, 0x19,
+    0xaf, 0x90, 0x51, 0xd6, 0xb2, 0x02, 0x60, 0x69, 0x7b, 0x78, 0xbc, 0x42,
+    0x3f, 0x8e, 0x0f, 0x8d, 0xa6, 0x32, 0xfc, 0xbe, 0x09, 0xa0, 0xac, 0x47,
+    0x82, 0x6e, 0xe4, 0x4e, 0xd9, 0xa8, 0x26, 0xae, 0xb6, 0x32, 0xc8, 0x07,
+    0xe7, 0x10, 0x79, 0xfb, 0x57, 0xa8, 0xbd, 0x4b, 0xad, 0x21, 0x7f, 0x05,
+    0x9f, 0x40, 0xee, 0x0a, 0x0f, 0xc0, 0x8b, 0x40, 0xb9, 0x28, 0x87, 0x08,
+    0xba, 0xa0, 0xf5, 0x08, 0xf8, 0xa0, 0x47, 0x00, 0x3d, 0xe0, 0x23, 0xe0,
+    0xc2, 0x20, 0x51, 0x40, 0x65, 0xd0, 0x25, 0x50, 0xc4, 0x18, 0xb9, 0xd0,
+    0x97, 0xa8, 0x23, 0xc0, 0xc2, 0x10, 0xf5, 0x30, 0xa0, 0x50, 0xdf, 0x30,
+    0x9c, 0xf0, 0xfa, 0x38, 0x2f, 0x58, 0x7e, 0xe0, 0xcf, 0x48, 0xf1, 0x70,
+    0x6c, 0x70, 0x68, 0xe0, 0x6a, 0xd0, 0x91, 0xc8, 0xd0
+};
+
+static const struct {
+    const char *desc;
+    const unsigned char *comp;
+    unsigned int clen, len;
+} kat[] = {
+    { "o0",          kat_o0,          sizeof(kat_o0),           300 },
+    { "o1",          kat_o1,          sizeof(kat_o1),           300 },
+    { "x32 o0",      kat_x32_o0,      sizeof(kat_x32_o0),      2048 },
+    { "x32 o1",      kat_x32_o1,      sizeof(kat_x32_o1),      2048 },
+    { "x32 rle o1",  kat_x32_rle_o1,  sizeof(kat_x32_rle_o1),  1024 },
+    { "x32 pack o0", kat_x32_pack_o0, sizeof(kat_x32_pack_o0), 1024 },
+};
+#define NKAT (sizeof(kat)/sizeof(*kat))
+#define KAT_MAX_LEN 2048
+
+// Quality-like values drifting over a small alphabet, independent of
+// fill() so that the recorded streams stay valid if that changes
+static void kat_fill(unsigned char *buf, unsigned int len) {
+    uint32_t x = 1;
+    unsigned int i;
+    unsigned char q = 0;
+
+    for (i = 0; i < len; i++) {
+        x = x * 1103515245 + 12345;
+        if ((x >> 16) % 8 == 0)
+            q = (x >> 20) % 4;
+        buf[i] = 33 + q + ((x >> 24) % 2);
+    }
+}
+
+static int test_known_answers(int verbose) {
+    unsigned char expected[KAT_MAX_LEN], *out;
+    unsigned int i, l, ulen;
+    int res = 0;
+
+    for (i = 0; i < NKAT; i++) {
+        int failed = 0;
+        kat_fill(expected, kat[i].len);
+        for (l = 0; l < NLEVELS; l++) {
+            rans_set_cpu(cpu_levels[l]);
+            out = rans_uncompress_4x16((unsigned char *) kat[i].comp,
+                                       kat[i].clen, &ulen);
+            if (!out || ulen != kat[i].len
+                || memcmp(out, expected, ulen) != 0) {
+                fprintf(stderr, "Known-answer stream \"%s\" decoded "
+                        "wrongly, cpu 0x%x\n", kat[i].desc, cpu_levels[l]);
+                failed = 1;
+            }
+            free(out);
+        }
+        if (verbose)
+            fprintf(stderr, "known answer %-11s %s\n", kat[i].desc,
+                    failed ? "FAIL" : "ok");
+        if (failed)
+            res = -1;
+    }
+
+    return res;
+}
+
+static int test_round_trip(unsigned char *in, unsigned int len, int order,
+                           const char *desc, int verbose) {
+    unsigned int clen, ulen, l;
+    unsigned char *comp, *out[NLEVELS] = { NULL };
+    int res = 0;
+
+    comp = rans_compress_4x16(in, len, &clen, order);
+    if (!comp) {
+        fprintf(stderr, "Failed to compress %s, len %u, order 0x%x\n",
+                desc, len, order);
+        return -1;
+    }
+
+    for (l = 0; l < NLEVELS; l++) {
+        rans_set_cpu(cpu_levels[l]);
+        out[l] = rans_uncompress_4x16(comp, clen, &ulen);
+        if (!out[l] || ulen != len || memcmp(in, out[l], len) != 0) {
+            fprintf(stderr, "Round trip failed for %s, len %u, order 0x%x, "
+                    "cpu 0x%x\n", desc, len, order, cpu_levels[l]);
+            res = -1;
+        } else if (l && memcmp(out[0], out[l], len) != 0) {
+            fprintf(stderr, "SIMD output differs for %s, len %u, "
+                    "order 0x%x, cpu 0x%x\n", desc, len, order, cpu_levels[l]);
+            res = -1;
+        }
+    }
+
+    // Truncated input must be rejected or decode to something without
+    // going out of bounds, by every implementation
+    for (l = 0; clen > 1 && l < NLEVELS; l++) {
+        unsigned char *o;
+        rans_set_cpu(cpu_levels[l]);
+        o = rans_uncompress_4x16(comp, clen - clen/3, &ulen);
+        free(o);
+    }
+
+    if (verbose)
+        fprintf(stderr, "%-10s len %6u order 0x%02x -> %6u %s\n",
+                desc, len, order, clen, res ? "FAIL" : "ok");
+
+    free(comp);
+    for (l = 0; l < NLEVELS; l++)
+        free(out[l]);
+
+    return res;
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0, opt, res = 0;
+    unsigned int s, o, t;
+    unsigned char *buf;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!(buf = malloc(sizes[NSIZES-1] + 1))) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    res |= test_known_answers(verbose);
+
+    for (t = 0; t < NTYPES; t++) {
+        for (s = 0; s < NSIZES; s++) {
+            fill(buf, sizes[s], t);
+            for (o = 0; o < NORDERS; o++)
+                res |= test_round_trip(buf, sizes[s], orders[o],
+                                       type_names[t], verbose);
+        }
+    }
+
+    free(buf);
+    return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
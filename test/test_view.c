@@ -36,6 +36,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "../htslib/sam.h"
 #include "../htslib/vcf.h"
 #include "../htslib/hts_log.h"
+#include "../htslib/thread_pool.h"
 
 struct opts {
     char *fn_ref;
@@ -47,6 +48,10 @@ struct opts {
     int benchmark;
     int nthreads;
     int multi_reg;
+    int64_t gap;
+    int par_reg;
+    hts_tpool *pool;
+    int idx_flags;
     char *index;
     int min_shift;
 };
@@ -60,6 +65,26 @@ enum test_op {
     WRITE_COMPRESSED   = 32, // eg vcf.gz, sam.gz
 };
 
+// Records gathered for one region by sam_itr_regarray_mt()
+typedef struct {
+    bam1_t **b;
+    size_t n, m;
+} region_recs;
+
+static int add_region_rec(void *data, int region, const sam_hdr_t *h, bam1_t *b) {
+    region_recs *rr = &((region_recs *) data)[region];
+    if (rr->n == rr->m) {
+        size_t m = rr->m ? rr->m * 2 : 16;
+        bam1_t **tmp = realloc(rr->b, m * sizeof(*tmp));
+        if (!tmp) return -1;
+        rr->b = tmp;
+        rr->m = m;
+    }
+    if (!(rr->b[rr->n] = bam_dup1(b))) return -1;
+    rr->n++;
+    return 0;
+}
+
 int sam_loop(int argc, char **argv, int optind, struct opts *opts, htsFile *in, htsFile *out) {
     int r = 0;
     sam_hdr_t *h = NULL;
@@ -112,14 +137,41 @@ int sam_loop(int argc, char **argv, int optind, struct opts *opts, htsFile *in,
 
     if (optind + 1 < argc && !(opts->flag & READ_COMPRESSED)) { // BAM input and has a region
         int i;
-        if ((idx = sam_index_load(in, argv[optind])) == 0) {
+        if ((idx = sam_index_load3(in, argv[optind], NULL, opts->idx_flags)) == 0) {
             fprintf(stderr, "[E::%s] fail to load the BAM index\n", __func__);
             goto fail;
         }
-        if (opts->multi_reg) {
+        if (opts->par_reg) {
+            // Read the regions in parallel, then write them out in order
+            int n_reg = argc - optind - 1;
+            size_t j;
+            region_recs *rr = calloc(n_reg, sizeof(*rr));
+            if (!rr)
+                goto fail;
+            r = sam_itr_regarray_mt(in, h, idx, &argv[optind + 1], n_reg,
+                                    opts->pool, add_region_rec, rr);
+            if (r < 0)
+                fprintf(stderr, "Error reading input.\n");
+            for (i = 0; i < n_reg; i++) {
+                for (j = 0; j < rr[i].n; j++) {
+                    if (r == 0 && !opts->benchmark
+                        && sam_write1(out, h, rr[i].b[j]) < 0) {
+                        fprintf(stderr, "Error writing output.\n");
+                        r = -1;
+                    }
+                    bam_destroy1(rr[i].b[j]);
+                }
+                free(rr[i].b);
+            }
+            free(rr);
+            if (r < 0)
+                goto fail;
+        } else if (opts->multi_reg) {
             hts_itr_t *iter = sam_itr_regarray(idx, h, &argv[optind + 1], argc - optind-1);
             if (!iter)
                 goto fail;
+            if (opts->gap >= 0)
+                iter->gap = opts->gap;
             while ((r = sam_itr_next(in, iter, b)) >= 0) {
                 if (!opts->benchmark && sam_write1(out, h, b) < 0) {
                     fprintf(stderr, "Error writing output.\n");
@@ -214,7 +266,7 @@ int vcf_loop(int argc, char **argv, int optind, struct opts *opts, htsFile *in,
 
     if (optind + 1 < argc) {
         // A series of regions.
-        if ((idx = bcf_index_load(argv[optind])) == 0) {
+        if ((idx = bcf_index_load3(argv[optind], NULL, opts->idx_flags)) == 0) {
             fprintf(stderr, "[E::%s] fail to load the BVCF index\n", __func__);
             return 1;
         }
@@ -292,10 +344,14 @@ int main(int argc, char *argv[])
     opts.benchmark = 0;
     opts.nthreads = 0; // shared pool
     opts.multi_reg = 0;
+    opts.gap = -1;
+    opts.par_reg = 0;
+    opts.pool = NULL;
+    opts.idx_flags = HTS_IDX_SAVE_REMOTE;
     opts.index = NULL;
     opts.min_shift = 0;
 
-    while ((c = getopt(argc, argv, "DSIt:i:bzCul:o:N:BZ:@:Mx:m:p:v")) >= 0) {
+    while ((c = getopt(argc, argv, "DSIt:i:bzCul:o:N:BZ:@:Mg:PLx:m:p:v")) >= 0) {
         switch (c) {
         case 'D': opts.flag |= READ_CRAM; break;
         case 'S': opts.flag |= READ_COMPRESSED; break;
@@ -312,6 +368,9 @@ int main(int argc, char *argv[])
         case 'B': opts.benchmark = 1; break;
         case 'Z': opts.extra_hdr_nuls = atoi(optarg); break;
         case 'M': opts.multi_reg = 1; break;
+        case 'g': opts.gap = strtoll(optarg, NULL, 10); break;
+        case 'P': opts.par_reg = 1; break;
+        case 'L': opts.idx_flags |= HTS_IDX_LAZY; break;
         case '@': opts.nthreads = atoi(optarg); break;
         case 'x': opts.index = optarg; break;
         case 'm': opts.min_shift = atoi(optarg); break;
@@ -320,7 +379,7 @@ int main(int argc, char *argv[])
         }
     }
     if (argc == optind) {
-        fprintf(stderr, "Usage: test_view [-DSI] [-t fn_ref] [-i option=value] [-bC] [-l level] [-o option=value] [-N num_reads] [-B] [-Z hdr_nuls] [-@ num_threads] [-x index_fn] [-m min_shift] [-p out] [-v] <in.bam>|<in.sam>|<in.cram> [region]\n");
+        fprintf(stderr, "Usage: test_view [-DSI] [-t fn_ref] [-i option=value] [-bC] [-l level] [-o option=value] [-N num_reads] [-B] [-M] [-g gap] [-P] [-L] [-Z hdr_nuls] [-@ num_threads] [-x index_fn] [-m min_shift] [-p out] [-v] <in.bam>|<in.sam>|<in.cram> [region]\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "-D: read CRAM format (mode 'c')\n");
         fprintf(stderr, "-S: read compressed BCF, BAM, FAI (mode 'b')\n");
@@ -337,6 +396,8 @@ int main(int argc, char *argv[])
         fprintf(stderr, "\n");
         fprintf(stderr, "-B: enable benchmarking\n");
         fprintf(stderr, "-M: use hts_itr_multi iterator\n");
+        fprintf(stderr, "-P: read each region in parallel with sam_itr_regarray_mt\n");
+        fprintf(stderr, "-L: load the index lazily (HTS_IDX_LAZY)\n");
         fprintf(stderr, "-Z hdr_nuls: append specified number of null bytes to the SAM header\n");
         fprintf(stderr, "-@ num_threads: use thread pool with specified number of threads\n\n");
         fprintf(stderr, "-x fn: write index to fn\n");
@@ -387,6 +448,7 @@ int main(int argc, char *argv[])
         } else {
             hts_set_opt(in,  HTS_OPT_THREAD_POOL, &p);
             hts_set_opt(out, HTS_OPT_THREAD_POOL, &p);
+            opts.pool = p.pool;
         }
     }
 
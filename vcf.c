@@ -40,6 +40,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/vcf.h"
 #include "htslib/bgzf.h"
 #include "htslib/tbx.h"
+#include "htslib/thread_pool.h"
 #include "htslib/hfile.h"
 #include "hts_internal.h"
 #include "htslib/hts_endian.h"
@@ -1194,15 +1195,11 @@ void bcf_destroy(bcf1_t *v)
     free(v);
 }
 
-static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
+// Decodes the 32 bytes of fixed-length fields at the start of a record
+// and sizes v->shared and v->indiv for the rest.
+static int bcf_decode_fixed(bcf1_t *v, const uint8_t *x)
 {
-    uint8_t x[32];
-    ssize_t ret;
     uint32_t shared_len, indiv_len;
-    if ((ret = bgzf_read(fp, x, 32)) != 32) {
-        if (ret == 0) return -1;
-        return -2;
-    }
     bcf_clear1(v);
     shared_len = le_to_u32(x);
     if (shared_len < 24) return -2;
@@ -1222,6 +1219,18 @@ static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
     v->indiv.l = indiv_len;
     // silent fix of broken BCFs produced by earlier versions of bcf_subset, prior to and including bd6ed8b4
     if ( (!v->indiv.l || !v->n_sample) && v->n_fmt ) v->n_fmt = 0;
+    return 0;
+}
+
+static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
+{
+    uint8_t x[32];
+    ssize_t ret;
+    if ((ret = bgzf_read(fp, x, 32)) != 32) {
+        if (ret == 0) return -1;
+        return -2;
+    }
+    if (bcf_decode_fixed(v, x) < 0) return -2;
 
     if (bgzf_read(fp, v->shared.s, v->shared.l) != v->shared.l) return -2;
     if (bgzf_read(fp, v->indiv.s, v->indiv.l) != v->indiv.l) return -2;
@@ -3194,7 +3203,54 @@ static int idx_calc_n_lvls_ids(const bcf_hdr_t *h, int min_shift,
     return n_lvls;
 }
 
-hts_idx_t *bcf_index(htsFile *fp, int min_shift)
+/*
+ * Parallel indexing: raw BCF records are read on the main thread and
+ * checked by hts_idx_push_mt() in the thread pool.
+ */
+static int bcf_index_read_raw(BGZF *fp, kstring_t *str, void *data)
+{
+    uint8_t *x;
+    size_t len;
+    ssize_t ret;
+
+    if (ks_resize(str, str->l + 32) < 0) return -1;
+    x = (uint8_t *) str->s + str->l;
+    if ((ret = bgzf_read(fp, x, 32)) != 32)
+        return ret == 0 ? 0 : -1;
+    // Both lengths are counted from the end of the first eight bytes
+    len = (size_t) le_to_u32(x) + le_to_u32(x + 4) + 8;
+    if (len < 32) return -1;
+    if (ks_resize(str, str->l + len) < 0) return -1;
+    if (bgzf_read(fp, str->s + str->l + 32, len - 32) != len - 32)
+        return -1;
+    str->l += len;
+    return 1;
+}
+
+static int bcf_index_parse_raw(char *buf, hts_idx_raw_t *recs, int n,
+                               void *data)
+{
+    const bcf_hdr_t *h = (const bcf_hdr_t *) data;
+    bcf1_t *v = bcf_init1();
+    int i;
+
+    if (!v) return -1;
+    for (i = 0; i < n; i++) {
+        uint8_t *x = (uint8_t *) buf + recs[i].start;
+        if (bcf_decode_fixed(v, x) < 0) break;
+        memcpy(v->shared.s, x + 32, v->shared.l);
+        memcpy(v->indiv.s, x + 32 + v->shared.l, v->indiv.l);
+        if (bcf_record_check(h, v) < 0) break;
+        recs[i].tid = v->rid;
+        recs[i].beg = v->pos;
+        recs[i].end = v->pos + v->rlen;
+        recs[i].is_mapped = 1;
+    }
+    bcf_destroy1(v);
+    return i < n ? -1 : 0;
+}
+
+static hts_idx_t *bcf_index_mt(htsFile *fp, int min_shift, hts_tpool *p)
 {
     int n_lvls;
     bcf1_t *b = NULL;
@@ -3209,7 +3265,12 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     if (!idx) goto fail;
     b = bcf_init1();
     if (!b) goto fail;
-    while ((r = bcf_read1(fp,h, b)) >= 0) {
+    if (p) {
+        if (hts_idx_push_mt(idx, fp->fp.bgzf, p, bcf_index_read_raw,
+                            bcf_index_parse_raw, NULL, h) < 0)
+            goto fail;
+        r = -1;
+    } else while ((r = bcf_read1(fp,h, b)) >= 0) {
         int ret;
         ret = hts_idx_push(idx, b->rid, b->pos, b->pos + b->rlen, bgzf_tell(fp->fp.bgzf), 1);
         if (ret < 0) goto fail;
@@ -3227,6 +3288,11 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     return NULL;
 }
 
+hts_idx_t *bcf_index(htsFile *fp, int min_shift)
+{
+    return bcf_index_mt(fp, min_shift, NULL);
+}
+
 hts_idx_t *bcf_index_load2(const char *fn, const char *fnidx)
 {
     return fnidx? hts_idx_load2(fn, fnidx) : bcf_index_load(fn);
@@ -3242,18 +3308,26 @@ int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_thr
     htsFile *fp;
     hts_idx_t *idx;
     tbx_t *tbx;
+    hts_tpool *pool = NULL;
     int ret;
     if ((fp = hts_open(fn, "rb")) == 0) return -2;
-    if (n_threads)
-        hts_set_threads(fp, n_threads);
     if ( fp->format.compression!=bgzf ) { hts_close(fp); return -3; }
+    if (n_threads > 0) {
+        // Shared by BGZF decompression and BCF record checking
+        if (!(pool = hts_tpool_init(n_threads))
+            || bgzf_thread_pool(fp->fp.bgzf, pool, 0) < 0) {
+            hts_close(fp);
+            if (pool) hts_tpool_destroy(pool);
+            return -1;
+        }
+    }
     switch (fp->format.format) {
         case bcf:
             if (!min_shift) {
                 hts_log_error("TBI indices for BCF files are not supported");
                 ret = -1;
             } else {
-                idx = bcf_index(fp, min_shift);
+                idx = bcf_index_mt(fp, min_shift, pool);
                 if (idx) {
                     ret = hts_idx_save_as(idx, fn, fnidx, HTS_FMT_CSI);
                     if (ret < 0) ret = -4;
@@ -3278,6 +3352,8 @@ int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_thr
             break;
     }
     hts_close(fp);
+    if (pool)
+        hts_tpool_destroy(pool);
     return ret;
 }
 